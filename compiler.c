@@ -1,12 +1,23 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #undef _GNU_SOURCE
 
 #include "libtap/tap.h"
@@ -31,12 +42,29 @@ __attribute__((used)) static const int kFixnumMask = 0x3;
 __attribute__((used)) static const int kFixnumShift = 2;
 __attribute__((used)) static const int kHeapObjectMask = 0x7;
 
+// Vectors and strings start with a header word: the length shifted left by
+// kHeaderShift, or'ed with one of these. No value ends in either byte, so the
+// collector can tell a header from the car of a pair. The elements (words) or
+// characters (bytes) follow, and the whole object is padded to 16 bytes.
+__attribute__((used)) static const int kVectorHeaderTag = 0x4f;
+__attribute__((used)) static const int kStringHeaderTag = 0x5f;
+__attribute__((used)) static const int kHeaderShift = 8;
+
+// Closures start with a header like a vector's, counting their free
+// variables. The address of their code comes next and then the free
+// variables, padded the same way.
+__attribute__((used)) static const int kClosureHeaderTag = 0x6f;
+
 int32_t encodeImmediateFixnum(int32_t f) {
   assert(f < 0x7fffffff && "too big");
   assert(f > -0x80000000L && "too small");
   return f << kFixnumShift;
 }
 
+// The fixnums that round-trip through encodeImmediateFixnum's 32-bit encoding.
+static const int kFixnumMin = -(1 << (31 - kFixnumShift));
+static const int kFixnumMax = (1 << (31 - kFixnumShift)) - 1;
+
 int32_t encodeImmediateBool(bool value) {
   return ((value ? 1L : 0L) << kBoolShift) | kBoolTag;
 }
@@ -60,53 +88,285 @@ typedef struct {
   byte *address;
   size_t len;
   BufferState state;
+  // For a dual-mapped buffer (see Buffer_init_dual), a second mapping of the
+  // same pages that can be executed but not written, the memfd behind both,
+  // and how much address space each view has to grow into; otherwise NULL,
+  // and fd and reserved mean nothing.
+  byte *exec;
+  int fd;
+  size_t reserved;
 } Buffer;
 
+static size_t round_up_to_page(size_t len) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  if (len == 0)
+    return page_size;
+  return (len + page_size - 1) & ~(page_size - 1);
+}
+
+// len is only the initial capacity; the buffer grows on demand while it is
+// still writable.
 void Buffer_init(Buffer *result, size_t len) {
+  len = round_up_to_page(len);
   result->address = mmap(/*addr=*/NULL, len, PROT_READ | PROT_WRITE,
                          MAP_ANONYMOUS | MAP_PRIVATE,
                          /*filedes=*/-1, /*off=*/0);
   assert(result->address != MAP_FAILED);
   result->len = len;
   result->state = kWritable;
+  result->exec = NULL;
+}
+
+// How much address space each view of a dual-mapped buffer reserves up front.
+// Only what is written is backed by the memfd; the rest costs nothing.
+static const size_t kDualBufferReserve = (size_t)1 << 30;
+
+// Map bytes [from, to) of `fd' into the same place in both of a dual-mapped
+// buffer's views, over what they have reserved.
+static int Buffer_map_views(Buffer *buf, size_t from, size_t to) {
+  if (mmap(buf->address + from, to - from, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, buf->fd, from) == MAP_FAILED ||
+      mmap(buf->exec + from, to - from, PROT_READ | PROT_EXEC,
+           MAP_SHARED | MAP_FIXED, buf->fd, from) == MAP_FAILED) {
+    return -1;
+  }
+  buf->len = to;
+  return 0;
+}
+
+// Like Buffer_init, but map the pages twice over a memfd: writable at
+// `address', where BufferWriter writes, and executable at `exec', where the
+// code runs from. The code can be run as soon as it is written, and more can
+// be written after it while it runs, without changing any page's protection
+// (x86 keeps instruction fetches coherent with stores). Both views grow in
+// place into the address space reserved behind them, so code never moves once
+// it is written: pointers into it (entry points, closures' code, return
+// addresses) stay good for as long as the buffer lives. Where memfd_create
+// isn't available, or the system won't map it executable, this is plain
+// Buffer_init and Buffer_make_executable still has to mprotect it.
+void Buffer_init_dual(Buffer *result, size_t len) {
+#ifdef MFD_CLOEXEC
+  len = round_up_to_page(len);
+  assert(len <= kDualBufferReserve);
+  int fd = memfd_create("code", MFD_CLOEXEC);
+  if (fd >= 0) {
+    *result = (Buffer){.state = kWritable,
+                       .fd = fd,
+                       .reserved = kDualBufferReserve};
+    result->address = mmap(/*addr=*/NULL, kDualBufferReserve, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           /*filedes=*/-1, /*off=*/0);
+    result->exec = mmap(/*addr=*/NULL, kDualBufferReserve, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        /*filedes=*/-1, /*off=*/0);
+    if (result->address != MAP_FAILED && result->exec != MAP_FAILED &&
+        ftruncate(fd, len) == 0 && Buffer_map_views(result, 0, len) == 0) {
+      return;
+    }
+    if (result->address != MAP_FAILED) {
+      munmap(result->address, kDualBufferReserve);
+    }
+    if (result->exec != MAP_FAILED) {
+      munmap(result->exec, kDualBufferReserve);
+    }
+    close(fd);
+  }
+#endif
+  Buffer_init(result, len);
 }
 
 void Buffer_deinit(Buffer *buf) {
-  munmap(buf->address, buf->len);
+  if (buf->exec != NULL) {
+    munmap(buf->address, buf->reserved);
+    munmap(buf->exec, buf->reserved);
+    close(buf->fd);
+    buf->exec = NULL;
+  } else {
+    munmap(buf->address, buf->len);
+  }
   buf->address = NULL;
 }
 
+// Where to run the code in `buf' from.
+byte *Buffer_code(const Buffer *buf) {
+  return buf->exec != NULL ? buf->exec : buf->address;
+}
+
+// The code starts with its entry point, which takes the heap (or with kOptGC
+// the Heap) and returns the result.
+typedef uint64_t (*EntryFunction)(uint64_t);
+
+// Code at `code' as something to call. The copy keeps the compiler from
+// assuming a data pointer and a function pointer never alias; that the two
+// convert at all is only guaranteed on POSIX systems (because of eg dlsym).
+EntryFunction EntryFunction_at(byte *code) {
+  EntryFunction function;
+  memcpy(&function, &code, sizeof function);
+  return function;
+}
+
+// A dual-mapped buffer is executable already, so this costs nothing and the
+// buffer stays writable. Otherwise the code stays readable, so that it can be
+// saved (see CodeCache_save), but can't be written any more.
 int Buffer_make_executable(Buffer *buf) {
-  int result = mprotect(buf->address, buf->len, PROT_EXEC);
   buf->state = kExecutable;
-  return result;
+  if (buf->exec != NULL) {
+    return 0;
+  }
+  return mprotect(buf->address, buf->len, PROT_READ | PROT_EXEC);
+}
+
+// Undo Buffer_make_executable, so that more code can be written to the buffer.
+// Nothing may run from it until it is made executable again, unless it is
+// dual-mapped.
+int Buffer_make_writable(Buffer *buf) {
+  buf->state = kWritable;
+  if (buf->exec != NULL) {
+    return 0;
+  }
+  return mprotect(buf->address, buf->len, PROT_READ | PROT_WRITE);
+}
+
+// Make sure the buffer can hold at least `capacity' bytes. Unless the buffer
+// is dual-mapped the mapping may move, so nobody should hold on to `address'
+// across writes; everything that refers into the buffer while it is being
+// written (label positions, jumps and calls waiting to be resolved) is stored
+// as an offset instead.
+void Buffer_ensure_capacity(Buffer *buf, size_t capacity) {
+  if (capacity <= buf->len)
+    return;
+  assert((buf->state == kWritable || buf->exec != NULL) &&
+         "can't grow an executable buffer");
+  size_t new_len = buf->len * 2;
+  if (new_len < capacity)
+    new_len = capacity;
+  new_len = round_up_to_page(new_len);
+  if (buf->exec != NULL) {
+    // The code lives in the memfd, so the views just take in more of it, where
+    // they are.
+    assert(capacity <= buf->reserved && "dual-mapped buffer is full");
+    if (new_len > buf->reserved) {
+      new_len = buf->reserved;
+    }
+    int result = ftruncate(buf->fd, new_len);
+    assert(result == 0);
+    result = Buffer_map_views(buf, buf->len, new_len);
+    assert(result == 0);
+    (void)result;
+    return;
+  }
+#ifdef MREMAP_MAYMOVE
+  byte *address = mremap(buf->address, buf->len, new_len, MREMAP_MAYMOVE);
+  assert(address != MAP_FAILED);
+#else
+  byte *address = mmap(/*addr=*/NULL, new_len, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE,
+                       /*filedes=*/-1, /*off=*/0);
+  assert(address != MAP_FAILED);
+  memcpy(address, buf->address, buf->len);
+  munmap(buf->address, buf->len);
+#endif
+  buf->address = address;
+  buf->len = new_len;
 }
 
 void Buffer_at_put(Buffer *buf, size_t pos, byte b) { buf->address[pos] = b; }
 
-// TODO: dynamically expand buffer when space runs out
+// A position in the code that jumps and calls can refer to before it is known.
+// Labels are numbered per writer from 0.
+typedef int32_t Label;
+
+struct Fixup;
+
+// What the peephole rules know about the last instruction written (see
+// BufferWriter_last).
+typedef enum {
+  // Anything the rules don't look at, or nothing since the last label: no
+  // rule looks back past it.
+  kInsnOther,
+  kInsnLoadImm, // {reg} = {imm}
+  kInsnMove,    // mov {reg}, {src}
+  kInsnLoad,    // mov {reg}, [rsp+{imm}]
+  kInsnStore,   // mov [rsp+{imm}], {reg}
+  kInsnAddImm,  // add {reg}, {imm}, which is negative for a sub
+} InsnKind;
+
+typedef struct {
+  InsnKind kind;
+  uint8_t reg;
+  uint8_t src;
+  int64_t imm;
+  // Where it starts and ends in the code.
+  size_t start;
+  size_t end;
+} Insn;
+
 typedef struct {
   Buffer *buf;
   size_t pos;
+  // Where each label is bound, or -1 if it isn't yet. Labels below
+  // first_label aren't this writer's to bind (see BufferWriter_init_appended);
+  // labels[i] is for label first_label + i, and num_labels is the number the
+  // next label gets.
+  int32_t *labels;
+  int32_t first_label;
+  int32_t num_labels;
+  int32_t labels_capacity;
+  // Jumps and calls emitted since the last BufferWriter_relax.
+  struct Fixup *fixups;
+  int32_t num_fixups;
+  int32_t fixups_capacity;
+  // With kOptPeephole: the emitters that have rules look back at `last',
+  // which is recorded either way. See the Peephole rules.
+  bool peephole;
+  Insn last;
 } BufferWriter;
 
 void BufferWriter_init(BufferWriter *writer, Buffer *buf) {
-  writer->buf = buf;
-  writer->pos = 0;
+  *writer = (BufferWriter){.buf = buf};
+}
+
+// For code to be written on its own and then appended to `target' with
+// BufferWriter_append. The labels target has so far can be jumped to and
+// called, but are bound as and where they are in target.
+void BufferWriter_init_appended(BufferWriter *writer, Buffer *buf,
+                                const BufferWriter *target) {
+  *writer = (BufferWriter){.buf = buf,
+                           .first_label = target->num_labels,
+                           .num_labels = target->num_labels,
+                           .peephole = target->peephole};
+}
+
+void BufferWriter_deinit(BufferWriter *writer) {
+  free(writer->labels);
+  free(writer->fixups);
+  writer->labels = NULL;
+  writer->fixups = NULL;
 }
 
 const int kBitsPerByte = 8; // bits
 const int kWordSize = 8;    // bytes
 
-void BufferWriter_backpatch_displacement_imm32(BufferWriter *writer,
-                                               int32_t pos_after_jump) {
-  int32_t relative = writer->pos - pos_after_jump;
-  int32_t displacement_first_byte = pos_after_jump - sizeof(int32_t);
-  for (size_t i = 0; i < sizeof(int32_t); i++) {
-    Buffer_at_put(writer->buf, displacement_first_byte + i,
-                  (relative >> (i * kBitsPerByte)) & 0xff);
+// Reserve `len' bytes at the end of the writer and return a pointer to them
+// for the caller to fill in. Emitters reserve a whole instruction at once so
+// that there is one capacity check per instruction rather than one per byte.
+// The pointer is only good until the next write, since the buffer may move.
+byte *BufferWriter_reserve(BufferWriter *writer, size_t len) {
+  size_t pos = writer->pos;
+  if (pos + len > writer->buf->len) {
+    Buffer_ensure_capacity(writer->buf, pos + len);
   }
+  writer->pos = pos + len;
+  writer->last.kind = kInsnOther;
+  return writer->buf->address + pos;
 }
+
+// x86-64 is little-endian, so immediates and displacements are stored with a
+// single (possibly unaligned) memcpy instead of byte by byte.
+static void store32(byte *dst, int32_t value) {
+  memcpy(dst, &value, sizeof value);
+}
+
 size_t BufferWriter_get_pos(BufferWriter *writer) { return writer->pos; }
 
 void Buffer_dump(BufferWriter *writer, FILE *fp) {
@@ -117,20 +377,15 @@ void Buffer_dump(BufferWriter *writer, FILE *fp) {
 }
 
 void Buffer_write8(BufferWriter *writer, byte b) {
-  assert(writer->pos < writer->buf->len);
-  Buffer_at_put(writer->buf, writer->pos++, b);
+  *BufferWriter_reserve(writer, 1) = b;
 }
 
 void Buffer_write_arr(BufferWriter *writer, byte *arr, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    Buffer_write8(writer, arr[i]);
-  }
+  memcpy(BufferWriter_reserve(writer, len), arr, len);
 }
 
 void Buffer_write32(BufferWriter *writer, int32_t value) {
-  for (size_t i = 0; i < 4; i++) {
-    Buffer_write8(writer, (value >> (i * kBitsPerByte)) & 0xff);
-  }
+  store32(BufferWriter_reserve(writer, sizeof value), value);
 }
 
 typedef enum {
@@ -148,46 +403,257 @@ typedef enum {
   kAl = 0,
 } SubRegister;
 
+// Values are the x86 condition codes, as used in the low nibble of jcc and
+// setcc. Flipping the low bit negates a condition.
 typedef enum {
-  kEqual,
+  kOverflow = 0x0,
+  kNoOverflow = 0x1,
+  kBelow = 0x2,
+  kAboveEqual = 0x3,
+  kEqual = 0x4,
+  kNotEqual = 0x5,
+  kBelowEqual = 0x6,
+  kAbove = 0x7,
+  kLess = 0xc,
+  kGreaterEqual = 0xd,
+  kLessEqual = 0xe,
+  kGreater = 0xf,
 } Condition;
 
+Condition Condition_negate(Condition cond) { return cond ^ 1; }
+
+// Peephole rules
+//
+// With kOptPeephole, a few of the emitters below look at the instruction
+// written just before theirs, and write something shorter for the two of them
+// together, or nothing at all:
+//
+// - A load of what was just stored -- mov [rsp-8], rax; mov rax, [rsp-8], as
+//   AST_compile_let makes -- is dropped, or becomes a move if it is into
+//   another register. So is a store of what was just loaded or stored, and a
+//   move straight back.
+// - mov rax, rsi; or rax, {tag}, as AST_compile_cons makes, becomes one lea:
+//   rsi is always aligned to an object (see the Heap section), so the or is an
+//   add.
+// - Any other or of rax with a byte that has its top bit clear, like the tag
+//   integer->char adds, only changes al, which has a shorter encoding.
+// - An immediate added to or subtracted from a register right after another
+//   adds in the sum of the two instead.
+// - A register that is set and then set again before anything reads it loses
+//   the first set.
+//
+// The window is the one instruction in BufferWriter.last, which the emitters
+// with rules record. Everything else that writes code forgets it, and so does
+// binding a label, since a jump could land between the two. The rules don't
+// keep the flags: no code reads the flags of a move, add or or, except for a
+// jo right after an add -- and the jo ends the window.
+
+// The last instruction, if the peephole rules are on and nothing has come
+// since; otherwise NULL.
+static Insn *BufferWriter_last(BufferWriter *writer) {
+  Insn *last = &writer->last;
+  if (!writer->peephole || last->kind == kInsnOther ||
+      last->end != writer->pos) {
+    return NULL;
+  }
+  return last;
+}
+
+// Record `insn', the instruction just written from `start', as the last one.
+static void BufferWriter_record(BufferWriter *writer, size_t start,
+                                Insn insn) {
+  insn.start = start;
+  insn.end = writer->pos;
+  writer->last = insn;
+}
+
+// Take the last instruction back out of the code.
+static void BufferWriter_drop_last(BufferWriter *writer) {
+  writer->pos = writer->last.start;
+  writer->last.kind = kInsnOther;
+}
+
+// Before an instruction that sets `reg' without reading it: if the last one
+// did nothing but set `reg', drop it.
+static void BufferWriter_drop_dead_set(BufferWriter *writer, Register reg) {
+  Insn *last = BufferWriter_last(writer);
+  if (last != NULL && last->reg == reg &&
+      (last->kind == kInsnLoadImm || last->kind == kInsnMove ||
+       last->kind == kInsnLoad)) {
+    BufferWriter_drop_last(writer);
+  }
+}
+
+// Instruction selection: the emitters below take full-width immediates and
+// displacements, and each picks the shortest encoding that does what it says
+// -- the sign-extended imm8 form of an ALU op when the value fits in a byte, a
+// disp8 or no displacement at all in an address, test rather than cmp against
+// zero. Callers don't need to know which one they got.
+
+static bool is_imm8(int32_t value) {
+  return value >= INT8_MIN && value <= INT8_MAX;
+}
+
 void Buffer_inc_reg(BufferWriter *writer, Register reg) {
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0xff);
-  Buffer_write8(writer, 0xc0 + reg);
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0xff;
+  insn[2] = 0xc0 + reg;
 }
 
 void Buffer_dec_reg(BufferWriter *writer, Register reg) {
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0xff);
-  Buffer_write8(writer, 0xc8 + reg);
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0xff;
+  insn[2] = 0xc8 + reg;
+}
+
+// inc qword [{reg}]. rsp and rbp would need other encodings.
+void Buffer_inc_mem_reg(BufferWriter *writer, Register reg) {
+  assert(reg != kRsp && reg != kRbp);
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0xff;
+  insn[2] = 0x00 + reg;
 }
 
+// mov {dst}, {imm64}
+void Buffer_mov_reg_imm64(BufferWriter *writer, Register dst, uint64_t src) {
+  byte *insn = BufferWriter_reserve(writer, 10);
+  insn[0] = 0x48;
+  insn[1] = 0xb8 + dst;
+  memcpy(insn + 2, &src, sizeof src);
+}
+
+// mov {dst:32}, {imm32}, which zero-extends. It leaves the flags alone; see
+// Buffer_load_reg_imm32 for the shorter form that doesn't.
 void Buffer_mov_reg_imm32(BufferWriter *writer, Register dst, int32_t src) {
-  Buffer_write8(writer, 0xb8 + dst);
-  Buffer_write32(writer, src);
+  byte *insn = BufferWriter_reserve(writer, 5);
+  insn[0] = 0xb8 + dst;
+  store32(insn + 1, src);
 }
 
-void Buffer_add_reg_imm32(BufferWriter *writer, Register dst, int32_t src) {
+// xor {dst:32}, {src:32}
+void Buffer_xor_reg_reg(BufferWriter *writer, Register dst, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 2);
+  insn[0] = 0x31;
+  insn[1] = 0xc0 + dst + src * 8;
+}
+
+// Set {dst} to the zero-extended {value}. Zero takes two bytes with xor rather
+// than five with mov, at the cost of the flags.
+void Buffer_load_reg_imm32(BufferWriter *writer, Register dst,
+                           int32_t value) {
+  BufferWriter_drop_dead_set(writer, dst);
+  size_t start = writer->pos;
+  if (value == 0) {
+    Buffer_xor_reg_reg(writer, dst, dst);
+  } else {
+    Buffer_mov_reg_imm32(writer, dst, value);
+  }
+  BufferWriter_record(writer, start,
+                      (Insn){.kind = kInsnLoadImm, .reg = dst, .imm = value});
+}
+
+// The add/sub/and/or/cmp {reg}, {imm} instructions share a layout: an
+// optional REX.W, 83 /digit {imm8} if the value fits in a byte, and otherwise
+// either the short form for rax (opcode, imm32) or 81 /digit {imm32}.
+static void Buffer_alu_reg_imm(BufferWriter *writer, bool wide,
+                               byte rax_opcode, byte modrm_base, Register dst,
+                               int32_t value) {
+  byte *insn;
+  if (is_imm8(value)) {
+    insn = BufferWriter_reserve(writer, 3 + wide);
+    if (wide) {
+      *insn++ = 0x48;
+    }
+    insn[0] = 0x83;
+    insn[1] = modrm_base + dst;
+    insn[2] = (byte)value;
+    return;
+  }
   if (dst == kRax) {
-    // Optimization: add eax, {imm32} can either be encoded as 05 {imm32} or 81
-    // c0 {imm32}.
-    Buffer_write8(writer, 0x05);
+    insn = BufferWriter_reserve(writer, 5 + wide);
+    if (wide) {
+      *insn++ = 0x48;
+    }
+    insn[0] = rax_opcode;
+    store32(insn + 1, value);
+    return;
+  }
+  insn = BufferWriter_reserve(writer, 6 + wide);
+  if (wide) {
+    *insn++ = 0x48;
+  }
+  insn[0] = 0x81;
+  insn[1] = modrm_base + dst;
+  store32(insn + 2, value);
+}
+
+// Add {value} to {dst} -- with a sub of it, if `sub' -- unless the rule for
+// adjacent immediates folds it into the last instruction. A register gets
+// the same width every time, so the sum is what the two would have added.
+static void Buffer_add_sub_reg_imm(BufferWriter *writer, bool wide, bool sub,
+                                   Register dst, int32_t value) {
+  int64_t total = sub ? -(int64_t)value : value;
+  Insn *last = BufferWriter_last(writer);
+  if (last != NULL && last->kind == kInsnAddImm && last->reg == dst &&
+      total + last->imm >= INT32_MIN && total + last->imm <= INT32_MAX) {
+    total += last->imm;
+    BufferWriter_drop_last(writer);
+    if (total == 0) {
+      return;
+    }
+    sub = false;
+    value = (int32_t)total;
+  }
+  size_t start = writer->pos;
+  if (sub) {
+    Buffer_alu_reg_imm(writer, wide, 0x2d, 0xe8, dst, value);
   } else {
-    Buffer_write8(writer, 0x81);
-    Buffer_write8(writer, 0xc0 + dst);
+    Buffer_alu_reg_imm(writer, wide, 0x05, 0xc0, dst, value);
   }
-  Buffer_write32(writer, src);
+  BufferWriter_record(writer, start,
+                      (Insn){.kind = kInsnAddImm, .reg = dst, .imm = total});
+}
+
+void Buffer_add_reg_imm32(BufferWriter *writer, Register dst, int32_t src) {
+  // 32-bit for rax, and REX.W otherwise: this is mostly used to bump rsi,
+  // which must not be truncated.
+  Buffer_add_sub_reg_imm(writer, /*wide=*/dst != kRax, /*sub=*/false, dst,
+                         src);
+}
+
+// 64-bit add, unlike Buffer_add_reg_imm32: rsp must never be truncated.
+void Buffer_add_rsp_imm32(BufferWriter *writer, int32_t value) {
+  Buffer_add_sub_reg_imm(writer, /*wide=*/true, /*sub=*/false, kRsp, value);
 }
 
-void Buffer_add_reg_stack(BufferWriter *writer, Register dst, int8_t offset) {
+// All of the [rsp+{disp}] forms share this layout: REX.W, the opcode, a ModRM
+// byte with a SIB (since the base is rsp), the SIB byte, and a disp8 if the
+// offset fits in one or a disp32 if it doesn't.
+static void Buffer_op_reg_stack(BufferWriter *writer, byte opcode,
+                                Register reg, int32_t offset) {
   assert(offset < 0 && "positive stack offset unimplemented");
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x03);
-  Buffer_write8(writer, 0x04 + (dst * 8) + (offset == 0 ? 0 : 0x40));
-  Buffer_write8(writer, 0x24);
-  Buffer_write8(writer, 0x100 + offset);
+  if (is_imm8(offset)) {
+    byte *insn = BufferWriter_reserve(writer, 5);
+    insn[0] = 0x48;
+    insn[1] = opcode;
+    insn[2] = 0x44 + reg * 8;
+    insn[3] = 0x24;
+    insn[4] = (byte)offset;
+    return;
+  }
+  byte *insn = BufferWriter_reserve(writer, 8);
+  insn[0] = 0x48;
+  insn[1] = opcode;
+  insn[2] = 0x84 + reg * 8;
+  insn[3] = 0x24;
+  store32(insn + 4, offset);
+}
+
+void Buffer_add_reg_stack(BufferWriter *writer, Register dst, int32_t offset) {
+  Buffer_op_reg_stack(writer, 0x03, dst, offset);
 }
 
 static uint8_t encode_disp(int8_t disp) {
@@ -196,1527 +662,12150 @@ static uint8_t encode_disp(int8_t disp) {
   return 0x100 + disp;
 }
 
+// The [{base}+{disp}] forms with rax as the other operand: REX.W, the opcode,
+// and a ModRM byte followed by nothing when disp is 0, a disp8, or a disp32.
+// rbp can't go without a displacement (that encoding means rip-relative) and
+// rsp as a base needs a SIB byte (see Buffer_op_reg_stack).
+static void Buffer_op_rax_base_disp(BufferWriter *writer, byte opcode,
+                                    Register base, int32_t disp) {
+  assert(base != kRsp && "rsp as a base needs a SIB byte");
+  if (disp == 0 && base != kRbp) {
+    byte *insn = BufferWriter_reserve(writer, 3);
+    insn[0] = 0x48;
+    insn[1] = opcode;
+    insn[2] = base;
+    return;
+  }
+  if (is_imm8(disp)) {
+    byte *insn = BufferWriter_reserve(writer, 4);
+    insn[0] = 0x48;
+    insn[1] = opcode;
+    insn[2] = 0x40 + base;
+    insn[3] = encode_disp(disp);
+    return;
+  }
+  byte *insn = BufferWriter_reserve(writer, 7);
+  insn[0] = 0x48;
+  insn[1] = opcode;
+  insn[2] = 0x80 + base;
+  store32(insn + 3, disp);
+}
+
+// mov [{dst}+{disp}], rax
 void Buffer_mov_rax_to_reg_disp(BufferWriter *writer, Register dst,
-                                int8_t disp) {
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x89);
-  Buffer_write8(writer, 0x40 + dst);
-  Buffer_write8(writer, encode_disp(disp));
+                                int32_t disp) {
+  Buffer_op_rax_base_disp(writer, 0x89, dst, disp);
 }
 
+// mov rax, [{dst}+{disp}]
 void Buffer_mov_reg_disp_to_rax(BufferWriter *writer, Register dst,
-                                int8_t disp) {
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x8b);
-  Buffer_write8(writer, 0x40 + dst);
-  Buffer_write8(writer, encode_disp(disp));
+                                int32_t disp) {
+  Buffer_op_rax_base_disp(writer, 0x8b, dst, disp);
+}
+
+// cmp rax, [{base}+{disp}]
+void Buffer_cmp_rax_reg_disp(BufferWriter *writer, Register base,
+                             int32_t disp) {
+  Buffer_op_rax_base_disp(writer, 0x3b, base, disp);
+}
+
+// xor rax, [{base}+{disp}]
+void Buffer_xor_rax_reg_disp(BufferWriter *writer, Register base,
+                             int32_t disp) {
+  Buffer_op_rax_base_disp(writer, 0x33, base, disp);
 }
 
 void Buffer_sub_reg_imm32(BufferWriter *writer, Register dst, int32_t src) {
-  if (dst == kRax) {
-    // Optimization: sub eax, {imm32} can either be encoded as 2d {imm32} or 81
-    // e8 {imm32}.
-    Buffer_write8(writer, 0x2d);
-  } else {
-    Buffer_write8(writer, 0x83);
-    Buffer_write8(writer, 0xe8 + dst);
-  }
-  Buffer_write32(writer, src);
+  // Sized like Buffer_add_reg_imm32.
+  Buffer_add_sub_reg_imm(writer, /*wide=*/dst != kRax, /*sub=*/true, dst,
+                         src);
 }
 
 void Buffer_mov_reg_reg(BufferWriter *writer, Register dst, Register src) {
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x89);
-  Buffer_write8(writer, 0xc0 + dst + src * 8);
+  Insn *last = BufferWriter_last(writer);
+  if (writer->peephole &&
+      (dst == src ||
+       (last != NULL && last->kind == kInsnMove &&
+        ((last->reg == src && last->src == dst) ||
+         (last->reg == dst && last->src == src))))) {
+    return;
+  }
+  BufferWriter_drop_dead_set(writer, dst);
+  size_t start = writer->pos;
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x89;
+  insn[2] = 0xc0 + dst + src * 8;
+  BufferWriter_record(writer, start,
+                      (Insn){.kind = kInsnMove, .reg = dst, .src = src});
+}
+
+void Buffer_add_reg_reg(BufferWriter *writer, Register dst, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x01;
+  insn[2] = 0xc0 + dst + src * 8;
+}
+
+void Buffer_sub_reg_reg(BufferWriter *writer, Register dst, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x29;
+  insn[2] = 0xc0 + dst + src * 8;
+}
+
+void Buffer_or_reg_reg(BufferWriter *writer, Register dst, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x09;
+  insn[2] = 0xc0 + dst + src * 8;
 }
 
 void Buffer_mov_reg_to_stack(BufferWriter *writer, Register src,
-                             int8_t offset) {
-  assert(offset < 0 && "positive stack offset unimplemented");
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x89);
-  Buffer_write8(writer, 0x04 + (src * 8) + (offset == 0 ? 0 : 0x40));
-  Buffer_write8(writer, 0x24);
-  Buffer_write8(writer, 0x100 + offset);
+                             int32_t offset) {
+  Insn *last = BufferWriter_last(writer);
+  if (last != NULL && (last->kind == kInsnLoad || last->kind == kInsnStore) &&
+      last->reg == src && last->imm == offset) {
+    // The slot holds it already.
+    return;
+  }
+  size_t start = writer->pos;
+  Buffer_op_reg_stack(writer, 0x89, src, offset);
+  BufferWriter_record(writer, start,
+                      (Insn){.kind = kInsnStore, .reg = src, .imm = offset});
 }
 
 void Buffer_mov_stack_to_reg(BufferWriter *writer, Register dst,
-                             int8_t offset) {
-  assert(offset < 0 && "positive stack offset unimplemented");
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x8b);
-  Buffer_write8(writer, 0x04 + (dst * 8) + (offset == 0 ? 0 : 0x40));
-  Buffer_write8(writer, 0x24);
-  Buffer_write8(writer, 0x100 + offset);
+                             int32_t offset) {
+  Insn *last = BufferWriter_last(writer);
+  if (last != NULL && last->kind == kInsnStore && last->imm == offset) {
+    // What the slot holds is still in the register it came from.
+    Buffer_mov_reg_reg(writer, dst, last->reg);
+    return;
+  }
+  BufferWriter_drop_dead_set(writer, dst);
+  size_t start = writer->pos;
+  Buffer_op_reg_stack(writer, 0x8b, dst, offset);
+  BufferWriter_record(writer, start,
+                      (Insn){.kind = kInsnLoad, .reg = dst, .imm = offset});
 }
 
 void Buffer_shl_reg(BufferWriter *writer, Register dst, int8_t bits) {
   assert(bits >= 0 && "too few bits");
   assert(bits < 64 && "too many bits");
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0xc1);
-  Buffer_write8(writer, 0xe0 + dst);
-  Buffer_write8(writer, bits);
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x48;
+  insn[1] = 0xc1;
+  insn[2] = 0xe0 + dst;
+  insn[3] = bits;
+}
+
+// shr {dst}, {bits}: a logical shift, which brings in zeroes.
+void Buffer_shr_reg(BufferWriter *writer, Register dst, int8_t bits) {
+  assert(bits >= 0 && "too few bits");
+  assert(bits < 64 && "too many bits");
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x48;
+  insn[1] = 0xc1;
+  insn[2] = 0xe8 + dst;
+  insn[3] = bits;
 }
 
 void Buffer_and_reg_imm32(BufferWriter *writer, Register dst, int32_t value) {
-  Buffer_write8(writer, 0x48);
-  if (dst == kRax) {
-    // Optimization: and eax, {imm32} can either be encoded as 48 25 {imm32} or
-    // 48 81 e0 {imm32}.
-    Buffer_write8(writer, 0x25);
-    Buffer_write32(writer, value);
-    return;
-  }
-  Buffer_write8(writer, 0x81);
-  Buffer_write8(writer, 0xe0 + dst);
-  Buffer_write32(writer, value);
+  Buffer_alu_reg_imm(writer, /*wide=*/true, 0x25, 0xe0, dst, value);
 }
 
+void Buffer_lea_reg_disp(BufferWriter *writer, Register dst, Register base,
+                         int32_t disp);
+
 void Buffer_or_reg_imm32(BufferWriter *writer, Register dst, int32_t value) {
-  Buffer_write8(writer, 0x48);
-  if (dst == kRax) {
-    // Optimization: or eax, {imm32} can either be encoded as 48 0d {imm32} or
-    // 48 81 c8 {imm32}.
-    Buffer_write8(writer, 0x0d);
-    Buffer_write32(writer, value);
+  Insn *last = BufferWriter_last(writer);
+  if (last != NULL && last->kind == kInsnMove && last->reg == dst &&
+      last->src == kRsi && value >= 0 && value <= kHeapObjectMask) {
+    BufferWriter_drop_last(writer);
+    Buffer_lea_reg_disp(writer, dst, kRsi, value);
     return;
   }
-  Buffer_write8(writer, 0x81);
-  Buffer_write8(writer, 0xc8 + dst);
-  Buffer_write32(writer, value);
-}
-
-void Buffer_cmp_reg_imm32(BufferWriter *writer, Register dst, int32_t value) {
-  if (dst == kRax) {
-    // Optimization: cmp eax, {imm32} can either be encoded as 48 3d {imm32} or
-    // 48 81 f8 {imm32}.
-    Buffer_write8(writer, 0x48);
-    Buffer_write8(writer, 0x3d);
-    Buffer_write32(writer, value);
+  if (writer->peephole && dst == kRax && value >= 0 && value <= INT8_MAX) {
+    // or al, {value}
+    byte *insn = BufferWriter_reserve(writer, 2);
+    insn[0] = 0x0c;
+    insn[1] = (byte)value;
     return;
   }
-  Buffer_write8(writer, 0x48);
-  Buffer_write8(writer, 0x81);
-  Buffer_write8(writer, 0xf8 + dst);
-  Buffer_write32(writer, value);
+  Buffer_alu_reg_imm(writer, /*wide=*/true, 0x0d, 0xc8, dst, value);
 }
 
-void Buffer_setcc_reg(BufferWriter *writer, Condition cond, SubRegister dst) {
-  assert(cond == kEqual && "other conditions unimplemented");
-  Buffer_write8(writer, 0x0f);
-  Buffer_write8(writer, 0x94);
-  Buffer_write8(writer, 0xc0 + dst);
+void Buffer_xor_reg_imm32(BufferWriter *writer, Register dst, int32_t value) {
+  Buffer_alu_reg_imm(writer, /*wide=*/true, 0x35, 0xf0, dst, value);
 }
 
-// Relative jump
-void Buffer_je_imm32(BufferWriter *writer, int32_t disp) {
-  assert(disp > 0 && "negative disp unimplemented");
-  Buffer_write8(writer, 0x0f);
-  Buffer_write8(writer, 0x84);
-  Buffer_write32(writer, disp);
+// cmp {left}, {right}
+void Buffer_cmp_reg_reg(BufferWriter *writer, Register left, Register right) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x39;
+  insn[2] = 0xc0 + left + right * 8;
 }
 
-// Relative jump
-void Buffer_jmp_imm32(BufferWriter *writer, int32_t disp) {
-  assert(disp > 0 && "negative disp unimplemented");
-  Buffer_write8(writer, 0xe9);
-  Buffer_write32(writer, disp);
+void Buffer_cmp_reg_stack(BufferWriter *writer, Register left,
+                          int32_t offset) {
+  Buffer_op_reg_stack(writer, 0x3b, left, offset);
 }
 
-static uint32_t encode_disp32(int32_t disp) {
-  if (disp >= 0)
-    return disp;
-  return 0x100000000 + disp;
+// test {left}, {right}
+void Buffer_test_reg_reg(BufferWriter *writer, Register left, Register right) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x48;
+  insn[1] = 0x85;
+  insn[2] = 0xc0 + left + right * 8;
 }
 
-// Relative call
-void Buffer_call_imm32(BufferWriter *writer, int32_t disp) {
-  disp -= 5; // sizeof call instruction (e8 + imm32)
-  Buffer_write8(writer, 0xe8);
-  Buffer_write32(writer, encode_disp32(disp));
+void Buffer_cmp_reg_imm32(BufferWriter *writer, Register dst, int32_t value) {
+  if (value == 0) {
+    // test sets every flag a condition can read the same way cmp with 0 does.
+    Buffer_test_reg_reg(writer, dst, dst);
+    return;
+  }
+  Buffer_alu_reg_imm(writer, /*wide=*/true, 0x3d, 0xf8, dst, value);
 }
 
-void Buffer_ret(BufferWriter *writer) { Buffer_write8(writer, 0xc3); }
-
-// End Machine code
+// The 32-bit ALU ops that fixnum arithmetic is done with (see the Primitives
+// section), as the opcodes of their {op} {reg}, {r/m} forms. imul's takes two
+// bytes. idiv has only the one operand, which goes in the r/m, with /7 in
+// place of the register.
+typedef enum {
+  kAlu32Add = 0x03,
+  kAlu32Or = 0x0b,
+  kAlu32And = 0x23,
+  kAlu32Sub = 0x2b,
+  kAlu32Cmp = 0x3b,
+  kAlu32Imul = 0x0faf,
+  kAlu32Idiv = 0xf7,
+} Alu32Op;
+
+// Reserve room for the opcode of `op' and `rest' more bytes, write the
+// opcode, and return where the rest go.
+static byte *Buffer_alu32_opcode(BufferWriter *writer, Alu32Op op, int rest) {
+  bool two_bytes = op > 0xff;
+  byte *insn = BufferWriter_reserve(writer, 1 + two_bytes + rest);
+  if (two_bytes) {
+    *insn++ = op >> 8;
+  }
+  *insn++ = op & 0xff;
+  return insn;
+}
 
-// Env
+// {op} {dst:32}, {src:32}
+void Buffer_alu32_reg_reg(BufferWriter *writer, Alu32Op op, Register dst,
+                          Register src) {
+  byte *insn = Buffer_alu32_opcode(writer, op, 1);
+  insn[0] = 0xc0 + dst * 8 + src;
+}
 
-// An Env maps a list of names to a list of corresponding indices in the stack.
-// This is useful when binding names in function params, `let`, and at the top
-// level.
-//
-// Goal: don't allocate any EnvNodes on the heap when recursively compiling
-// functions and let-bindings; instead, borrow the atom char* and store an
-// EnvNode on the stack. All recursive leaf calls will be able to reference
-// this EnvNode and when the function returns, the name should not be
-// available/bound anyway. Eg:
-//
-// void AST_compile_let(..., ASTNode *bindings, ASTNode *body) {
-//   if (bindings == nil) {
-//     AST_compile_expr(..., body);
-//     return;
-//   }
-//   EnvNode new_env = bind_name(car(bindings));
-//   new_env.next = ctx->locals;
-//   CompilerContext new_ctx = CompilerContext_with_locals(..., &new_env);
-//   AST_compile_let(&new_ctx, ..., cdr(bindings), body);
-// }
-//
-// In any case, the atoms/char* will live long enough since we don't have any
-// plan to free ASTNodes right now...
+// {op} {dst:32}, dword [rsp+{offset}], laid out like Buffer_op_reg_stack but
+// without the REX.W.
+void Buffer_alu32_reg_stack(BufferWriter *writer, Alu32Op op, Register dst,
+                            int32_t offset) {
+  assert(offset < 0 && "positive stack offset unimplemented");
+  if (is_imm8(offset)) {
+    byte *insn = Buffer_alu32_opcode(writer, op, 3);
+    insn[0] = 0x44 + dst * 8;
+    insn[1] = 0x24;
+    insn[2] = (byte)offset;
+    return;
+  }
+  byte *insn = Buffer_alu32_opcode(writer, op, 6);
+  insn[0] = 0x84 + dst * 8;
+  insn[1] = 0x24;
+  store32(insn + 2, offset);
+}
 
-typedef struct EnvNode {
-  char *name;
-  int32_t stack_index;
-  struct EnvNode *next;
-} EnvNode;
+// idiv {src:32}: divide edx:eax by it, leaving the quotient in eax and the
+// remainder in edx.
+void Buffer_idiv32_reg(BufferWriter *writer, Register src) {
+  // /7 is idiv; kRdi happens to be 7.
+  Buffer_alu32_reg_reg(writer, kAlu32Idiv, /*dst=*/kRdi, src);
+}
 
-EnvNode Env_init(char *name, int32_t stack_index, EnvNode *next) {
-  return (EnvNode){.name = name, .stack_index = stack_index, .next = next};
+// idiv dword [rsp+{offset}]
+void Buffer_idiv32_stack(BufferWriter *writer, int32_t offset) {
+  Buffer_alu32_reg_stack(writer, kAlu32Idiv, /*dst=*/kRdi, offset);
 }
 
-// Return true if found and store the corresponding stack_index in
-// *stack_index. Return false otherwise.
-bool Env_lookup(EnvNode *env, char *name, int32_t *stack_index) {
-  assert(name != NULL);
-  assert(stack_index != NULL);
-  if (env == NULL)
-    return false;
-  if (env->name == name || strcmp(env->name, name) == 0) {
-    *stack_index = env->stack_index;
-    return true;
+// imul {dst:32}, {src:32}, {value}, which sets the overflow flag where shl
+// wouldn't.
+void Buffer_imul32_reg_imm(BufferWriter *writer, Register dst, Register src,
+                           int32_t value) {
+  if (is_imm8(value)) {
+    byte *insn = BufferWriter_reserve(writer, 3);
+    insn[0] = 0x6b;
+    insn[1] = 0xc0 + dst * 8 + src;
+    insn[2] = (byte)value;
+    return;
   }
-  return Env_lookup(env->next, name, stack_index);
+  byte *insn = BufferWriter_reserve(writer, 6);
+  insn[0] = 0x69;
+  insn[1] = 0xc0 + dst * 8 + src;
+  store32(insn + 2, value);
 }
 
-// End Env
+// cdq: sign-extend eax into edx, for idiv.
+void Buffer_cdq(BufferWriter *writer) { Buffer_write8(writer, 0x99); }
 
-// AST
+// sar {dst:32}, {bits}
+void Buffer_sar32_reg(BufferWriter *writer, Register dst, int8_t bits) {
+  assert(bits >= 0 && bits < 32);
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0xc1;
+  insn[1] = 0xf8 + dst;
+  insn[2] = bits;
+}
 
-typedef enum {
-  kFixnum,
-  kAtom,
-  kCons,
-} ASTNodeType;
+// shl {dst:32}, {bits}
+void Buffer_shl32_reg(BufferWriter *writer, Register dst, int8_t bits) {
+  assert(bits >= 0 && bits < 32);
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0xc1;
+  insn[1] = 0xe0 + dst;
+  insn[2] = bits;
+}
 
-struct ASTNode;
+// ud2, which raises SIGILL.
+void Buffer_ud2(BufferWriter *writer) {
+  byte *insn = BufferWriter_reserve(writer, 2);
+  insn[0] = 0x0f;
+  insn[1] = 0x0b;
+}
 
-typedef struct {
-  struct ASTNode *car;
-  struct ASTNode *cdr;
-} ASTCons;
+void Buffer_setcc_reg(BufferWriter *writer, Condition cond, SubRegister dst) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x0f;
+  insn[1] = 0x90 + cond;
+  insn[2] = 0xc0 + dst;
+}
 
-// TODO: tag AST nodes as values. immediate ints, etc
-typedef struct ASTNode {
-  ASTNodeType type;
-  union {
-    int fixnum;
-    char *atom;
-    ASTCons cons;
-  } value;
-} ASTNode;
+// movzx {dst:32}, {src:8}, which clears the rest of {dst}.
+void Buffer_movzx_reg_subreg(BufferWriter *writer, Register dst,
+                             SubRegister src) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x0f;
+  insn[1] = 0xb6;
+  insn[2] = 0xc0 + dst * 8 + src;
+}
 
-ASTNode nil_struct = {.type = kCons, .value.cons = {.car = NULL, .cdr = NULL}};
-ASTNode *nil = &nil_struct;
+// movzx {dst:32}, byte [{base}+{disp}]
+void Buffer_movzx_reg_byte_disp(BufferWriter *writer, Register dst,
+                                Register base, int8_t disp) {
+  assert(base != kRsp && "rsp as a base needs a SIB byte");
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x0f;
+  insn[1] = 0xb6;
+  insn[2] = 0x40 + dst * 8 + base;
+  insn[3] = encode_disp(disp);
+}
 
-ASTNode *AST_new_fixnum(int fixnum) {
-  ASTNode *result = malloc(sizeof *result);
-  result->type = kFixnum;
-  result->value.fixnum = fixnum;
-  return result;
+// mov byte [{base}+{disp}], {src:8}
+void Buffer_mov_subreg_to_reg_disp(BufferWriter *writer, Register base,
+                                   SubRegister src, int8_t disp) {
+  assert(base != kRsp && "rsp as a base needs a SIB byte");
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x88;
+  insn[1] = 0x40 + src * 8 + base;
+  insn[2] = encode_disp(disp);
 }
 
-ASTNode *AST_new_atom(char *atom) {
-  ASTNode *result = malloc(sizeof *result);
-  result->type = kAtom;
-  result->value.atom = strdup(atom);
-  return result;
+// bsf {dst}, {src}: the index of the lowest set bit of {src}, which must not
+// be zero.
+void Buffer_bsf_reg_reg(BufferWriter *writer, Register dst, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x48;
+  insn[1] = 0x0f;
+  insn[2] = 0xbc;
+  insn[3] = 0xc0 + dst * 8 + src;
 }
 
-ASTNode *AST_new_cons(ASTNode *car, ASTNode *cdr) {
-  if (car == NULL && cdr == NULL)
-    return nil;
-  assert(car != NULL && "both car & cdr must be NULL, or neither");
-  assert(cdr != NULL && "both car & cdr must be NULL, or neither");
-  ASTNode *result = malloc(sizeof *result);
-  result->type = kCons;
-  result->value.cons.car = car;
-  result->value.cons.cdr = cdr;
-  return result;
+// The SSE2 registers, which only the routines (see the Routines section) use.
+typedef enum {
+  kXmm0 = 0,
+  kXmm1,
+} XmmRegister;
+
+// movq {dst}, {src}: the low quadword of {dst}; the high one is cleared.
+void Buffer_movq_xmm_reg(BufferWriter *writer, XmmRegister dst,
+                         Register src) {
+  byte *insn = BufferWriter_reserve(writer, 5);
+  insn[0] = 0x66;
+  insn[1] = 0x48;
+  insn[2] = 0x0f;
+  insn[3] = 0x6e;
+  insn[4] = 0xc0 + dst * 8 + src;
 }
 
-int AST_is_atom(ASTNode *node) { return node->type == kAtom; }
+// The 66 0f {opcode} {dst}, {src} forms between two xmm registers, or with a
+// general register as {dst} for pmovmskb.
+static void Buffer_sse_reg_reg(BufferWriter *writer, byte opcode, int dst,
+                               int src) {
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x66;
+  insn[1] = 0x0f;
+  insn[2] = opcode;
+  insn[3] = 0xc0 + dst * 8 + src;
+}
 
-int AST_atom_equals_cstr(ASTNode *node, char *cstr) {
-  assert(AST_is_atom(node));
-  return strcmp(node->value.atom, cstr) == 0;
+// punpcklqdq {dst}, {src}: the low quadword of {src} into the high one of
+// {dst}.
+void Buffer_punpcklqdq(BufferWriter *writer, XmmRegister dst,
+                       XmmRegister src) {
+  Buffer_sse_reg_reg(writer, 0x6c, dst, src);
 }
 
-ASTNode *AST_car(ASTNode *cons) {
-  assert(cons != nil);
-  assert(cons->type == kCons);
-  return cons->value.cons.car;
+// pcmpeqb {dst}, {src}: each byte of {dst} becomes 0xff where it equals the
+// one in {src}, and 0 where it doesn't.
+void Buffer_pcmpeqb(BufferWriter *writer, XmmRegister dst, XmmRegister src) {
+  Buffer_sse_reg_reg(writer, 0x74, dst, src);
 }
 
-ASTNode *AST_cdr(ASTNode *cons) {
-  assert(cons != nil);
-  assert(cons->type == kCons);
-  return cons->value.cons.cdr;
+// pmovmskb {dst:32}, {src}: bit i is the top bit of byte i.
+void Buffer_pmovmskb(BufferWriter *writer, Register dst, XmmRegister src) {
+  Buffer_sse_reg_reg(writer, 0xd7, dst, src);
 }
 
-// Reader
+// The f3 0f {opcode} forms of movdqu, between an xmm register and [{base}].
+static void Buffer_movdqu(BufferWriter *writer, byte opcode, XmmRegister xmm,
+                          Register base) {
+  assert(base != kRsp && base != kRbp && "base needs a SIB byte or a disp");
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0xf3;
+  insn[1] = 0x0f;
+  insn[2] = opcode;
+  insn[3] = xmm * 8 + base;
+}
 
-void advance(int *pos) { ++*pos; }
+// movdqu {dst}, [{base}]
+void Buffer_movdqu_load(BufferWriter *writer, XmmRegister dst, Register base) {
+  Buffer_movdqu(writer, 0x6f, dst, base);
+}
 
-ASTNode *Reader_read_number(char *input, int *pos) {
-  char c = '\0';
-  int value = 0;
-  while (isdigit(c = input[*pos])) {
-    value *= 10;
-    value += c - '0';
-    advance(pos);
-  }
-  return AST_new_fixnum(value);
+// movdqu [{base}], {src}
+void Buffer_movdqu_store(BufferWriter *writer, Register base,
+                         XmmRegister src) {
+  Buffer_movdqu(writer, 0x7f, src, base);
 }
 
-const int ATOM_MAX = 32;
+void Buffer_ret(BufferWriter *writer) { Buffer_write8(writer, 0xc3); }
 
-bool isatomchar(char c) { return isalpha(c) || c == '+' || c == '-'; }
+// call {disp32}, with the displacement counted from the end of the call. Only
+// for code outside the writer, whose distance is known up front; calls within
+// the writer go through labels.
+void Buffer_call_rel32(BufferWriter *writer, int32_t disp) {
+  byte *insn = BufferWriter_reserve(writer, 5);
+  insn[0] = 0xe8;
+  store32(insn + 1, disp);
+}
 
-ASTNode *Reader_read_atom(char *input, int *pos) {
-  char buf[ATOM_MAX + 1]; // +1 for NUL
-  int length = 0;
-  while (length < ATOM_MAX && isatomchar(buf[length] = input[*pos])) {
-    advance(pos);
-    length++;
-  }
-  buf[length] = '\0';
-  return AST_new_atom(buf);
+// The ff /{op} forms through [rax+{disp}].
+static void Buffer_indirect_rax_disp(BufferWriter *writer, byte op,
+                                     int8_t disp) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0xff;
+  insn[1] = 0x40 + op * 8;
+  insn[2] = encode_disp(disp);
 }
 
-ASTNode *Reader_read_rec(char *input, int *pos);
+// call [rax+{disp}]
+void Buffer_call_rax_disp(BufferWriter *writer, int8_t disp) {
+  Buffer_indirect_rax_disp(writer, 2, disp);
+}
 
-ASTNode *Reader_read_list(char *input, int *pos) {
-  if (input[*pos] == ')') {
-    advance(pos);
-    return nil;
-  }
-  ASTNode *car = Reader_read_rec(input, pos);
-  assert(car != NULL);
-  ASTNode *cdr = Reader_read_list(input, pos);
-  assert(cdr != NULL);
-  return AST_new_cons(car, cdr);
+// jmp [rax+{disp}]
+void Buffer_jmp_rax_disp(BufferWriter *writer, int8_t disp) {
+  Buffer_indirect_rax_disp(writer, 4, disp);
 }
 
-ASTNode *Reader_read_rec(char *input, int *pos) {
-  char c = '\0';
-  while (isspace(c = input[*pos])) {
-    advance(pos);
-  }
-  if (isdigit(c)) {
-    return Reader_read_number(input, pos);
-  }
-  if (isatomchar(c)) {
-    return Reader_read_atom(input, pos);
-  }
-  if (c == '(') {
-    advance(pos); // skip '('
-    return Reader_read_list(input, pos);
+void Buffer_syscall(BufferWriter *writer) {
+  byte *insn = BufferWriter_reserve(writer, 2);
+  insn[0] = 0x0f;
+  insn[1] = 0x05;
+}
+
+// lea {dst}, [{base}+{disp}]. Unlike add, it leaves the flags alone.
+void Buffer_lea_reg_disp(BufferWriter *writer, Register dst, Register base,
+                         int32_t disp) {
+  assert(base != kRsp && "rsp as a base needs a SIB byte");
+  if (is_imm8(disp)) {
+    byte *insn = BufferWriter_reserve(writer, 4);
+    insn[0] = 0x48;
+    insn[1] = 0x8d;
+    insn[2] = 0x40 + dst * 8 + base;
+    insn[3] = encode_disp(disp);
+    return;
   }
-  return NULL;
+  byte *insn = BufferWriter_reserve(writer, 7);
+  insn[0] = 0x48;
+  insn[1] = 0x8d;
+  insn[2] = 0x80 + dst * 8 + base;
+  store32(insn + 3, disp);
 }
 
-ASTNode *Reader_read(char *input) {
-  int pos = 0;
-  return Reader_read_rec(input, &pos);
+void Buffer_push_reg(BufferWriter *writer, Register reg) {
+  Buffer_write8(writer, 0x50 + reg);
 }
 
-// End Reader
+void Buffer_pop_reg(BufferWriter *writer, Register reg) {
+  Buffer_write8(writer, 0x58 + reg);
+}
 
-// Compiler context
+// With kOptGC, r11 holds the Heap the code allocates from (see the Heap
+// section). Naming it takes a REX.B or REX.R bit, so rather than giving it a
+// place in Register -- where every other emitter would have to cope with it
+// -- it gets the handful of emitters it needs here.
+
+// mov r11, {src}
+void Buffer_mov_r11_reg(BufferWriter *writer, Register src) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x49;
+  insn[1] = 0x89;
+  insn[2] = 0xc3 + src * 8;
+}
 
-// Does not include stack index because that is modified a lot when recursing
-// I may end up being annoyed about this for Env, too
-typedef struct {
-  BufferWriter *writer;
-  EnvNode *labels;
-  EnvNode *locals;
-  // TODO: add formals separately from locals?
-} CompilerContext;
+// mov {dst}, r11
+void Buffer_mov_reg_r11(BufferWriter *writer, Register dst) {
+  byte *insn = BufferWriter_reserve(writer, 3);
+  insn[0] = 0x4c;
+  insn[1] = 0x89;
+  insn[2] = 0xd8 + dst;
+}
 
-void CompilerContext_init(CompilerContext *ctx, BufferWriter *writer,
-                          EnvNode *labels, EnvNode *locals) {
-  assert(ctx != NULL);
-  ctx->writer = writer;
-  ctx->labels = labels;
-  ctx->locals = locals;
+// The [r11+{disp8}] forms: REX.W|REX.B, the opcode, and a ModRM byte with r11
+// (3, once the REX.B bit is taken off) as the base.
+static void Buffer_op_reg_r11_disp(BufferWriter *writer, byte opcode,
+                                   Register reg, int8_t disp) {
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x49;
+  insn[1] = opcode;
+  insn[2] = 0x43 + reg * 8;
+  insn[3] = encode_disp(disp);
 }
 
-CompilerContext CompilerContext_with_labels(CompilerContext *ctx,
-                                            EnvNode *labels) {
-  CompilerContext result = *ctx;
-  result.labels = labels;
-  return result;
+// mov {dst}, [r11+{disp8}]
+void Buffer_mov_r11_disp_to_reg(BufferWriter *writer, Register dst,
+                                int8_t disp) {
+  Buffer_op_reg_r11_disp(writer, 0x8b, dst, disp);
 }
 
-CompilerContext CompilerContext_with_locals(CompilerContext *ctx,
-                                            EnvNode *locals) {
-  CompilerContext result = *ctx;
-  result.locals = locals;
-  return result;
+// mov [r11+{disp8}], {src}
+void Buffer_mov_reg_to_r11_disp(BufferWriter *writer, Register src,
+                                int8_t disp) {
+  Buffer_op_reg_r11_disp(writer, 0x89, src, disp);
 }
 
-// End Compiler context
+// cmp {left}, [r11+{disp8}]
+void Buffer_cmp_reg_r11_disp(BufferWriter *writer, Register left,
+                             int8_t disp) {
+  Buffer_op_reg_r11_disp(writer, 0x3b, left, disp);
+}
 
-// env is a map of variables to stack locations
-int AST_compile_expr(CompilerContext *ctx, ASTNode *node, int stack_index);
+// call [r11+{disp8}]
+void Buffer_call_r11_disp(BufferWriter *writer, int8_t disp) {
+  byte *insn = BufferWriter_reserve(writer, 4);
+  insn[0] = 0x41;
+  insn[1] = 0xff;
+  insn[2] = 0x53;
+  insn[3] = encode_disp(disp);
+}
 
-ASTNode *operand1(ASTNode *args) { return AST_car(args); }
-ASTNode *operand2(ASTNode *args) { return AST_car(AST_cdr(args)); }
-ASTNode *operand3(ASTNode *args) { return AST_car(AST_cdr(AST_cdr(args))); }
+void Buffer_push_r11(BufferWriter *writer) {
+  byte *insn = BufferWriter_reserve(writer, 2);
+  insn[0] = 0x41;
+  insn[1] = 0x53;
+}
 
-int AST_compile_let(CompilerContext *ctx, ASTNode *bindings, ASTNode *body,
-                    int stack_index) {
-  if (bindings == nil) {
-    // Base case: no bindings. Emit the body.
-    AST_compile_expr(ctx, body, stack_index);
-    return 0;
+void Buffer_pop_r11(BufferWriter *writer) {
+  byte *insn = BufferWriter_reserve(writer, 2);
+  insn[0] = 0x41;
+  insn[1] = 0x5b;
+}
+
+// Labels and relaxation
+//
+// Jumps and calls are emitted against labels rather than positions. Each one
+// is written out in its rel32 form and recorded as a fixup; once the code is
+// complete, BufferWriter_relax switches every jump whose target turns out to
+// be within reach to its two-byte rel8 form, closes up the gaps and fills in
+// all of the displacements. Calls are always rel32, but they are fixups too,
+// since relaxing moves the code on either side of them; so are the
+// rip-relative leas that take the address of a label.
+
+typedef enum {
+  kFixupJmp,
+  kFixupJcc,
+  kFixupCall,
+  kFixupLea,
+} FixupKind;
+
+typedef struct Fixup {
+  // Where the instruction starts
+  int32_t pos;
+  Label target;
+  FixupKind kind;
+  Condition cond;
+  bool is_short;
+} Fixup;
+
+static const int kShortJumpSize = 2;
+
+static int Fixup_long_size(Fixup *fixup) {
+  switch (fixup->kind) {
+  case kFixupJcc:
+    return 6;
+  case kFixupLea:
+    return 7;
+  default:
+    return 5;
   }
-  // Inductive case: some bindings. Emit code for the first binding, bind the
-  // name to the stack index, and recurse.
-  ASTNode *first_binding = AST_car(bindings);
-  ASTNode *name = AST_car(first_binding);
-  assert(name && name->type == kAtom && "name must be an atom");
-  ASTNode *expr = AST_car(AST_cdr(first_binding));
-  AST_compile_expr(ctx, expr, stack_index);
-  Buffer_mov_reg_to_stack(ctx->writer, kRax, stack_index);
-  EnvNode new_locals = Env_init(name->value.atom, stack_index, ctx->locals);
-  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &new_locals);
-  return AST_compile_let(&new_ctx, AST_cdr(bindings), body,
-                         stack_index - kWordSize);
 }
 
-// http://ref.x86asm.net/coder32.html
-// https://www.felixcloutier.com/x86/index.html
-// rasm2 -D -b64 "48 89 44 24 f8 "
-//  -> or -d
+Label BufferWriter_new_label(BufferWriter *writer) {
+  int32_t index = writer->num_labels - writer->first_label;
+  if (index == writer->labels_capacity) {
+    writer->labels_capacity =
+        writer->labels_capacity == 0 ? 16 : writer->labels_capacity * 2;
+    writer->labels = realloc(writer->labels,
+                             writer->labels_capacity * sizeof *writer->labels);
+    assert(writer->labels != NULL);
+  }
+  writer->labels[index] = -1;
+  return writer->num_labels++;
+}
 
-int AST_compile_if(CompilerContext *ctx, ASTNode *test, ASTNode *iftrue,
-                   ASTNode *iffalse, int stack_index) {
-  AST_compile_expr(ctx, test, stack_index);
-  Buffer_cmp_reg_imm32(ctx->writer, kRax, encodeImmediateBool(false));
-  Buffer_je_imm32(ctx->writer, 0x12345678);
-  int iffalse_pos = BufferWriter_get_pos(ctx->writer);
-  AST_compile_expr(ctx, iftrue, stack_index);
-  Buffer_jmp_imm32(ctx->writer, 0x1a2b3c4d);
-  int end_pos = BufferWriter_get_pos(ctx->writer);
-  BufferWriter_backpatch_displacement_imm32(ctx->writer, iffalse_pos);
-  AST_compile_expr(ctx, iffalse, stack_index);
-  BufferWriter_backpatch_displacement_imm32(ctx->writer, end_pos);
-  return 0;
+// Bind `label' to `pos', which has already been written.
+void BufferWriter_bind_label_at(BufferWriter *writer, Label label,
+                                size_t pos) {
+  assert(label >= writer->first_label && label < writer->num_labels);
+  assert(pos <= writer->pos);
+  int32_t *bound = &writer->labels[label - writer->first_label];
+  assert(*bound == -1 && "label bound twice");
+  *bound = pos;
+  writer->last.kind = kInsnOther;
 }
 
-int AST_compile_cons(CompilerContext *ctx, ASTNode *car, ASTNode *cdr,
-                     int stack_index) {
-  AST_compile_expr(ctx, car, stack_index - kWordSize);
-  // Set car
-  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, 0);
-  AST_compile_expr(ctx, cdr, stack_index);
-  // Set cdr
-  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, kWordSize);
-  // Tag the pointer
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
-  Buffer_or_reg_imm32(ctx->writer, /*dst=*/kRax, 1);
-  // Bump heap
-  Buffer_add_reg_imm32(ctx->writer, /*dst=*/kRsi, 2 * kWordSize);
-  return 0;
+// Bind `label' to the current position.
+void BufferWriter_bind_label(BufferWriter *writer, Label label) {
+  BufferWriter_bind_label_at(writer, label, writer->pos);
 }
 
-int AST_compile_code(CompilerContext *ctx, ASTNode *formals, ASTNode *body,
-                     int stack_index) {
-  if (formals == nil) {
-    int result = AST_compile_expr(ctx, body, stack_index);
-    if (result != 0) {
-      return result;
-    }
-    Buffer_ret(ctx->writer);
-    return 0;
+// Where `label' is bound. Only final once the code has been relaxed.
+int32_t BufferWriter_label_pos(BufferWriter *writer, Label label) {
+  assert(label < writer->num_labels);
+  if (label < writer->first_label) {
+    return -1;
   }
-  ASTNode *name = AST_car(formals);
-  EnvNode new_locals = Env_init(name->value.atom, stack_index, ctx->locals);
-  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &new_locals);
-  return AST_compile_code(&new_ctx, AST_cdr(formals), body,
-                          stack_index - kWordSize);
+  return writer->labels[label - writer->first_label];
 }
 
-int AST_compile_labelcall(CompilerContext *ctx, int32_t code_pos, ASTNode *args,
-                          int stack_index) {
-  assert(args->type == kCons);
-  if (args == nil) {
-    int32_t disp = code_pos - BufferWriter_get_pos(ctx->writer);
-    Buffer_call_imm32(ctx->writer, disp);
-    return 0;
-  }
-  ASTNode *arg = AST_car(args);
-  int result = AST_compile_expr(ctx, arg, stack_index);
-  if (result != 0) {
-    return result;
+static Fixup *BufferWriter_next_fixup(BufferWriter *writer) {
+  if (writer->num_fixups == writer->fixups_capacity) {
+    writer->fixups_capacity =
+        writer->fixups_capacity == 0 ? 16 : writer->fixups_capacity * 2;
+    writer->fixups = realloc(writer->fixups,
+                             writer->fixups_capacity * sizeof *writer->fixups);
+    assert(writer->fixups != NULL);
   }
-  Buffer_mov_reg_to_stack(ctx->writer, kRax, stack_index);
-  return AST_compile_labelcall(ctx, code_pos, AST_cdr(args),
-                               stack_index - kWordSize);
+  return &writer->fixups[writer->num_fixups++];
 }
 
-int AST_compile_call(CompilerContext *ctx, ASTNode *fnexpr, ASTNode *args,
-                     int stack_index) {
-  if (AST_is_atom(fnexpr)) {
-    // Assumed to be a primcall
-    if (AST_atom_equals_cstr(fnexpr, "add1")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      Buffer_add_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(1));
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "sub1")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      Buffer_sub_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(1));
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "integer->char")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      Buffer_shl_reg(ctx->writer, kRax, /*bits=*/kCharShift - kFixnumShift);
-      // TODO: generate more compact code since we know we're only or-ing with a
-      // byte
-      Buffer_or_reg_imm32(ctx->writer, kRax, kCharTag);
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "zero?")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      Buffer_cmp_reg_imm32(ctx->writer, kRax, 0);
-      Buffer_mov_reg_imm32(ctx->writer, kRax, 0);
-      Buffer_setcc_reg(ctx->writer, kEqual, kAl);
-      Buffer_shl_reg(ctx->writer, kRax, kBoolShift);
-      Buffer_or_reg_imm32(ctx->writer, kRax, kBoolTag);
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "+")) {
-      AST_compile_expr(ctx, operand2(args), stack_index);
-      Buffer_mov_reg_to_stack(ctx->writer, kRax, /*offset=*/stack_index);
-      AST_compile_expr(ctx, operand1(args), stack_index - kWordSize);
-      Buffer_add_reg_stack(ctx->writer, kRax, /*offset=*/stack_index);
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "let")) {
-      return AST_compile_let(ctx, /*bindings=*/operand1(args),
-                             /*body=*/operand2(args), stack_index);
-    }
-    if (AST_atom_equals_cstr(fnexpr, "if")) {
-      // TODO: in if, rewrite empty iffalse => '()
-      return AST_compile_if(ctx, operand1(args), operand2(args), operand3(args),
-                            stack_index);
-    }
-    if (AST_atom_equals_cstr(fnexpr, "cons")) {
-      return AST_compile_cons(ctx, operand1(args), operand2(args), stack_index);
-    }
-    if (AST_atom_equals_cstr(fnexpr, "car")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      // Since heap addresses are biased by 1, the car of a cons cell is at
-      // offset -1, instead of 0.
-      Buffer_mov_reg_disp_to_rax(ctx->writer, /*src=*/kRax, -1);
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "cdr")) {
-      AST_compile_expr(ctx, operand1(args), stack_index);
-      // Since heap addresses are biased by 1, the cdr of a cons cell is at
-      // offset 7, instead of 8.
-      Buffer_mov_reg_disp_to_rax(ctx->writer, /*src=*/kRax, kWordSize - 1);
-      return 0;
-    }
-    if (AST_atom_equals_cstr(fnexpr, "code")) {
-      // The flow of control enters `code` in a new call frame. The stack looks
-      // like this:
-      //
-      // low addr
-      // --------
-      // .
-      // .
-      // .
-      // rsp   24: arg3
-      // rsp - 16: arg2
-      // rsp - 8 : arg1
-      // rsp     : return addr
-      // ~~~~~~~~~~~
-      // .
-      // .
-      // .
-      // ---------
-      // high addr
-      //
-      // Start stack_index over at -kWordSize -- the location of the first
-      // formal -- since the return address is at rsp.
-      return AST_compile_code(ctx, /*formals=*/operand1(args),
-                              /*body=*/operand2(args), -kWordSize);
-    }
-    if (AST_atom_equals_cstr(fnexpr, "labelcall")) {
-      ASTNode *label = operand1(args);
-      assert(AST_is_atom(label));
-      char *name = label->value.atom;
-      int32_t code_pos;
-      if (!Env_lookup(ctx->labels, name, &code_pos)) {
-        fprintf(stderr, "Unbound label: `%s'\n", name);
-        return -1;
-      }
-      return AST_compile_labelcall(ctx, /*code_pos=*/code_pos,
-                                   /*args=*/AST_cdr(args), stack_index);
+static void BufferWriter_add_fixup(BufferWriter *writer, FixupKind kind,
+                                   Condition cond, Label target) {
+  assert(target < writer->num_labels);
+  Fixup *fixup = BufferWriter_next_fixup(writer);
+  *fixup = (Fixup){.pos = writer->pos, .target = target, .kind = kind,
+                   .cond = cond, .is_short = false};
+  // The displacement is filled in by BufferWriter_relax.
+  memset(BufferWriter_reserve(writer, Fixup_long_size(fixup)), 0,
+         Fixup_long_size(fixup));
+}
+
+// Relative jump to `label', taken if `cond' holds
+void Buffer_jcc_label(BufferWriter *writer, Condition cond, Label label) {
+  BufferWriter_add_fixup(writer, kFixupJcc, cond, label);
+}
+
+// Relative jump to `label'
+void Buffer_jmp_label(BufferWriter *writer, Label label) {
+  BufferWriter_add_fixup(writer, kFixupJmp, kEqual, label);
+}
+
+// Relative call to `label'
+void Buffer_call_label(BufferWriter *writer, Label label) {
+  BufferWriter_add_fixup(writer, kFixupCall, kEqual, label);
+}
+
+// lea rax, [rip+{label}]: the address `label' ends up at, wherever the code
+// is loaded.
+void Buffer_lea_rax_label(BufferWriter *writer, Label label) {
+  BufferWriter_add_fixup(writer, kFixupLea, kEqual, label);
+}
+
+// Bytes saved by the fixups before `pos', as relaxed so far. `shrunk[i]' is
+// the total for the first i fixups.
+static int32_t BufferWriter_shrinkage_before(BufferWriter *writer,
+                                             int32_t *shrunk, int32_t pos) {
+  int32_t lo = 0, hi = writer->num_fixups;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo) / 2;
+    if (writer->fixups[mid].pos < pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    assert(0 && "unknown call");
   }
-  assert(0 && "unknown call");
+  return shrunk[lo];
 }
 
-int AST_compile_expr(CompilerContext *ctx, ASTNode *node, int stack_index) {
-  switch (node->type) {
-  case kFixnum: {
-    uint32_t value = (uint32_t)node->value.fixnum;
-    Buffer_mov_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(value));
-    return 0;
+static void BufferWriter_sum_shrinkage(BufferWriter *writer,
+                                       int32_t *shrunk) {
+  shrunk[0] = 0;
+  for (int32_t i = 0; i < writer->num_fixups; i++) {
+    Fixup *fixup = &writer->fixups[i];
+    shrunk[i + 1] =
+        shrunk[i] +
+        (fixup->is_short ? Fixup_long_size(fixup) - kShortJumpSize : 0);
   }
-  case kCons: {
-    // Assumed to be in the form (<expr> <op1> <op2> ...)
-    return AST_compile_call(ctx, AST_car(node), AST_cdr(node), stack_index);
+}
+
+// Pick the short form for every jump that can use it, move the code to close
+// up the bytes that saves, and fill in the displacements of all the jumps and
+// calls emitted since the last call. Every label they refer to must be bound.
+// Code before the first of those fixups doesn't move, so it is fine to relax
+// once per function; labels bound after it move, so their positions are only
+// final after this.
+void BufferWriter_relax(BufferWriter *writer) {
+  // The code is about to move.
+  writer->last.kind = kInsnOther;
+  if (writer->num_fixups == 0) {
+    return;
   }
-  case kAtom: {
-    // TODO: confusing that it shadows the parameter. fix
-    int32_t stack_index;
-    char *name = node->value.atom;
-    if (!Env_lookup(ctx->locals, name, &stack_index)) {
-      fprintf(stderr, "Unbound variable: `%s'\n", name);
-      return -1;
+  int32_t *shrunk = malloc((writer->num_fixups + 1) * sizeof *shrunk);
+  assert(shrunk != NULL);
+  // Code only ever gets smaller, so a jump that fits once keeps fitting: start
+  // with every jump long and shorten whatever fits until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    BufferWriter_sum_shrinkage(writer, shrunk);
+    for (int32_t i = 0; i < writer->num_fixups; i++) {
+      Fixup *fixup = &writer->fixups[i];
+      if (fixup->kind == kFixupCall || fixup->kind == kFixupLea ||
+          fixup->is_short) {
+        continue;
+      }
+      int32_t target = BufferWriter_label_pos(writer, fixup->target);
+      assert(target >= 0 && "jump to unbound label");
+      int32_t from = fixup->pos - shrunk[i] + kShortJumpSize;
+      int32_t to =
+          target - BufferWriter_shrinkage_before(writer, shrunk, target);
+      if (target > fixup->pos) {
+        // As if this jump were already short
+        to -= Fixup_long_size(fixup) - kShortJumpSize;
+      }
+      if (to - from >= INT8_MIN && to - from <= INT8_MAX) {
+        fixup->is_short = true;
+        changed = true;
+      }
     }
-    Buffer_mov_stack_to_reg(ctx->writer, kRax, stack_index);
-    return 0;
   }
+  BufferWriter_sum_shrinkage(writer, shrunk);
+  // Move the labels while the fixups still have their old positions.
+  for (int32_t i = 0; i < writer->num_labels - writer->first_label; i++) {
+    int32_t pos = writer->labels[i];
+    if (pos >= 0) {
+      writer->labels[i] =
+          pos - BufferWriter_shrinkage_before(writer, shrunk, pos);
+    }
   }
-  assert(false && "unhandled expression type");
-  return -1;
+  free(shrunk);
+  // Close up the gaps. Everything moves down, so copying up from the first
+  // fixup never overwrites anything still to be copied.
+  byte *code = writer->buf->address;
+  int32_t from = writer->fixups[0].pos;
+  int32_t to = from;
+  for (int32_t i = 0; i < writer->num_fixups; i++) {
+    Fixup *fixup = &writer->fixups[i];
+    memmove(code + to, code + from, fixup->pos - from);
+    to += fixup->pos - from;
+    from = fixup->pos + Fixup_long_size(fixup);
+    fixup->pos = to;
+    to += fixup->is_short ? kShortJumpSize : Fixup_long_size(fixup);
+  }
+  memmove(code + to, code + from, writer->pos - from);
+  writer->pos = to + (writer->pos - from);
+  for (int32_t i = 0; i < writer->num_fixups; i++) {
+    Fixup *fixup = &writer->fixups[i];
+    byte *insn = code + fixup->pos;
+    int32_t target = BufferWriter_label_pos(writer, fixup->target);
+    assert(target >= 0 && "reference to unbound label");
+    if (fixup->is_short) {
+      insn[0] = fixup->kind == kFixupJcc ? 0x70 + fixup->cond : 0xeb;
+      insn[1] = (byte)(int8_t)(target - (fixup->pos + kShortJumpSize));
+      continue;
+    }
+    int size = Fixup_long_size(fixup);
+    if (fixup->kind == kFixupJcc) {
+      insn[0] = 0x0f;
+      insn[1] = 0x80 + fixup->cond;
+    } else if (fixup->kind == kFixupLea) {
+      insn[0] = 0x48;
+      insn[1] = 0x8d;
+      insn[2] = 0x05;
+    } else {
+      insn[0] = fixup->kind == kFixupCall ? 0xe8 : 0xe9;
+    }
+    store32(insn + size - sizeof(int32_t), target - (fixup->pos + size));
+  }
+  writer->num_fixups = 0;
 }
 
-// TODO: naming confusing because we have no concept of functions, really
-int AST_compile_function(CompilerContext *ctx, ASTNode *node) {
-  int result = AST_compile_expr(ctx, node, -kWordSize);
-  if (result != 0) {
-    return result;
+// Copy the code written to `other', which was set up with
+// BufferWriter_init_appended, to the end of `writer', along with its labels
+// and the jumps and calls still waiting for BufferWriter_relax. Labels of
+// other's own get new numbers in `writer'; return what was added to them.
+int32_t BufferWriter_append(BufferWriter *writer, BufferWriter *other) {
+  assert(other->first_label <= writer->num_labels);
+  int32_t base = writer->pos;
+  Buffer_write_arr(writer, other->buf->address, other->pos);
+  int32_t delta = writer->num_labels - other->first_label;
+  for (int32_t i = 0; i < other->num_labels - other->first_label; i++) {
+    Label copy = BufferWriter_new_label(writer);
+    int32_t pos = other->labels[i];
+    if (pos >= 0) {
+      writer->labels[copy - writer->first_label] = base + pos;
+    }
   }
-  Buffer_ret(ctx->writer);
-  return 0;
+  for (int32_t i = 0; i < other->num_fixups; i++) {
+    Fixup *fixup = BufferWriter_next_fixup(writer);
+    *fixup = other->fixups[i];
+    fixup->pos += base;
+    if (fixup->target >= other->first_label) {
+      fixup->target += delta;
+    }
+  }
+  return delta;
 }
+// End Machine code
 
-int AST_compile_entry(CompilerContext *ctx, ASTNode *node) {
-  // Save the heap in rsi, our global heap pointer
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRsi, /*src=*/kRdi);
-  return AST_compile_function(ctx, node);
+// Arena
+
+// An Arena hands out memory by bumping a pointer through a list of large
+// chunks. Nothing is freed individually; everything allocated from an arena is
+// released at once by Arena_deinit. A compilation allocates its ASTNodes and
+// atom text from one arena, so building the tree costs a pointer bump per node
+// and tearing it down costs one free per chunk.
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  // uint64_t keeps the payload kArenaAlignment-aligned.
+  uint64_t data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *chunks;
+  byte *ptr;
+  byte *limit;
+  // ASTNodes allocated from the arena so far (see AST_alloc).
+  uint64_t num_nodes;
+} Arena;
+
+static const size_t kArenaChunkSize = 64 * 1024; // bytes
+static const size_t kArenaAlignment = 8;         // bytes
+
+void Arena_init(Arena *arena) {
+  arena->chunks = NULL;
+  arena->ptr = NULL;
+  arena->limit = NULL;
+  arena->num_nodes = 0;
 }
 
-// labels is an environment mapping labels to code locations
-// this is different from other environments that track stack locations of
-// local variables and parameters
-// (labels ((lvar (code (...) ...)) ...)
-//         <exp>)
-// Example -2: No labels
-// 	(labels ()
-// 	  5)
-// Example -1: One label and don't use it
-// 	(labels (
-// 		(const (code () 5))
-// 	 	)
-// 	  5)
-// Example 0: No parameters
-// 	(labels (
-// 		(const (code () 5))
-// 	 	)
-// 	  (labelcall const))
-// Example 1: One param; return it
-// 	(labels (
-// 		(id (code (x) x))
-// 	 	)
-// 	  (labelcall id 5))
-// Example 2: Two params and use them
-// 	(labels (
-// 		(add (code (x y) (+ x y)))
-// 	 	)
-// 	  (labelcall add 1 2))
-// Example 3: Multiple labels in let* form (labels can use labels before them)
-// 	(labels (
-// 		(id (code (x) x))
-// 		(add (code (x y) (+ (labelcall id x) y)))
-// 	 	)
-// 	  (labelcall add 1 2))
-int AST_compile_labels(CompilerContext *ctx, ASTNode *bindings, ASTNode *body,
-                       int body_pos, int stack_index) {
-  if (bindings == nil) {
-    // Emit body and backpatch jump to it
-    BufferWriter_backpatch_displacement_imm32(ctx->writer, body_pos);
-    return AST_compile_entry(ctx, body);
-  }
-  ASTNode *binding = AST_car(bindings);
-  ASTNode *name = AST_car(binding);
-  assert(name->type == kAtom);
-  ASTNode *exp = AST_car(AST_cdr(binding));
-  EnvNode new_labels = Env_init(name->value.atom,
-                                BufferWriter_get_pos(ctx->writer), ctx->labels);
-  CompilerContext new_ctx = CompilerContext_with_labels(ctx, &new_labels);
-  int result = AST_compile_expr(&new_ctx, exp, stack_index);
-  if (result != 0) {
-    return result;
+void Arena_deinit(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk != NULL) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
   }
-  return AST_compile_labels(&new_ctx, /*bindings=*/AST_cdr(bindings), body,
-                            body_pos, stack_index);
+  Arena_init(arena);
 }
 
-ASTNode *AST_tag(ASTNode *node) {
-  assert(node->type == kCons);
-  ASTNode *tag = AST_car(node);
-  assert(tag->type == kAtom);
-  return tag;
+static void Arena_new_chunk(Arena *arena, size_t min_size) {
+  size_t size = min_size > kArenaChunkSize ? min_size : kArenaChunkSize;
+  ArenaChunk *chunk = malloc(sizeof *chunk + size);
+  assert(chunk != NULL);
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->ptr = (byte *)chunk->data;
+  arena->limit = arena->ptr + size;
 }
 
-// (labels ((lvar <lexp>) ...)
-//         <exp>)
-int AST_compile_prog(CompilerContext *ctx, ASTNode *prog) {
-  assert(prog->type == kCons);
-  ASTNode *tag = AST_tag(prog);
-  assert(tag->type == kAtom);
-  assert(AST_atom_equals_cstr(tag, "labels"));
-  ASTNode *args = AST_cdr(prog);
-  // Jump to body
-  Buffer_jmp_imm32(ctx->writer, 0x12345678);
-  int body_pos = BufferWriter_get_pos(ctx->writer);
-  // Emit labels & label-expressions
-  ASTNode *body = operand2(args);
-  return AST_compile_labels(ctx, /*bindings=*/operand1(args), body, body_pos,
-                            /*stack_index=*/-kWordSize);
+void *Arena_alloc(Arena *arena, size_t size) {
+  size = (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+  if ((size_t)(arena->limit - arena->ptr) < size) {
+    Arena_new_chunk(arena, size);
+  }
+  void *result = arena->ptr;
+  arena->ptr += size;
+  return result;
 }
 
-// End AST
+char *Arena_strdup(Arena *arena, const char *str) {
+  size_t len = strlen(str) + 1; // +1 for NUL
+  char *result = Arena_alloc(arena, len);
+  memcpy(result, str, len);
+  return result;
+}
 
-// Testing
+// End Arena
 
-typedef uint64_t (*EntryFunction)(uint64_t);
+// Symbols
 
-uint64_t Testing_call_entry(Buffer *buf, uint64_t heap) {
-  assert(buf != NULL);
-  assert(buf->address != NULL);
-  assert(buf->state == kExecutable);
-  // The pointer-pointer cast is allowed but the underlying
-  // data-to-function-pointer back-and-forth is only guaranteed to work on
-  // POSIX systems (because of eg dlsym).
-  EntryFunction function = *(EntryFunction *)(&buf->address);
-  return function(heap);
-}
+// Every atom is interned into one process-wide table when it is created, so
+// two atoms with the same name share a Symbol and can be compared by pointer.
+// Each Symbol also carries its hash and a dense id (assigned in interning
+// order) that passes can use to index side tables.
+//
+// The names the compiler itself recognizes are interned first, in
+// BuiltinSymbol order, so that a builtin's id is its enum value.
+//
+// Any thread may intern: the table is set up once and then guarded by a
+// mutex, so readers and compilers on different threads still agree on every
+// Symbol. The builtins are also kept where growing the table can't move them,
+// so looking one up takes no lock.
 
-void run_test(void (*test_body)(CompilerContext *, uint64_t)) {
-  Buffer buf;
-  Buffer_init(&buf, 100);
-  void *heap = malloc(100 * kWordSize);
-  {
-    BufferWriter writer;
+typedef struct {
+  char *name;
+  size_t length;
+  uint32_t hash;
+  uint32_t id;
+} Symbol;
+
+typedef enum {
+  kSymAdd1,
+  kSymSub1,
+  kSymIntegerToChar,
+  kSymZerop,
+  kSymPlus,
+  kSymMinus,
+  kSymTimes,
+  kSymQuotient,
+  kSymRemainder,
+  kSymLogand,
+  kSymLogor,
+  kSymNumEqual,
+  kSymLess,
+  kSymLessEqual,
+  kSymLet,
+  kSymIf,
+  kSymCons,
+  kSymCar,
+  kSymCdr,
+  kSymMakeVector,
+  kSymVectorRef,
+  kSymVectorSet,
+  kSymVectorLength,
+  kSymVectorFill,
+  kSymVectorCopy,
+  kSymMakeString,
+  kSymStringRef,
+  kSymStringSet,
+  kSymStringLength,
+  kSymStringFill,
+  kSymStringEqual,
+  kSymStringLess,
+  kSymLambda,
+  kSymFuncall,
+  kSymCode,
+  kSymLabelcall,
+  kSymLabels,
+  // Not a form: the hidden first formal of a closure's code (see
+  // AST_closure_formal).
+  kSymClosure,
+  kNumBuiltinSymbols,
+} BuiltinSymbol;
+
+static const char *kBuiltinSymbolNames[] = {
+    [kSymAdd1] = "add1",
+    [kSymSub1] = "sub1",
+    [kSymIntegerToChar] = "integer->char",
+    [kSymZerop] = "zero?",
+    [kSymPlus] = "+",
+    [kSymMinus] = "-",
+    [kSymTimes] = "*",
+    [kSymQuotient] = "quotient",
+    [kSymRemainder] = "remainder",
+    [kSymLogand] = "logand",
+    [kSymLogor] = "logor",
+    [kSymNumEqual] = "=",
+    [kSymLess] = "<",
+    [kSymLessEqual] = "<=",
+    [kSymLet] = "let",
+    [kSymIf] = "if",
+    [kSymCons] = "cons",
+    [kSymCar] = "car",
+    [kSymCdr] = "cdr",
+    [kSymMakeVector] = "make-vector",
+    [kSymVectorRef] = "vector-ref",
+    [kSymVectorSet] = "vector-set!",
+    [kSymVectorLength] = "vector-length",
+    [kSymVectorFill] = "vector-fill!",
+    [kSymVectorCopy] = "vector-copy!",
+    [kSymMakeString] = "make-string",
+    [kSymStringRef] = "string-ref",
+    [kSymStringSet] = "string-set!",
+    [kSymStringLength] = "string-length",
+    [kSymStringFill] = "string-fill!",
+    [kSymStringEqual] = "string=?",
+    [kSymStringLess] = "string<?",
+    [kSymLambda] = "lambda",
+    [kSymFuncall] = "funcall",
+    [kSymCode] = "code",
+    [kSymLabelcall] = "labelcall",
+    [kSymLabels] = "labels",
+    [kSymClosure] = "#closure",
+};
+
+typedef struct {
+  // Open-addressed hash table of interned symbols; capacity is a power of 2.
+  Symbol **slots;
+  size_t capacity;
+  // by_id[id] is the symbol with that id; there are `count' of them.
+  Symbol **by_id;
+  size_t count;
+  // The first kNumBuiltinSymbols of by_id, which never move.
+  Symbol *builtins[kNumBuiltinSymbols];
+  // Symbols and their names live here for the life of the process.
+  Arena arena;
+} SymbolTable;
+
+static SymbolTable symbol_table;
+static pthread_once_t symbol_table_once = PTHREAD_ONCE_INIT;
+// Held while interning or reading by_id.
+static pthread_mutex_t symbol_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const size_t kSymbolTableInitialCapacity = 256;
+
+// FNV-1a
+static uint32_t Symbol_hash(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (byte)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static Symbol **SymbolTable_find_slot(Symbol **slots, size_t capacity,
+                                      const char *name, size_t length,
+                                      uint32_t hash) {
+  size_t mask = capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    Symbol *sym = slots[i];
+    if (sym == NULL) {
+      return &slots[i];
+    }
+    if (sym->hash == hash && sym->length == length &&
+        memcmp(sym->name, name, length) == 0) {
+      return &slots[i];
+    }
+  }
+}
+
+static void SymbolTable_grow(SymbolTable *table) {
+  size_t capacity = table->capacity * 2;
+  Symbol **slots = calloc(capacity, sizeof *slots);
+  assert(slots != NULL);
+  for (size_t i = 0; i < table->count; i++) {
+    Symbol *sym = table->by_id[i];
+    *SymbolTable_find_slot(slots, capacity, sym->name, sym->length,
+                           sym->hash) = sym;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->by_id = realloc(table->by_id, capacity * sizeof *table->by_id);
+  assert(table->by_id != NULL);
+  table->capacity = capacity;
+}
+
+static Symbol *SymbolTable_intern(SymbolTable *table, const char *name,
+                                  size_t length);
+
+static void SymbolTable_init(SymbolTable *table) {
+  table->capacity = kSymbolTableInitialCapacity;
+  table->slots = calloc(table->capacity, sizeof *table->slots);
+  table->by_id = malloc(table->capacity * sizeof *table->by_id);
+  assert(table->slots != NULL && table->by_id != NULL);
+  table->count = 0;
+  Arena_init(&table->arena);
+  for (int i = 0; i < kNumBuiltinSymbols; i++) {
+    const char *name = kBuiltinSymbolNames[i];
+    Symbol *sym = SymbolTable_intern(table, name, strlen(name));
+    assert(sym->id == (uint32_t)i);
+    table->builtins[i] = sym;
+  }
+}
+
+static void Symbol_init_table(void) { SymbolTable_init(&symbol_table); }
+
+static Symbol *SymbolTable_intern(SymbolTable *table, const char *name,
+                                  size_t length) {
+  uint32_t hash = Symbol_hash(name, length);
+  Symbol **slot = SymbolTable_find_slot(table->slots, table->capacity, name,
+                                        length, hash);
+  if (*slot != NULL) {
+    return *slot;
+  }
+  Symbol *sym = Arena_alloc(&table->arena, sizeof *sym);
+  sym->name = Arena_alloc(&table->arena, length + 1); // +1 for NUL
+  memcpy(sym->name, name, length);
+  sym->name[length] = '\0';
+  sym->length = length;
+  sym->hash = hash;
+  sym->id = table->count;
+  *slot = sym;
+  table->by_id[table->count++] = sym;
+  // Keep the load factor at or under 1/2.
+  if (table->count * 2 > table->capacity) {
+    SymbolTable_grow(table);
+  }
+  return sym;
+}
+
+Symbol *Symbol_intern_len(const char *name, size_t length) {
+  pthread_once(&symbol_table_once, Symbol_init_table);
+  pthread_mutex_lock(&symbol_table_lock);
+  Symbol *sym = SymbolTable_intern(&symbol_table, name, length);
+  pthread_mutex_unlock(&symbol_table_lock);
+  return sym;
+}
+
+Symbol *Symbol_intern(const char *name) {
+  return Symbol_intern_len(name, strlen(name));
+}
+
+Symbol *Symbol_builtin(BuiltinSymbol builtin) {
+  pthread_once(&symbol_table_once, Symbol_init_table);
+  return symbol_table.builtins[builtin];
+}
+
+// Number of symbols interned so far; ids are in [0, Symbol_count()).
+size_t Symbol_count() {
+  pthread_once(&symbol_table_once, Symbol_init_table);
+  pthread_mutex_lock(&symbol_table_lock);
+  size_t count = symbol_table.count;
+  pthread_mutex_unlock(&symbol_table_lock);
+  return count;
+}
+
+Symbol *Symbol_from_id(uint32_t id) {
+  pthread_once(&symbol_table_once, Symbol_init_table);
+  pthread_mutex_lock(&symbol_table_lock);
+  assert(id < symbol_table.count);
+  Symbol *sym = symbol_table.by_id[id];
+  pthread_mutex_unlock(&symbol_table_lock);
+  return sym;
+}
+
+// End Symbols
+
+// Env
+
+// An Env maps a list of names to a list of corresponding indices in the stack.
+// This is useful when binding names in function params, `let`, and at the top
+// level.
+//
+// Goal: don't allocate any EnvNodes on the heap when recursively compiling
+// functions and let-bindings; instead, borrow the atom's Symbol and store an
+// EnvNode on the stack. All recursive leaf calls will be able to reference
+// this EnvNode and when the function returns, the name should not be
+// available/bound anyway. Eg:
+//
+// void AST_compile_let(..., ASTNode *bindings, ASTNode *body) {
+//   if (bindings == nil) {
+//     AST_compile_expr(..., body);
+//     return;
+//   }
+//   EnvNode new_env = bind_name(car(bindings));
+//   new_env.next = ctx->locals;
+//   CompilerContext new_ctx = CompilerContext_with_locals(..., &new_env);
+//   AST_compile_let(&new_ctx, ..., cdr(bindings), body);
+// }
+//
+// In any case, the Symbols will live long enough since they are interned for
+// the life of the process. Since they are interned, lookup is a pointer
+// comparison per EnvNode.
+
+typedef struct EnvNode {
+  Symbol *name;
+  int32_t stack_index;
+  struct EnvNode *next;
+} EnvNode;
+
+EnvNode Env_init(Symbol *name, int32_t stack_index, EnvNode *next) {
+  return (EnvNode){.name = name, .stack_index = stack_index, .next = next};
+}
+
+// Return true if found and store the corresponding stack_index in
+// *stack_index. Return false otherwise.
+bool Env_lookup(EnvNode *env, Symbol *name, int32_t *stack_index) {
+  assert(name != NULL);
+  assert(stack_index != NULL);
+  if (env == NULL)
+    return false;
+  if (env->name == name) {
+    *stack_index = env->stack_index;
+    return true;
+  }
+  return Env_lookup(env->next, name, stack_index);
+}
+
+// End Env
+
+// Stats
+
+// Where the time goes and how much work gets done, for telling whether a slow
+// request was slow to read, compile, make executable or run. Nothing is
+// recorded unless a Stats is asked for: CompilerContext.stats, Reader.stats
+// and Heap.stats are NULL by default, and then all it costs is a test of the
+// pointer at the start and end of each phase (and in each name lookup).
+//
+// A Stats is not locked; give each thread its own and add them up with
+// Stats_add.
+
+typedef enum {
+  kPhaseRead,
+  kPhaseCompile,
+  kPhaseMakeExecutable,
+  kPhaseRun,
+  kNumPhases,
+} Phase;
+
+typedef struct {
+  // Nanoseconds spent in each phase, and the number of times it was entered.
+  uint64_t phase_ns[kNumPhases];
+  uint64_t phase_count[kNumPhases];
+  // ASTNodes allocated by the reader, and by compiling (folding makes new
+  // ones).
+  uint64_t ast_nodes;
+  // Env entries looked at to find the names the code generator compiles.
+  uint64_t env_hops;
+  // Bytes of code compiled, after relaxation.
+  uint64_t code_bytes;
+  // Jumps and calls whose displacements relaxation filled in.
+  uint64_t branches_patched;
+  // Bytes the compiled code allocated from a Heap.
+  uint64_t heap_bytes;
+} Stats;
+
+void Stats_reset(Stats *stats) { memset(stats, 0, sizeof *stats); }
+
+// A copy of what `stats' has recorded so far. If `reset', start it over, so
+// that snapshots taken one after another each cover what happened in between.
+Stats Stats_snapshot(Stats *stats, bool reset) {
+  Stats result = *stats;
+  if (reset) {
+    Stats_reset(stats);
+  }
+  return result;
+}
+
+void Stats_add(Stats *stats, const Stats *other) {
+  for (int i = 0; i < kNumPhases; i++) {
+    stats->phase_ns[i] += other->phase_ns[i];
+    stats->phase_count[i] += other->phase_count[i];
+  }
+  stats->ast_nodes += other->ast_nodes;
+  stats->env_hops += other->env_hops;
+  stats->code_bytes += other->code_bytes;
+  stats->branches_patched += other->branches_patched;
+  stats->heap_bytes += other->heap_bytes;
+}
+
+// Nanoseconds on a clock that only goes forwards.
+uint64_t Stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start timing a phase: pass the result to Stats_stop when it ends. Both do
+// nothing if `stats' is NULL.
+uint64_t Stats_start(Stats *stats) { return stats == NULL ? 0 : Stats_now(); }
+
+void Stats_stop(Stats *stats, Phase phase, uint64_t start) {
+  if (stats != NULL) {
+    stats->phase_ns[phase] += Stats_now() - start;
+    stats->phase_count[phase]++;
+  }
+}
+
+// End Stats
+
+// Profile
+
+// With kOptProfile, the code counts how often it runs each `code' body and
+// each arm of each `if' in a Profile's counters, for deciding what to inline
+// and how to lay out branches when the source is compiled again. Sites are
+// identified by things that stay the same from one compile to the next: a
+// `code' body by the label it is bound to, and an `if' by where its test
+// starts in the source (folding keeps spans). Profile_entry_count and
+// Profile_branch_counts look them up.
+//
+// The code increments the counters where they are, by address, so they are
+// allocated up front and never move, and the code can't be written out. The
+// increments aren't atomic: runs on several threads at once may lose a few.
+
+typedef enum {
+  kProfileEntry,
+  kProfileIf,
+} ProfileSiteKind;
+
+typedef struct {
+  ProfileSiteKind kind;
+  // For kProfileEntry, the label the `code' is bound to.
+  Symbol *label;
+  // For kProfileIf, where the test starts in the source.
+  size_t span_start;
+  // The site's counters start here: one for an entry, and one for each arm of
+  // an `if', the true one first.
+  int32_t counter;
+} ProfileSite;
+
+typedef struct {
+  uint64_t *counters;
+  int32_t num_counters;
+  int32_t max_counters;
+  ProfileSite *sites;
+  int32_t num_sites;
+  int32_t sites_capacity;
+} Profile;
+
+void Profile_init(Profile *profile, int32_t max_counters) {
+  *profile = (Profile){.counters = calloc(max_counters, sizeof(uint64_t)),
+                       .max_counters = max_counters};
+  assert(profile->counters != NULL);
+}
+
+void Profile_deinit(Profile *profile) {
+  free(profile->counters);
+  free(profile->sites);
+  *profile = (Profile){0};
+}
+
+// Zero the counts, keeping the sites, to start profiling over.
+void Profile_reset(Profile *profile) {
+  memset(profile->counters, 0, profile->num_counters * sizeof(uint64_t));
+}
+
+// Add a site with `num_counters' counters, and return the first of them, or
+// -1 if the profile is full.
+int32_t Profile_add_site(Profile *profile, ProfileSiteKind kind,
+                         Symbol *label, size_t span_start,
+                         int32_t num_counters) {
+  if (profile->num_counters + num_counters > profile->max_counters) {
+    fprintf(stderr, "Too many profile counters\n");
+    return -1;
+  }
+  if (profile->num_sites == profile->sites_capacity) {
+    profile->sites_capacity =
+        profile->sites_capacity == 0 ? 16 : profile->sites_capacity * 2;
+    profile->sites = realloc(profile->sites, profile->sites_capacity *
+                                                 sizeof *profile->sites);
+    assert(profile->sites != NULL);
+  }
+  int32_t counter = profile->num_counters;
+  profile->sites[profile->num_sites++] =
+      (ProfileSite){.kind = kind,
+                    .label = label,
+                    .span_start = span_start,
+                    .counter = counter};
+  profile->num_counters += num_counters;
+  return counter;
+}
+
+// How many times the `code' bound to `label' was entered, counting every
+// definition of it.
+uint64_t Profile_entry_count(const Profile *profile, Symbol *label) {
+  uint64_t count = 0;
+  for (int32_t i = 0; i < profile->num_sites; i++) {
+    const ProfileSite *site = &profile->sites[i];
+    if (site->kind == kProfileEntry && site->label == label) {
+      count += profile->counters[site->counter];
+    }
+  }
+  return count;
+}
+
+// Store how many times each arm of the `if' whose test starts at `span_start'
+// ran. Return false if no such `if' was compiled.
+bool Profile_branch_counts(const Profile *profile, size_t span_start,
+                           uint64_t *iftrue, uint64_t *iffalse) {
+  *iftrue = *iffalse = 0;
+  bool found = false;
+  for (int32_t i = 0; i < profile->num_sites; i++) {
+    const ProfileSite *site = &profile->sites[i];
+    if (site->kind == kProfileIf && site->span_start == span_start) {
+      *iftrue += profile->counters[site->counter];
+      *iffalse += profile->counters[site->counter + 1];
+      found = true;
+    }
+  }
+  return found;
+}
+
+// End Profile
+
+// Heap
+
+// With kOptGC the generated code allocates from a Heap: two semispaces, the
+// current one of which (from-space) rsi bumps through. Each allocation is
+// preceded by an inline check of rsi against the end of from-space. When that
+// fails, an out-of-line slow path calls the GC stub, which saves the registers
+// and calls Heap_collect. That is a Cheney copying collector: it copies
+// everything reachable into to-space, swaps the two, and the code carries on
+// from the new rsi.
+//
+// The roots are precise. At every call the code makes -- to the GC stub or to
+// a label -- the compiler records a StackMapEntry saying where the return
+// address sits in the calling frame and which of that frame's slots (and, for
+// the stub, saved registers) hold live values. So the collector can start at
+// the stub's return address and walk up frame by frame: each entry gives the
+// size of the frame, and the return address at the top of the frame leads to
+// the entry for the next one, until it gets to the frame the entry point
+// started with.
+//
+// While the code runs, r11 points at the Heap. Its first few fields are the
+// ones the code uses, at the kHeap* offsets.
+//
+// A Heap holds all of the state a run of the code needs, and the code itself
+// only reads its Buffer and the stack maps. So one compiled program can run on
+// any number of threads at once, each on a Heap of its own (see Heap_run).
+
+// The registers the GC stub saves, numbered by where they end up: the stub
+// hands Heap_collect a pointer to the first, and the return address into the
+// slow path comes right after the last.
+typedef enum {
+  kSavedR11,
+  kSavedRsi,
+  kSavedRdi,
+  kSavedRdx,
+  kSavedRcx,
+  kSavedRax,
+  kNumSavedRegisters,
+} SavedRegister;
+
+typedef struct {
+  // Bound just after the call, where its return address points.
+  Label ret;
+  // The final position of `ret', filled in by StackMaps_resolve.
+  int32_t offset;
+  // Where the return address is in the calling frame. Slots above it may be
+  // live; the ones below belong to the callee.
+  int32_t stack_index;
+  // For a call to the GC stub: bit r is set if the saved register r (a
+  // SavedRegister) holds a live value, and `bytes' is how much the code is
+  // about to allocate.
+  uint8_t registers;
+  int32_t bytes;
+  // Index in StackMaps.bits of the first word of the frame's live-slot
+  // bitmap. Bit i is for the slot at stack index -kWordSize * (i + 1).
+  int32_t bitmap;
+} StackMapEntry;
+
+// A heap check's way out to the collector; see Heap_emit_check.
+typedef struct {
+  Label slow;
+  Label resume;
+  int32_t entry;
+} SlowPath;
+
+typedef struct {
+  StackMapEntry *entries;
+  int32_t num_entries;
+  int32_t entries_capacity;
+  uint64_t *bits;
+  int32_t num_bits;
+  int32_t bits_capacity;
+  // Code generation state: the GC stub's label, or -1 until something calls
+  // it, and the slow paths still to be emitted at the end of the function.
+  Label stub;
+  SlowPath *slow_paths;
+  int32_t num_slow_paths;
+  int32_t slow_paths_capacity;
+} StackMaps;
+
+static const int kBitsPerWord = 64;
+
+void StackMaps_init(StackMaps *maps) { *maps = (StackMaps){.stub = -1}; }
+
+void StackMaps_deinit(StackMaps *maps) {
+  free(maps->entries);
+  free(maps->bits);
+  free(maps->slow_paths);
+  *maps = (StackMaps){.stub = -1};
+}
+
+// Number of slots in a frame whose return address is at stack_index.
+static int32_t StackMaps_frame_slots(int32_t stack_index) {
+  return -stack_index / kWordSize - 1;
+}
+
+// Add an entry for a call with its return address at stack_index, and nothing
+// live yet. Return the entry's index.
+int32_t StackMaps_add(StackMaps *maps, Label ret, int32_t stack_index) {
+  if (maps->num_entries == maps->entries_capacity) {
+    maps->entries_capacity =
+        maps->entries_capacity == 0 ? 16 : maps->entries_capacity * 2;
+    maps->entries = realloc(maps->entries,
+                            maps->entries_capacity * sizeof *maps->entries);
+    assert(maps->entries != NULL);
+  }
+  int32_t words =
+      (StackMaps_frame_slots(stack_index) + kBitsPerWord - 1) / kBitsPerWord;
+  if (maps->num_bits + words > maps->bits_capacity) {
+    while (maps->num_bits + words > maps->bits_capacity) {
+      maps->bits_capacity =
+          maps->bits_capacity == 0 ? 16 : maps->bits_capacity * 2;
+    }
+    maps->bits = realloc(maps->bits, maps->bits_capacity * sizeof *maps->bits);
+    assert(maps->bits != NULL);
+  }
+  memset(maps->bits + maps->num_bits, 0, words * sizeof *maps->bits);
+  maps->entries[maps->num_entries] =
+      (StackMapEntry){.ret = ret,
+                      .offset = -1,
+                      .stack_index = stack_index,
+                      .bitmap = maps->num_bits};
+  maps->num_bits += words;
+  return maps->num_entries++;
+}
+
+// Mark the slot at stack_index live at `entry'.
+void StackMaps_mark_slot(StackMaps *maps, int32_t entry, int32_t stack_index) {
+  StackMapEntry *e = &maps->entries[entry];
+  assert(stack_index < 0 && stack_index > e->stack_index &&
+         "slot is not in the frame");
+  int32_t slot = -stack_index / kWordSize - 1;
+  maps->bits[e->bitmap + slot / kBitsPerWord] |= (uint64_t)1
+                                                 << (slot % kBitsPerWord);
+}
+
+// Mark `reg' live at `entry', which must be a call to the GC stub.
+void StackMaps_mark_register(StackMaps *maps, int32_t entry, Register reg) {
+  SavedRegister saved;
+  switch (reg) {
+  case kRax:
+    saved = kSavedRax;
+    break;
+  case kRcx:
+    saved = kSavedRcx;
+    break;
+  case kRdx:
+    saved = kSavedRdx;
+    break;
+  case kRdi:
+    saved = kSavedRdi;
+    break;
+  default:
+    assert(false && "register is not saved by the GC stub");
+    return;
+  }
+  maps->entries[entry].registers |= 1 << saved;
+}
+
+static bool StackMaps_slot_is_live(const StackMaps *maps,
+                                   const StackMapEntry *entry, int32_t slot) {
+  return (maps->bits[entry->bitmap + slot / kBitsPerWord] >>
+          (slot % kBitsPerWord)) &
+         1;
+}
+
+static int StackMapEntry_compare(const void *left, const void *right) {
+  int32_t l = ((const StackMapEntry *)left)->offset;
+  int32_t r = ((const StackMapEntry *)right)->offset;
+  return (l > r) - (l < r);
+}
+
+// Look up where each entry's return address ended up, now that the code has
+// been relaxed, and sort the entries by it for Heap_collect.
+void StackMaps_resolve(StackMaps *maps, BufferWriter *writer) {
+  assert(maps->num_slow_paths == 0 && "slow paths not emitted yet");
+  for (int32_t i = 0; i < maps->num_entries; i++) {
+    maps->entries[i].offset =
+        BufferWriter_label_pos(writer, maps->entries[i].ret);
+  }
+  qsort(maps->entries, maps->num_entries, sizeof *maps->entries,
+        StackMapEntry_compare);
+}
+
+// Add the entries of `other', which were made for code that has since been
+// linked in after the code of `maps' with BufferWriter_append (which returned
+// `delta'). They get resolved along with the rest.
+void StackMaps_append(StackMaps *maps, const StackMaps *other, int32_t delta) {
+  assert(other->num_slow_paths == 0 && "slow paths not emitted yet");
+  int32_t num_entries = maps->num_entries + other->num_entries;
+  if (num_entries > maps->entries_capacity) {
+    while (num_entries > maps->entries_capacity) {
+      maps->entries_capacity =
+          maps->entries_capacity == 0 ? 16 : maps->entries_capacity * 2;
+    }
+    maps->entries = realloc(maps->entries,
+                            maps->entries_capacity * sizeof *maps->entries);
+    assert(maps->entries != NULL);
+  }
+  int32_t num_bits = maps->num_bits + other->num_bits;
+  if (num_bits > maps->bits_capacity) {
+    while (num_bits > maps->bits_capacity) {
+      maps->bits_capacity =
+          maps->bits_capacity == 0 ? 16 : maps->bits_capacity * 2;
+    }
+    maps->bits =
+        realloc(maps->bits, maps->bits_capacity * sizeof *maps->bits);
+    assert(maps->bits != NULL);
+  }
+  for (int32_t i = 0; i < other->num_entries; i++) {
+    StackMapEntry entry = other->entries[i];
+    entry.ret += delta;
+    entry.bitmap += maps->num_bits;
+    maps->entries[maps->num_entries++] = entry;
+  }
+  if (other->num_bits > 0) {
+    memcpy(maps->bits + maps->num_bits, other->bits,
+           other->num_bits * sizeof *maps->bits);
+  }
+  maps->num_bits = num_bits;
+}
+
+// The entry whose return address is at `offset' in the code, or NULL.
+static const StackMapEntry *StackMaps_find(const StackMaps *maps,
+                                           int64_t offset) {
+  int32_t low = 0, high = maps->num_entries;
+  while (low < high) {
+    int32_t mid = low + (high - low) / 2;
+    if (maps->entries[mid].offset < offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low < maps->num_entries && maps->entries[low].offset == offset) {
+    return &maps->entries[low];
+  }
+  return NULL;
+}
+
+typedef struct Heap {
+  // The next free byte in from-space. The code keeps it in rsi while it runs
+  // and only stores it back when it returns.
+  uint64_t alloc;
+  // The end of from-space.
+  uint64_t limit;
+  // rsp in the entry point, just before it calls the body.
+  uint64_t stack_top;
+  // Heap_collect, called through here so the code doesn't have to know
+  // where it is.
+  void (*collect)(struct Heap *heap, uint64_t *saved);
+  uint64_t *from_space;
+  uint64_t *to_space;
+  // Bytes in each space.
+  size_t space_size;
+  const StackMaps *maps;
+  const byte *code;
+  // Number of collections so far.
+  int collections;
+  // Bytes the code allocated in the from-spaces before this one, and where
+  // it started allocating in this one (see Heap_bytes_allocated).
+  uint64_t allocated;
+  uint64_t alloc_start;
+  // If set, Heap_run records the time it takes and the bytes the code
+  // allocates here.
+  Stats *stats;
+} Heap;
+
+static const int8_t kHeapAlloc = offsetof(Heap, alloc);
+static const int8_t kHeapLimit = offsetof(Heap, limit);
+static const int8_t kHeapStackTop = offsetof(Heap, stack_top);
+static const int8_t kHeapCollect = offsetof(Heap, collect);
+
+// Stored in the first word of an object that has been copied to to-space;
+// the second then holds the copy. No value or header has this tag, so no
+// object that is still in place can be mistaken for one that moved. Every
+// object has at least two words.
+static const uint64_t kForwardedTag = 0x3f;
+
+// In StackMapEntry.bytes: the size of the allocation was only known at run
+// time, and the code passed rsi + size in rax (see Heap_emit_check_rax).
+static const int32_t kHeapBytesInRax = -1;
+
+// The size in words of the object that starts with `first', including its
+// padding.
+static size_t Heap_object_words(uint64_t first) {
+  uint64_t length = first >> kHeaderShift;
+  if ((first & kCharMask) == (uint64_t)kVectorHeaderTag) {
+    return ((length + 1) * kWordSize + 15) / 16 * 2;
+  }
+  if ((first & kCharMask) == (uint64_t)kStringHeaderTag) {
+    return (kWordSize + length + 15) / 16 * 2;
+  }
+  if ((first & kCharMask) == (uint64_t)kClosureHeaderTag) {
+    return ((length + 2) * kWordSize + 15) / 16 * 2;
+  }
+  // A pair.
+  return 2;
+}
+
+static bool Heap_in_from_space(Heap *heap, uint64_t *address) {
+  return address >= heap->from_space &&
+         (byte *)address < (byte *)heap->from_space + heap->space_size;
+}
+
+// If `value' refers to an object in from-space, copy the object to `*free'
+// in to-space (unless an earlier reference did). Return what `value' should
+// become.
+static uint64_t Heap_copy(Heap *heap, uint64_t **free, uint64_t value) {
+  uint64_t tag = value & kHeapObjectMask;
+  if (tag != (uint64_t)kPairTag && tag != (uint64_t)kVectorTag &&
+      tag != (uint64_t)kStringTag && tag != (uint64_t)kClosureTag) {
+    return value;
+  }
+  uint64_t *from = (uint64_t *)(value - tag);
+  if (!Heap_in_from_space(heap, from)) {
+    return value;
+  }
+  if (from[0] == kForwardedTag) {
+    return from[1];
+  }
+  uint64_t *to = *free;
+  size_t words = Heap_object_words(from[0]);
+  memcpy(to, from, words * kWordSize);
+  *free += words;
+  uint64_t result = (uint64_t)to | tag;
+  from[0] = kForwardedTag;
+  from[1] = result;
+  return result;
+}
+
+static const StackMapEntry *Heap_entry_for(Heap *heap,
+                                           uint64_t return_address) {
+  const StackMapEntry *entry = StackMaps_find(
+      heap->maps, (int64_t)(return_address - (uint64_t)heap->code));
+  assert(entry != NULL && "return address without a stack map");
+  return entry;
+}
+
+// Copy everything the saved registers and the frames refer to.
+static void Heap_copy_roots(Heap *heap, uint64_t *saved, uint64_t **free) {
+  uint64_t *ret = &saved[kNumSavedRegisters];
+  const StackMapEntry *entry = Heap_entry_for(heap, *ret);
+  for (int r = 0; r < kNumSavedRegisters; r++) {
+    if (entry->registers & (1 << r)) {
+      saved[r] = Heap_copy(heap, free, saved[r]);
+    }
+  }
+  for (;;) {
+    uint64_t *frame = (uint64_t *)((byte *)ret - entry->stack_index);
+    int32_t num_slots = StackMaps_frame_slots(entry->stack_index);
+    for (int32_t slot = 0; slot < num_slots; slot++) {
+      if (StackMaps_slot_is_live(heap->maps, entry, slot)) {
+        frame[-(slot + 1)] = Heap_copy(heap, free, frame[-(slot + 1)]);
+      }
+    }
+    if ((uint64_t)frame == heap->stack_top - kWordSize) {
+      // The frame the entry point called; the rest are the embedder's.
+      return;
+    }
+    ret = frame;
+    entry = Heap_entry_for(heap, *ret);
+  }
+}
+
+// Copy everything reachable into a fresh to-space of `size' bytes, and make
+// that from-space.
+static void Heap_flip(Heap *heap, uint64_t *saved, size_t size) {
+  uint64_t *to_space = heap->to_space;
+  if (size != heap->space_size) {
+    to_space = malloc(size);
+    assert(to_space != NULL);
+  }
+  uint64_t *free_ptr = to_space;
+  Heap_copy_roots(heap, saved, &free_ptr);
+  // Everything between scan and free_ptr has been copied but not looked
+  // inside yet. Pairs are two values; vectors are a header and then values;
+  // strings have none; closures have a header and a code address before
+  // theirs.
+  for (uint64_t *scan = to_space; scan < free_ptr;) {
+    uint64_t first = *scan;
+    size_t words = Heap_object_words(first);
+    size_t start = 0;
+    size_t end = words;
+    if ((first & kCharMask) == (uint64_t)kVectorHeaderTag) {
+      start = 1;
+      end = 1 + (first >> kHeaderShift);
+    } else if ((first & kCharMask) == (uint64_t)kStringHeaderTag) {
+      end = 0;
+    } else if ((first & kCharMask) == (uint64_t)kClosureHeaderTag) {
+      start = 2;
+      end = 2 + (first >> kHeaderShift);
+    }
+    for (size_t i = start; i < end; i++) {
+      scan[i] = Heap_copy(heap, &free_ptr, scan[i]);
+    }
+    scan += words;
+  }
+  if (size != heap->space_size) {
+    free(heap->from_space);
+    free(heap->to_space);
+    heap->to_space = malloc(size);
+    assert(heap->to_space != NULL);
+    heap->space_size = size;
+  } else {
+    heap->to_space = heap->from_space;
+  }
+  heap->from_space = to_space;
+  heap->alloc = (uint64_t)free_ptr;
+  heap->limit = (uint64_t)to_space + size;
+}
+
+// Called by the GC stub when an allocation doesn't fit. `saved' is where the
+// stub saved the registers; rsi is updated there for when they are restored.
+void Heap_collect(Heap *heap, uint64_t *saved) {
+  const StackMapEntry *entry = Heap_entry_for(heap, saved[kNumSavedRegisters]);
+  int64_t bytes = entry->bytes;
+  if (bytes == kHeapBytesInRax) {
+    bytes = saved[kSavedRax] - saved[kSavedRsi];
+  }
+  heap->allocated += saved[kSavedRsi] - heap->alloc_start;
+  Heap_flip(heap, saved, heap->space_size);
+  // Grow when more than half of the space is still in use afterwards, so
+  // that collections don't come ever closer together. That copies the live
+  // data a second time, but then the heap has doubled.
+  size_t used = heap->alloc - (uint64_t)heap->from_space + bytes;
+  if (used > heap->space_size / 2) {
+    size_t size = heap->space_size * 2;
+    while (used > size / 2) {
+      size *= 2;
+    }
+    Heap_flip(heap, saved, size);
+  }
+  heap->collections++;
+  heap->alloc_start = heap->alloc;
+  saved[kSavedRsi] = heap->alloc;
+  if (entry->bytes == kHeapBytesInRax) {
+    saved[kSavedRax] = heap->alloc + bytes;
+  }
+}
+
+// `space_size' is the initial size in bytes of each of the two spaces. The
+// stack maps and code are the program's, which must be done compiling.
+void Heap_init(Heap *heap, size_t space_size, const StackMaps *maps,
+               const Buffer *code) {
+  uint64_t *from_space = malloc(space_size);
+  uint64_t *to_space = malloc(space_size);
+  assert(from_space != NULL && to_space != NULL);
+  *heap = (Heap){.alloc = (uint64_t)from_space,
+                 .alloc_start = (uint64_t)from_space,
+                 .limit = (uint64_t)from_space + space_size,
+                 .collect = Heap_collect,
+                 .from_space = from_space,
+                 .to_space = to_space,
+                 .space_size = space_size,
+                 .maps = maps,
+                 .code = Buffer_code(code)};
+}
+
+// Bytes the code has allocated from the heap, counting what has since been
+// collected. Only up to date while the code isn't running.
+uint64_t Heap_bytes_allocated(const Heap *heap) {
+  return heap->allocated + (heap->alloc - heap->alloc_start);
+}
+
+void Heap_deinit(Heap *heap) {
+  free(heap->from_space);
+  free(heap->to_space);
+  heap->from_space = heap->to_space = NULL;
+}
+
+// Run the code the heap was set up for, which must have been compiled with
+// kOptGC and made executable, on the calling thread. Return its result.
+uint64_t Heap_run(Heap *heap) {
+  if (heap->stats == NULL) {
+    return EntryFunction_at((byte *)heap->code)((uint64_t)heap);
+  }
+  uint64_t allocated = Heap_bytes_allocated(heap);
+  uint64_t start = Stats_start(heap->stats);
+  uint64_t result = EntryFunction_at((byte *)heap->code)((uint64_t)heap);
+  Stats_stop(heap->stats, kPhaseRun, start);
+  heap->stats->heap_bytes += Heap_bytes_allocated(heap) - allocated;
+  return result;
+}
+
+// The code the slow paths call: save the registers the code may be using,
+// call heap->collect(heap, saved) with the stack aligned the way C expects,
+// and restore the registers -- now with the new rsi and the live values
+// updated.
+static void Heap_emit_stub(BufferWriter *writer) {
+  // In reverse SavedRegister order, so that they end up in it.
+  Buffer_push_reg(writer, kRax);
+  Buffer_push_reg(writer, kRcx);
+  Buffer_push_reg(writer, kRdx);
+  Buffer_push_reg(writer, kRdi);
+  Buffer_push_reg(writer, kRsi);
+  Buffer_push_r11(writer);
+  // rbx keeps our rsp across the call. It is callee-saved, so whoever called
+  // the entry point expects it back.
+  Buffer_push_reg(writer, kRbx);
+  Buffer_mov_reg_reg(writer, /*dst=*/kRbx, /*src=*/kRsp);
+  Buffer_and_reg_imm32(writer, kRsp, -16);
+  Buffer_mov_reg_r11(writer, kRdi);
+  Buffer_lea_reg_disp(writer, kRsi, kRbx, kWordSize);
+  Buffer_call_r11_disp(writer, kHeapCollect);
+  Buffer_mov_reg_reg(writer, /*dst=*/kRsp, /*src=*/kRbx);
+  Buffer_pop_reg(writer, kRbx);
+  Buffer_pop_r11(writer);
+  Buffer_pop_reg(writer, kRsi);
+  Buffer_pop_reg(writer, kRdi);
+  Buffer_pop_reg(writer, kRdx);
+  Buffer_pop_reg(writer, kRcx);
+  Buffer_pop_reg(writer, kRax);
+  Buffer_ret(writer);
+}
+
+// Jump to a new slow path if the comparison just emitted found the heap full,
+// and return the stack map entry for its call into the collector.
+static int32_t Heap_emit_slow_jump(BufferWriter *writer, StackMaps *maps,
+                                   int32_t bytes, int32_t stack_index) {
+  if (maps->stub == -1) {
+    maps->stub = BufferWriter_new_label(writer);
+  }
+  SlowPath slow_path = {.slow = BufferWriter_new_label(writer),
+                        .resume = BufferWriter_new_label(writer)};
+  Buffer_jcc_label(writer, kAbove, slow_path.slow);
+  BufferWriter_bind_label(writer, slow_path.resume);
+  slow_path.entry =
+      StackMaps_add(maps, BufferWriter_new_label(writer), stack_index);
+  maps->entries[slow_path.entry].bytes = bytes;
+  if (maps->num_slow_paths == maps->slow_paths_capacity) {
+    maps->slow_paths_capacity =
+        maps->slow_paths_capacity == 0 ? 16 : maps->slow_paths_capacity * 2;
+    maps->slow_paths =
+        realloc(maps->slow_paths,
+                maps->slow_paths_capacity * sizeof *maps->slow_paths);
+    assert(maps->slow_paths != NULL);
+  }
+  maps->slow_paths[maps->num_slow_paths++] = slow_path;
+  return slow_path.entry;
+}
+
+// Emit the inline check that `bytes' more fit in from-space, for code whose
+// frame is live above stack_index. That is where the return address goes if
+// the check fails and the slow path calls the collector. Return the stack map
+// entry for that call, for the caller to mark what is live.
+int32_t Heap_emit_check(BufferWriter *writer, StackMaps *maps, int32_t bytes,
+                        int32_t stack_index) {
+  // Compare rsi + bytes against the limit without a spare register: bump
+  // rsi, compare, and take the bump back with an lea, which leaves the flags
+  // alone.
+  Buffer_add_reg_imm32(writer, kRsi, bytes);
+  Buffer_cmp_reg_r11_disp(writer, kRsi, kHeapLimit);
+  Buffer_lea_reg_disp(writer, kRsi, kRsi, -bytes);
+  return Heap_emit_slow_jump(writer, maps, bytes, stack_index);
+}
+
+// Like Heap_emit_check, for an allocation whose size in bytes is in rax. rax
+// holds rsi + size afterwards (the collector moves it along with rsi), and
+// can't be marked live.
+int32_t Heap_emit_check_rax(BufferWriter *writer, StackMaps *maps,
+                            int32_t stack_index) {
+  Buffer_add_reg_reg(writer, /*dst=*/kRax, /*src=*/kRsi);
+  Buffer_cmp_reg_r11_disp(writer, kRax, kHeapLimit);
+  return Heap_emit_slow_jump(writer, maps, kHeapBytesInRax, stack_index);
+}
+
+// Emit the slow paths of the checks made since the last call, and the GC stub
+// if that isn't there yet. Done at the end of each function, so that they are
+// out of the way of the code that runs.
+void Heap_emit_slow_paths(BufferWriter *writer, StackMaps *maps) {
+  for (int32_t i = 0; i < maps->num_slow_paths; i++) {
+    SlowPath *slow_path = &maps->slow_paths[i];
+    StackMapEntry *entry = &maps->entries[slow_path->entry];
+    BufferWriter_bind_label(writer, slow_path->slow);
+    // Move rsp down past the live slots, as for a labelcall.
+    int32_t rsp_adjust = entry->stack_index + kWordSize;
+    if (rsp_adjust != 0) {
+      Buffer_add_rsp_imm32(writer, rsp_adjust);
+    }
+    Buffer_call_label(writer, maps->stub);
+    BufferWriter_bind_label(writer, entry->ret);
+    if (rsp_adjust != 0) {
+      Buffer_add_rsp_imm32(writer, -rsp_adjust);
+    }
+    Buffer_jmp_label(writer, slow_path->resume);
+  }
+  maps->num_slow_paths = 0;
+  if (maps->stub != -1 && BufferWriter_label_pos(writer, maps->stub) == -1) {
+    BufferWriter_bind_label(writer, maps->stub);
+    Heap_emit_stub(writer);
+  }
+}
+
+// End Heap
+
+// Routines
+
+// The bulk operations on vectors and strings (vector-fill!, vector-copy!,
+// string=? and so on) call these instead of looping over the elements in
+// line. They work 16 bytes at a time with SSE2, which every x86-64 has.
+//
+// Like the overflow trap, each function that calls one gets a copy of it at
+// its end (see AST_emit_slow_paths), so that the code stays position
+// independent -- it is the same in the code cache and in an ELF -- and runs
+// compiled in parallel need nothing shared. They take their arguments in rdi,
+// rdx, rcx and rax and may clobber those and the xmm registers, but leave rsi
+// and r11 alone and push nothing. Callers spill their register slots and move
+// rsp down past the live slots first, as for a labelcall; a routine may use
+// the word below its return address.
+
+typedef enum {
+  // Store rax to each of the rcx words from rdi on.
+  kRoutineFill,
+  // Copy rcx words from rdx to rdi. The two must not overlap, unless they
+  // are the same.
+  kRoutineCopy,
+  // Return in rax the index of the first of the rcx bytes from rdi that
+  // differs from the one from rdx, or rcx if none does. Both may be read up
+  // to the end of the word the last byte is in.
+  kRoutineMismatch,
+  kNumRoutines,
+} RoutineKind;
+
+// The labels of the routines the function being compiled calls, or -1 for
+// the ones it doesn't.
+typedef struct {
+  Label labels[kNumRoutines];
+} Routines;
+
+void Routines_init(Routines *routines) {
+  for (int i = 0; i < kNumRoutines; i++) {
+    routines->labels[i] = -1;
+  }
+}
+
+static void Routine_emit_fill(BufferWriter *writer) {
+  Label loop = BufferWriter_new_label(writer);
+  Label tail = BufferWriter_new_label(writer);
+  Label done = BufferWriter_new_label(writer);
+  Buffer_movq_xmm_reg(writer, kXmm0, kRax);
+  Buffer_punpcklqdq(writer, kXmm0, kXmm0);
+  BufferWriter_bind_label(writer, loop);
+  Buffer_cmp_reg_imm32(writer, kRcx, 2);
+  Buffer_jcc_label(writer, kLess, tail);
+  Buffer_movdqu_store(writer, kRdi, kXmm0);
+  Buffer_add_reg_imm32(writer, kRdi, 2 * kWordSize);
+  Buffer_sub_reg_imm32(writer, kRcx, 2);
+  Buffer_jmp_label(writer, loop);
+  BufferWriter_bind_label(writer, tail);
+  Buffer_cmp_reg_imm32(writer, kRcx, 0);
+  Buffer_jcc_label(writer, kEqual, done);
+  Buffer_mov_rax_to_reg_disp(writer, kRdi, 0);
+  BufferWriter_bind_label(writer, done);
+  Buffer_ret(writer);
+}
+
+static void Routine_emit_copy(BufferWriter *writer) {
+  Label loop = BufferWriter_new_label(writer);
+  Label tail = BufferWriter_new_label(writer);
+  Label done = BufferWriter_new_label(writer);
+  BufferWriter_bind_label(writer, loop);
+  Buffer_cmp_reg_imm32(writer, kRcx, 2);
+  Buffer_jcc_label(writer, kLess, tail);
+  Buffer_movdqu_load(writer, kXmm0, kRdx);
+  Buffer_movdqu_store(writer, kRdi, kXmm0);
+  Buffer_add_reg_imm32(writer, kRdx, 2 * kWordSize);
+  Buffer_add_reg_imm32(writer, kRdi, 2 * kWordSize);
+  Buffer_sub_reg_imm32(writer, kRcx, 2);
+  Buffer_jmp_label(writer, loop);
+  BufferWriter_bind_label(writer, tail);
+  Buffer_cmp_reg_imm32(writer, kRcx, 0);
+  Buffer_jcc_label(writer, kEqual, done);
+  Buffer_mov_reg_disp_to_rax(writer, kRdx, 0);
+  Buffer_mov_rax_to_reg_disp(writer, kRdi, 0);
+  BufferWriter_bind_label(writer, done);
+  Buffer_ret(writer);
+}
+
+static void Routine_emit_mismatch(BufferWriter *writer) {
+  Label chunks = BufferWriter_new_label(writer);
+  Label words = BufferWriter_new_label(writer);
+  Label in_chunk = BufferWriter_new_label(writer);
+  Label in_word = BufferWriter_new_label(writer);
+  Label found = BufferWriter_new_label(writer);
+  Label done = BufferWriter_new_label(writer);
+  // Count rcx down as rdi and rdx go up; the index of a mismatch is then
+  // the count we started with, less rcx, plus where it is in the chunk.
+  Buffer_mov_reg_to_stack(writer, kRcx, -kWordSize);
+  BufferWriter_bind_label(writer, chunks);
+  Buffer_cmp_reg_imm32(writer, kRcx, 16);
+  Buffer_jcc_label(writer, kLess, words);
+  Buffer_movdqu_load(writer, kXmm0, kRdi);
+  Buffer_movdqu_load(writer, kXmm1, kRdx);
+  Buffer_pcmpeqb(writer, kXmm0, kXmm1);
+  Buffer_pmovmskb(writer, kRax, kXmm0);
+  // Now bit i is clear where byte i differs.
+  Buffer_xor_reg_imm32(writer, kRax, 0xffff);
+  Buffer_jcc_label(writer, kNotEqual, in_chunk);
+  Buffer_add_reg_imm32(writer, kRdi, 16);
+  Buffer_add_reg_imm32(writer, kRdx, 16);
+  Buffer_sub_reg_imm32(writer, kRcx, 16);
+  Buffer_jmp_label(writer, chunks);
+  // The rest a word at a time, so as not to read past the last one.
+  BufferWriter_bind_label(writer, words);
+  Buffer_cmp_reg_imm32(writer, kRcx, 0);
+  Buffer_jcc_label(writer, kLessEqual, done);
+  Buffer_mov_reg_disp_to_rax(writer, kRdi, 0);
+  Buffer_xor_rax_reg_disp(writer, kRdx, 0);
+  Buffer_jcc_label(writer, kNotEqual, in_word);
+  Buffer_add_reg_imm32(writer, kRdi, kWordSize);
+  Buffer_add_reg_imm32(writer, kRdx, kWordSize);
+  Buffer_sub_reg_imm32(writer, kRcx, kWordSize);
+  Buffer_jmp_label(writer, words);
+  BufferWriter_bind_label(writer, in_word);
+  Buffer_bsf_reg_reg(writer, kRax, kRax);
+  Buffer_shr_reg(writer, kRax, 3);
+  Buffer_jmp_label(writer, found);
+  BufferWriter_bind_label(writer, in_chunk);
+  Buffer_bsf_reg_reg(writer, kRax, kRax);
+  BufferWriter_bind_label(writer, found);
+  Buffer_sub_reg_reg(writer, /*dst=*/kRax, /*src=*/kRcx);
+  Buffer_add_reg_stack(writer, kRax, -kWordSize);
+  // A difference past the end of the last word's bytes doesn't count.
+  Buffer_cmp_reg_stack(writer, kRax, -kWordSize);
+  Buffer_jcc_label(writer, kGreaterEqual, done);
+  Buffer_ret(writer);
+  BufferWriter_bind_label(writer, done);
+  Buffer_mov_stack_to_reg(writer, kRax, -kWordSize);
+  Buffer_ret(writer);
+}
+
+// Emit the routines the function just compiled called.
+void Routines_emit(BufferWriter *writer, Routines *routines) {
+  static void (*const emit[kNumRoutines])(BufferWriter *) = {
+      [kRoutineFill] = Routine_emit_fill,
+      [kRoutineCopy] = Routine_emit_copy,
+      [kRoutineMismatch] = Routine_emit_mismatch,
+  };
+  for (int i = 0; i < kNumRoutines; i++) {
+    if (routines->labels[i] != -1) {
+      BufferWriter_bind_label(writer, routines->labels[i]);
+      emit[i](writer);
+    }
+  }
+}
+
+// End Routines
+
+// AST
+
+typedef enum {
+  kFixnum,
+  kAtom,
+  kCons,
+  // Chars and bools only come out of constant folding; the reader doesn't
+  // produce them.
+  kChar,
+  kBool,
+} ASTNodeType;
+
+struct ASTNode;
+
+typedef struct {
+  struct ASTNode *car;
+  struct ASTNode *cdr;
+} ASTCons;
+
+// TODO: tag AST nodes as values. immediate ints, etc
+typedef struct ASTNode {
+  ASTNodeType type;
+  // Where the node came from in the source, for diagnostics. Nodes that
+  // weren't read from source (and nil) have an empty span at 0. The length
+  // sits here to fill out the padding after type, keeping a node at 32 bytes.
+  uint32_t span_length;
+  union {
+    int fixnum;
+    Symbol *atom;
+    ASTCons cons;
+    char character;
+    bool boolean;
+  } value;
+  size_t span_start;
+} ASTNode;
+
+ASTNode nil_struct = {.type = kCons, .value.cons = {.car = NULL, .cdr = NULL}};
+ASTNode *nil = &nil_struct;
+
+// ASTNodes are small and allocated back to back in the arena (no per-node
+// malloc header), so a subtree built by the reader is packed into a few cache
+// lines instead of being scattered around the malloc heap.
+static ASTNode *AST_alloc(Arena *arena) {
+  ASTNode *result = Arena_alloc(arena, sizeof(ASTNode));
+  arena->num_nodes++;
+  result->span_start = 0;
+  result->span_length = 0;
+  return result;
+}
+
+ASTNode *AST_new_fixnum(Arena *arena, int fixnum) {
+  ASTNode *result = AST_alloc(arena);
+  result->type = kFixnum;
+  result->value.fixnum = fixnum;
+  return result;
+}
+
+ASTNode *AST_new_char(Arena *arena, char character) {
+  ASTNode *result = AST_alloc(arena);
+  result->type = kChar;
+  result->value.character = character;
+  return result;
+}
+
+ASTNode *AST_new_bool(Arena *arena, bool boolean) {
+  ASTNode *result = AST_alloc(arena);
+  result->type = kBool;
+  result->value.boolean = boolean;
+  return result;
+}
+
+ASTNode *AST_new_symbol(Arena *arena, Symbol *atom) {
+  ASTNode *result = AST_alloc(arena);
+  result->type = kAtom;
+  result->value.atom = atom;
+  return result;
+}
+
+ASTNode *AST_new_atom(Arena *arena, char *atom) {
+  return AST_new_symbol(arena, Symbol_intern(atom));
+}
+
+ASTNode *AST_new_cons(Arena *arena, ASTNode *car, ASTNode *cdr) {
+  if (car == NULL && cdr == NULL)
+    return nil;
+  assert(car != NULL && "both car & cdr must be NULL, or neither");
+  assert(cdr != NULL && "both car & cdr must be NULL, or neither");
+  ASTNode *result = AST_alloc(arena);
+  result->type = kCons;
+  result->value.cons.car = car;
+  result->value.cons.cdr = cdr;
+  return result;
+}
+
+int AST_is_atom(ASTNode *node) { return node->type == kAtom; }
+
+int AST_atom_equals_cstr(ASTNode *node, char *cstr) {
+  assert(AST_is_atom(node));
+  return strcmp(node->value.atom->name, cstr) == 0;
+}
+
+int AST_atom_is_builtin(ASTNode *node, BuiltinSymbol builtin) {
+  assert(AST_is_atom(node));
+  return node->value.atom->id == (uint32_t)builtin;
+}
+
+ASTNode *AST_car(ASTNode *cons) {
+  assert(cons != nil);
+  assert(cons->type == kCons);
+  return cons->value.cons.car;
+}
+
+ASTNode *AST_cdr(ASTNode *cons) {
+  assert(cons != nil);
+  assert(cons->type == kCons);
+  return cons->value.cons.cdr;
+}
+
+int AST_list_length(ASTNode *list) {
+  int result = 0;
+  for (; list != nil; list = AST_cdr(list)) {
+    result++;
+  }
+  return result;
+}
+
+// Reader
+
+// A Reader turns source text into top-level forms, one at a time. The text
+// either sits in memory all at once (a C string, or a file mapped with mmap)
+// or arrives through a refill callback into a fixed-size window, so a large
+// source can be read and compiled form by form without holding all of it.
+//
+// Lists are built with an explicit stack of open lists instead of recursion,
+// so neither very long lists nor very deep nesting use any C stack.
+
+// Fill `buf' with up to `len' bytes of input and return how many were
+// written; 0 means end of input.
+typedef size_t (*ReaderRefill)(void *state, char *buf, size_t len);
+
+typedef enum {
+  kReadOk,
+  kReadEof,
+  kReadError,
+} ReadResult;
+
+// A list whose closing paren we haven't seen yet.
+typedef struct {
+  ASTNode *head;
+  ASTNode *tail; // last cons cell, or NULL while the list is empty
+  size_t start;  // source offset of the '('
+} ReaderFrame;
+
+typedef struct {
+  Arena *arena;
+  // The current window of source text. window[i] is at source offset
+  // window_start + i.
+  const char *window;
+  size_t window_len;
+  size_t window_start;
+  size_t index;
+  // Only set for streams.
+  ReaderRefill refill;
+  void *refill_state;
+  char *refill_buf;
+  // Only set for mapped files.
+  void *mapping;
+  size_t mapping_len;
+  // Text of the atom or number being read; tokens can straddle refills, so
+  // they are accumulated here rather than pointed to in the window.
+  char *token;
+  size_t token_len;
+  size_t token_cap;
+  ReaderFrame *stack;
+  size_t depth;
+  size_t stack_cap;
+  // Set when Reader_next returns kReadError.
+  const char *error;
+  size_t error_pos;
+  // If set, Reader_next records the time it takes and the nodes it makes
+  // here.
+  Stats *stats;
+} Reader;
+
+static const size_t kReaderWindowSize = 64 * 1024; // bytes
+
+static void Reader_init_common(Reader *reader, Arena *arena) {
+  memset(reader, 0, sizeof *reader);
+  reader->arena = arena;
+}
+
+// `input' must stay alive (and unchanged) while the reader is in use.
+void Reader_init_cstr(Reader *reader, Arena *arena, const char *input) {
+  Reader_init_common(reader, arena);
+  reader->window = input;
+  reader->window_len = strlen(input);
+}
+
+void Reader_init_stream(Reader *reader, Arena *arena, ReaderRefill refill,
+                        void *state) {
+  Reader_init_common(reader, arena);
+  reader->refill = refill;
+  reader->refill_state = state;
+  reader->refill_buf = malloc(kReaderWindowSize);
+  assert(reader->refill_buf != NULL);
+  reader->window = reader->refill_buf;
+}
+
+static size_t Reader_refill_from_file(void *state, char *buf, size_t len) {
+  return fread(buf, 1, len, (FILE *)state);
+}
+
+void Reader_init_FILE(Reader *reader, Arena *arena, FILE *fp) {
+  Reader_init_stream(reader, arena, Reader_refill_from_file, fp);
+}
+
+// Map the file at `path' and read straight out of the mapping. Return 0 on
+// success and -1 if the file can't be opened or mapped.
+int Reader_init_file(Reader *reader, Arena *arena, const char *path) {
+  Reader_init_common(reader, arena);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  size_t len = st.st_size;
+  if (len > 0) {
+    void *mapping = mmap(/*addr=*/NULL, len, PROT_READ, MAP_PRIVATE, fd,
+                         /*off=*/0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    reader->mapping = mapping;
+    reader->mapping_len = len;
+    reader->window = mapping;
+    reader->window_len = len;
+  }
+  // The mapping keeps the file contents alive.
+  close(fd);
+  return 0;
+}
+
+void Reader_deinit(Reader *reader) {
+  if (reader->mapping != NULL) {
+    munmap(reader->mapping, reader->mapping_len);
+  }
+  free(reader->refill_buf);
+  free(reader->token);
+  free(reader->stack);
+  memset(reader, 0, sizeof *reader);
+}
+
+// Return the next character without consuming it, or EOF.
+static int Reader_peek(Reader *reader) {
+  if (reader->index == reader->window_len) {
+    if (reader->refill == NULL) {
+      return EOF;
+    }
+    reader->window_start += reader->window_len;
+    reader->index = 0;
+    reader->window_len = reader->refill(reader->refill_state,
+                                        reader->refill_buf, kReaderWindowSize);
+    if (reader->window_len == 0) {
+      return EOF;
+    }
+  }
+  return (byte)reader->window[reader->index];
+}
+
+static void Reader_advance(Reader *reader) {
+  assert(reader->index < reader->window_len);
+  reader->index++;
+}
+
+// Source offset of the next character.
+size_t Reader_pos(Reader *reader) {
+  return reader->window_start + reader->index;
+}
+
+static ReadResult Reader_fail(Reader *reader, const char *error, size_t pos) {
+  reader->error = error;
+  reader->error_pos = pos;
+  return kReadError;
+}
+
+static void Reader_token_push(Reader *reader, char c) {
+  if (reader->token_len == reader->token_cap) {
+    reader->token_cap = reader->token_cap == 0 ? 32 : reader->token_cap * 2;
+    reader->token = realloc(reader->token, reader->token_cap);
+    assert(reader->token != NULL);
+  }
+  reader->token[reader->token_len++] = c;
+}
+
+bool isatomchar(int c) {
+  return c != '\0' && (isalnum(c) || strchr("+-*/<=>!?_%&^~.", c) != NULL);
+}
+
+static void AST_set_span(ASTNode *node, size_t start, size_t end) {
+  node->span_start = start;
+  size_t length = end - start;
+  node->span_length = length > UINT32_MAX ? UINT32_MAX : length;
+}
+
+// Read the atom or number that starts at the current character.
+static ReadResult Reader_read_token(Reader *reader, ASTNode **result) {
+  size_t start = Reader_pos(reader);
+  reader->token_len = 0;
+  int c;
+  while ((c = Reader_peek(reader)) != EOF && isatomchar(c)) {
+    Reader_token_push(reader, c);
+    Reader_advance(reader);
+  }
+  char *token = reader->token;
+  size_t len = reader->token_len;
+  bool negative = len > 1 && token[0] == '-' && isdigit(token[1]);
+  if (isdigit(token[0]) || negative) {
+    int64_t value = 0;
+    int64_t limit = negative ? -(int64_t)kFixnumMin : kFixnumMax;
+    for (size_t i = negative ? 1 : 0; i < len; i++) {
+      if (!isdigit(token[i])) {
+        return Reader_fail(reader, "malformed number", start);
+      }
+      value = value * 10 + (token[i] - '0');
+      if (value > limit) {
+        return Reader_fail(reader, "number too big", start);
+      }
+    }
+    *result = AST_new_fixnum(reader->arena, negative ? -value : value);
+  } else {
+    *result = AST_new_symbol(reader->arena, Symbol_intern_len(token, len));
+  }
+  AST_set_span(*result, start, Reader_pos(reader));
+  return kReadOk;
+}
+
+static void Reader_push_frame(Reader *reader, size_t start) {
+  if (reader->depth == reader->stack_cap) {
+    reader->stack_cap = reader->stack_cap == 0 ? 16 : reader->stack_cap * 2;
+    reader->stack =
+        realloc(reader->stack, reader->stack_cap * sizeof *reader->stack);
+    assert(reader->stack != NULL);
+  }
+  reader->stack[reader->depth++] =
+      (ReaderFrame){.head = nil, .tail = NULL, .start = start};
+}
+
+static void ReaderFrame_append(Reader *reader, ReaderFrame *frame,
+                               ASTNode *node) {
+  ASTNode *cell = AST_new_cons(reader->arena, node, nil);
+  if (frame->tail == NULL) {
+    frame->head = cell;
+  } else {
+    frame->tail->value.cons.cdr = cell;
+  }
+  frame->tail = cell;
+}
+
+static ReadResult Reader_next_form(Reader *reader, ASTNode **result) {
+  assert(reader->depth == 0);
+  for (;;) {
+    int c = Reader_peek(reader);
+    while (c != EOF && isspace(c)) {
+      Reader_advance(reader);
+      c = Reader_peek(reader);
+    }
+    if (c == ';') {
+      while (c != EOF && c != '\n') {
+        Reader_advance(reader);
+        c = Reader_peek(reader);
+      }
+      continue;
+    }
+    ASTNode *node = NULL;
+    if (c == EOF || c == '\0') {
+      if (reader->depth != 0) {
+        size_t start = reader->stack[reader->depth - 1].start;
+        reader->depth = 0;
+        return Reader_fail(reader, "unterminated list", start);
+      }
+      return kReadEof;
+    } else if (c == '(') {
+      Reader_push_frame(reader, Reader_pos(reader));
+      Reader_advance(reader);
+      continue;
+    } else if (c == ')') {
+      if (reader->depth == 0) {
+        return Reader_fail(reader, "unexpected `)'", Reader_pos(reader));
+      }
+      Reader_advance(reader);
+      ReaderFrame *frame = &reader->stack[--reader->depth];
+      node = frame->head;
+      if (node != nil) {
+        AST_set_span(node, frame->start, Reader_pos(reader));
+      }
+    } else if (isatomchar(c)) {
+      ReadResult read = Reader_read_token(reader, &node);
+      if (read != kReadOk) {
+        reader->depth = 0;
+        return read;
+      }
+    } else {
+      size_t pos = Reader_pos(reader);
+      reader->depth = 0;
+      return Reader_fail(reader, "unexpected character", pos);
+    }
+    if (reader->depth == 0) {
+      *result = node;
+      return kReadOk;
+    }
+    ReaderFrame_append(reader, &reader->stack[reader->depth - 1], node);
+  }
+}
+
+// Read the next top-level form into *result. Return kReadEof when the input
+// is exhausted and kReadError (with reader->error set) on malformed input.
+ReadResult Reader_next(Reader *reader, ASTNode **result) {
+  if (reader->stats == NULL) {
+    return Reader_next_form(reader, result);
+  }
+  uint64_t num_nodes = reader->arena->num_nodes;
+  uint64_t start = Stats_start(reader->stats);
+  ReadResult read = Reader_next_form(reader, result);
+  Stats_stop(reader->stats, kPhaseRead, start);
+  reader->stats->ast_nodes += reader->arena->num_nodes - num_nodes;
+  return read;
+}
+
+// Read the first form in `input', or return NULL if there isn't a well-formed
+// one. The returned tree is allocated in `arena'.
+ASTNode *Reader_read(Arena *arena, char *input) {
+  Reader reader;
+  Reader_init_cstr(&reader, arena, input);
+  ASTNode *result = NULL;
+  if (Reader_next(&reader, &result) != kReadOk) {
+    result = NULL;
+  }
+  Reader_deinit(&reader);
+  return result;
+}
+
+// End Reader
+
+// Compiler context
+
+// Optional code generation strategies, or'ed together into
+// CompilerContext.options. They all default to off, which gives the plain
+// stack-machine code that the byte-level tests pin down.
+typedef enum {
+  kOptNone = 0,
+  // Keep the values of the first few stack slots in registers.
+  kOptRegisters = 1 << 0,
+  // Compile through the linear IR (see the IR section), falling back to the
+  // direct emitter one function at a time.
+  kOptIR = 1 << 1,
+  // Fold constant subexpressions before generating code (see AST_fold).
+  kOptFold = 1 << 2,
+  // Allocate from a garbage-collected Heap (see the Heap section). The entry
+  // point then takes a Heap * instead of a bare heap pointer, and
+  // CompilerContext.stack_maps must be set.
+  kOptGC = 1 << 3,
+  // Compile the functions of a `labels' form on several threads and link them
+  // together afterwards (see AST_compile_labels_in_parallel).
+  kOptParallel = 1 << 4,
+  // Count entries to `code' bodies and arms of `if's (see the Profile
+  // section). CompilerContext.profile must be set. The counting code goes
+  // through the direct emitter, so this turns kOptIR off; and kOptParallel,
+  // since sites are added in order.
+  kOptProfile = 1 << 5,
+  // Replace calls to small functions by their bodies (see AST_inline).
+  kOptInline = 1 << 6,
+  // Trap with ud2 when fixnum arithmetic overflows (see AST_check_overflow).
+  // The IR doesn't check, so this turns kOptIR off.
+  kOptOverflow = 1 << 7,
+  // Tidy up the code as it is written (see the Peephole rules).
+  kOptPeephole = 1 << 8,
+} CompilerOption;
+
+// Where a `labels' form put each of its functions, for naming the code once it
+// leaves the process (see the ELF section).
+typedef struct {
+  Symbol *name;
+  Label label;
+} LabelSymbol;
+
+typedef struct {
+  LabelSymbol *entries;
+  int32_t num_entries;
+  int32_t capacity;
+  // Where the body of the `labels' form starts, which is also where the last
+  // function ends; -1 until it is compiled.
+  Label body;
+} LabelSymbols;
+
+void LabelSymbols_init(LabelSymbols *symbols) {
+  *symbols = (LabelSymbols){.body = -1};
+}
+
+void LabelSymbols_deinit(LabelSymbols *symbols) {
+  free(symbols->entries);
+  LabelSymbols_init(symbols);
+}
+
+void LabelSymbols_add(LabelSymbols *symbols, Symbol *name, Label label) {
+  if (symbols->num_entries == symbols->capacity) {
+    symbols->capacity = symbols->capacity == 0 ? 16 : symbols->capacity * 2;
+    symbols->entries = realloc(symbols->entries,
+                               symbols->capacity * sizeof *symbols->entries);
+    assert(symbols->entries != NULL);
+  }
+  symbols->entries[symbols->num_entries++] =
+      (LabelSymbol){.name = name, .label = label};
+}
+
+// A closure that AST_compile_let compiled as a function of its own, since
+// it is only ever called: a funcall of `name' is a labelcall of `label' with
+// the values of `free_vars' after the arguments.
+typedef struct KnownFunction {
+  Symbol *name;
+  Label label;
+  EnvNode *free_vars;
+  struct KnownFunction *next;
+} KnownFunction;
+
+// Does not include stack index because that is modified a lot when recursing
+// I may end up being annoyed about this for Env, too
+typedef struct {
+  BufferWriter *writer;
+  int options;
+  // Where the AST being compiled lives; passes that build new nodes allocate
+  // them here too.
+  Arena *arena;
+  EnvNode *labels;
+  EnvNode *locals;
+  // Inside a `lambda': its free variables, each with its index in the
+  // closure. Names not in `locals' are looked up here.
+  EnvNode *free_vars;
+  // The closures in scope that were compiled as functions instead.
+  KnownFunction *known;
+  // TODO: add formals separately from locals?
+  // Set while compiling an expression whose value the function returns (see
+  // AST_compile_tail_expr). Only `if', `let' and `labelcall' ever see it set;
+  // AST_compile_expr clears it for everything else.
+  bool tail;
+  // With kOptGC: where the stack maps for the code go.
+  StackMaps *stack_maps;
+  // The slots set aside for the return addresses of labelcalls whose
+  // arguments are still being evaluated. Until the call there is nothing in
+  // them for the collector to look at.
+  EnvNode *return_slots;
+  // Set inside an expression whose allocations were all covered by one heap
+  // check at its start (see AST_compile_reserving_heap).
+  bool heap_reserved;
+  // If set, AST_compile_labels records every label it binds here.
+  LabelSymbols *label_symbols;
+  // If set, AST_compile_prog and AST_compile_entry record what they do here.
+  Stats *stats;
+  // With kOptProfile: where the counters go. Otherwise, with kOptInline, the
+  // counts of an earlier run to decide what to inline by, if set.
+  Profile *profile;
+  // With kOptOverflow: the trap at the end of the function being compiled.
+  Label overflow;
+  // The routines the function being compiled calls, which go at its end.
+  Routines *routines;
+} CompilerContext;
+
+void CompilerContext_init(CompilerContext *ctx, BufferWriter *writer,
+                          Arena *arena, EnvNode *labels, EnvNode *locals) {
+  assert(ctx != NULL);
+  ctx->writer = writer;
+  ctx->options = kOptNone;
+  ctx->arena = arena;
+  ctx->labels = labels;
+  ctx->locals = locals;
+  ctx->free_vars = NULL;
+  ctx->known = NULL;
+  ctx->tail = false;
+  ctx->stack_maps = NULL;
+  ctx->return_slots = NULL;
+  ctx->heap_reserved = false;
+  ctx->label_symbols = NULL;
+  ctx->stats = NULL;
+  ctx->profile = NULL;
+  ctx->overflow = -1;
+  ctx->routines = NULL;
+}
+
+CompilerContext CompilerContext_with_labels(CompilerContext *ctx,
+                                            EnvNode *labels) {
+  CompilerContext result = *ctx;
+  result.labels = labels;
+  return result;
+}
+
+CompilerContext CompilerContext_with_locals(CompilerContext *ctx,
+                                            EnvNode *locals) {
+  CompilerContext result = *ctx;
+  result.locals = locals;
+  return result;
+}
+
+// End Compiler context
+
+// Primitives
+
+// Every primitive and special form is a Primitive registered under its
+// symbol's id, so AST_compile_call finds the code to emit with one array
+// index instead of comparing the operator against each name in turn. Embedders
+// can add their own with Primitive_register before compiling anything.
+
+typedef int (*PrimitiveCompiler)(CompilerContext *ctx, ASTNode *args,
+                                 int stack_index);
+
+// Predicates are compiled as tests instead: emit code that sets the flags and
+// store in *cond the condition under which the predicate holds. An `if' can
+// then branch on the flags directly; anywhere else the result is turned into a
+// boolean object.
+typedef int (*PrimitiveTestCompiler)(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index, Condition *cond);
+
+// Arity for forms that take a variable number of arguments and check them
+// themselves.
+static const int kVariadic = -1;
+
+typedef struct {
+  Symbol *name;
+  int arity;
+  // Exactly one of these is set.
+  PrimitiveCompiler compile;
+  PrimitiveTestCompiler compile_test;
+} Primitive;
+
+typedef struct {
+  // Indexed by symbol id. Entries with a NULL compile are unregistered.
+  Primitive *by_id;
+  size_t capacity;
+} PrimitiveTable;
+
+static PrimitiveTable primitive_table;
+static pthread_once_t primitive_table_once = PTHREAD_ONCE_INIT;
+
+static void Primitives_init();
+
+static Primitive *Primitive_slot(const char *name) {
+  Symbol *sym = Symbol_intern(name);
+  if (sym->id >= primitive_table.capacity) {
+    size_t capacity = primitive_table.capacity * 2;
+    while (capacity <= sym->id) {
+      capacity *= 2;
+    }
+    primitive_table.by_id =
+        realloc(primitive_table.by_id, capacity * sizeof(Primitive));
+    assert(primitive_table.by_id != NULL);
+    memset(primitive_table.by_id + primitive_table.capacity, 0,
+           (capacity - primitive_table.capacity) * sizeof(Primitive));
+    primitive_table.capacity = capacity;
+  }
+  Primitive *result = &primitive_table.by_id[sym->id];
+  *result = (Primitive){.name = sym};
+  return result;
+}
+
+// Primitives_init registers the builtins with these; everyone else goes
+// through Primitive_register, which sets the table up first.
+static void Primitive_add(const char *name, int arity,
+                          PrimitiveCompiler compile) {
+  Primitive *primitive = Primitive_slot(name);
+  primitive->arity = arity;
+  primitive->compile = compile;
+}
+
+static void Primitive_add_test(const char *name, int arity,
+                               PrimitiveTestCompiler compile_test) {
+  Primitive *primitive = Primitive_slot(name);
+  primitive->arity = arity;
+  primitive->compile_test = compile_test;
+}
+
+void Primitive_register(const char *name, int arity,
+                        PrimitiveCompiler compile) {
+  pthread_once(&primitive_table_once, Primitives_init);
+  Primitive_add(name, arity, compile);
+}
+
+void Primitive_register_test(const char *name, int arity,
+                             PrimitiveTestCompiler compile_test) {
+  pthread_once(&primitive_table_once, Primitives_init);
+  Primitive_add_test(name, arity, compile_test);
+}
+
+Primitive *Primitive_lookup(Symbol *name) {
+  pthread_once(&primitive_table_once, Primitives_init);
+  if (name->id >= primitive_table.capacity) {
+    return NULL;
+  }
+  Primitive *result = &primitive_table.by_id[name->id];
+  return result->name == NULL ? NULL : result;
+}
+
+// End Primitives
+
+// env is a map of variables to stack locations
+int AST_compile_expr(CompilerContext *ctx, ASTNode *node, int stack_index);
+int AST_compile_tail_expr(CompilerContext *ctx, ASTNode *node,
+                          int stack_index);
+bool IR_compile_function(CompilerContext *ctx, ASTNode *formals,
+                         ASTNode *body);
+
+ASTNode *operand1(ASTNode *args) { return AST_car(args); }
+ASTNode *operand2(ASTNode *args) { return AST_car(AST_cdr(args)); }
+ASTNode *operand3(ASTNode *args) { return AST_car(AST_cdr(AST_cdr(args))); }
+
+// Folding
+
+// With kOptFold, each function body is simplified before any code is
+// generated for it. Primitive calls whose operands are all literals are
+// evaluated at compile time, an `if' with a literal test is replaced by the arm
+// that would run, and names bound to literals by `let' are replaced by the
+// literals. The result is a new tree allocated in the arena; the input is left
+// alone, and subtrees that don't change are shared rather than copied.
+//
+// Folding only ever computes what the generated code would have computed, so
+// anything it isn't sure of -- fixnum results the runtime would wrap, forms
+// registered by embedders, malformed forms -- is left for code generation
+// (which also reports the errors).
+
+// What a name is bound to while folding: a literal, or NULL if its value is
+// only known at run time (which also hides any outer binding of the name).
+typedef struct FoldBinding {
+  Symbol *name;
+  ASTNode *value;
+  struct FoldBinding *next;
+} FoldBinding;
+
+static bool AST_is_literal(ASTNode *node) {
+  return node->type == kFixnum || node->type == kChar || node->type == kBool;
+}
+
+// Return true if `name' appears anywhere in `node'. Deliberately blind to
+// scoping, so it can only err towards keeping a binding.
+static bool AST_mentions(ASTNode *node, Symbol *name) {
+  while (node->type == kCons && node != nil) {
+    if (AST_mentions(AST_car(node), name)) {
+      return true;
+    }
+    node = AST_cdr(node);
+  }
+  return node->type == kAtom && node->value.atom == name;
+}
+
+static ASTNode *AST_with_span_of(ASTNode *node, ASTNode *original) {
+  node->span_start = original->span_start;
+  node->span_length = original->span_length;
+  return node;
+}
+
+static ASTNode *AST_fold_expr(Arena *arena, FoldBinding *env, ASTNode *node);
+
+// Fold each element of the list `exprs'. Return the list itself if none of
+// them changed.
+static ASTNode *AST_fold_list(Arena *arena, FoldBinding *env, ASTNode *exprs) {
+  if (exprs == nil || exprs->type != kCons) {
+    return exprs;
+  }
+  ASTNode *car = AST_fold_expr(arena, env, AST_car(exprs));
+  ASTNode *cdr = AST_fold_list(arena, env, AST_cdr(exprs));
+  if (car == AST_car(exprs) && cdr == AST_cdr(exprs)) {
+    return exprs;
+  }
+  return AST_with_span_of(AST_new_cons(arena, car, cdr), exprs);
+}
+
+static ASTNode *AST_fold_fixnum(Arena *arena, ASTNode *original,
+                                int64_t value) {
+  if (value < kFixnumMin || value > kFixnumMax) {
+    return original;
+  }
+  return AST_with_span_of(AST_new_fixnum(arena, value), original);
+}
+
+// `call' is a call to the binary primitive `op' on the fixnums a and b.
+static ASTNode *AST_fold_binary(Arena *arena, ASTNode *call, uint32_t op,
+                                int64_t a, int64_t b) {
+  switch ((BuiltinSymbol)op) {
+  case kSymPlus:
+    return AST_fold_fixnum(arena, call, a + b);
+  case kSymMinus:
+    return AST_fold_fixnum(arena, call, a - b);
+  case kSymTimes:
+    return AST_fold_fixnum(arena, call, a * b);
+  case kSymQuotient:
+    // C division truncates too, like idiv. Division by zero is the code's to
+    // trap.
+    return b == 0 ? call : AST_fold_fixnum(arena, call, a / b);
+  case kSymRemainder:
+    return b == 0 ? call : AST_fold_fixnum(arena, call, a % b);
+  case kSymLogand:
+    return AST_fold_fixnum(arena, call, a & b);
+  case kSymLogor:
+    return AST_fold_fixnum(arena, call, a | b);
+  default:
+    return call;
+  }
+}
+
+// Whether the comparison `op' holds for the fixnums a and b.
+static bool AST_fold_compare(uint32_t op, int64_t a, int64_t b) {
+  switch ((BuiltinSymbol)op) {
+  case kSymNumEqual:
+    return a == b;
+  case kSymLess:
+    return a < b;
+  default:
+    assert(op == kSymLessEqual);
+    return a <= b;
+  }
+}
+
+// `call' is a call to a pure primitive with its arguments already folded.
+static ASTNode *AST_fold_primcall(Arena *arena, ASTNode *call) {
+  Symbol *name = AST_car(call)->value.atom;
+  ASTNode *args = AST_cdr(call);
+  for (ASTNode *arg = args; arg != nil; arg = AST_cdr(arg)) {
+    if (!AST_is_literal(AST_car(arg))) {
+      return call;
+    }
+  }
+  ASTNode *x = operand1(args);
+  switch ((BuiltinSymbol)name->id) {
+  case kSymAdd1:
+    if (x->type == kFixnum) {
+      return AST_fold_fixnum(arena, call, (int64_t)x->value.fixnum + 1);
+    }
+    break;
+  case kSymSub1:
+    if (x->type == kFixnum) {
+      return AST_fold_fixnum(arena, call, (int64_t)x->value.fixnum - 1);
+    }
+    break;
+  case kSymPlus:
+  case kSymMinus:
+  case kSymTimes:
+  case kSymQuotient:
+  case kSymRemainder:
+  case kSymLogand:
+  case kSymLogor:
+    if (x->type == kFixnum && operand2(args)->type == kFixnum) {
+      return AST_fold_binary(arena, call, name->id, x->value.fixnum,
+                             operand2(args)->value.fixnum);
+    }
+    break;
+  case kSymNumEqual:
+  case kSymLess:
+  case kSymLessEqual:
+    // Non-fixnums are compared by their encodings, which the folder leaves
+    // to the code.
+    if (x->type == kFixnum && operand2(args)->type == kFixnum) {
+      bool holds = AST_fold_compare(name->id, x->value.fixnum,
+                                    operand2(args)->value.fixnum);
+      return AST_with_span_of(AST_new_bool(arena, holds), call);
+    }
+    break;
+  case kSymIntegerToChar:
+    // Only ASCII: encodeImmediateChar sign-extends.
+    if (x->type == kFixnum && x->value.fixnum >= 0 && x->value.fixnum < 128) {
+      return AST_with_span_of(AST_new_char(arena, x->value.fixnum), call);
+    }
+    break;
+  case kSymZerop:
+    // Chars and bools are never zero: they carry a non-zero tag.
+    return AST_with_span_of(
+        AST_new_bool(arena, x->type == kFixnum && x->value.fixnum == 0), call);
+  default:
+    break;
+  }
+  return call;
+}
+
+static ASTNode *AST_fold_let(Arena *arena, FoldBinding *env, ASTNode *let) {
+  ASTNode *bindings = operand1(AST_cdr(let));
+  ASTNode *body = operand2(AST_cdr(let));
+  int num_bindings = 0;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b)) {
+    if (b->type != kCons) {
+      return let;
+    }
+    ASTNode *binding = AST_car(b);
+    if (binding->type != kCons || binding == nil ||
+        AST_list_length(binding) != 2 || !AST_is_atom(AST_car(binding))) {
+      return let;
+    }
+    num_bindings++;
+  }
+  // Bindings are sequential, like AST_compile_let: each one sees the ones
+  // before it.
+  FoldBinding *scopes = malloc((num_bindings + 1) * sizeof *scopes);
+  ASTNode **values = malloc((num_bindings + 1) * sizeof *values);
+  assert(scopes != NULL && values != NULL);
+  bool changed = false;
+  int i = 0;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b), i++) {
+    ASTNode *binding = AST_car(b);
+    values[i] = AST_fold_expr(arena, env, operand2(binding));
+    changed |= values[i] != operand2(binding);
+    scopes[i] = (FoldBinding){
+        .name = AST_car(binding)->value.atom,
+        .value = AST_is_literal(values[i]) ? values[i] : NULL,
+        .next = env};
+    env = &scopes[i];
+  }
+  ASTNode *result = AST_fold_expr(arena, env, body);
+  changed |= result != body;
+  // Rebuild the bindings from the last one back, so that we know what is
+  // still mentioned after each of them. A literal binding is only dropped if
+  // nothing mentions it any more; anything the folder couldn't see into (an
+  // embedder's form, say) keeps it alive.
+  ASTNode *kept = nil;
+  for (i = num_bindings - 1; i >= 0; i--) {
+    Symbol *name = scopes[i].name;
+    if (scopes[i].value != NULL && !AST_mentions(result, name) &&
+        !AST_mentions(kept, name)) {
+      changed = true;
+      continue;
+    }
+    ASTNode *binding = AST_new_cons(arena, AST_new_symbol(arena, name),
+                                    AST_new_cons(arena, values[i], nil));
+    kept = AST_new_cons(arena, binding, kept);
+  }
+  free(values);
+  free(scopes);
+  if (!changed) {
+    return let;
+  }
+  if (kept == nil) {
+    return result;
+  }
+  ASTNode *rest = AST_new_cons(arena, kept, AST_new_cons(arena, result, nil));
+  return AST_with_span_of(AST_new_cons(arena, AST_car(let), rest), let);
+}
+
+static ASTNode *AST_fold_call(Arena *arena, FoldBinding *env, ASTNode *call) {
+  ASTNode *fnexpr = AST_car(call);
+  ASTNode *args = AST_cdr(call);
+  if (!AST_is_atom(fnexpr)) {
+    return call;
+  }
+  Symbol *name = fnexpr->value.atom;
+  Primitive *primitive = Primitive_lookup(name);
+  if (primitive == NULL || name->id >= kNumBuiltinSymbols) {
+    // Embedders' forms are opaque: we don't know which of their arguments are
+    // expressions.
+    return call;
+  }
+  if (primitive->arity != kVariadic &&
+      AST_list_length(args) != primitive->arity) {
+    return call;
+  }
+  switch ((BuiltinSymbol)name->id) {
+  case kSymAdd1:
+  case kSymSub1:
+  case kSymIntegerToChar:
+  case kSymZerop:
+  case kSymPlus:
+  case kSymMinus:
+  case kSymTimes:
+  case kSymQuotient:
+  case kSymRemainder:
+  case kSymLogand:
+  case kSymLogor:
+  case kSymNumEqual:
+  case kSymLess:
+  case kSymLessEqual:
+  case kSymCar:
+  case kSymCdr:
+  case kSymCons:
+  case kSymMakeVector:
+  case kSymVectorRef:
+  case kSymVectorSet:
+  case kSymVectorLength:
+  case kSymVectorFill:
+  case kSymVectorCopy:
+  case kSymMakeString:
+  case kSymStringRef:
+  case kSymStringSet:
+  case kSymStringLength:
+  case kSymStringFill:
+  case kSymStringEqual:
+  case kSymStringLess:
+  case kSymFuncall: {
+    ASTNode *folded_args = AST_fold_list(arena, env, args);
+    if (folded_args != args) {
+      call = AST_with_span_of(AST_new_cons(arena, fnexpr, folded_args), call);
+    }
+    return AST_fold_primcall(arena, call);
+  }
+  case kSymIf: {
+    ASTNode *test = AST_fold_expr(arena, env, operand1(args));
+    if (AST_is_literal(test)) {
+      // Only #f is false.
+      bool taken = !(test->type == kBool && !test->value.boolean);
+      return AST_fold_expr(arena, env,
+                           taken ? operand2(args) : operand3(args));
+    }
+    ASTNode *folded_args = AST_fold_list(arena, env, AST_cdr(args));
+    if (test == operand1(args) && folded_args == AST_cdr(args)) {
+      return call;
+    }
+    return AST_with_span_of(
+        AST_new_cons(arena, fnexpr, AST_new_cons(arena, test, folded_args)),
+        call);
+  }
+  case kSymLet:
+    return AST_fold_let(arena, env, call);
+  case kSymLabelcall: {
+    if (args == nil) {
+      return call;
+    }
+    ASTNode *folded_args = AST_fold_list(arena, env, AST_cdr(args));
+    if (folded_args == AST_cdr(args)) {
+      return call;
+    }
+    return AST_with_span_of(
+        AST_new_cons(arena, fnexpr,
+                     AST_new_cons(arena, AST_car(args), folded_args)),
+        call);
+  }
+  default:
+    // `code' bodies are folded when they are compiled.
+    return call;
+  }
+}
+
+static ASTNode *AST_fold_expr(Arena *arena, FoldBinding *env, ASTNode *node) {
+  switch (node->type) {
+  case kFixnum:
+  case kChar:
+  case kBool:
+    return node;
+  case kAtom:
+    for (; env != NULL; env = env->next) {
+      if (env->name == node->value.atom) {
+        if (env->value == NULL) {
+          return node;
+        }
+        ASTNode *copy = AST_alloc(arena);
+        *copy = *env->value;
+        return AST_with_span_of(copy, node);
+      }
+    }
+    return node;
+  case kCons:
+    if (node == nil) {
+      return node;
+    }
+    return AST_fold_call(arena, env, node);
+  }
+  return node;
+}
+
+// Fold the body of a function. Formals don't need to be passed in: function
+// bodies are folded starting from an empty environment, so no outer constant
+// can be mistaken for a formal.
+ASTNode *AST_fold(CompilerContext *ctx, ASTNode *node) {
+  return AST_fold_expr(ctx->arena, /*env=*/NULL, node);
+}
+
+// End Folding
+
+// Inlining
+
+// With kOptInline, a labelcall to a small function that doesn't call itself
+// is replaced by the function's body, with a `let' binding the formals to the
+// arguments:
+//
+//   (labels ((inc (code (x) (add1 x)))) (labelcall inc 5))
+//   => (labels ((inc (code (x) (add1 x)))) (let ((x 5)) (add1 x)))
+//
+// That saves the call, the argument stores and the reloads, and with kOptFold
+// the body then folds against constant arguments. The functions are still
+// compiled, for the calls that weren't inlined.
+//
+// A function can only call itself and the ones before it, so the functions
+// are visited in order, and the body that goes in at a call site already has
+// the calls in it inlined. A body is only inlined if it is at most
+// kInlineBudget nodes, calls nothing by its own name, and refers to nothing
+// but its formals and what it binds itself, so that it means the same at the
+// call site. If CompilerContext.profile holds the counts of an earlier
+// kOptProfile run, functions that never ran are left alone, and ones entered
+// at least kInlineHotCount times get kInlineHotBudget nodes instead.
+//
+// Like AST_fold, this builds new nodes in the arena and leaves the input
+// alone; anything it isn't sure of is left for code generation. That includes
+// programs that bind a name twice, where a body moved to a call site could
+// end up calling a different function by the same name.
+
+static const int32_t kInlineBudget = 16;      // nodes
+static const int32_t kInlineHotBudget = 64;   // nodes
+static const uint64_t kInlineHotCount = 1000; // calls
+
+typedef struct {
+  Symbol *name;
+  ASTNode *formals;
+  // The body with the calls in it inlined, or NULL if it isn't inlined.
+  ASTNode *body;
+} InlineFunction;
+
+typedef struct {
+  Arena *arena;
+  // The functions visible where the inliner is, the most recent last.
+  InlineFunction *functions;
+  int32_t num_functions;
+  // Counts to go by, or NULL.
+  const Profile *profile;
+} Inliner;
+
+// The number of nodes in `node', or more than `limit' if it has more.
+static int32_t AST_size(ASTNode *node, int32_t limit) {
+  int32_t size = 1;
+  for (; node->type == kCons && node != nil && size <= limit;
+       node = AST_cdr(node)) {
+    size += AST_size(AST_car(node), limit - size);
+  }
+  return size;
+}
+
+// Return true if `node' contains a labelcall to `label'. Blind to scoping,
+// like AST_mentions.
+static bool AST_calls(ASTNode *node, Symbol *label) {
+  if (node->type != kCons || node == nil) {
+    return false;
+  }
+  if (AST_is_atom(AST_car(node)) &&
+      AST_atom_is_builtin(AST_car(node), kSymLabelcall) &&
+      AST_cdr(node) != nil && AST_is_atom(operand1(AST_cdr(node))) &&
+      operand1(AST_cdr(node))->value.atom == label) {
+    return true;
+  }
+  for (; node->type == kCons && node != nil; node = AST_cdr(node)) {
+    if (AST_calls(AST_car(node), label)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return true if `binding' is a well-formed `let' binding: (name expr).
+static bool AST_is_let_binding(ASTNode *binding) {
+  return binding->type == kCons && binding != nil &&
+         AST_list_length(binding) == 2 && AST_is_atom(AST_car(binding));
+}
+
+static bool AST_is_closed(ASTNode *node, EnvNode *bound);
+
+// The `let' case of AST_is_closed: each binding sees the ones before it.
+static bool AST_let_is_closed(ASTNode *bindings, ASTNode *body,
+                              EnvNode *bound) {
+  if (bindings == nil) {
+    return AST_is_closed(body, bound);
+  }
+  if (bindings->type != kCons || !AST_is_let_binding(AST_car(bindings)) ||
+      !AST_is_closed(operand2(AST_car(bindings)), bound)) {
+    return false;
+  }
+  EnvNode node = Env_init(AST_car(AST_car(bindings))->value.atom,
+                          /*stack_index=*/0, bound);
+  return AST_let_is_closed(AST_cdr(bindings), body, &node);
+}
+
+// Return true if `node' is an expression made of builtin forms that refers to
+// no variables but the ones in `bound' and the ones it binds itself.
+static bool AST_is_closed(ASTNode *node, EnvNode *bound) {
+  int32_t unused;
+  switch (node->type) {
+  case kFixnum:
+  case kChar:
+  case kBool:
+    return true;
+  case kAtom:
+    return Env_lookup(bound, node->value.atom, &unused);
+  case kCons:
+    break;
+  }
+  if (node == nil || !AST_is_atom(AST_car(node))) {
+    return false;
+  }
+  Symbol *name = AST_car(node)->value.atom;
+  Primitive *primitive = Primitive_lookup(name);
+  ASTNode *args = AST_cdr(node);
+  if (primitive == NULL || name->id >= kNumBuiltinSymbols ||
+      (primitive->arity != kVariadic &&
+       AST_list_length(args) != primitive->arity)) {
+    return false;
+  }
+  switch ((BuiltinSymbol)name->id) {
+  case kSymLet:
+    return AST_let_is_closed(operand1(args), operand2(args), bound);
+  case kSymLabelcall:
+    if (args == nil || !AST_is_atom(operand1(args))) {
+      return false;
+    }
+    args = AST_cdr(args);
+    break;
+  case kSymLambda:
+  case kSymCode:
+  case kSymLabels:
+    return false;
+  default:
+    break;
+  }
+  for (; args != nil; args = AST_cdr(args)) {
+    if (args->type != kCons || !AST_is_closed(AST_car(args), bound)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return true if `formals' is a list of distinct atoms, and bind them in
+// `nodes', which has room for all of them, on top of `bound'. Store the
+// innermost in *result.
+static bool AST_bind_formals(ASTNode *formals, EnvNode *nodes,
+                             EnvNode **result) {
+  EnvNode *bound = NULL;
+  int32_t unused;
+  for (int32_t i = 0; formals != nil; formals = AST_cdr(formals), i++) {
+    if (formals->type != kCons || !AST_is_atom(AST_car(formals)) ||
+        Env_lookup(bound, AST_car(formals)->value.atom, &unused)) {
+      return false;
+    }
+    nodes[i] = Env_init(AST_car(formals)->value.atom, i, bound);
+    bound = &nodes[i];
+  }
+  *result = bound;
+  return true;
+}
+
+// Decide whether `fn' is to be inlined, and clear its body if not.
+static void Inliner_consider(Inliner *inliner, InlineFunction *fn) {
+  int32_t budget = kInlineBudget;
+  if (inliner->profile != NULL) {
+    uint64_t count = Profile_entry_count(inliner->profile, fn->name);
+    if (count == 0) {
+      fn->body = NULL;
+      return;
+    }
+    if (count >= kInlineHotCount) {
+      budget = kInlineHotBudget;
+    }
+  }
+  if (AST_size(fn->body, budget) > budget || AST_calls(fn->body, fn->name)) {
+    fn->body = NULL;
+    return;
+  }
+  int32_t num_formals = AST_list_length(fn->formals);
+  EnvNode *nodes = malloc((num_formals + 1) * sizeof *nodes);
+  assert(nodes != NULL);
+  EnvNode *bound;
+  if (!AST_bind_formals(fn->formals, nodes, &bound) ||
+      !AST_is_closed(fn->body, bound)) {
+    fn->body = NULL;
+  }
+  free(nodes);
+}
+
+static ASTNode *Inliner_expr(Inliner *inliner, ASTNode *node);
+
+// Inline into each element of the list `exprs'. Return the list itself if
+// none of them changed.
+static ASTNode *Inliner_list(Inliner *inliner, ASTNode *exprs) {
+  if (exprs == nil || exprs->type != kCons) {
+    return exprs;
+  }
+  ASTNode *car = Inliner_expr(inliner, AST_car(exprs));
+  ASTNode *cdr = Inliner_list(inliner, AST_cdr(exprs));
+  if (car == AST_car(exprs) && cdr == AST_cdr(exprs)) {
+    return exprs;
+  }
+  return AST_with_span_of(AST_new_cons(inliner->arena, car, cdr), exprs);
+}
+
+// (let ((names[0] values[0]) ...) body), with the span of `original'.
+static ASTNode *AST_new_let(Arena *arena, Symbol **names, ASTNode **values,
+                            int32_t num_bindings, ASTNode *body,
+                            ASTNode *original) {
+  ASTNode *bindings = nil;
+  for (int32_t i = num_bindings - 1; i >= 0; i--) {
+    ASTNode *binding = AST_new_cons(arena, AST_new_symbol(arena, names[i]),
+                                    AST_new_cons(arena, values[i], nil));
+    bindings = AST_new_cons(arena, binding, bindings);
+  }
+  return AST_with_span_of(
+      AST_new_cons(arena, AST_new_symbol(arena, Symbol_builtin(kSymLet)),
+                   AST_new_cons(arena, bindings,
+                                AST_new_cons(arena, body, nil))),
+      original);
+}
+
+// The name of the temporary for argument `i'. The reader doesn't make atoms
+// with a `#' in them, so no argument can refer to one.
+static Symbol *Inliner_temporary(int32_t i) {
+  char name[32];
+  snprintf(name, sizeof name, "#arg%d", (int)i);
+  return Symbol_intern(name);
+}
+
+// The body of `fn' in place of `call', a call to it with `args' (already
+// inlined into).
+static ASTNode *Inliner_expand(Inliner *inliner, InlineFunction *fn,
+                               ASTNode *args, ASTNode *call) {
+  if (fn->formals == nil) {
+    return fn->body;
+  }
+  // `let' binds one name at a time, so if an argument mentions a formal bound
+  // before it, that formal would capture it: evaluate all of the arguments
+  // into temporaries first.
+  bool needs_temporaries = false;
+  ASTNode *later = AST_cdr(args);
+  for (ASTNode *f = fn->formals; f != nil && later != nil;
+       f = AST_cdr(f), later = AST_cdr(later)) {
+    needs_temporaries =
+        needs_temporaries || AST_mentions(later, AST_car(f)->value.atom);
+  }
+  int32_t num_formals = AST_list_length(fn->formals);
+  Symbol **names = malloc(2 * num_formals * sizeof *names);
+  ASTNode **values = malloc(2 * num_formals * sizeof *values);
+  assert(names != NULL && values != NULL);
+  // The temporaries, if any, and then the formals.
+  ASTNode *f = fn->formals;
+  ASTNode *a = args;
+  for (int32_t i = 0; i < num_formals; i++) {
+    names[i] = Inliner_temporary(i);
+    values[i] = AST_car(a);
+    names[num_formals + i] = AST_car(f)->value.atom;
+    values[num_formals + i] =
+        needs_temporaries ? AST_new_symbol(inliner->arena, names[i])
+                          : AST_car(a);
+    f = AST_cdr(f);
+    a = AST_cdr(a);
+  }
+  int32_t first = needs_temporaries ? 0 : num_formals;
+  ASTNode *result =
+      AST_new_let(inliner->arena, names + first, values + first,
+                  2 * num_formals - first, fn->body, call);
+  free(names);
+  free(values);
+  return result;
+}
+
+// The function `name' refers to where the inliner is, or NULL.
+static InlineFunction *Inliner_lookup(Inliner *inliner, Symbol *name) {
+  for (int32_t i = inliner->num_functions - 1; i >= 0; i--) {
+    if (inliner->functions[i].name == name) {
+      return &inliner->functions[i];
+    }
+  }
+  return NULL;
+}
+
+static ASTNode *Inliner_labelcall(Inliner *inliner, ASTNode *call) {
+  ASTNode *args = AST_cdr(call);
+  if (args == nil || !AST_is_atom(operand1(args))) {
+    return call;
+  }
+  ASTNode *call_args = Inliner_list(inliner, AST_cdr(args));
+  InlineFunction *fn = Inliner_lookup(inliner, operand1(args)->value.atom);
+  if (fn != NULL && fn->body != NULL &&
+      AST_list_length(call_args) == AST_list_length(fn->formals)) {
+    return Inliner_expand(inliner, fn, call_args, call);
+  }
+  if (call_args == AST_cdr(args)) {
+    return call;
+  }
+  return AST_with_span_of(
+      AST_new_cons(inliner->arena, AST_car(call),
+                   AST_new_cons(inliner->arena, operand1(args), call_args)),
+      call);
+}
+
+static ASTNode *Inliner_let(Inliner *inliner, ASTNode *let) {
+  ASTNode *bindings = operand1(AST_cdr(let));
+  ASTNode *body = operand2(AST_cdr(let));
+  int32_t num_bindings = 0;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b), num_bindings++) {
+    if (b->type != kCons || !AST_is_let_binding(AST_car(b))) {
+      return let;
+    }
+  }
+  Symbol **names = malloc((num_bindings + 1) * sizeof *names);
+  ASTNode **values = malloc((num_bindings + 1) * sizeof *values);
+  assert(names != NULL && values != NULL);
+  ASTNode *new_body = Inliner_expr(inliner, body);
+  bool changed = new_body != body;
+  int32_t i = 0;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b), i++) {
+    names[i] = AST_car(AST_car(b))->value.atom;
+    values[i] = Inliner_expr(inliner, operand2(AST_car(b)));
+    changed = changed || values[i] != operand2(AST_car(b));
+  }
+  ASTNode *result =
+      changed ? AST_new_let(inliner->arena, names, values, num_bindings,
+                            new_body, let)
+              : let;
+  free(names);
+  free(values);
+  return result;
+}
+
+static ASTNode *Inliner_expr(Inliner *inliner, ASTNode *node) {
+  if (node->type != kCons || node == nil || !AST_is_atom(AST_car(node))) {
+    return node;
+  }
+  Symbol *name = AST_car(node)->value.atom;
+  if (name->id >= kNumBuiltinSymbols || Primitive_lookup(name) == NULL) {
+    // Embedders' forms are opaque, as for folding.
+    return node;
+  }
+  ASTNode *args = AST_cdr(node);
+  switch ((BuiltinSymbol)name->id) {
+  case kSymLabelcall:
+    return Inliner_labelcall(inliner, node);
+  case kSymLet:
+    return AST_list_length(args) == 2 ? Inliner_let(inliner, node) : node;
+  case kSymCode:
+  case kSymLabels:
+    return node;
+  default: {
+    ASTNode *new_args = Inliner_list(inliner, args);
+    if (new_args == args) {
+      return node;
+    }
+    return AST_with_span_of(
+        AST_new_cons(inliner->arena, AST_car(node), new_args), node);
+  }
+  }
+}
+
+// Inline calls in the `labels' form `prog', if it is well-formed, and return
+// the result.
+ASTNode *AST_inline(CompilerContext *ctx, ASTNode *prog) {
+  ASTNode *args = AST_cdr(prog);
+  if (args == nil || AST_list_length(args) != 2) {
+    return prog;
+  }
+  ASTNode *bindings = operand1(args);
+  int32_t num_functions = 0;
+  bool *bound = calloc(Symbol_count(), sizeof *bound);
+  assert(bound != NULL);
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b), num_functions++) {
+    ASTNode *binding = b->type == kCons ? AST_car(b) : nil;
+    ASTNode *code = AST_is_let_binding(binding) ? operand2(binding) : nil;
+    if (code->type != kCons || code == nil ||
+        !AST_atom_is_builtin(AST_car(code), kSymCode) ||
+        AST_list_length(AST_cdr(code)) != 2 ||
+        bound[AST_car(binding)->value.atom->id]) {
+      free(bound);
+      return prog;
+    }
+    bound[AST_car(binding)->value.atom->id] = true;
+  }
+  free(bound);
+  Inliner inliner = {
+      .arena = ctx->arena,
+      .functions = malloc((num_functions + 1) * sizeof(InlineFunction)),
+      .profile = (ctx->options & kOptProfile) ? NULL : ctx->profile};
+  assert(inliner.functions != NULL);
+  ASTNode **codes = malloc((num_functions + 1) * sizeof *codes);
+  assert(codes != NULL);
+  bool changed = false;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b)) {
+    ASTNode *code = operand2(AST_car(b));
+    ASTNode *body = operand2(AST_cdr(code));
+    // Until it has been looked at, calls to the function from inside it
+    // find it and are left alone.
+    InlineFunction *fn = &inliner.functions[inliner.num_functions];
+    *fn = (InlineFunction){.name = AST_car(AST_car(b))->value.atom,
+                           .formals = operand1(AST_cdr(code)),
+                           .body = NULL};
+    inliner.num_functions++;
+    ASTNode *new_body = Inliner_expr(&inliner, body);
+    codes[inliner.num_functions - 1] = code;
+    if (new_body != body) {
+      changed = true;
+      codes[inliner.num_functions - 1] = AST_with_span_of(
+          AST_new_cons(ctx->arena, AST_car(code),
+                       AST_new_cons(ctx->arena, fn->formals,
+                                    AST_new_cons(ctx->arena, new_body, nil))),
+          code);
+    }
+    fn->body = new_body;
+    Inliner_consider(&inliner, fn);
+  }
+  ASTNode *body = operand2(args);
+  ASTNode *new_body = Inliner_expr(&inliner, body);
+  ASTNode *result = prog;
+  if (changed || new_body != body) {
+    ASTNode *new_bindings = nil;
+    int32_t i = num_functions;
+    while (i-- > 0) {
+      ASTNode *binding = AST_new_cons(
+          ctx->arena, AST_new_symbol(ctx->arena, inliner.functions[i].name),
+          AST_new_cons(ctx->arena, codes[i], nil));
+      new_bindings = AST_new_cons(ctx->arena, binding, new_bindings);
+    }
+    result = AST_with_span_of(
+        AST_new_cons(ctx->arena, AST_car(prog),
+                     AST_new_cons(ctx->arena, new_bindings,
+                                  AST_new_cons(ctx->arena, new_body, nil))),
+        prog);
+  }
+  free(codes);
+  free(inliner.functions);
+  return result;
+}
+
+// End Inlining
+
+// Env_lookup, counting the entries it looks at in ctx->stats if that is set.
+static bool AST_lookup(CompilerContext *ctx, EnvNode *env, Symbol *name,
+                       int32_t *stack_index) {
+  if (ctx->stats != NULL) {
+    for (EnvNode *node = env; node != NULL; node = node->next) {
+      ctx->stats->env_hops++;
+      if (node->name == name) {
+        break;
+      }
+    }
+  }
+  return Env_lookup(env, name, stack_index);
+}
+
+// Add a site to ctx->profile, for kOptProfile. Return its first counter, or
+// -1 if there is no room (or no profile).
+static int32_t AST_add_profile_site(CompilerContext *ctx, ProfileSiteKind kind,
+                                    Symbol *label, size_t span_start,
+                                    int32_t num_counters) {
+  if (ctx->profile == NULL) {
+    fprintf(stderr, "kOptProfile needs a Profile\n");
+    return -1;
+  }
+  return Profile_add_site(ctx->profile, kind, label, span_start,
+                          num_counters);
+}
+
+// Count one more run of the code here in ctx->profile's `counter', unless
+// that is -1. This clobbers rax and the flags, so it only goes where neither
+// holds anything yet: the start of a `code' body or of an arm of an `if'.
+static void AST_emit_count(CompilerContext *ctx, int32_t counter) {
+  if (counter < 0) {
+    return;
+  }
+  Buffer_mov_reg_imm64(ctx->writer, kRax,
+                       (uintptr_t)&ctx->profile->counters[counter]);
+  Buffer_inc_mem_reg(ctx->writer, kRax);
+}
+
+// BufferWriter_relax, counting the fixups it fills in in ctx->stats if that
+// is set.
+static void AST_relax(CompilerContext *ctx) {
+  if (ctx->stats != NULL) {
+    ctx->stats->branches_patched += ctx->writer->num_fixups;
+  }
+  BufferWriter_relax(ctx->writer);
+}
+
+// Every value the code generator needs to keep around -- a let binding, a
+// formal, the second operand of `+', a labelcall argument -- gets a slot in the
+// current frame, named by its stack_index. With kOptRegisters, the first
+// kNumSlotRegisters slots ([rsp-8], [rsp-16], ...) live in registers instead,
+// and the stack slot is only their home for when they have to be saved.
+//
+// Slots are handed out in strict stack order, so each value's lifetime nests
+// inside those of the slots above it. Giving the registers to the outermost
+// slots therefore never needs a move to keep a value in the same place, and
+// the values that spill under pressure are the most deeply nested ones.
+//
+// rax holds the result of every expression and rsi is the heap pointer, so the
+// pool is the rest of the caller-saved registers. Being caller-saved, the live
+// ones are saved to their homes around each labelcall; arguments go out
+// through their homes too, and the callee loads its formals from there into
+// the same registers.
+static const Register kSlotRegisters[] = {kRcx, kRdx, kRdi};
+static const int kNumSlotRegisters =
+    sizeof kSlotRegisters / sizeof kSlotRegisters[0];
+
+// Return true and store the register in *reg if the slot at stack_index is
+// kept in a register.
+static bool AST_slot_register(CompilerContext *ctx, int stack_index,
+                              Register *reg) {
+  if (!(ctx->options & kOptRegisters)) {
+    return false;
+  }
+  int slot = -stack_index / kWordSize - 1;
+  assert(slot >= 0 && "slots are below the return address");
+  if (slot >= kNumSlotRegisters) {
+    return false;
+  }
+  *reg = kSlotRegisters[slot];
+  return true;
+}
+
+// Move rax into the slot at stack_index.
+static void AST_store_slot(CompilerContext *ctx, int stack_index) {
+  Register reg;
+  if (AST_slot_register(ctx, stack_index, &reg)) {
+    Buffer_mov_reg_reg(ctx->writer, /*dst=*/reg, /*src=*/kRax);
+    return;
+  }
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, stack_index);
+}
+
+// Move the slot at stack_index into rax.
+static void AST_load_slot(CompilerContext *ctx, int stack_index) {
+  Register reg;
+  if (AST_slot_register(ctx, stack_index, &reg)) {
+    Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/reg);
+    return;
+  }
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, stack_index);
+}
+
+// Add the slot at stack_index to rax.
+static void AST_add_slot(CompilerContext *ctx, int stack_index) {
+  Register reg;
+  if (AST_slot_register(ctx, stack_index, &reg)) {
+    Buffer_add_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/reg);
+    return;
+  }
+  Buffer_add_reg_stack(ctx->writer, kRax, stack_index);
+}
+
+// Copy the register slots in [from, to) -- from is the higher stack_index --
+// out to their homes on the stack.
+static void AST_spill_slots(CompilerContext *ctx, int from, int to) {
+  Register reg;
+  for (int index = from; index > to; index -= kWordSize) {
+    if (AST_slot_register(ctx, index, &reg)) {
+      Buffer_mov_reg_to_stack(ctx->writer, reg, index);
+    }
+  }
+}
+
+// The reverse of AST_spill_slots.
+static void AST_reload_slots(CompilerContext *ctx, int from, int to) {
+  Register reg;
+  for (int index = from; index > to; index -= kWordSize) {
+    if (AST_slot_register(ctx, index, &reg)) {
+      Buffer_mov_stack_to_reg(ctx->writer, reg, index);
+    }
+  }
+}
+
+// With kOptGC, each call records which slots of the frame are live. Since
+// every slot is filled before anything is compiled below it, that is all of
+// the slots above the call's stack_index -- apart from the ones labelcalls
+// have set aside for their return addresses.
+static bool AST_is_return_slot(CompilerContext *ctx, int stack_index) {
+  for (EnvNode *node = ctx->return_slots; node != NULL; node = node->next) {
+    if (node->stack_index == stack_index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Mark the live slots above stack_index in stack map `entry'. The ones kept in
+// registers are marked as registers instead, unless they have been spilled to
+// their homes for the call.
+static void AST_mark_live_slots(CompilerContext *ctx, int32_t entry,
+                                int stack_index, bool spilled) {
+  for (int index = -kWordSize; index > stack_index; index -= kWordSize) {
+    if (AST_is_return_slot(ctx, index)) {
+      continue;
+    }
+    Register reg;
+    if (!spilled && AST_slot_register(ctx, index, &reg)) {
+      StackMaps_mark_register(ctx->stack_maps, entry, reg);
+    } else {
+      StackMaps_mark_slot(ctx->stack_maps, entry, index);
+    }
+  }
+}
+
+// Check that `bytes' more fit in the heap, for code at stack_index. If
+// `rax_live', rax holds a value that has to survive a collection too.
+static void AST_emit_heap_check(CompilerContext *ctx, int32_t bytes,
+                                int stack_index, bool rax_live) {
+  int32_t entry =
+      Heap_emit_check(ctx->writer, ctx->stack_maps, bytes, stack_index);
+  AST_mark_live_slots(ctx, entry, stack_index, /*spilled=*/false);
+  if (rax_live) {
+    StackMaps_mark_register(ctx->stack_maps, entry, kRax);
+  }
+}
+
+// Like AST_emit_heap_check, for an allocation whose size in bytes is in rax,
+// made with the register slots spilled (see Heap_emit_check_rax).
+static void AST_emit_heap_check_rax(CompilerContext *ctx, int stack_index) {
+  int32_t entry =
+      Heap_emit_check_rax(ctx->writer, ctx->stack_maps, stack_index);
+  AST_mark_live_slots(ctx, entry, stack_index, /*spilled=*/true);
+}
+
+// Emit the slow paths for the heap checks in the function just compiled, its
+// overflow trap and the routines it calls.
+static void AST_emit_slow_paths(CompilerContext *ctx) {
+  if (ctx->options & kOptGC) {
+    Heap_emit_slow_paths(ctx->writer, ctx->stack_maps);
+  }
+  if (ctx->options & kOptOverflow) {
+    BufferWriter_bind_label(ctx->writer, ctx->overflow);
+    Buffer_ud2(ctx->writer);
+  }
+  // A `code' form compiled on its own as a function has emitted them already.
+  if (ctx->routines != NULL) {
+    Routines_emit(ctx->writer, ctx->routines);
+    ctx->routines = NULL;
+  }
+}
+
+// Set up for the function about to be compiled, whose calls to routines are
+// recorded in `routines' until AST_emit_slow_paths. With kOptOverflow, also
+// give it a trap of its own for AST_check_overflow to jump to.
+static void AST_start_function(CompilerContext *ctx, Routines *routines) {
+  ctx->writer->peephole = (ctx->options & kOptPeephole) != 0;
+  Routines_init(routines);
+  ctx->routines = routines;
+  if (ctx->options & kOptOverflow) {
+    ctx->overflow = BufferWriter_new_label(ctx->writer);
+  }
+}
+
+// With kOptOverflow, trap if the arithmetic just emitted overflowed.
+static void AST_check_overflow(CompilerContext *ctx) {
+  if (ctx->options & kOptOverflow) {
+    assert(ctx->overflow != -1 && "checked arithmetic outside a function");
+    Buffer_jcc_label(ctx->writer, kOverflow, ctx->overflow);
+  }
+}
+
+// How many nodes AST_heap_bytes looks at before giving up, so that sizing
+// each of the subexpressions of a large expression in turn stays linear.
+static const int kHeapBytesBudget = 64;
+
+// An upper bound on the bytes `node' allocates, or -1 if that isn't known up
+// front: it calls a label (which may collect), uses an embedder's form, is
+// malformed, or is too big to be worth sizing.
+static int32_t AST_heap_bytes(ASTNode *node, int *budget) {
+  if (--*budget < 0) {
+    return -1;
+  }
+  if (node->type != kCons || node == nil) {
+    return 0;
+  }
+  ASTNode *fnexpr = AST_car(node);
+  ASTNode *args = AST_cdr(node);
+  if (!AST_is_atom(fnexpr) || fnexpr->value.atom->id >= kNumBuiltinSymbols) {
+    return -1;
+  }
+  Primitive *primitive = Primitive_lookup(fnexpr->value.atom);
+  if (primitive == NULL || (primitive->arity != kVariadic &&
+                            AST_list_length(args) != primitive->arity)) {
+    return -1;
+  }
+  int32_t bytes = 0;
+  switch ((BuiltinSymbol)fnexpr->value.atom->id) {
+  case kSymCons:
+    bytes = 2 * kWordSize;
+    // Fall through
+  case kSymAdd1:
+  case kSymSub1:
+  case kSymIntegerToChar:
+  case kSymZerop:
+  case kSymPlus:
+  case kSymMinus:
+  case kSymTimes:
+  case kSymQuotient:
+  case kSymRemainder:
+  case kSymLogand:
+  case kSymLogor:
+  case kSymNumEqual:
+  case kSymLess:
+  case kSymLessEqual:
+  case kSymCar:
+  case kSymCdr:
+  case kSymVectorRef:
+  case kSymVectorSet:
+  case kSymVectorLength:
+  case kSymVectorFill:
+  case kSymVectorCopy:
+  case kSymStringRef:
+  case kSymStringSet:
+  case kSymStringLength:
+  case kSymStringFill:
+  case kSymStringEqual:
+  case kSymStringLess:
+    for (; args != nil; args = AST_cdr(args)) {
+      int32_t arg_bytes = AST_heap_bytes(AST_car(args), budget);
+      if (arg_bytes < 0) {
+        return -1;
+      }
+      bytes += arg_bytes;
+    }
+    return bytes;
+  case kSymIf: {
+    int32_t test = AST_heap_bytes(operand1(args), budget);
+    int32_t iftrue = AST_heap_bytes(operand2(args), budget);
+    int32_t iffalse = AST_heap_bytes(operand3(args), budget);
+    if (test < 0 || iftrue < 0 || iffalse < 0) {
+      return -1;
+    }
+    return test + (iftrue > iffalse ? iftrue : iffalse);
+  }
+  case kSymLet: {
+    for (ASTNode *b = operand1(args); b != nil; b = AST_cdr(b)) {
+      if (b->type != kCons || AST_car(b)->type != kCons ||
+          AST_car(b) == nil || AST_list_length(AST_car(b)) != 2) {
+        return -1;
+      }
+      int32_t value_bytes = AST_heap_bytes(operand2(AST_car(b)), budget);
+      if (value_bytes < 0) {
+        return -1;
+      }
+      bytes += value_bytes;
+    }
+    int32_t body_bytes = AST_heap_bytes(operand2(args), budget);
+    return body_bytes < 0 ? -1 : bytes + body_bytes;
+  }
+  default:
+    return -1;
+  }
+}
+
+// (lambda (formals) body) evaluates to a closure: a heap object, tagged
+// kClosureTag, holding the address of the code for `body' and a copy of each
+// of the variables the body refers to from outside -- its free variables:
+//
+//   [header][code][free variable 0][free variable 1]...
+//
+// (funcall f args) calls that code with f as a hidden first formal, so the
+// body finds its closure at [rsp-8] and its own formals below it. Variables
+// are never assigned, so a copy is as good as the variable. The code goes in
+// line in the function that makes the closure, with a jump around it.
+//
+// Most closures never leave the `let' that binds them: they are only called.
+// Those needn't be made at all. AST_compile_let compiles the code of one as a
+// function that takes the free variables as more arguments after its formals,
+// and each funcall of it becomes a labelcall that passes them.
+
+// Where the code address and the first free variable are, from a tagged
+// closure.
+static const int32_t kClosureCode = kWordSize - kClosureTag;
+static const int32_t kClosureFreeVars = 2 * kWordSize - kClosureTag;
+
+// The hidden first formal of a closure's code. The reader doesn't make atoms
+// with a `#' in them, so nothing else can refer to it. It is a builtin so that
+// looking it up neither hashes nor touches the symbol table, which isn't safe
+// from the threads of AST_compile_labels_in_parallel.
+static Symbol *AST_closure_formal() { return Symbol_builtin(kSymClosure); }
+
+int AST_compile_code(CompilerContext *ctx, ASTNode *formals, ASTNode *body,
+                     int stack_index);
+
+// Load the variable `name' into rax: from its slot, or from the closure of
+// the `lambda' being compiled if it is one of its free variables.
+static int AST_compile_variable(CompilerContext *ctx, Symbol *name) {
+  int32_t index;
+  if (AST_lookup(ctx, ctx->locals, name, &index)) {
+    AST_load_slot(ctx, index);
+    return 0;
+  }
+  if (AST_lookup(ctx, ctx->free_vars, name, &index)) {
+    int32_t closure;
+    bool found = Env_lookup(ctx->locals, AST_closure_formal(), &closure);
+    assert(found && "free variables without a closure");
+    (void)found;
+    AST_load_slot(ctx, closure);
+    Buffer_mov_reg_disp_to_rax(ctx->writer, kRax,
+                               kClosureFreeVars + index * kWordSize);
+    return 0;
+  }
+  fprintf(stderr, "Unbound variable: `%s'\n", name->name);
+  return -1;
+}
+
+// Return true if `formals' is a list of atoms.
+static bool AST_is_formals(ASTNode *formals) {
+  for (; formals != nil; formals = AST_cdr(formals)) {
+    if (formals->type != kCons || !AST_is_atom(AST_car(formals))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return true if `node' is a well-formed (lambda (formals) body).
+static bool AST_is_lambda(ASTNode *node) {
+  return node->type == kCons && node != nil &&
+         AST_atom_is_builtin(AST_car(node), kSymLambda) &&
+         AST_list_length(node) == 3 && AST_is_formals(operand2(node));
+}
+
+static void AST_collect_free_vars(CompilerContext *ctx, ASTNode *node,
+                                  EnvNode *bound, EnvNode **free_vars);
+
+// The `let' case of AST_collect_free_vars: each binding sees the ones before
+// it.
+static void AST_collect_let_free_vars(CompilerContext *ctx, ASTNode *bindings,
+                                      ASTNode *body, EnvNode *bound,
+                                      EnvNode **free_vars) {
+  if (bindings == nil) {
+    AST_collect_free_vars(ctx, body, bound, free_vars);
+    return;
+  }
+  if (bindings->type != kCons || !AST_is_let_binding(AST_car(bindings))) {
+    // Left for AST_compile_let to report.
+    return;
+  }
+  AST_collect_free_vars(ctx, operand2(AST_car(bindings)), bound, free_vars);
+  EnvNode node = Env_init(AST_car(AST_car(bindings))->value.atom,
+                          /*stack_index=*/0, bound);
+  AST_collect_let_free_vars(ctx, AST_cdr(bindings), body, &node, free_vars);
+}
+
+// The `lambda' case: `body' sees `formals', which are atoms.
+static void AST_collect_lambda_free_vars(CompilerContext *ctx,
+                                         ASTNode *formals, ASTNode *body,
+                                         EnvNode *bound, EnvNode **free_vars) {
+  if (formals == nil) {
+    AST_collect_free_vars(ctx, body, bound, free_vars);
+    return;
+  }
+  EnvNode node =
+      Env_init(AST_car(formals)->value.atom, /*stack_index=*/0, bound);
+  AST_collect_lambda_free_vars(ctx, AST_cdr(formals), body, &node, free_vars);
+}
+
+// Add to *free_vars the variables that `node' refers to, apart from the ones
+// in `bound' and the ones it binds itself, that mean something where ctx is:
+// a local, or a free variable of the `lambda' the code is in. Each is added
+// once, numbered by where it goes in the closure.
+static void AST_collect_free_vars(CompilerContext *ctx, ASTNode *node,
+                                  EnvNode *bound, EnvNode **free_vars) {
+  int32_t unused;
+  if (node->type == kAtom) {
+    Symbol *name = node->value.atom;
+    if (Env_lookup(bound, name, &unused) ||
+        Env_lookup(*free_vars, name, &unused) ||
+        !(Env_lookup(ctx->locals, name, &unused) ||
+          Env_lookup(ctx->free_vars, name, &unused))) {
+      return;
+    }
+    EnvNode *free_var = Arena_alloc(ctx->arena, sizeof *free_var);
+    *free_var = Env_init(
+        name, *free_vars == NULL ? 0 : (*free_vars)->stack_index + 1,
+        *free_vars);
+    *free_vars = free_var;
+    return;
+  }
+  if (node->type != kCons || node == nil) {
+    return;
+  }
+  ASTNode *args = node;
+  if (AST_is_atom(AST_car(node))) {
+    args = AST_cdr(node);
+    if (AST_atom_is_builtin(AST_car(node), kSymLet) &&
+        AST_list_length(args) == 2) {
+      AST_collect_let_free_vars(ctx, operand1(args), operand2(args), bound,
+                                free_vars);
+      return;
+    }
+    if (AST_is_lambda(node)) {
+      AST_collect_lambda_free_vars(ctx, operand1(args), operand2(args), bound,
+                                   free_vars);
+      return;
+    }
+    if (AST_atom_is_builtin(AST_car(node), kSymLabelcall) && args != nil) {
+      // Labels aren't variables.
+      args = AST_cdr(args);
+    }
+  }
+  for (; args != nil && args->type == kCons; args = AST_cdr(args)) {
+    AST_collect_free_vars(ctx, AST_car(args), bound, free_vars);
+  }
+}
+
+// `list' followed by the names in `free_vars', as atoms: the formals of a
+// closure compiled as a function of its own, or the arguments of a call to
+// it.
+static ASTNode *AST_append_free_vars(Arena *arena, ASTNode *list,
+                                     EnvNode *free_vars) {
+  if (list != nil) {
+    return AST_new_cons(arena, AST_car(list),
+                        AST_append_free_vars(arena, AST_cdr(list), free_vars));
+  }
+  ASTNode *result = nil;
+  for (; free_vars != NULL; free_vars = free_vars->next) {
+    result =
+        AST_new_cons(arena, AST_new_symbol(arena, free_vars->name), result);
+  }
+  return result;
+}
+
+// Compile `body' at `label' as the code of a function taking `formals', with
+// `free_vars' in its closure if it has one. The code starts afresh, like that
+// of a `code' form.
+static int AST_compile_closure_code(CompilerContext *ctx, Label label,
+                                    ASTNode *formals, ASTNode *body,
+                                    EnvNode *free_vars) {
+  CompilerContext code_ctx = *ctx;
+  code_ctx.locals = NULL;
+  code_ctx.free_vars = free_vars;
+  code_ctx.known = NULL;
+  code_ctx.tail = false;
+  code_ctx.return_slots = NULL;
+  code_ctx.heap_reserved = false;
+  Routines routines;
+  AST_start_function(&code_ctx, &routines);
+  if (ctx->options & kOptFold) {
+    body = AST_fold(&code_ctx, body);
+  }
+  Label over = BufferWriter_new_label(ctx->writer);
+  Buffer_jmp_label(ctx->writer, over);
+  BufferWriter_bind_label(ctx->writer, label);
+  int result = AST_compile_code(&code_ctx, formals, body, -kWordSize);
+  if (result != 0) {
+    return result;
+  }
+  AST_emit_slow_paths(&code_ctx);
+  BufferWriter_bind_label(ctx->writer, over);
+  return 0;
+}
+
+static int AST_compile_lambda(CompilerContext *ctx, ASTNode *args,
+                              int stack_index) {
+  ASTNode *formals = operand1(args);
+  if (!AST_is_formals(formals)) {
+    fprintf(stderr, "lambda needs a list of formals\n");
+    return -1;
+  }
+  EnvNode *free_vars = NULL;
+  AST_collect_lambda_free_vars(ctx, formals, operand2(args), /*bound=*/NULL,
+                               &free_vars);
+  Label code = BufferWriter_new_label(ctx->writer);
+  ASTNode *code_formals = AST_new_cons(
+      ctx->arena, AST_new_symbol(ctx->arena, AST_closure_formal()), formals);
+  int result = AST_compile_closure_code(ctx, code, code_formals,
+                                        operand2(args), free_vars);
+  if (result != 0) {
+    return result;
+  }
+  int32_t num_free_vars = free_vars == NULL ? 0 : free_vars->stack_index + 1;
+  int32_t bytes = ((num_free_vars + 2) * kWordSize + 15) / 16 * 16;
+  if ((ctx->options & kOptGC) && !ctx->heap_reserved) {
+    AST_emit_heap_check(ctx, bytes, stack_index, /*rax_live=*/false);
+  }
+  Buffer_load_reg_imm32(ctx->writer, kRax,
+                        (num_free_vars << kHeaderShift) | kClosureHeaderTag);
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, 0);
+  Buffer_lea_rax_label(ctx->writer, code);
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, kWordSize);
+  for (EnvNode *free_var = free_vars; free_var != NULL;
+       free_var = free_var->next) {
+    result = AST_compile_variable(ctx, free_var->name);
+    if (result != 0) {
+      return result;
+    }
+    Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi,
+                               (2 + free_var->stack_index) * kWordSize);
+  }
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
+  Buffer_or_reg_imm32(ctx->writer, /*dst=*/kRax, kClosureTag);
+  Buffer_add_reg_imm32(ctx->writer, /*dst=*/kRsi, bytes);
+  return 0;
+}
+
+static bool AST_only_calls(ASTNode *node, Symbol *name, EnvNode *free_vars);
+
+// Return true if binding `bound' would hide `name' or one of `free_vars'.
+static bool AST_hides(Symbol *bound, Symbol *name, EnvNode *free_vars) {
+  int32_t unused;
+  return bound == name || Env_lookup(free_vars, bound, &unused);
+}
+
+// The `let' case of AST_only_calls.
+static bool AST_let_only_calls(ASTNode *bindings, ASTNode *body, Symbol *name,
+                               EnvNode *free_vars) {
+  for (; bindings != nil; bindings = AST_cdr(bindings)) {
+    if (bindings->type != kCons || !AST_is_let_binding(AST_car(bindings)) ||
+        AST_hides(AST_car(AST_car(bindings))->value.atom, name, free_vars) ||
+        !AST_only_calls(operand2(AST_car(bindings)), name, free_vars)) {
+      return false;
+    }
+  }
+  return AST_only_calls(body, name, free_vars);
+}
+
+// Return true if `node' does nothing with `name' but funcall it, outside of
+// any `lambda', and binds neither `name' nor any of `free_vars' again. Blind
+// to scoping otherwise, like AST_mentions, so it can only err towards making
+// the closure.
+static bool AST_only_calls(ASTNode *node, Symbol *name, EnvNode *free_vars) {
+  if (node->type == kAtom) {
+    return node->value.atom != name;
+  }
+  if (node->type != kCons || node == nil) {
+    return true;
+  }
+  ASTNode *args = node;
+  if (AST_is_atom(AST_car(node))) {
+    args = AST_cdr(node);
+    if (AST_atom_is_builtin(AST_car(node), kSymLet)) {
+      return AST_list_length(args) == 2 &&
+             AST_let_only_calls(operand1(args), operand2(args), name,
+                                free_vars);
+    }
+    if (AST_atom_is_builtin(AST_car(node), kSymLambda)) {
+      if (!AST_is_lambda(node) || AST_mentions(operand2(args), name)) {
+        return false;
+      }
+      for (ASTNode *formal = operand1(args); formal != nil;
+           formal = AST_cdr(formal)) {
+        if (AST_hides(AST_car(formal)->value.atom, name, free_vars)) {
+          return false;
+        }
+      }
+      return AST_only_calls(operand2(args), name, free_vars);
+    }
+    if ((AST_atom_is_builtin(AST_car(node), kSymFuncall) &&
+         args != nil && AST_is_atom(operand1(args)) &&
+         operand1(args)->value.atom == name) ||
+        (AST_atom_is_builtin(AST_car(node), kSymLabelcall) && args != nil)) {
+      args = AST_cdr(args);
+    }
+  }
+  for (; args != nil; args = AST_cdr(args)) {
+    if (args->type != kCons ||
+        !AST_only_calls(AST_car(args), name, free_vars)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return true if `binding' binds a `lambda' that only `bindings' and `body'
+// after it see and that they only ever call, so that AST_compile_let can
+// compile it as a function of its own. Store its free variables in
+// *free_vars.
+static bool AST_is_known_function(CompilerContext *ctx, ASTNode *binding,
+                                  ASTNode *bindings, ASTNode *body,
+                                  EnvNode **free_vars) {
+  ASTNode *lambda = operand2(binding);
+  if (!AST_is_lambda(lambda)) {
+    return false;
+  }
+  Symbol *name = AST_car(binding)->value.atom;
+  *free_vars = NULL;
+  AST_collect_lambda_free_vars(ctx, operand2(lambda), operand3(lambda),
+                               /*bound=*/NULL, free_vars);
+  // A lambda that refers to an outer `name' needs that one passed in, which
+  // the calls can't see.
+  int32_t unused;
+  return !Env_lookup(*free_vars, name, &unused) &&
+         AST_let_only_calls(bindings, body, name, *free_vars);
+}
+
+int AST_compile_let(CompilerContext *ctx, ASTNode *bindings, ASTNode *body,
+                    int stack_index) {
+  if (bindings == nil) {
+    // Base case: no bindings. Emit the body.
+    if (ctx->tail) {
+      return AST_compile_tail_expr(ctx, body, stack_index);
+    }
+    return AST_compile_expr(ctx, body, stack_index);
+  }
+  // Inductive case: some bindings. Emit code for the first binding, bind the
+  // name to the stack index, and recurse.
+  ASTNode *first_binding = AST_car(bindings);
+  ASTNode *name = AST_car(first_binding);
+  assert(name && name->type == kAtom && "name must be an atom");
+  ASTNode *expr = AST_car(AST_cdr(first_binding));
+  EnvNode *free_vars;
+  if (AST_is_known_function(ctx, first_binding, AST_cdr(bindings), body,
+                            &free_vars)) {
+    // No closure, so no slot: the calls pass the free variables instead.
+    KnownFunction known = {.name = name->value.atom,
+                           .label = BufferWriter_new_label(ctx->writer),
+                           .free_vars = free_vars,
+                           .next = ctx->known};
+    ASTNode *formals =
+        AST_append_free_vars(ctx->arena, operand2(expr), free_vars);
+    int result = AST_compile_closure_code(ctx, known.label, formals,
+                                          operand3(expr), /*free_vars=*/NULL);
+    if (result != 0) {
+      return result;
+    }
+    CompilerContext new_ctx = *ctx;
+    new_ctx.known = &known;
+    return AST_compile_let(&new_ctx, AST_cdr(bindings), body, stack_index);
+  }
+  int result = AST_compile_expr(ctx, expr, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_store_slot(ctx, stack_index);
+  EnvNode new_locals = Env_init(name->value.atom, stack_index, ctx->locals);
+  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &new_locals);
+  return AST_compile_let(&new_ctx, AST_cdr(bindings), body,
+                         stack_index - kWordSize);
+}
+
+// http://ref.x86asm.net/coder32.html
+// https://www.felixcloutier.com/x86/index.html
+// rasm2 -D -b64 "48 89 44 24 f8 "
+//  -> or -d
+
+// Compile `test' for a branch: leave the flags set so that `cond' holds
+// exactly when the test is true. Predicates set the flags themselves; any
+// other expression is true unless it is #f.
+int AST_compile_test(CompilerContext *ctx, ASTNode *test, int stack_index,
+                     Condition *cond) {
+  if (test->type == kCons && test != nil && AST_is_atom(AST_car(test))) {
+    Primitive *primitive = Primitive_lookup(AST_car(test)->value.atom);
+    ASTNode *args = AST_cdr(test);
+    if (primitive != NULL && primitive->compile_test != NULL &&
+        (primitive->arity == kVariadic ||
+         AST_list_length(args) == primitive->arity)) {
+      return primitive->compile_test(ctx, args, stack_index, cond);
+    }
+  }
+  int result = AST_compile_expr(ctx, test, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_cmp_reg_imm32(ctx->writer, kRax, encodeImmediateBool(false));
+  *cond = kNotEqual;
+  return 0;
+}
+
+int AST_compile_if(CompilerContext *ctx, ASTNode *test, ASTNode *iftrue,
+                   ASTNode *iffalse, int stack_index) {
+  int32_t counter = -1;
+  if (ctx->options & kOptProfile) {
+    counter = AST_add_profile_site(ctx, kProfileIf, /*label=*/NULL,
+                                   test->span_start, /*num_counters=*/2);
+    if (counter < 0) {
+      return -1;
+    }
+  }
+  Condition cond;
+  int result = AST_compile_test(ctx, test, stack_index, &cond);
+  if (result != 0) {
+    return result;
+  }
+  Label iffalse_label = BufferWriter_new_label(ctx->writer);
+  Buffer_jcc_label(ctx->writer, Condition_negate(cond), iffalse_label);
+  AST_emit_count(ctx, counter);
+  if (ctx->tail) {
+    // Both arms return by themselves, so there is nothing to join.
+    result = AST_compile_tail_expr(ctx, iftrue, stack_index);
+    if (result != 0) {
+      return result;
+    }
+    BufferWriter_bind_label(ctx->writer, iffalse_label);
+    AST_emit_count(ctx, counter < 0 ? -1 : counter + 1);
+    return AST_compile_tail_expr(ctx, iffalse, stack_index);
+  }
+  Label end_label = BufferWriter_new_label(ctx->writer);
+  result = AST_compile_expr(ctx, iftrue, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_jmp_label(ctx->writer, end_label);
+  BufferWriter_bind_label(ctx->writer, iffalse_label);
+  AST_emit_count(ctx, counter < 0 ? -1 : counter + 1);
+  result = AST_compile_expr(ctx, iffalse, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  BufferWriter_bind_label(ctx->writer, end_label);
+  return 0;
+}
+
+int AST_compile_cons(CompilerContext *ctx, ASTNode *car, ASTNode *cdr,
+                     int stack_index) {
+  // Both halves are evaluated before anything is written, since either may
+  // allocate pairs of its own at rsi.
+  int result = AST_compile_expr(ctx, car, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_store_slot(ctx, stack_index);
+  result = AST_compile_expr(ctx, cdr, stack_index - kWordSize);
+  if (result != 0) {
+    return result;
+  }
+  if ((ctx->options & kOptGC) && !ctx->heap_reserved) {
+    // There was no telling up front how much the halves would allocate, so
+    // this pair gets a check of its own.
+    AST_emit_heap_check(ctx, 2 * kWordSize, stack_index - kWordSize,
+                        /*rax_live=*/true);
+  }
+  // Set cdr
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, kWordSize);
+  // Set car
+  AST_load_slot(ctx, stack_index);
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, 0);
+  // Tag the pointer
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
+  Buffer_or_reg_imm32(ctx->writer, /*dst=*/kRax, 1);
+  // Bump heap
+  Buffer_add_reg_imm32(ctx->writer, /*dst=*/kRsi, 2 * kWordSize);
+  return 0;
+}
+
+int AST_compile_code(CompilerContext *ctx, ASTNode *formals, ASTNode *body,
+                     int stack_index) {
+  if (formals == nil) {
+    // The caller left the arguments in the formals' homes.
+    AST_reload_slots(ctx, -kWordSize, stack_index);
+    return AST_compile_tail_expr(ctx, body, stack_index);
+  }
+  ASTNode *name = AST_car(formals);
+  EnvNode new_locals = Env_init(name->value.atom, stack_index, ctx->locals);
+  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &new_locals);
+  return AST_compile_code(&new_ctx, AST_cdr(formals), body,
+                          stack_index - kWordSize);
+}
+
+// A `label' for the labelcalls below that makes them call the closure that
+// is their first argument instead (see AST_compile_funcall).
+static const Label kClosureLabel = -1;
+
+// A labelcall in tail position reuses the current frame: the arguments go over
+// our own formals and we jump to the label, so the callee returns straight to
+// our caller and a loop written as recursion runs in constant stack space.
+// All of the arguments are evaluated before any of them is moved, since they
+// may still need the formals.
+static int AST_compile_tail_labelcall(CompilerContext *ctx, Label label,
+                                      ASTNode *args, int stack_index) {
+  int arg_index = stack_index;
+  for (; args != nil; args = AST_cdr(args)) {
+    int result = AST_compile_expr(ctx, AST_car(args), arg_index);
+    if (result != 0) {
+      return result;
+    }
+    AST_store_slot(ctx, arg_index);
+    arg_index -= kWordSize;
+  }
+  // Each argument moves up (or stays put), so going in order never overwrites
+  // one that is still to be moved. The callee reloads its formals from the
+  // stack, so the ones in registers have to go there too.
+  int formal_index = -kWordSize;
+  for (int index = stack_index; index > arg_index;
+       index -= kWordSize, formal_index -= kWordSize) {
+    Register reg;
+    if (AST_slot_register(ctx, index, &reg)) {
+      Buffer_mov_reg_to_stack(ctx->writer, reg, formal_index);
+    } else if (index != formal_index) {
+      Buffer_mov_stack_to_reg(ctx->writer, kRax, index);
+      Buffer_mov_reg_to_stack(ctx->writer, kRax, formal_index);
+    }
+  }
+  if (label == kClosureLabel) {
+    Buffer_mov_stack_to_reg(ctx->writer, kRax, -kWordSize);
+    Buffer_jmp_rax_disp(ctx->writer, kClosureCode);
+    return 0;
+  }
+  Buffer_jmp_label(ctx->writer, label);
+  return 0;
+}
+
+int AST_compile_labelcall(CompilerContext *ctx, Label label, ASTNode *args,
+                          int stack_index) {
+  assert(args->type == kCons);
+  if (ctx->tail) {
+    return AST_compile_tail_labelcall(ctx, label, args, stack_index);
+  }
+  // The slot at stack_index is where `call' will push the return address, so
+  // the arguments start one slot below it. That way the callee finds its
+  // first formal at [rsp-8], just like `code' expects.
+  EnvNode return_slot = Env_init(NULL, stack_index, ctx->return_slots);
+  CompilerContext args_ctx = *ctx;
+  args_ctx.return_slots = &return_slot;
+  int arg_index = stack_index - kWordSize;
+  for (; args != nil; args = AST_cdr(args)) {
+    int result = AST_compile_expr(&args_ctx, AST_car(args), arg_index);
+    if (result != 0) {
+      return result;
+    }
+    AST_store_slot(ctx, arg_index);
+    arg_index -= kWordSize;
+  }
+  // Everything in registers is caller-saved: the live slots above the return
+  // address go home until the call returns, and the arguments go where the
+  // callee expects them.
+  AST_spill_slots(ctx, -kWordSize, stack_index);
+  AST_spill_slots(ctx, stack_index - kWordSize, arg_index);
+  if (label == kClosureLabel) {
+    Buffer_mov_stack_to_reg(ctx->writer, kRax, stack_index - kWordSize);
+  }
+  // Move rsp down past our locals so the return address lands in that slot.
+  int32_t rsp_adjust = stack_index + kWordSize;
+  if (rsp_adjust != 0) {
+    Buffer_add_rsp_imm32(ctx->writer, rsp_adjust);
+  }
+  if (label == kClosureLabel) {
+    Buffer_call_rax_disp(ctx->writer, kClosureCode);
+  } else {
+    Buffer_call_label(ctx->writer, label);
+  }
+  if (ctx->options & kOptGC) {
+    Label ret = BufferWriter_new_label(ctx->writer);
+    BufferWriter_bind_label(ctx->writer, ret);
+    int32_t entry = StackMaps_add(ctx->stack_maps, ret, stack_index);
+    AST_mark_live_slots(ctx, entry, stack_index, /*spilled=*/true);
+  }
+  if (rsp_adjust != 0) {
+    Buffer_add_rsp_imm32(ctx->writer, -rsp_adjust);
+  }
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  return 0;
+}
+
+static int AST_compile_add1(CompilerContext *ctx, ASTNode *args,
+                            int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_add_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(1));
+  AST_check_overflow(ctx);
+  return 0;
+}
+
+static int AST_compile_sub1(CompilerContext *ctx, ASTNode *args,
+                            int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_sub_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(1));
+  AST_check_overflow(ctx);
+  return 0;
+}
+
+static int AST_compile_integer_to_char(CompilerContext *ctx, ASTNode *args,
+                                       int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_shl_reg(ctx->writer, kRax, /*bits=*/kCharShift - kFixnumShift);
+  // With kOptPeephole this is or al, kCharTag.
+  Buffer_or_reg_imm32(ctx->writer, kRax, kCharTag);
+  return 0;
+}
+
+static int AST_test_zerop(CompilerContext *ctx, ASTNode *args,
+                          int stack_index, Condition *cond) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_cmp_reg_imm32(ctx->writer, kRax, 0);
+  *cond = kEqual;
+  return 0;
+}
+
+// Fixnums keep their value in the low 32 bits of a register, the way
+// encodeImmediateFixnum makes them, so the arithmetic below is all done with
+// 32-bit ops: negative fixnums compare the right way round, and the overflow
+// flag is set exactly when a result doesn't fit in a fixnum, which
+// AST_check_overflow can branch on with no test of its own.
+//
+// With a tag of 0 in the low kFixnumShift bits, sums, differences, logand,
+// logor and comparisons of tagged values are the tagged results, so they
+// take one instruction. A product only needs one of its operands untagged,
+// the quotient of two tagged values is untagged, and their remainder is
+// tagged already.
+
+// Evaluate the second operand of `args' into the slot at stack_index and then
+// the first into rax, the order AST_compile_plus has always used.
+static int AST_compile_operands(CompilerContext *ctx, ASTNode *args,
+                                int stack_index) {
+  int result = AST_compile_expr(ctx, operand2(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_store_slot(ctx, stack_index);
+  return AST_compile_expr(ctx, operand1(args), stack_index - kWordSize);
+}
+
+// {op} eax, {the slot at stack_index}
+static void AST_alu32_slot(CompilerContext *ctx, Alu32Op op,
+                           int stack_index) {
+  Register reg;
+  if (AST_slot_register(ctx, stack_index, &reg)) {
+    Buffer_alu32_reg_reg(ctx->writer, op, kRax, reg);
+    return;
+  }
+  Buffer_alu32_reg_stack(ctx->writer, op, kRax, stack_index);
+}
+
+static int AST_compile_plus(CompilerContext *ctx, ASTNode *args,
+                            int stack_index) {
+  int result = AST_compile_operands(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_alu32_slot(ctx, kAlu32Add, stack_index);
+  AST_check_overflow(ctx);
+  return 0;
+}
+
+// A binary primitive that is a single ALU op on the tagged operands.
+static int AST_compile_alu32(CompilerContext *ctx, ASTNode *args,
+                             int stack_index, Alu32Op op) {
+  int result = AST_compile_operands(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_alu32_slot(ctx, op, stack_index);
+  return 0;
+}
+
+static int AST_compile_minus(CompilerContext *ctx, ASTNode *args,
+                             int stack_index) {
+  int result = AST_compile_alu32(ctx, args, stack_index, kAlu32Sub);
+  if (result != 0) {
+    return result;
+  }
+  AST_check_overflow(ctx);
+  return 0;
+}
+
+static int AST_compile_times(CompilerContext *ctx, ASTNode *args,
+                             int stack_index) {
+  int result = AST_compile_operands(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_sar32_reg(ctx->writer, kRax, kFixnumShift);
+  AST_alu32_slot(ctx, kAlu32Imul, stack_index);
+  AST_check_overflow(ctx);
+  return 0;
+}
+
+static int AST_compile_logand(CompilerContext *ctx, ASTNode *args,
+                              int stack_index) {
+  return AST_compile_alu32(ctx, args, stack_index, kAlu32And);
+}
+
+static int AST_compile_logor(CompilerContext *ctx, ASTNode *args,
+                             int stack_index) {
+  return AST_compile_alu32(ctx, args, stack_index, kAlu32Or);
+}
+
+// Divide the first operand by the second and leave the quotient or the
+// remainder in rax. Dividing by zero raises SIGFPE, like it does in C.
+static int AST_compile_divide(CompilerContext *ctx, ASTNode *args,
+                              int stack_index, bool remainder) {
+  int result = AST_compile_operands(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  // idiv takes edx for the top half of the dividend, so whatever slot lives
+  // in rdx has to get out of its way: the divisor goes home, and an outer
+  // value waits in the free slot below the divisor until we're done.
+  Register reg;
+  bool divisor_in_register = AST_slot_register(ctx, stack_index, &reg);
+  if (divisor_in_register && reg == kRdx) {
+    Buffer_mov_reg_to_stack(ctx->writer, kRdx, stack_index);
+    divisor_in_register = false;
+  }
+  bool save_rdx = false;
+  for (int index = -kWordSize; index > stack_index; index -= kWordSize) {
+    Register live;
+    save_rdx =
+        save_rdx || (AST_slot_register(ctx, index, &live) && live == kRdx);
+  }
+  int32_t saved_rdx = stack_index - kWordSize;
+  if (save_rdx) {
+    Buffer_mov_reg_to_stack(ctx->writer, kRdx, saved_rdx);
+  }
+  Buffer_cdq(ctx->writer);
+  if (divisor_in_register) {
+    Buffer_idiv32_reg(ctx->writer, reg);
+  } else {
+    Buffer_idiv32_stack(ctx->writer, stack_index);
+  }
+  if (remainder) {
+    // idiv zero-extends edx like any other 32-bit op.
+    Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRdx);
+  } else if (ctx->options & kOptOverflow) {
+    // Only kFixnumMin divided by -1 overflows.
+    Buffer_imul32_reg_imm(ctx->writer, kRax, kRax, 1 << kFixnumShift);
+    AST_check_overflow(ctx);
+  } else {
+    Buffer_shl32_reg(ctx->writer, kRax, kFixnumShift);
+  }
+  if (save_rdx) {
+    Buffer_mov_stack_to_reg(ctx->writer, kRdx, saved_rdx);
+  }
+  return 0;
+}
+
+static int AST_compile_quotient(CompilerContext *ctx, ASTNode *args,
+                                int stack_index) {
+  return AST_compile_divide(ctx, args, stack_index, /*remainder=*/false);
+}
+
+static int AST_compile_remainder(CompilerContext *ctx, ASTNode *args,
+                                 int stack_index) {
+  return AST_compile_divide(ctx, args, stack_index, /*remainder=*/true);
+}
+
+// Compare the first operand with the second, for the predicates.
+static int AST_test_compare(CompilerContext *ctx, ASTNode *args,
+                            int stack_index, Condition holds,
+                            Condition *cond) {
+  int result = AST_compile_alu32(ctx, args, stack_index, kAlu32Cmp);
+  if (result != 0) {
+    return result;
+  }
+  *cond = holds;
+  return 0;
+}
+
+static int AST_test_num_equal(CompilerContext *ctx, ASTNode *args,
+                              int stack_index, Condition *cond) {
+  return AST_test_compare(ctx, args, stack_index, kEqual, cond);
+}
+
+static int AST_test_less(CompilerContext *ctx, ASTNode *args,
+                         int stack_index, Condition *cond) {
+  return AST_test_compare(ctx, args, stack_index, kLess, cond);
+}
+
+static int AST_test_less_equal(CompilerContext *ctx, ASTNode *args,
+                               int stack_index, Condition *cond) {
+  return AST_test_compare(ctx, args, stack_index, kLessEqual, cond);
+}
+
+static int AST_compile_let_form(CompilerContext *ctx, ASTNode *args,
+                                int stack_index) {
+  return AST_compile_let(ctx, /*bindings=*/operand1(args),
+                         /*body=*/operand2(args), stack_index);
+}
+
+static int AST_compile_if_form(CompilerContext *ctx, ASTNode *args,
+                               int stack_index) {
+  // TODO: in if, rewrite empty iffalse => '()
+  return AST_compile_if(ctx, operand1(args), operand2(args), operand3(args),
+                        stack_index);
+}
+
+static int AST_compile_cons_form(CompilerContext *ctx, ASTNode *args,
+                                 int stack_index) {
+  return AST_compile_cons(ctx, operand1(args), operand2(args), stack_index);
+}
+
+static int AST_compile_car(CompilerContext *ctx, ASTNode *args,
+                           int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  // Since heap addresses are biased by 1, the car of a cons cell is at
+  // offset -1, instead of 0.
+  Buffer_mov_reg_disp_to_rax(ctx->writer, /*src=*/kRax, -1);
+  return 0;
+}
+
+static int AST_compile_cdr(CompilerContext *ctx, ASTNode *args,
+                           int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  // Since heap addresses are biased by 1, the cdr of a cons cell is at
+  // offset 7, instead of 8.
+  Buffer_mov_reg_disp_to_rax(ctx->writer, /*src=*/kRax, kWordSize - 1);
+  return 0;
+}
+
+// Vectors and strings are laid out as described at kVectorHeaderTag, with no
+// bounds checks (like car and cdr, they trust their operands). The bulk
+// operations call routines; see the Routines section. The primitives that
+// change an object return it.
+
+// Offsets from a tagged vector or string of its header and its first
+// element or character.
+static const int32_t kVectorHeader = -kVectorTag;
+static const int32_t kVectorData = kWordSize - kVectorTag;
+static const int32_t kStringHeader = -kStringTag;
+static const int32_t kStringData = kWordSize - kStringTag;
+
+// Evaluate `args' in order into the slots from stack_index down.
+static int AST_compile_args_to_slots(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index) {
+  for (; args != nil; args = AST_cdr(args)) {
+    int result = AST_compile_expr(ctx, AST_car(args), stack_index);
+    if (result != 0) {
+      return result;
+    }
+    AST_store_slot(ctx, stack_index);
+    stack_index -= kWordSize;
+  }
+  return 0;
+}
+
+// Call routine `kind', whose arguments are in place, from code whose frame is
+// live above stack_index. The register slots must be in their homes.
+static void AST_call_routine(CompilerContext *ctx, RoutineKind kind,
+                             int stack_index) {
+  assert(ctx->routines != NULL && "routine call outside a function");
+  Label *label = &ctx->routines->labels[kind];
+  if (*label == -1) {
+    *label = BufferWriter_new_label(ctx->writer);
+  }
+  // Move rsp down past the live slots, as for a labelcall.
+  int32_t rsp_adjust = stack_index + kWordSize;
+  if (rsp_adjust != 0) {
+    Buffer_add_rsp_imm32(ctx->writer, rsp_adjust);
+  }
+  Buffer_call_label(ctx->writer, *label);
+  if (rsp_adjust != 0) {
+    Buffer_add_rsp_imm32(ctx->writer, -rsp_adjust);
+  }
+}
+
+// {dst} = the bytes a vector or string of the length in the slot at
+// length_index takes up, header and padding included. The slot must be in
+// its home. Like the other fixnum arithmetic, this only looks at the low 32
+// bits of the length.
+static void AST_emit_object_bytes(CompilerContext *ctx, Register dst,
+                                  int length_index, bool string) {
+  Buffer_mov_stack_to_reg(ctx->writer, dst, length_index);
+  if (string) {
+    Buffer_sar32_reg(ctx->writer, dst, kFixnumShift);
+  } else {
+    // From a tagged length to words.
+    Buffer_alu32_reg_reg(ctx->writer, kAlu32Add, dst, dst);
+  }
+  Buffer_add_reg_imm32(ctx->writer, dst, kWordSize + 15);
+  Buffer_and_reg_imm32(ctx->writer, dst, -16);
+}
+
+// rax = the char in the slot at char_index in each byte, for kRoutineFill.
+// Clobbers rdx.
+static void AST_emit_char_bytes(CompilerContext *ctx, int char_index) {
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, char_index);
+  Buffer_shr_reg(ctx->writer, kRax, kCharShift);
+  Buffer_and_reg_imm32(ctx->writer, kRax, 0xff);
+  Buffer_imul32_reg_imm(ctx->writer, kRax, kRax, 0x01010101);
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRdx, /*src=*/kRax);
+  Buffer_shl_reg(ctx->writer, kRdx, 32);
+  Buffer_or_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRdx);
+}
+
+// rcx = the words of the payload of the vector or string in rax.
+static void AST_emit_payload_words(CompilerContext *ctx, bool string) {
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRax,
+                             string ? kStringHeader : kVectorHeader);
+  Buffer_shr_reg(ctx->writer, kRax, kHeaderShift);
+  if (string) {
+    Buffer_add_reg_imm32(ctx->writer, kRax, kWordSize - 1);
+    Buffer_shr_reg(ctx->writer, kRax, 3);
+  }
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRcx, /*src=*/kRax);
+}
+
+// (make-vector n x) and (make-string n c): a new object of n elements, each
+// of them x or c.
+static int AST_compile_make_sequence(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index, bool string) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  int length_index = stack_index;
+  int fill_index = stack_index - kWordSize;
+  int call_index = stack_index - 2 * kWordSize;
+  // The routine clobbers the registers anyway, so everything is worked on in
+  // the homes, and the collector is told to look for the slots there.
+  AST_spill_slots(ctx, -kWordSize, call_index);
+  if (ctx->options & kOptGC) {
+    AST_emit_object_bytes(ctx, kRax, length_index, string);
+    AST_emit_heap_check_rax(ctx, call_index);
+  }
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, length_index);
+  // Untag in 32 bits first, so only the fixnum's own bits reach the header.
+  Buffer_sar32_reg(ctx->writer, kRax, kFixnumShift);
+  Buffer_shl_reg(ctx->writer, kRax, kHeaderShift);
+  Buffer_or_reg_imm32(ctx->writer, kRax,
+                      string ? kStringHeaderTag : kVectorHeaderTag);
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, 0);
+  Buffer_lea_reg_disp(ctx->writer, kRax, kRsi, string ? kStringTag
+                                                      : kVectorTag);
+  AST_emit_payload_words(ctx, string);
+  if (string) {
+    AST_emit_char_bytes(ctx, fill_index);
+  } else {
+    Buffer_mov_stack_to_reg(ctx->writer, kRax, fill_index);
+  }
+  Buffer_lea_reg_disp(ctx->writer, kRdi, kRsi, kWordSize);
+  AST_call_routine(ctx, kRoutineFill, call_index);
+  AST_emit_object_bytes(ctx, kRdi, length_index, string);
+  Buffer_lea_reg_disp(ctx->writer, kRax, kRsi, string ? kStringTag
+                                                      : kVectorTag);
+  Buffer_add_reg_reg(ctx->writer, /*dst=*/kRsi, /*src=*/kRdi);
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  return 0;
+}
+
+static int AST_compile_make_vector(CompilerContext *ctx, ASTNode *args,
+                                   int stack_index) {
+  return AST_compile_make_sequence(ctx, args, stack_index, /*string=*/false);
+}
+
+static int AST_compile_make_string(CompilerContext *ctx, ASTNode *args,
+                                   int stack_index) {
+  return AST_compile_make_sequence(ctx, args, stack_index, /*string=*/true);
+}
+
+static int AST_compile_vector_ref(CompilerContext *ctx, ASTNode *args,
+                                  int stack_index) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  // Doubling the tagged index makes it the offset in bytes.
+  AST_load_slot(ctx, stack_index - kWordSize);
+  Buffer_alu32_reg_reg(ctx->writer, kAlu32Add, /*dst=*/kRax, /*src=*/kRax);
+  AST_add_slot(ctx, stack_index);
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRax, kVectorData);
+  return 0;
+}
+
+static int AST_compile_string_ref(CompilerContext *ctx, ASTNode *args,
+                                  int stack_index) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  AST_load_slot(ctx, stack_index - kWordSize);
+  Buffer_sar32_reg(ctx->writer, kRax, kFixnumShift);
+  AST_add_slot(ctx, stack_index);
+  Buffer_movzx_reg_byte_disp(ctx->writer, kRax, kRax, kStringData);
+  Buffer_shl_reg(ctx->writer, kRax, kCharShift);
+  Buffer_or_reg_imm32(ctx->writer, kRax, kCharTag);
+  return 0;
+}
+
+// (vector-set! v i x) and (string-set! s i c). The store needs a register
+// for the address as well as rax, so rcx is borrowed for it.
+static int AST_compile_sequence_set(CompilerContext *ctx, ASTNode *args,
+                                    int stack_index, bool string) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  int object_index = stack_index;
+  int index_index = stack_index - kWordSize;
+  int value_index = stack_index - 2 * kWordSize;
+  int saved_index = stack_index - 3 * kWordSize;
+  AST_spill_slots(ctx, object_index, saved_index);
+  Buffer_mov_reg_to_stack(ctx->writer, kRcx, saved_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRcx, index_index);
+  if (string) {
+    Buffer_sar32_reg(ctx->writer, kRcx, kFixnumShift);
+  } else {
+    Buffer_alu32_reg_reg(ctx->writer, kAlu32Add, /*dst=*/kRcx, /*src=*/kRcx);
+  }
+  Buffer_add_reg_stack(ctx->writer, kRcx, object_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, value_index);
+  if (string) {
+    Buffer_shr_reg(ctx->writer, kRax, kCharShift);
+    Buffer_mov_subreg_to_reg_disp(ctx->writer, kRcx, kAl, kStringData);
+  } else {
+    Buffer_mov_rax_to_reg_disp(ctx->writer, kRcx, kVectorData);
+  }
+  Buffer_mov_stack_to_reg(ctx->writer, kRcx, saved_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, object_index);
+  return 0;
+}
+
+static int AST_compile_vector_set(CompilerContext *ctx, ASTNode *args,
+                                  int stack_index) {
+  return AST_compile_sequence_set(ctx, args, stack_index, /*string=*/false);
+}
+
+static int AST_compile_string_set(CompilerContext *ctx, ASTNode *args,
+                                  int stack_index) {
+  return AST_compile_sequence_set(ctx, args, stack_index, /*string=*/true);
+}
+
+// The length is the top of the header, so it only has to be shifted down to
+// where a fixnum's is.
+static int AST_compile_sequence_length(CompilerContext *ctx, ASTNode *args,
+                                       int stack_index, bool string) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRax,
+                             string ? kStringHeader : kVectorHeader);
+  Buffer_shr_reg(ctx->writer, kRax, kHeaderShift);
+  Buffer_shl_reg(ctx->writer, kRax, kFixnumShift);
+  return 0;
+}
+
+static int AST_compile_vector_length(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index) {
+  return AST_compile_sequence_length(ctx, args, stack_index,
+                                     /*string=*/false);
+}
+
+static int AST_compile_string_length(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index) {
+  return AST_compile_sequence_length(ctx, args, stack_index, /*string=*/true);
+}
+
+// (vector-fill! v x) and (string-fill! s c). A string's last word is filled
+// whole; the bytes past its end are padding.
+static int AST_compile_sequence_fill(CompilerContext *ctx, ASTNode *args,
+                                     int stack_index, bool string) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  int object_index = stack_index;
+  int fill_index = stack_index - kWordSize;
+  int call_index = stack_index - 2 * kWordSize;
+  AST_spill_slots(ctx, -kWordSize, call_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, object_index);
+  AST_emit_payload_words(ctx, string);
+  if (string) {
+    AST_emit_char_bytes(ctx, fill_index);
+  } else {
+    Buffer_mov_stack_to_reg(ctx->writer, kRax, fill_index);
+  }
+  Buffer_mov_stack_to_reg(ctx->writer, kRdi, object_index);
+  Buffer_add_reg_imm32(ctx->writer, kRdi, string ? kStringData : kVectorData);
+  AST_call_routine(ctx, kRoutineFill, call_index);
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, object_index);
+  return 0;
+}
+
+static int AST_compile_vector_fill(CompilerContext *ctx, ASTNode *args,
+                                   int stack_index) {
+  return AST_compile_sequence_fill(ctx, args, stack_index, /*string=*/false);
+}
+
+static int AST_compile_string_fill(CompilerContext *ctx, ASTNode *args,
+                                   int stack_index) {
+  return AST_compile_sequence_fill(ctx, args, stack_index, /*string=*/true);
+}
+
+// rax = the header of whichever of the strings or vectors in rdi and rdx is
+// shorter. Headers of the same kind compare the way their lengths do.
+static void AST_emit_shorter_header(CompilerContext *ctx, int32_t header) {
+  Label done = BufferWriter_new_label(ctx->writer);
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRdi, header);
+  Buffer_cmp_rax_reg_disp(ctx->writer, kRdx, header);
+  Buffer_jcc_label(ctx->writer, kBelowEqual, done);
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRdx, header);
+  BufferWriter_bind_label(ctx->writer, done);
+}
+
+// (vector-copy! to from): copy the elements of `from' over the first ones of
+// `to', as many as fit.
+static int AST_compile_vector_copy(CompilerContext *ctx, ASTNode *args,
+                                   int stack_index) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  int to_index = stack_index;
+  int from_index = stack_index - kWordSize;
+  int call_index = stack_index - 2 * kWordSize;
+  AST_spill_slots(ctx, -kWordSize, call_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdi, to_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdx, from_index);
+  AST_emit_shorter_header(ctx, kVectorHeader);
+  Buffer_shr_reg(ctx->writer, kRax, kHeaderShift);
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRcx, /*src=*/kRax);
+  Buffer_add_reg_imm32(ctx->writer, kRdi, kVectorData);
+  Buffer_add_reg_imm32(ctx->writer, kRdx, kVectorData);
+  AST_call_routine(ctx, kRoutineCopy, call_index);
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, to_index);
+  return 0;
+}
+
+// Find where the strings in the slots at stack_index and the one below first
+// differ, up to the end of the shorter one: leave the index in rax and that
+// length in the slot below them both. Their lengths match if `same_length',
+// which is checked first; if they don't, the flags are left not-equal and
+// this jumps to `done'. Leaves the register slots spilled.
+static void AST_emit_string_mismatch(CompilerContext *ctx, int stack_index,
+                                     bool same_length, Label done) {
+  int a_index = stack_index;
+  int b_index = stack_index - kWordSize;
+  int length_index = stack_index - 2 * kWordSize;
+  AST_spill_slots(ctx, -kWordSize, length_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdi, a_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdx, b_index);
+  if (same_length) {
+    Buffer_mov_reg_disp_to_rax(ctx->writer, kRdi, kStringHeader);
+    Buffer_cmp_rax_reg_disp(ctx->writer, kRdx, kStringHeader);
+    Buffer_jcc_label(ctx->writer, kNotEqual, done);
+  } else {
+    AST_emit_shorter_header(ctx, kStringHeader);
+  }
+  Buffer_shr_reg(ctx->writer, kRax, kHeaderShift);
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, length_index);
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRcx, /*src=*/kRax);
+  Buffer_add_reg_imm32(ctx->writer, kRdi, kStringData);
+  Buffer_add_reg_imm32(ctx->writer, kRdx, kStringData);
+  AST_call_routine(ctx, kRoutineMismatch, length_index - kWordSize);
+}
+
+static int AST_test_string_equal(CompilerContext *ctx, ASTNode *args,
+                                 int stack_index, Condition *cond) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Label done = BufferWriter_new_label(ctx->writer);
+  AST_emit_string_mismatch(ctx, stack_index, /*same_length=*/true, done);
+  Buffer_cmp_reg_stack(ctx->writer, kRax, stack_index - 2 * kWordSize);
+  BufferWriter_bind_label(ctx->writer, done);
+  // The reloads are movs, which leave the flags alone.
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  *cond = kEqual;
+  return 0;
+}
+
+// Compare the strings byte by byte, as unsigned chars; a string that runs
+// out first is the lesser.
+static int AST_test_string_less(CompilerContext *ctx, ASTNode *args,
+                                int stack_index, Condition *cond) {
+  int result = AST_compile_args_to_slots(ctx, args, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  int a_index = stack_index;
+  int b_index = stack_index - kWordSize;
+  Label differ = BufferWriter_new_label(ctx->writer);
+  Label done = BufferWriter_new_label(ctx->writer);
+  AST_emit_string_mismatch(ctx, stack_index, /*same_length=*/false, done);
+  Buffer_cmp_reg_stack(ctx->writer, kRax, stack_index - 2 * kWordSize);
+  Buffer_jcc_label(ctx->writer, kNotEqual, differ);
+  // One is a prefix of the other.
+  Buffer_mov_stack_to_reg(ctx->writer, kRdi, a_index);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdx, b_index);
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRdi, kStringHeader);
+  Buffer_cmp_rax_reg_disp(ctx->writer, kRdx, kStringHeader);
+  Buffer_jmp_label(ctx->writer, done);
+  BufferWriter_bind_label(ctx->writer, differ);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdi, a_index);
+  Buffer_add_reg_reg(ctx->writer, /*dst=*/kRdi, /*src=*/kRax);
+  Buffer_movzx_reg_byte_disp(ctx->writer, kRcx, kRdi, kStringData);
+  Buffer_mov_stack_to_reg(ctx->writer, kRdx, b_index);
+  Buffer_add_reg_reg(ctx->writer, /*dst=*/kRdx, /*src=*/kRax);
+  Buffer_movzx_reg_byte_disp(ctx->writer, kRax, kRdx, kStringData);
+  Buffer_cmp_reg_reg(ctx->writer, kRcx, kRax);
+  BufferWriter_bind_label(ctx->writer, done);
+  AST_reload_slots(ctx, -kWordSize, stack_index);
+  *cond = kBelow;
+  return 0;
+}
+
+static int AST_compile_code_form(CompilerContext *ctx, ASTNode *args,
+                                 int stack_index) {
+  (void)stack_index;
+  // The flow of control enters `code` in a new call frame. The stack looks
+  // like this:
+  //
+  // low addr
+  // --------
+  // .
+  // .
+  // .
+  // rsp   24: arg3
+  // rsp - 16: arg2
+  // rsp - 8 : arg1
+  // rsp     : return addr
+  // ~~~~~~~~~~~
+  // .
+  // .
+  // .
+  // ---------
+  // high addr
+  //
+  // Start stack_index over at -kWordSize -- the location of the first
+  // formal -- since the return address is at rsp.
+  ASTNode *body = operand2(args);
+  Routines routines;
+  AST_start_function(ctx, &routines);
+  if (ctx->options & kOptProfile) {
+    // The labels start with the one this is bound to.
+    Symbol *label = ctx->labels == NULL ? NULL : ctx->labels->name;
+    int32_t counter =
+        AST_add_profile_site(ctx, kProfileEntry, label, body->span_start,
+                             /*num_counters=*/1);
+    if (counter < 0) {
+      return -1;
+    }
+    AST_emit_count(ctx, counter);
+  }
+  if (ctx->options & kOptFold) {
+    body = AST_fold(ctx, body);
+  }
+  if (!((ctx->options & (kOptIR | kOptProfile | kOptOverflow)) == kOptIR &&
+        IR_compile_function(ctx, operand1(args), body))) {
+    int result =
+        AST_compile_code(ctx, /*formals=*/operand1(args), body, -kWordSize);
+    if (result != 0) {
+      return result;
+    }
+  }
+  AST_emit_slow_paths(ctx);
+  return 0;
+}
+
+static int AST_compile_labelcall_form(CompilerContext *ctx, ASTNode *args,
+                                      int stack_index) {
+  if (args == nil) {
+    fprintf(stderr, "labelcall needs a label\n");
+    return -1;
+  }
+  ASTNode *label = operand1(args);
+  assert(AST_is_atom(label));
+  Symbol *name = label->value.atom;
+  Label code_label;
+  if (!AST_lookup(ctx, ctx->labels, name, &code_label)) {
+    fprintf(stderr, "Unbound label: `%s'\n", name->name);
+    return -1;
+  }
+  return AST_compile_labelcall(ctx, /*label=*/code_label,
+                               /*args=*/AST_cdr(args), stack_index);
+}
+
+// (funcall f args...): a labelcall, if f was compiled as a function of its
+// own, or else a call of the closure f evaluates to.
+static int AST_compile_funcall(CompilerContext *ctx, ASTNode *args,
+                               int stack_index) {
+  if (args == nil) {
+    fprintf(stderr, "funcall needs a function\n");
+    return -1;
+  }
+  ASTNode *fn = operand1(args);
+  for (KnownFunction *known = ctx->known; known != NULL && AST_is_atom(fn);
+       known = known->next) {
+    if (known->name == fn->value.atom) {
+      return AST_compile_labelcall(
+          ctx, known->label,
+          AST_append_free_vars(ctx->arena, AST_cdr(args), known->free_vars),
+          stack_index);
+    }
+  }
+  return AST_compile_labelcall(ctx, kClosureLabel, args, stack_index);
+}
+
+static void Primitives_init() {
+  primitive_table.capacity = kNumBuiltinSymbols;
+  primitive_table.by_id = calloc(primitive_table.capacity, sizeof(Primitive));
+  assert(primitive_table.by_id != NULL);
+  Primitive_add("add1", 1, AST_compile_add1);
+  Primitive_add("sub1", 1, AST_compile_sub1);
+  Primitive_add("integer->char", 1, AST_compile_integer_to_char);
+  Primitive_add_test("zero?", 1, AST_test_zerop);
+  Primitive_add("+", 2, AST_compile_plus);
+  Primitive_add("-", 2, AST_compile_minus);
+  Primitive_add("*", 2, AST_compile_times);
+  Primitive_add("quotient", 2, AST_compile_quotient);
+  Primitive_add("remainder", 2, AST_compile_remainder);
+  Primitive_add("logand", 2, AST_compile_logand);
+  Primitive_add("logor", 2, AST_compile_logor);
+  Primitive_add_test("=", 2, AST_test_num_equal);
+  Primitive_add_test("<", 2, AST_test_less);
+  Primitive_add_test("<=", 2, AST_test_less_equal);
+  Primitive_add("let", 2, AST_compile_let_form);
+  Primitive_add("if", 3, AST_compile_if_form);
+  Primitive_add("cons", 2, AST_compile_cons_form);
+  Primitive_add("car", 1, AST_compile_car);
+  Primitive_add("cdr", 1, AST_compile_cdr);
+  Primitive_add("make-vector", 2, AST_compile_make_vector);
+  Primitive_add("vector-ref", 2, AST_compile_vector_ref);
+  Primitive_add("vector-set!", 3, AST_compile_vector_set);
+  Primitive_add("vector-length", 1, AST_compile_vector_length);
+  Primitive_add("vector-fill!", 2, AST_compile_vector_fill);
+  Primitive_add("vector-copy!", 2, AST_compile_vector_copy);
+  Primitive_add("make-string", 2, AST_compile_make_string);
+  Primitive_add("string-ref", 2, AST_compile_string_ref);
+  Primitive_add("string-set!", 3, AST_compile_string_set);
+  Primitive_add("string-length", 1, AST_compile_string_length);
+  Primitive_add("string-fill!", 2, AST_compile_string_fill);
+  Primitive_add_test("string=?", 2, AST_test_string_equal);
+  Primitive_add_test("string<?", 2, AST_test_string_less);
+  Primitive_add("lambda", 2, AST_compile_lambda);
+  Primitive_add("funcall", kVariadic, AST_compile_funcall);
+  Primitive_add("code", 2, AST_compile_code_form);
+  Primitive_add("labelcall", kVariadic, AST_compile_labelcall_form);
+}
+
+int AST_compile_call(CompilerContext *ctx, ASTNode *fnexpr, ASTNode *args,
+                     int stack_index) {
+  assert(AST_is_atom(fnexpr) && "unknown call");
+  // Assumed to be a primcall
+  Symbol *name = fnexpr->value.atom;
+  Primitive *primitive = Primitive_lookup(name);
+  if (primitive == NULL) {
+    fprintf(stderr, "Unknown primitive: `%s'\n", name->name);
+    return -1;
+  }
+  if (primitive->arity != kVariadic) {
+    int nargs = AST_list_length(args);
+    if (nargs != primitive->arity) {
+      fprintf(stderr, "`%s' takes %d argument(s) but was given %d\n",
+              name->name, primitive->arity, nargs);
+      return -1;
+    }
+  }
+  if (primitive->compile != NULL) {
+    return primitive->compile(ctx, args, stack_index);
+  }
+  // A predicate used as a value: turn the flags into a boolean object.
+  Condition cond;
+  int result = primitive->compile_test(ctx, args, stack_index, &cond);
+  if (result != 0) {
+    return result;
+  }
+  // setcc only writes al; movzx clears the rest of rax (in three bytes, where
+  // clearing it with a flag-preserving mov beforehand would take five).
+  Buffer_setcc_reg(ctx->writer, cond, kAl);
+  Buffer_movzx_reg_subreg(ctx->writer, kRax, kAl);
+  Buffer_shl_reg(ctx->writer, kRax, kBoolShift);
+  Buffer_or_reg_imm32(ctx->writer, kRax, kBoolTag);
+  return 0;
+}
+
+// With kOptGC, an expression that only allocates through builtins checks for
+// all of it at once, so that (cons 1 (cons 2 3)) makes one heap check rather
+// than two. One that can't be sized that way (see AST_heap_bytes) leaves its
+// subexpressions to check for themselves.
+static int AST_compile_reserving_heap(CompilerContext *ctx, ASTNode *node,
+                                      int stack_index) {
+  int budget = kHeapBytesBudget;
+  int32_t bytes = AST_heap_bytes(node, &budget);
+  if (bytes < 0) {
+    return AST_compile_call(ctx, AST_car(node), AST_cdr(node), stack_index);
+  }
+  if (bytes > 0) {
+    AST_emit_heap_check(ctx, bytes, stack_index, /*rax_live=*/false);
+  }
+  CompilerContext reserved = *ctx;
+  reserved.heap_reserved = true;
+  return AST_compile_call(&reserved, AST_car(node), AST_cdr(node),
+                          stack_index);
+}
+
+int AST_compile_expr(CompilerContext *ctx, ASTNode *node, int stack_index) {
+  if (ctx->tail) {
+    CompilerContext inner = *ctx;
+    inner.tail = false;
+    return AST_compile_expr(&inner, node, stack_index);
+  }
+  switch (node->type) {
+  case kFixnum: {
+    uint32_t value = (uint32_t)node->value.fixnum;
+    Buffer_load_reg_imm32(ctx->writer, kRax, encodeImmediateFixnum(value));
+    return 0;
+  }
+  case kChar:
+    Buffer_load_reg_imm32(ctx->writer, kRax,
+                          encodeImmediateChar(node->value.character));
+    return 0;
+  case kBool:
+    Buffer_load_reg_imm32(ctx->writer, kRax,
+                          encodeImmediateBool(node->value.boolean));
+    return 0;
+  case kCons: {
+    // Assumed to be in the form (<expr> <op1> <op2> ...)
+    if ((ctx->options & kOptGC) && !ctx->heap_reserved) {
+      return AST_compile_reserving_heap(ctx, node, stack_index);
+    }
+    return AST_compile_call(ctx, AST_car(node), AST_cdr(node), stack_index);
+  }
+  case kAtom:
+    return AST_compile_variable(ctx, node->value.atom);
+  }
+  assert(false && "unhandled expression type");
+  return -1;
+}
+
+// Compile `node' in tail position: its value is what the current function
+// returns. Every path through the code ends in a ret, or in a jmp for a
+// labelcall (see AST_compile_tail_labelcall).
+int AST_compile_tail_expr(CompilerContext *ctx, ASTNode *node,
+                          int stack_index) {
+  if (node->type == kCons && node != nil && AST_is_atom(AST_car(node)) &&
+      (AST_atom_is_builtin(AST_car(node), kSymIf) ||
+       AST_atom_is_builtin(AST_car(node), kSymLet) ||
+       AST_atom_is_builtin(AST_car(node), kSymLabelcall) ||
+       AST_atom_is_builtin(AST_car(node), kSymFuncall))) {
+    CompilerContext tail_ctx = *ctx;
+    tail_ctx.tail = true;
+    return AST_compile_call(&tail_ctx, AST_car(node), AST_cdr(node),
+                            stack_index);
+  }
+  int result = AST_compile_expr(ctx, node, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_ret(ctx->writer);
+  return 0;
+}
+
+// TODO: naming confusing because we have no concept of functions, really
+int AST_compile_function(CompilerContext *ctx, ASTNode *node) {
+  Routines routines;
+  AST_start_function(ctx, &routines);
+  if (ctx->options & kOptFold) {
+    node = AST_fold(ctx, node);
+  }
+  if (!((ctx->options & (kOptIR | kOptProfile | kOptOverflow)) == kOptIR &&
+        IR_compile_function(ctx, nil, node))) {
+    int result = AST_compile_tail_expr(ctx, node, -kWordSize);
+    if (result != 0) {
+      return result;
+    }
+  }
+  AST_emit_slow_paths(ctx);
+  AST_relax(ctx);
+  if (ctx->options & kOptGC) {
+    StackMaps_resolve(ctx->stack_maps, ctx->writer);
+  }
+  return 0;
+}
+
+// The entry point of a program, whose body is `node'.
+static int AST_compile_main(CompilerContext *ctx, ASTNode *node) {
+  if (ctx->options & kOptGC) {
+    // We are passed the Heap. Keep it in r11, run the body as a function of
+    // its own -- it may return from the end of a tail call -- and store rsi
+    // back into the Heap once it has.
+    Label body = BufferWriter_new_label(ctx->writer);
+    Buffer_mov_r11_reg(ctx->writer, kRdi);
+    Buffer_mov_r11_disp_to_reg(ctx->writer, kRsi, kHeapAlloc);
+    // The collector stops walking frames here.
+    Buffer_mov_reg_to_r11_disp(ctx->writer, kRsp, kHeapStackTop);
+    Buffer_call_label(ctx->writer, body);
+    Buffer_mov_reg_to_r11_disp(ctx->writer, kRsi, kHeapAlloc);
+    Buffer_ret(ctx->writer);
+    BufferWriter_bind_label(ctx->writer, body);
+    return AST_compile_function(ctx, node);
+  }
+  // Save the heap in rsi, our global heap pointer
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRsi, /*src=*/kRdi);
+  return AST_compile_function(ctx, node);
+}
+
+// labels is an environment mapping labels to code locations
+// this is different from other environments that track stack locations of
+// local variables and parameters
+// (labels ((lvar (code (...) ...)) ...)
+//         <exp>)
+// Example -2: No labels
+// 	(labels ()
+// 	  5)
+// Example -1: One label and don't use it
+// 	(labels (
+// 		(const (code () 5))
+// 	 	)
+// 	  5)
+// Example 0: No parameters
+// 	(labels (
+// 		(const (code () 5))
+// 	 	)
+// 	  (labelcall const))
+// Example 1: One param; return it
+// 	(labels (
+// 		(id (code (x) x))
+// 	 	)
+// 	  (labelcall id 5))
+// Example 2: Two params and use them
+// 	(labels (
+// 		(add (code (x y) (+ x y)))
+// 	 	)
+// 	  (labelcall add 1 2))
+// Example 3: Multiple labels in let* form (labels can use labels before them)
+// 	(labels (
+// 		(id (code (x) x))
+// 		(add (code (x y) (+ (labelcall id x) y)))
+// 	 	)
+// 	  (labelcall add 1 2))
+int AST_compile_labels(CompilerContext *ctx, ASTNode *bindings, ASTNode *body,
+                       Label body_label, int stack_index) {
+  if (bindings == nil) {
+    // Emit body; the jump over the labels lands here
+    BufferWriter_bind_label(ctx->writer, body_label);
+    if (ctx->label_symbols != NULL) {
+      ctx->label_symbols->body = body_label;
+    }
+    return AST_compile_main(ctx, body);
+  }
+  ASTNode *binding = AST_car(bindings);
+  ASTNode *name = AST_car(binding);
+  assert(name->type == kAtom);
+  ASTNode *exp = AST_car(AST_cdr(binding));
+  Label code_label = BufferWriter_new_label(ctx->writer);
+  BufferWriter_bind_label(ctx->writer, code_label);
+  if (ctx->label_symbols != NULL) {
+    LabelSymbols_add(ctx->label_symbols, name->value.atom, code_label);
+  }
+  EnvNode new_labels = Env_init(name->value.atom, code_label, ctx->labels);
+  CompilerContext new_ctx = CompilerContext_with_labels(ctx, &new_labels);
+  int result = AST_compile_expr(&new_ctx, exp, stack_index);
+  if (result != 0) {
+    return result;
+  }
+  return AST_compile_labels(&new_ctx, /*bindings=*/AST_cdr(bindings), body,
+                            body_label, stack_index);
+}
+
+// With kOptParallel, the functions of a `labels' form are split into runs of
+// consecutive ones, and each run is compiled into a writer of its own by
+// whichever of a pool of threads gets to it first. The functions' labels are
+// made up front in ctx's writer, and the others are set up to be appended to
+// it (see BufferWriter_init_appended), so calls and tail calls between
+// functions are written as fixups like any other. Once every run is compiled
+// they are appended to ctx's writer in order, and relaxing the whole program
+// at the end resolves those fixups just as it would have if the functions had
+// been written there directly. The scoping is the same as AST_compile_labels':
+// each function sees itself and the ones before it.
+//
+// The code comes out the same as without kOptParallel, except that with kOptGC
+// each run that allocates gets a GC stub of its own.
+
+// Runs per thread, so that a thread that gets quick ones can pick up more.
+static const int32_t kLabelsRunsPerThread = 4;
+
+typedef struct {
+  // The bindings of the run, and the index of the first of them.
+  ASTNode *bindings;
+  int32_t first;
+  int32_t num_functions;
+  // Where each function starts in `writer'.
+  int32_t *starts;
+  CompilerContext ctx;
+  Buffer buf;
+  BufferWriter writer;
+  Arena arena;
+  StackMaps stack_maps;
+  // What the run did, if ctx has stats.
+  Stats stats;
+  int result;
+} LabelsRun;
+
+typedef struct {
+  pthread_mutex_t lock;
+  LabelsRun *runs;
+  int32_t num_runs;
+  int32_t next;
+  // The label table, with an entry for each function.
+  EnvNode *labels;
+  int stack_index;
+} LabelsRuns;
+
+static void LabelsRun_compile(LabelsRuns *runs, LabelsRun *run) {
+  ASTNode *bindings = run->bindings;
+  for (int32_t i = 0; i < run->num_functions; i++) {
+    run->starts[i] = run->writer.pos;
+    CompilerContext ctx =
+        CompilerContext_with_labels(&run->ctx, &runs->labels[run->first + i]);
+    run->result = AST_compile_expr(&ctx, AST_car(AST_cdr(AST_car(bindings))),
+                                   runs->stack_index);
+    if (run->result != 0) {
+      return;
+    }
+    bindings = AST_cdr(bindings);
+  }
+}
+
+static void *LabelsRuns_work(void *arg) {
+  LabelsRuns *runs = arg;
+  while (true) {
+    pthread_mutex_lock(&runs->lock);
+    int32_t i = runs->next++;
+    pthread_mutex_unlock(&runs->lock);
+    if (i >= runs->num_runs) {
+      return NULL;
+    }
+    LabelsRun_compile(runs, &runs->runs[i]);
+  }
+}
+
+static int AST_compile_labels_in_parallel(CompilerContext *ctx,
+                                          ASTNode *bindings, ASTNode *body,
+                                          Label body_label, int stack_index) {
+  int32_t num_functions = AST_list_length(bindings);
+  EnvNode *labels = malloc(num_functions * sizeof *labels);
+  Label *code_labels = malloc(num_functions * sizeof *code_labels);
+  int32_t *starts = malloc(num_functions * sizeof *starts);
+  assert(labels != NULL && code_labels != NULL && starts != NULL);
+  int32_t i = 0;
+  for (ASTNode *b = bindings; b != nil; b = AST_cdr(b), i++) {
+    ASTNode *name = AST_car(AST_car(b));
+    assert(name->type == kAtom);
+    code_labels[i] = BufferWriter_new_label(ctx->writer);
+    labels[i] = Env_init(name->value.atom, code_labels[i],
+                         i == 0 ? ctx->labels : &labels[i - 1]);
+    if (ctx->label_symbols != NULL) {
+      LabelSymbols_add(ctx->label_symbols, name->value.atom, code_labels[i]);
+    }
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int32_t num_threads = num_cpus < num_functions ? (int32_t)num_cpus
+                                                 : num_functions;
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  int32_t num_runs = num_threads == 1 ? 1 : num_threads * kLabelsRunsPerThread;
+  if (num_runs > num_functions) {
+    num_runs = num_functions;
+  }
+  LabelsRun *runs = calloc(num_runs, sizeof *runs);
+  assert(runs != NULL);
+  ASTNode *b = bindings;
+  int32_t first = 0;
+  for (i = 0; i < num_runs; i++) {
+    LabelsRun *run = &runs[i];
+    // Spread the remainder over the first few runs.
+    run->num_functions =
+        num_functions / num_runs + (i < num_functions % num_runs);
+    run->first = first;
+    run->bindings = b;
+    run->starts = &starts[first];
+    for (int32_t f = 0; f < run->num_functions; f++) {
+      b = AST_cdr(b);
+    }
+    first += run->num_functions;
+    Buffer_init(&run->buf, 1);
+    BufferWriter_init_appended(&run->writer, &run->buf, ctx->writer);
+    // Folding allocates, and arenas aren't shared between threads.
+    Arena_init(&run->arena);
+    StackMaps_init(&run->stack_maps);
+    run->ctx = *ctx;
+    run->ctx.writer = &run->writer;
+    run->ctx.arena = &run->arena;
+    run->ctx.stack_maps = &run->stack_maps;
+    run->ctx.label_symbols = NULL;
+    if (ctx->stats != NULL) {
+      Stats_reset(&run->stats);
+      run->ctx.stats = &run->stats;
+    }
+  }
+  // The primitives are registered the first time anything looks one up; do
+  // that before the threads all look at once.
+  Primitive_lookup(Symbol_builtin(kSymLabels));
+  LabelsRuns work = {.runs = runs, .num_runs = num_runs, .labels = labels,
+                     .stack_index = stack_index};
+  int lock_result = pthread_mutex_init(&work.lock, /*attr=*/NULL);
+  assert(lock_result == 0);
+  (void)lock_result;
+  // This thread is one of them.
+  pthread_t *threads = malloc(num_threads * sizeof *threads);
+  assert(threads != NULL);
+  int32_t num_started = 0;
+  for (; num_started < num_threads - 1; num_started++) {
+    if (pthread_create(&threads[num_started], /*attr=*/NULL, LabelsRuns_work,
+                       &work) != 0) {
+      break;
+    }
+  }
+  LabelsRuns_work(&work);
+  for (int32_t t = 0; t < num_started; t++) {
+    pthread_join(threads[t], /*retval=*/NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&work.lock);
+
+  int result = 0;
+  for (i = 0; i < num_runs; i++) {
+    LabelsRun *run = &runs[i];
+    if (result == 0) {
+      result = run->result;
+    }
+    if (result == 0) {
+      size_t base = ctx->writer->pos;
+      int32_t delta = BufferWriter_append(ctx->writer, &run->writer);
+      for (int32_t f = 0; f < run->num_functions; f++) {
+        BufferWriter_bind_label_at(ctx->writer, code_labels[run->first + f],
+                                   base + run->starts[f]);
+      }
+      if (ctx->options & kOptGC) {
+        StackMaps_append(ctx->stack_maps, &run->stack_maps, delta);
+      }
+    }
+    if (ctx->stats != NULL) {
+      // The run's nodes are in its own arena, which AST_compile_recording
+      // doesn't see.
+      run->stats.ast_nodes += run->arena.num_nodes;
+      Stats_add(ctx->stats, &run->stats);
+    }
+    StackMaps_deinit(&run->stack_maps);
+    Arena_deinit(&run->arena);
+    BufferWriter_deinit(&run->writer);
+    Buffer_deinit(&run->buf);
+  }
+  free(runs);
+  free(starts);
+  free(code_labels);
+  if (result == 0) {
+    // Emit body; the jump over the labels lands here
+    BufferWriter_bind_label(ctx->writer, body_label);
+    if (ctx->label_symbols != NULL) {
+      ctx->label_symbols->body = body_label;
+    }
+    CompilerContext body_ctx =
+        CompilerContext_with_labels(ctx, &labels[num_functions - 1]);
+    result = AST_compile_main(&body_ctx, body);
+  }
+  free(labels);
+  return result;
+}
+
+ASTNode *AST_tag(ASTNode *node) {
+  assert(node->type == kCons);
+  ASTNode *tag = AST_car(node);
+  assert(tag->type == kAtom);
+  return tag;
+}
+
+// Whether `node' is a whole program, for embedders that take either a program
+// or a single expression to run.
+bool AST_is_labels_form(ASTNode *node) {
+  return node->type == kCons && node != nil && AST_is_atom(AST_car(node)) &&
+         AST_atom_is_builtin(AST_car(node), kSymLabels);
+}
+
+// (labels ((lvar <lexp>) ...)
+//         <exp>)
+static int AST_compile_labels_form(CompilerContext *ctx, ASTNode *prog) {
+  assert(prog->type == kCons);
+  ASTNode *tag = AST_tag(prog);
+  assert(tag->type == kAtom);
+  assert(AST_atom_is_builtin(tag, kSymLabels));
+  if (ctx->options & kOptInline) {
+    prog = AST_inline(ctx, prog);
+  }
+  ASTNode *args = AST_cdr(prog);
+  // Jump to body
+  Label body_label = BufferWriter_new_label(ctx->writer);
+  Buffer_jmp_label(ctx->writer, body_label);
+  // Emit labels & label-expressions
+  ASTNode *body = operand2(args);
+  ASTNode *bindings = operand1(args);
+  if ((ctx->options & (kOptParallel | kOptProfile)) == kOptParallel &&
+      bindings != nil) {
+    return AST_compile_labels_in_parallel(ctx, bindings, body, body_label,
+                                          /*stack_index=*/-kWordSize);
+  }
+  return AST_compile_labels(ctx, bindings, body, body_label,
+                            /*stack_index=*/-kWordSize);
+}
+
+// Compile `node' with `compile', recording it in ctx->stats if that is set.
+static int AST_compile_recording(CompilerContext *ctx, ASTNode *node,
+                                 int (*compile)(CompilerContext *, ASTNode *)) {
+  Stats *stats = ctx->stats;
+  if (stats == NULL) {
+    return compile(ctx, node);
+  }
+  size_t pos = ctx->writer->pos;
+  uint64_t num_nodes = ctx->arena->num_nodes;
+  uint64_t start = Stats_start(stats);
+  int result = compile(ctx, node);
+  Stats_stop(stats, kPhaseCompile, start);
+  stats->ast_nodes += ctx->arena->num_nodes - num_nodes;
+  if (result == 0) {
+    stats->code_bytes += ctx->writer->pos - pos;
+  }
+  return result;
+}
+
+// Compile a program that is just an expression.
+int AST_compile_entry(CompilerContext *ctx, ASTNode *node) {
+  return AST_compile_recording(ctx, node, AST_compile_main);
+}
+
+int AST_compile_prog(CompilerContext *ctx, ASTNode *prog) {
+  return AST_compile_recording(ctx, prog, AST_compile_labels_form);
+}
+
+// End AST
+
+// IR
+
+// With kOptIR, the body of each function (a `code' form, or the entry
+// expression) is first lowered to a linear three-address IR and the x86 is
+// emitted from that instead of straight from the AST. Instructions live in one
+// flat array and operate on virtual registers, which are just integers
+// numbered from 0. They are grouped into basic blocks, each of which ends in a
+// branch, jump, return or tail call. There are no loops inside a function
+// (even a tail call to itself starts the function afresh), so control only
+// ever flows forward and the blocks are laid out in an order where every jump
+// goes down.
+//
+// If the lowering meets something it can't express -- a primitive registered
+// by an embedder, a malformed form -- it gives up on that function. The
+// function is then compiled by the direct AST emitter as usual, which also
+// reports any errors. Both tiers use the same calling convention, so functions
+// compiled either way can call each other.
+
+typedef enum {
+  kIRConst,  // dst = imm
+  kIRParam,  // dst = formal number imm
+  kIRMove,   // dst = a
+  kIRAdd,    // dst = a + b
+  kIRAddImm, // dst = a + imm
+  kIRShlImm, // dst = a << imm
+  kIROrImm,  // dst = a | imm
+  kIRCompare, // dst = #t if a `cond' b holds (b kIRNone means 0), else #f
+  kIRLoad,   // dst = the word at address a + imm
+  kIRCons,   // dst = a new pair with car b and cdr a
+  kIRArg,    // outgoing argument number imm = a
+  kIRCall,   // dst = call the label imm with the outgoing arguments
+  kIRTailCall, // jump to the label imm with the outgoing arguments as ours
+  kIRBranch, // if a is #f goto block imm, else fall through to the next block
+  kIRCompareBranch, // unless a `cond' b (as for kIRCompare), goto block imm
+  kIRJump,   // goto block imm
+  kIRReturn, // return a
+} IROpcode;
+
+static const char *kIROpcodeNames[] = {
+    "const",  "param",          "move", "add",    "add",  "shl",
+    "or",     "compare",        "load", "cons",   "arg",  "call",
+    "tailcall", "branch", "branch.compare", "jump", "return",
+};
+
+// Indexed by Condition.
+static const char *kConditionNames[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+// Marks an unused operand. The backend evaluates every instruction in rax and
+// loads `a' into it first, so the operand computed last goes in `a' -- which
+// is why kIRCons keeps its cdr there.
+static const int32_t kIRNone = -1;
+
+typedef struct {
+  IROpcode op;
+  int32_t dst;
+  int32_t a;
+  int32_t b;
+  int32_t imm;
+  Condition cond; // for comparisons only
+} IRInsn;
+
+typedef struct {
+  // Index of the first instruction, or kIRNone until the block is started.
+  int32_t start;
+} IRBlock;
+
+typedef struct {
+  IRInsn *insns;
+  int32_t num_insns;
+  int32_t insns_capacity;
+  IRBlock *blocks;
+  int32_t num_blocks;
+  int32_t blocks_capacity;
+  int32_t num_vregs;
+  int32_t num_formals;
+  // Labels visible from this function, for resolving labelcall.
+  EnvNode *labels;
+} IRFunction;
+
+// Make room for at least one more element in a malloc'd array.
+static void *IR_grow(void *array, int32_t count, int32_t *capacity,
+                     size_t elem_size) {
+  if (count < *capacity) {
+    return array;
+  }
+  *capacity = *capacity == 0 ? 16 : *capacity * 2;
+  void *result = realloc(array, *capacity * elem_size);
+  assert(result != NULL);
+  return result;
+}
+
+void IR_init(IRFunction *fn, EnvNode *labels) {
+  memset(fn, 0, sizeof *fn);
+  fn->labels = labels;
+}
+
+void IR_deinit(IRFunction *fn) {
+  free(fn->insns);
+  free(fn->blocks);
+}
+
+int32_t IR_new_vreg(IRFunction *fn) { return fn->num_vregs++; }
+
+int32_t IR_new_block(IRFunction *fn) {
+  fn->blocks = IR_grow(fn->blocks, fn->num_blocks, &fn->blocks_capacity,
+                       sizeof *fn->blocks);
+  fn->blocks[fn->num_blocks].start = kIRNone;
+  return fn->num_blocks++;
+}
+
+// Start laying out `block' after the current last instruction.
+void IR_start_block(IRFunction *fn, int32_t block) {
+  assert(fn->blocks[block].start == kIRNone && "block already started");
+  fn->blocks[block].start = fn->num_insns;
+}
+
+void IR_emit(IRFunction *fn, IROpcode op, int32_t dst, int32_t a, int32_t b,
+             int32_t imm) {
+  fn->insns =
+      IR_grow(fn->insns, fn->num_insns, &fn->insns_capacity, sizeof *fn->insns);
+  fn->insns[fn->num_insns++] =
+      (IRInsn){.op = op, .dst = dst, .a = a, .b = b, .imm = imm};
+}
+
+// Emit a comparison of `a' against `b' (or 0, if b is kIRNone).
+static void IR_emit_compare(IRFunction *fn, IROpcode op, int32_t dst,
+                            int32_t a, int32_t b, Condition cond,
+                            int32_t block) {
+  IR_emit(fn, op, dst, a, b, block);
+  fn->insns[fn->num_insns - 1].cond = cond;
+}
+
+// Emit an instruction that defines a fresh vreg and return the vreg.
+static int32_t IR_emit_value(IRFunction *fn, IROpcode op, int32_t a, int32_t b,
+                             int32_t imm) {
+  int32_t dst = IR_new_vreg(fn);
+  IR_emit(fn, op, dst, a, b, imm);
+  return dst;
+}
+
+void IR_dump(IRFunction *fn, FILE *fp) {
+  for (int32_t i = 0; i < fn->num_insns; i++) {
+    for (int32_t block = 0; block < fn->num_blocks; block++) {
+      if (fn->blocks[block].start == i) {
+        fprintf(fp, "b%d:\n", block);
+      }
+    }
+    IRInsn *insn = &fn->insns[i];
+    fprintf(fp, "  ");
+    if (insn->dst != kIRNone) {
+      fprintf(fp, "v%d = ", insn->dst);
+    }
+    fprintf(fp, "%s", kIROpcodeNames[insn->op]);
+    if (insn->a != kIRNone) {
+      fprintf(fp, " v%d", insn->a);
+    }
+    if (insn->b != kIRNone) {
+      fprintf(fp, " v%d", insn->b);
+    }
+    if (insn->op == kIRCompare || insn->op == kIRCompareBranch) {
+      fprintf(fp, " %s", kConditionNames[insn->cond]);
+    }
+    switch (insn->op) {
+    case kIRConst:
+    case kIRParam:
+    case kIRAddImm:
+    case kIRShlImm:
+    case kIROrImm:
+    case kIRLoad:
+    case kIRArg:
+    case kIRCall:
+    case kIRTailCall:
+      fprintf(fp, " %d", insn->imm);
+      break;
+    case kIRBranch:
+    case kIRCompareBranch:
+    case kIRJump:
+      fprintf(fp, " b%d", insn->imm);
+      break;
+    default:
+      break;
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+// Lowering
+
+// The lowering functions store the vreg holding the value of the expression in
+// *result and return 0, or return -1 if the IR can't express the expression.
+// A NULL `result' means the expression is in tail position: rather than
+// producing a value, every path through it ends in a return or a tail call.
+// Locals are an Env mapping names to vregs instead of stack indices.
+static int IR_lower_expr(IRFunction *fn, EnvNode *locals, ASTNode *node,
+                         int32_t *result);
+
+static int IR_lower_let(IRFunction *fn, EnvNode *locals, ASTNode *bindings,
+                        ASTNode *body, int32_t *result) {
+  if (bindings == nil) {
+    return IR_lower_expr(fn, locals, body, result);
+  }
+  if (bindings->type != kCons) {
+    return -1;
+  }
+  ASTNode *binding = AST_car(bindings);
+  if (binding->type != kCons || binding == nil ||
+      AST_list_length(binding) != 2 || !AST_is_atom(AST_car(binding))) {
+    return -1;
+  }
+  int32_t value;
+  if (IR_lower_expr(fn, locals, operand2(binding), &value) != 0) {
+    return -1;
+  }
+  EnvNode new_locals = Env_init(AST_car(binding)->value.atom, value, locals);
+  return IR_lower_let(fn, &new_locals, AST_cdr(bindings), body, result);
+}
+
+// Lower `test' into a branch to `iffalse_block' when it doesn't hold. A
+// predicate branches on the comparison itself instead of making a boolean
+// first, like AST_compile_test.
+static int IR_lower_test(IRFunction *fn, EnvNode *locals, ASTNode *test,
+                         int32_t iffalse_block) {
+  if (test->type == kCons && test != nil && AST_is_atom(AST_car(test)) &&
+      AST_atom_is_builtin(AST_car(test), kSymZerop) &&
+      AST_list_length(AST_cdr(test)) == 1) {
+    int32_t value;
+    if (IR_lower_expr(fn, locals, operand1(AST_cdr(test)), &value) != 0) {
+      return -1;
+    }
+    IR_emit_compare(fn, kIRCompareBranch, kIRNone, value, kIRNone, kEqual,
+                    iffalse_block);
+    return 0;
+  }
+  int32_t value;
+  if (IR_lower_expr(fn, locals, test, &value) != 0) {
+    return -1;
+  }
+  IR_emit(fn, kIRBranch, kIRNone, value, kIRNone, iffalse_block);
+  return 0;
+}
+
+static int IR_lower_if(IRFunction *fn, EnvNode *locals, ASTNode *args,
+                       int32_t *result) {
+  int32_t iftrue_block = IR_new_block(fn);
+  int32_t iffalse_block = IR_new_block(fn);
+  if (IR_lower_test(fn, locals, operand1(args), iffalse_block) != 0) {
+    return -1;
+  }
+  IR_start_block(fn, iftrue_block);
+  if (result == NULL) {
+    // Both arms leave the function, so there is nothing to join.
+    if (IR_lower_expr(fn, locals, operand2(args), NULL) != 0) {
+      return -1;
+    }
+    IR_start_block(fn, iffalse_block);
+    return IR_lower_expr(fn, locals, operand3(args), NULL);
+  }
+  int32_t join = IR_new_vreg(fn);
+  int32_t join_block = IR_new_block(fn);
+  int32_t value;
+  if (IR_lower_expr(fn, locals, operand2(args), &value) != 0) {
+    return -1;
+  }
+  IR_emit(fn, kIRMove, join, value, kIRNone, 0);
+  IR_emit(fn, kIRJump, kIRNone, kIRNone, kIRNone, join_block);
+  IR_start_block(fn, iffalse_block);
+  if (IR_lower_expr(fn, locals, operand3(args), &value) != 0) {
+    return -1;
+  }
+  IR_emit(fn, kIRMove, join, value, kIRNone, 0);
+  IR_emit(fn, kIRJump, kIRNone, kIRNone, kIRNone, join_block);
+  IR_start_block(fn, join_block);
+  *result = join;
+  return 0;
+}
+
+static int IR_lower_labelcall(IRFunction *fn, EnvNode *locals, ASTNode *args,
+                              int32_t *result) {
+  if (args == nil || !AST_is_atom(operand1(args))) {
+    return -1;
+  }
+  Label code_label;
+  if (!Env_lookup(fn->labels, operand1(args)->value.atom, &code_label)) {
+    return -1;
+  }
+  // Evaluate all of the arguments before storing any of them, since an
+  // argument that makes a call of its own would clobber the outgoing area.
+  args = AST_cdr(args);
+  int nargs = AST_list_length(args);
+  int32_t *values = malloc((nargs + 1) * sizeof *values);
+  assert(values != NULL);
+  for (int i = 0; i < nargs; i++, args = AST_cdr(args)) {
+    if (IR_lower_expr(fn, locals, AST_car(args), &values[i]) != 0) {
+      free(values);
+      return -1;
+    }
+  }
+  for (int i = 0; i < nargs; i++) {
+    IR_emit(fn, kIRArg, kIRNone, values[i], kIRNone, i);
+  }
+  free(values);
+  if (result == NULL) {
+    IR_emit(fn, kIRTailCall, kIRNone, kIRNone, kIRNone, code_label);
+    return 0;
+  }
+  *result = IR_emit_value(fn, kIRCall, kIRNone, kIRNone, code_label);
+  return 0;
+}
+
+static int IR_lower_call(IRFunction *fn, EnvNode *locals, ASTNode *fnexpr,
+                         ASTNode *args, int32_t *result) {
+  if (!AST_is_atom(fnexpr)) {
+    return -1;
+  }
+  Symbol *name = fnexpr->value.atom;
+  Primitive *primitive = Primitive_lookup(name);
+  if (primitive == NULL || name->id >= kNumBuiltinSymbols) {
+    return -1;
+  }
+  if (primitive->arity != kVariadic &&
+      AST_list_length(args) != primitive->arity) {
+    return -1;
+  }
+  int32_t a = kIRNone, b = kIRNone;
+  switch ((BuiltinSymbol)name->id) {
+  case kSymAdd1:
+  case kSymSub1:
+  case kSymIntegerToChar:
+  case kSymZerop:
+  case kSymCar:
+  case kSymCdr:
+    if (IR_lower_expr(fn, locals, operand1(args), &a) != 0) {
+      return -1;
+    }
+    break;
+  default:
+    break;
+  }
+  switch ((BuiltinSymbol)name->id) {
+  case kSymAdd1:
+    *result =
+        IR_emit_value(fn, kIRAddImm, a, kIRNone, encodeImmediateFixnum(1));
+    return 0;
+  case kSymSub1:
+    *result =
+        IR_emit_value(fn, kIRAddImm, a, kIRNone, encodeImmediateFixnum(-1));
+    return 0;
+  case kSymIntegerToChar:
+    a = IR_emit_value(fn, kIRShlImm, a, kIRNone, kCharShift - kFixnumShift);
+    *result = IR_emit_value(fn, kIROrImm, a, kIRNone, kCharTag);
+    return 0;
+  case kSymZerop:
+    *result = IR_new_vreg(fn);
+    IR_emit_compare(fn, kIRCompare, *result, a, kIRNone, kEqual, 0);
+    return 0;
+  case kSymCar:
+    // Heap addresses are biased by 1; see AST_compile_car.
+    *result = IR_emit_value(fn, kIRLoad, a, kIRNone, -1);
+    return 0;
+  case kSymCdr:
+    *result = IR_emit_value(fn, kIRLoad, a, kIRNone, kWordSize - 1);
+    return 0;
+  case kSymPlus:
+    // Same evaluation order as AST_compile_plus.
+    if (IR_lower_expr(fn, locals, operand2(args), &b) != 0 ||
+        IR_lower_expr(fn, locals, operand1(args), &a) != 0) {
+      return -1;
+    }
+    *result = IR_emit_value(fn, kIRAdd, a, b, 0);
+    return 0;
+  case kSymCons:
+    if (IR_lower_expr(fn, locals, operand1(args), &b) != 0 ||
+        IR_lower_expr(fn, locals, operand2(args), &a) != 0) {
+      return -1;
+    }
+    *result = IR_emit_value(fn, kIRCons, a, b, 0);
+    return 0;
+  case kSymLet:
+    return IR_lower_let(fn, locals, operand1(args), operand2(args), result);
+  case kSymIf:
+    return IR_lower_if(fn, locals, args, result);
+  case kSymLabelcall:
+    return IR_lower_labelcall(fn, locals, args, result);
+  default:
+    // `code' and `labels' only make sense at the top level.
+    return -1;
+  }
+}
+
+static int IR_lower_expr(IRFunction *fn, EnvNode *locals, ASTNode *node,
+                         int32_t *result) {
+  if (result == NULL &&
+      !(node->type == kCons && node != nil && AST_is_atom(AST_car(node)) &&
+        (AST_atom_is_builtin(AST_car(node), kSymIf) ||
+         AST_atom_is_builtin(AST_car(node), kSymLet) ||
+         AST_atom_is_builtin(AST_car(node), kSymLabelcall)))) {
+    // Nothing to pass the tail position on to: return the value.
+    int32_t value;
+    if (IR_lower_expr(fn, locals, node, &value) != 0) {
+      return -1;
+    }
+    IR_emit(fn, kIRReturn, kIRNone, value, kIRNone, 0);
+    return 0;
+  }
+  switch (node->type) {
+  case kFixnum:
+    *result = IR_emit_value(fn, kIRConst, kIRNone, kIRNone,
+                            encodeImmediateFixnum(node->value.fixnum));
+    return 0;
+  case kChar:
+    *result = IR_emit_value(fn, kIRConst, kIRNone, kIRNone,
+                            encodeImmediateChar(node->value.character));
+    return 0;
+  case kBool:
+    *result = IR_emit_value(fn, kIRConst, kIRNone, kIRNone,
+                            encodeImmediateBool(node->value.boolean));
+    return 0;
+  case kAtom:
+    return Env_lookup(locals, node->value.atom, result) ? 0 : -1;
+  case kCons:
+    if (node == nil) {
+      return -1;
+    }
+    return IR_lower_call(fn, locals, AST_car(node), AST_cdr(node), result);
+  }
+  return -1;
+}
+
+static int IR_lower_formals(IRFunction *fn, EnvNode *locals, ASTNode *formals,
+                            ASTNode *body) {
+  if (formals == nil) {
+    return IR_lower_expr(fn, locals, body, /*result=*/NULL);
+  }
+  if (formals->type != kCons || !AST_is_atom(AST_car(formals))) {
+    return -1;
+  }
+  int32_t param =
+      IR_emit_value(fn, kIRParam, kIRNone, kIRNone, fn->num_formals++);
+  EnvNode new_locals = Env_init(AST_car(formals)->value.atom, param, locals);
+  return IR_lower_formals(fn, &new_locals, AST_cdr(formals), body);
+}
+
+// Lower a function taking `formals' and returning `body' into `fn'. Return 0
+// on success and -1 if the IR can't express it.
+int IR_lower_function(IRFunction *fn, ASTNode *formals, ASTNode *body) {
+  IR_start_block(fn, IR_new_block(fn));
+  return IR_lower_formals(fn, /*locals=*/NULL, formals, body);
+}
+
+// End Lowering
+
+// Register allocation
+
+// Linear scan over live intervals. Since control only flows forward, a vreg is
+// live exactly from its first definition to its last use in layout order (a
+// vreg that merges the arms of an `if' is defined in both, and its interval
+// covers both). Intervals are visited in order of their start; when the
+// register pool is exhausted the interval that ends last is the one spilled.
+//
+// The pool is kSlotRegisters, the same caller-saved registers the direct
+// emitter uses. Rather than saving them around each call, an interval that
+// spans a call is given a stack slot to begin with. A value that is used only
+// by the very next instruction never leaves rax at all.
+
+typedef enum {
+  kIRInRax,
+  kIRInRegister,
+  kIROnStack,
+} IRLocationKind;
+
+typedef struct {
+  IRLocationKind kind;
+  Register reg;
+  int32_t offset; // from rsp, for kIROnStack
+} IRLocation;
+
+typedef struct {
+  int32_t start; // index of the first definition
+  int32_t end;   // index of the last definition or use
+  int32_t last_def;
+  int32_t defs;
+  int32_t uses;
+} IRInterval;
+
+typedef struct {
+  IRLocation *locations;
+  // Kept for the backend, which needs to know what is live at each call with
+  // kOptGC.
+  IRInterval *intervals;
+  // Stack index of the return address slot when this function makes a call;
+  // the outgoing arguments go below it.
+  int32_t call_index;
+} IRAllocation;
+
+static void IR_add_use(IRInterval *intervals, int32_t vreg, int32_t index) {
+  if (vreg == kIRNone) {
+    return;
+  }
+  intervals[vreg].uses++;
+  if (index > intervals[vreg].end) {
+    intervals[vreg].end = index;
+  }
+}
+
+static IRInterval *IR_compute_intervals(IRFunction *fn) {
+  IRInterval *intervals = malloc((fn->num_vregs + 1) * sizeof *intervals);
+  assert(intervals != NULL);
+  for (int32_t v = 0; v < fn->num_vregs; v++) {
+    intervals[v] = (IRInterval){.start = INT32_MAX, .end = -1};
+  }
+  for (int32_t i = 0; i < fn->num_insns; i++) {
+    IRInsn *insn = &fn->insns[i];
+    IR_add_use(intervals, insn->a, i);
+    IR_add_use(intervals, insn->b, i);
+    if (insn->dst != kIRNone) {
+      IRInterval *interval = &intervals[insn->dst];
+      interval->defs++;
+      interval->last_def = i;
+      if (i < interval->start) {
+        interval->start = i;
+      }
+      if (i > interval->end) {
+        interval->end = i;
+      }
+    }
+  }
+  return intervals;
+}
+
+// Give `vreg' a stack slot that is free for the whole of its interval.
+static void IR_assign_slot(IRFunction *fn, IRInterval *intervals,
+                           IRLocation *locations, int32_t vreg,
+                           int32_t **slot_busy_until, int32_t *num_slots,
+                           int32_t *slots_capacity) {
+  IRInsn *def = &fn->insns[intervals[vreg].start];
+  if (def->op == kIRParam) {
+    // Formals already have a home.
+    locations[vreg] = (IRLocation){.kind = kIROnStack,
+                                   .offset = -kWordSize * (def->imm + 1)};
+    return;
+  }
+  int32_t slot = 0;
+  while (slot < *num_slots &&
+         (*slot_busy_until)[slot] >= intervals[vreg].start) {
+    slot++;
+  }
+  if (slot == *num_slots) {
+    *slot_busy_until =
+        IR_grow(*slot_busy_until, *num_slots, slots_capacity, sizeof(int32_t));
+    (*num_slots)++;
+  }
+  (*slot_busy_until)[slot] = intervals[vreg].end;
+  locations[vreg] = (IRLocation){
+      .kind = kIROnStack,
+      .offset = -kWordSize * (fn->num_formals + 1 + slot)};
+}
+
+// Fill in `allocation' for every vreg in `fn'.
+void IR_allocate(IRFunction *fn, IRAllocation *allocation) {
+  IRInterval *intervals = IR_compute_intervals(fn);
+  IRLocation *locations = calloc(fn->num_vregs + 1, sizeof *locations);
+  assert(locations != NULL);
+  // calls_before[i] is the number of calls at indices below i.
+  int32_t *calls_before = malloc((fn->num_insns + 1) * sizeof *calls_before);
+  assert(calls_before != NULL);
+  calls_before[0] = 0;
+  for (int32_t i = 0; i < fn->num_insns; i++) {
+    calls_before[i + 1] = calls_before[i] + (fn->insns[i].op == kIRCall);
+  }
+  int32_t owners[kNumSlotRegisters];
+  for (int r = 0; r < kNumSlotRegisters; r++) {
+    owners[r] = kIRNone;
+  }
+  int32_t *slot_busy_until = NULL;
+  int32_t num_slots = 0, slots_capacity = 0;
+  for (int32_t i = 0; i < fn->num_insns; i++) {
+    int32_t vreg = fn->insns[i].dst;
+    if (vreg == kIRNone || intervals[vreg].start != i) {
+      continue;
+    }
+    IRInterval *interval = &intervals[vreg];
+    // A value nobody uses can be left in rax to be overwritten.
+    if (interval->uses == 0 ||
+        (interval->defs == 1 && interval->uses == 1 &&
+         interval->end == i + 1 && fn->insns[i + 1].a == vreg)) {
+      locations[vreg].kind = kIRInRax;
+      continue;
+    }
+    if (calls_before[interval->end] - calls_before[i + 1] > 0) {
+      IR_assign_slot(fn, intervals, locations, vreg, &slot_busy_until,
+                     &num_slots, &slots_capacity);
+      continue;
+    }
+    // Expire the intervals that are over. One that ends here can hand its
+    // register over: instructions read their operands before writing dst.
+    int free_reg = -1;
+    int furthest = -1;
+    for (int r = 0; r < kNumSlotRegisters; r++) {
+      if (owners[r] != kIRNone && intervals[owners[r]].end <= i) {
+        owners[r] = kIRNone;
+      }
+      if (owners[r] == kIRNone) {
+        if (free_reg < 0) {
+          free_reg = r;
+        }
+      } else if (furthest < 0 ||
+                 intervals[owners[r]].end > intervals[owners[furthest]].end) {
+        furthest = r;
+      }
+    }
+    if (free_reg < 0 && intervals[owners[furthest]].end > interval->end) {
+      IR_assign_slot(fn, intervals, locations, owners[furthest],
+                     &slot_busy_until, &num_slots, &slots_capacity);
+      free_reg = furthest;
+    }
+    if (free_reg < 0) {
+      IR_assign_slot(fn, intervals, locations, vreg, &slot_busy_until,
+                     &num_slots, &slots_capacity);
+      continue;
+    }
+    owners[free_reg] = vreg;
+    locations[vreg] = (IRLocation){.kind = kIRInRegister,
+                                   .reg = kSlotRegisters[free_reg]};
+  }
+  free(slot_busy_until);
+  free(calls_before);
+  allocation->locations = locations;
+  allocation->intervals = intervals;
+  allocation->call_index = -kWordSize * (fn->num_formals + num_slots + 1);
+}
+
+// End Register allocation
+
+// x86 backend
+
+typedef struct {
+  BufferWriter *writer;
+  IRFunction *fn;
+  IRAllocation *allocation;
+  // The vreg whose value is currently in rax, or kIRNone.
+  int32_t rax_holds;
+  // Outgoing arguments stored since the last call
+  int32_t num_args;
+  // The label at the start of each block
+  Label *block_labels;
+  // With kOptGC, where the stack maps go, and how many of the bytes the last
+  // heap check covered are still to be allocated.
+  StackMaps *stack_maps;
+  int32_t heap_reserved;
+} IREmitter;
+
+static IRLocation *IR_location(IREmitter *emitter, int32_t vreg) {
+  return &emitter->allocation->locations[vreg];
+}
+
+static void IR_load_rax(IREmitter *emitter, int32_t vreg) {
+  if (emitter->rax_holds == vreg) {
+    return;
+  }
+  IRLocation *loc = IR_location(emitter, vreg);
+  assert(loc->kind != kIRInRax && "value has left rax");
+  if (loc->kind == kIRInRegister) {
+    Buffer_mov_reg_reg(emitter->writer, /*dst=*/kRax, /*src=*/loc->reg);
+  } else {
+    Buffer_mov_stack_to_reg(emitter->writer, kRax, loc->offset);
+  }
+  emitter->rax_holds = vreg;
+}
+
+static void IR_store_rax(IREmitter *emitter, int32_t vreg) {
+  IRLocation *loc = IR_location(emitter, vreg);
+  if (loc->kind == kIRInRegister) {
+    Buffer_mov_reg_reg(emitter->writer, /*dst=*/loc->reg, /*src=*/kRax);
+  } else if (loc->kind == kIROnStack) {
+    Buffer_mov_reg_to_stack(emitter->writer, kRax, loc->offset);
+  }
+  emitter->rax_holds = vreg;
+}
+
+// Jump to `block' if `cond' holds, or always if `always'.
+static void IR_emit_jump(IREmitter *emitter, bool always, Condition cond,
+                         int32_t block) {
+  if (!always) {
+    Buffer_jcc_label(emitter->writer, cond, emitter->block_labels[block]);
+  } else {
+    Buffer_jmp_label(emitter->writer, emitter->block_labels[block]);
+  }
+}
+
+static void IR_place_block(IREmitter *emitter, int32_t block) {
+  BufferWriter_bind_label(emitter->writer, emitter->block_labels[block]);
+  // Control can come in from elsewhere, so rax holds nothing in particular
+  // and the heap check before it may not have been made.
+  emitter->rax_holds = kIRNone;
+  emitter->heap_reserved = 0;
+}
+
+// Whether `vreg' holds a value at instruction `index' that is used there or
+// later (`after' only counts later uses). A vreg that merges the arms of an
+// `if' only holds its value once it is past its last definition; before that,
+// in the second arm, its location still holds whatever it held before.
+static bool IR_is_live(IREmitter *emitter, int32_t vreg, int32_t index,
+                       bool after) {
+  IRInterval *interval = &emitter->allocation->intervals[vreg];
+  int32_t defined = interval->defs == 1 ? interval->start : interval->last_def;
+  return defined < index &&
+         (after ? interval->end > index : interval->end >= index);
+}
+
+// Mark what is live at instruction `index' in stack map `entry'.
+static void IR_mark_live(IREmitter *emitter, int32_t entry, int32_t index,
+                         bool after) {
+  for (int32_t vreg = 0; vreg < emitter->fn->num_vregs; vreg++) {
+    if (!IR_is_live(emitter, vreg, index, after)) {
+      continue;
+    }
+    IRLocation *loc = IR_location(emitter, vreg);
+    if (loc->kind == kIRInRegister) {
+      StackMaps_mark_register(emitter->stack_maps, entry, loc->reg);
+    } else if (loc->kind == kIROnStack) {
+      StackMaps_mark_slot(emitter->stack_maps, entry, loc->offset);
+    }
+  }
+  if (emitter->rax_holds != kIRNone &&
+      IR_is_live(emitter, emitter->rax_holds, index, after)) {
+    StackMaps_mark_register(emitter->stack_maps, entry, kRax);
+  }
+}
+
+// Before the cons at `index', make sure there is room in the heap. One check
+// covers the rest of the conses in the block, up to the next call.
+static void IR_reserve_heap(IREmitter *emitter, int32_t index) {
+  if (emitter->heap_reserved > 0) {
+    return;
+  }
+  IRFunction *fn = emitter->fn;
+  int32_t bytes = 0;
+  for (int32_t i = index; i < fn->num_insns; i++) {
+    IROpcode op = fn->insns[i].op;
+    if (op == kIRCons) {
+      bytes += 2 * kWordSize;
+    } else if (op == kIRCall || op == kIRTailCall || op == kIRBranch ||
+               op == kIRCompareBranch || op == kIRJump || op == kIRReturn) {
+      break;
+    }
+  }
+  int32_t entry = Heap_emit_check(emitter->writer, emitter->stack_maps, bytes,
+                                  emitter->allocation->call_index);
+  IR_mark_live(emitter, entry, index, /*after=*/false);
+  emitter->heap_reserved = bytes;
+}
+
+// Set the flags for comparing `a' against `b' (or 0).
+static void IR_emit_cmp(IREmitter *emitter, IRInsn *insn) {
+  IR_load_rax(emitter, insn->a);
+  if (insn->b == kIRNone) {
+    Buffer_cmp_reg_imm32(emitter->writer, kRax, 0);
+    return;
+  }
+  IRLocation *loc = IR_location(emitter, insn->b);
+  if (loc->kind == kIRInRegister) {
+    Buffer_cmp_reg_reg(emitter->writer, kRax, loc->reg);
+  } else {
+    assert(loc->kind == kIROnStack);
+    Buffer_cmp_reg_stack(emitter->writer, kRax, loc->offset);
+  }
+}
+
+static void IR_emit_insn(IREmitter *emitter, int32_t index) {
+  IRFunction *fn = emitter->fn;
+  BufferWriter *writer = emitter->writer;
+  IRInsn *insn = &fn->insns[index];
+  switch (insn->op) {
+  case kIRConst: {
+    IRLocation *loc = IR_location(emitter, insn->dst);
+    if (loc->kind == kIRInRegister) {
+      Buffer_load_reg_imm32(writer, loc->reg, insn->imm);
+      return;
+    }
+    Buffer_load_reg_imm32(writer, kRax, insn->imm);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  }
+  case kIRParam: {
+    IRLocation *loc = IR_location(emitter, insn->dst);
+    int32_t home = -kWordSize * (insn->imm + 1);
+    if (loc->kind == kIRInRegister) {
+      Buffer_mov_stack_to_reg(writer, loc->reg, home);
+    } else if (loc->kind == kIRInRax) {
+      Buffer_mov_stack_to_reg(writer, kRax, home);
+      emitter->rax_holds = insn->dst;
+    }
+    return;
+  }
+  case kIRMove: {
+    IRLocation *dst = IR_location(emitter, insn->dst);
+    IRLocation *src = IR_location(emitter, insn->a);
+    if (dst->kind == kIRInRegister && src->kind == kIRInRegister) {
+      if (dst->reg != src->reg) {
+        Buffer_mov_reg_reg(writer, dst->reg, src->reg);
+      }
+      if (emitter->rax_holds == insn->dst) {
+        emitter->rax_holds = kIRNone;
+      }
+      return;
+    }
+    IR_load_rax(emitter, insn->a);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  }
+  case kIRAdd: {
+    IR_load_rax(emitter, insn->a);
+    IRLocation *loc = IR_location(emitter, insn->b);
+    // 32-bit, like AST_compile_plus, so the sum is zero-extended.
+    if (loc->kind == kIRInRegister) {
+      Buffer_alu32_reg_reg(writer, kAlu32Add, /*dst=*/kRax, /*src=*/loc->reg);
+    } else {
+      assert(loc->kind == kIROnStack);
+      Buffer_alu32_reg_stack(writer, kAlu32Add, kRax, loc->offset);
+    }
+    IR_store_rax(emitter, insn->dst);
+    return;
+  }
+  case kIRAddImm:
+    IR_load_rax(emitter, insn->a);
+    Buffer_add_reg_imm32(writer, kRax, insn->imm);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIRShlImm:
+    IR_load_rax(emitter, insn->a);
+    Buffer_shl_reg(writer, kRax, insn->imm);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIROrImm:
+    IR_load_rax(emitter, insn->a);
+    Buffer_or_reg_imm32(writer, kRax, insn->imm);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIRCompare:
+    IR_emit_cmp(emitter, insn);
+    Buffer_setcc_reg(writer, insn->cond, kAl);
+    Buffer_movzx_reg_subreg(writer, kRax, kAl);
+    Buffer_shl_reg(writer, kRax, kBoolShift);
+    Buffer_or_reg_imm32(writer, kRax, kBoolTag);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIRLoad:
+    IR_load_rax(emitter, insn->a);
+    Buffer_mov_reg_disp_to_rax(writer, /*src=*/kRax, insn->imm);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIRCons:
+    if (emitter->stack_maps != NULL) {
+      IR_reserve_heap(emitter, index);
+      emitter->heap_reserved -= 2 * kWordSize;
+    }
+    IR_load_rax(emitter, insn->a);
+    Buffer_mov_rax_to_reg_disp(writer, kRsi, kWordSize);
+    IR_load_rax(emitter, insn->b);
+    Buffer_mov_rax_to_reg_disp(writer, kRsi, 0);
+    Buffer_mov_reg_reg(writer, /*dst=*/kRax, /*src=*/kRsi);
+    Buffer_or_reg_imm32(writer, /*dst=*/kRax, kPairTag);
+    Buffer_add_reg_imm32(writer, /*dst=*/kRsi, 2 * kWordSize);
+    IR_store_rax(emitter, insn->dst);
+    return;
+  case kIRArg: {
+    int32_t offset =
+        emitter->allocation->call_index - kWordSize * (insn->imm + 1);
+    IRLocation *loc = IR_location(emitter, insn->a);
+    emitter->num_args++;
+    if (loc->kind == kIRInRegister) {
+      Buffer_mov_reg_to_stack(writer, loc->reg, offset);
+      return;
+    }
+    IR_load_rax(emitter, insn->a);
+    Buffer_mov_reg_to_stack(writer, kRax, offset);
+    return;
+  }
+  case kIRCall: {
+    int32_t rsp_adjust = emitter->allocation->call_index + kWordSize;
+    if (rsp_adjust != 0) {
+      Buffer_add_rsp_imm32(writer, rsp_adjust);
+    }
+    Buffer_call_label(writer, insn->imm);
+    if (emitter->stack_maps != NULL) {
+      Label ret = BufferWriter_new_label(writer);
+      BufferWriter_bind_label(writer, ret);
+      int32_t entry = StackMaps_add(emitter->stack_maps, ret,
+                                    emitter->allocation->call_index);
+      IR_mark_live(emitter, entry, index, /*after=*/true);
+      // The callee may have allocated.
+      emitter->heap_reserved = 0;
+    }
+    if (rsp_adjust != 0) {
+      Buffer_add_rsp_imm32(writer, -rsp_adjust);
+    }
+    emitter->num_args = 0;
+    emitter->rax_holds = kIRNone;
+    IR_store_rax(emitter, insn->dst);
+    return;
+  }
+  case kIRTailCall:
+    // Move the outgoing arguments up over our formals, in order: the outgoing
+    // area is below everything else in the frame, so nothing still to be
+    // moved gets overwritten. The callee returns straight to our caller.
+    for (int32_t i = 0; i < emitter->num_args; i++) {
+      Buffer_mov_stack_to_reg(
+          writer, kRax,
+          emitter->allocation->call_index - kWordSize * (i + 1));
+      Buffer_mov_reg_to_stack(writer, kRax, -kWordSize * (i + 1));
+    }
+    emitter->num_args = 0;
+    emitter->rax_holds = kIRNone;
+    Buffer_jmp_label(writer, insn->imm);
+    return;
+  case kIRBranch:
+    // The next block is the one we fall through to.
+    assert(index + 1 < fn->num_insns);
+    IR_load_rax(emitter, insn->a);
+    Buffer_cmp_reg_imm32(writer, kRax, encodeImmediateBool(false));
+    IR_emit_jump(emitter, /*always=*/false, kEqual, insn->imm);
+    return;
+  case kIRCompareBranch:
+    assert(index + 1 < fn->num_insns);
+    IR_emit_cmp(emitter, insn);
+    IR_emit_jump(emitter, /*always=*/false, Condition_negate(insn->cond),
+                 insn->imm);
+    return;
+  case kIRJump:
+    if (fn->blocks[insn->imm].start != index + 1) {
+      IR_emit_jump(emitter, /*always=*/true, kEqual, insn->imm);
+    }
+    return;
+  case kIRReturn:
+    IR_load_rax(emitter, insn->a);
+    Buffer_ret(writer);
+    return;
+  }
+  assert(false && "unhandled IR opcode");
+}
+
+// `stack_maps' is NULL unless the code is compiled with kOptGC.
+void IR_emit_function(IRFunction *fn, IRAllocation *allocation,
+                      BufferWriter *writer, StackMaps *stack_maps) {
+  IREmitter emitter = {.writer = writer,
+                       .fn = fn,
+                       .allocation = allocation,
+                       .rax_holds = kIRNone,
+                       .stack_maps = stack_maps};
+  emitter.block_labels = malloc(fn->num_blocks * sizeof(Label));
+  assert(emitter.block_labels != NULL);
+  // Which block, if any, starts at each instruction.
+  int32_t *block_at = malloc((fn->num_insns + 1) * sizeof(int32_t));
+  assert(block_at != NULL);
+  for (int32_t i = 0; i <= fn->num_insns; i++) {
+    block_at[i] = kIRNone;
+  }
+  for (int32_t block = 0; block < fn->num_blocks; block++) {
+    emitter.block_labels[block] = BufferWriter_new_label(writer);
+    assert(fn->blocks[block].start != kIRNone && "block never started");
+    block_at[fn->blocks[block].start] = block;
+  }
+  for (int32_t i = 0; i < fn->num_insns; i++) {
+    if (block_at[i] != kIRNone) {
+      IR_place_block(&emitter, block_at[i]);
+    }
+    IR_emit_insn(&emitter, i);
+  }
+  free(block_at);
+  free(emitter.block_labels);
+}
+
+// End x86 backend
+
+// Compile a function taking `formals' and returning `body' through the IR.
+// Return true if it was compiled and false if the IR can't express it, in
+// which case nothing has been emitted.
+bool IR_compile_function(CompilerContext *ctx, ASTNode *formals,
+                         ASTNode *body) {
+  IRFunction fn;
+  IR_init(&fn, ctx->labels);
+  IRAllocation allocation;
+  bool compiled = IR_lower_function(&fn, formals, body) == 0;
+  if (compiled) {
+    IR_allocate(&fn, &allocation);
+    IR_emit_function(&fn, &allocation, ctx->writer,
+                     (ctx->options & kOptGC) ? ctx->stack_maps : NULL);
+    free(allocation.locations);
+    free(allocation.intervals);
+  }
+  IR_deinit(&fn);
+  return compiled;
+}
+
+// End IR
+
+// Code cache
+
+// A CodeCache keeps compiled programs around, so that running the same source
+// again costs a hash and a lookup rather than a read, a compile and an
+// mprotect. Entries are keyed by the source text and the options it was
+// compiled with. Once the code and source they hold outgrow the cache's
+// budget, the least recently used ones are evicted.
+//
+// Any number of threads may look programs up at once. An entry handed out by
+// CodeCache_get stays valid until it is given back with CodeCache_release,
+// even if it is evicted in the meantime. Misses are compiled outside the
+// cache's lock, so hits don't wait for them and misses on different programs
+// compile in parallel.
+
+typedef struct CodeCacheEntry {
+  uint64_t hash;
+  char *source;
+  size_t length;
+  int options;
+  // Executable, with the entry point at the start.
+  Buffer code;
+  // With kOptGC, for the Heap the code runs on.
+  StackMaps stack_maps;
+  // What the entry counts for against the budget.
+  size_t bytes;
+  // One for the table while the entry is in it, and one for each
+  // CodeCache_get that hasn't been released yet.
+  int refs;
+  // The LRU list, most recently used first.
+  struct CodeCacheEntry *newer;
+  struct CodeCacheEntry *older;
+  // The next entry in the same bucket.
+  struct CodeCacheEntry *chain;
+} CodeCacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CodeCacheEntry **buckets;
+  size_t num_buckets; // a power of 2
+  size_t num_entries;
+  CodeCacheEntry *newest;
+  CodeCacheEntry *oldest;
+  size_t bytes;
+  size_t budget;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} CodeCache;
+
+static const size_t kCodeCacheInitialBuckets = 64;
+
+void CodeCache_init(CodeCache *cache, size_t budget) {
+  *cache = (CodeCache){.num_buckets = kCodeCacheInitialBuckets,
+                       .budget = budget};
+  cache->buckets = calloc(cache->num_buckets, sizeof *cache->buckets);
+  assert(cache->buckets != NULL);
+  int result = pthread_mutex_init(&cache->lock, /*attr=*/NULL);
+  assert(result == 0);
+  (void)result;
+}
+
+static void CodeCacheEntry_free(CodeCacheEntry *entry) {
+  Buffer_deinit(&entry->code);
+  StackMaps_deinit(&entry->stack_maps);
+  free(entry->source);
+  free(entry);
+}
+
+// Entries still held by callers must have been released first.
+void CodeCache_deinit(CodeCache *cache) {
+  CodeCacheEntry *entry = cache->newest;
+  while (entry != NULL) {
+    CodeCacheEntry *older = entry->older;
+    assert(entry->refs == 1 && "entry still in use");
+    CodeCacheEntry_free(entry);
+    entry = older;
+  }
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  cache->buckets = NULL;
+}
+
+// FNV-1a, with the options folded in.
+static uint64_t CodeCache_hash(const char *source, size_t length,
+                               int options) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (byte)source[i];
+    hash *= 1099511628211u;
+  }
+  return (hash ^ (uint64_t)options) * 1099511628211u;
+}
+
+static CodeCacheEntry **CodeCache_bucket(CodeCache *cache, uint64_t hash) {
+  return &cache->buckets[hash & (cache->num_buckets - 1)];
+}
+
+static CodeCacheEntry *CodeCache_find(CodeCache *cache, const char *source,
+                                      size_t length, uint64_t hash,
+                                      int options) {
+  for (CodeCacheEntry *entry = *CodeCache_bucket(cache, hash); entry != NULL;
+       entry = entry->chain) {
+    if (entry->hash == hash && entry->options == options &&
+        entry->length == length && memcmp(entry->source, source, length) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void CodeCache_unlink(CodeCache *cache, CodeCacheEntry *entry) {
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    cache->newest = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+  entry->newer = entry->older = NULL;
+}
+
+static void CodeCache_push_newest(CodeCache *cache, CodeCacheEntry *entry) {
+  entry->older = cache->newest;
+  if (cache->newest != NULL) {
+    cache->newest->newer = entry;
+  } else {
+    cache->oldest = entry;
+  }
+  cache->newest = entry;
+}
+
+static void CodeCache_grow(CodeCache *cache) {
+  CodeCacheEntry **old = cache->buckets;
+  size_t num_old = cache->num_buckets;
+  cache->num_buckets *= 2;
+  cache->buckets = calloc(cache->num_buckets, sizeof *cache->buckets);
+  assert(cache->buckets != NULL);
+  for (size_t i = 0; i < num_old; i++) {
+    CodeCacheEntry *entry = old[i];
+    while (entry != NULL) {
+      CodeCacheEntry *next = entry->chain;
+      CodeCacheEntry **bucket = CodeCache_bucket(cache, entry->hash);
+      entry->chain = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+  free(old);
+}
+
+// Take `entry' out of the table. Return true if nobody holds it, in which case
+// the caller frees it (outside the lock).
+static bool CodeCache_evict(CodeCache *cache, CodeCacheEntry *entry) {
+  CodeCacheEntry **link = CodeCache_bucket(cache, entry->hash);
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  entry->chain = NULL;
+  CodeCache_unlink(cache, entry);
+  cache->num_entries--;
+  cache->bytes -= entry->bytes;
+  cache->evictions++;
+  return --entry->refs == 0;
+}
+
+// Add `entry' to the table as the most recently used, and evict what no longer
+// fits in the budget (which may be `entry' itself). Called with the lock held.
+// Return the evicted entries that nobody holds, chained through `chain', for
+// the caller to free once it has let go of the lock.
+static CodeCacheEntry *CodeCache_insert(CodeCache *cache,
+                                        CodeCacheEntry *entry) {
+  CodeCacheEntry **bucket = CodeCache_bucket(cache, entry->hash);
+  entry->chain = *bucket;
+  *bucket = entry;
+  CodeCache_push_newest(cache, entry);
+  cache->bytes += entry->bytes;
+  if (++cache->num_entries > cache->num_buckets) {
+    CodeCache_grow(cache);
+  }
+  CodeCacheEntry *dead = NULL;
+  while (cache->bytes > cache->budget) {
+    CodeCacheEntry *oldest = cache->oldest;
+    if (CodeCache_evict(cache, oldest)) {
+      oldest->chain = dead;
+      dead = oldest;
+    }
+  }
+  return dead;
+}
+
+static void CodeCache_free_chain(CodeCacheEntry *dead) {
+  while (dead != NULL) {
+    CodeCacheEntry *next = dead->chain;
+    CodeCacheEntry_free(dead);
+    dead = next;
+  }
+}
+
+// What `entry' counts for against the budget.
+static size_t CodeCacheEntry_size(CodeCacheEntry *entry) {
+  return sizeof *entry + entry->length + 1 + entry->code.len +
+         entry->stack_maps.num_entries * sizeof(StackMapEntry) +
+         entry->stack_maps.num_bits * sizeof *entry->stack_maps.bits;
+}
+
+// Compile `source' into a new entry, or return NULL if it doesn't compile.
+static CodeCacheEntry *CodeCache_compile(const char *source, size_t length,
+                                         uint64_t hash, int options) {
+  CodeCacheEntry *entry = calloc(1, sizeof *entry);
+  assert(entry != NULL);
+  entry->hash = hash;
+  entry->source = malloc(length + 1); // +1 for NUL
+  assert(entry->source != NULL);
+  memcpy(entry->source, source, length);
+  entry->source[length] = '\0';
+  entry->length = length;
+  entry->options = options;
+  Buffer_init(&entry->code, 1);
+  StackMaps_init(&entry->stack_maps);
+  Arena arena;
+  Arena_init(&arena);
+  BufferWriter writer;
+  BufferWriter_init(&writer, &entry->code);
+  CompilerContext ctx;
+  CompilerContext_init(&ctx, &writer, &arena, /*labels=*/NULL,
+                       /*locals=*/NULL);
+  ctx.options = options;
+  if (options & kOptGC) {
+    ctx.stack_maps = &entry->stack_maps;
+  }
+  ASTNode *node = Reader_read(&arena, entry->source);
+  int result = -1;
+  if (node != NULL) {
+    result = AST_is_labels_form(node) ? AST_compile_prog(&ctx, node)
+                                      : AST_compile_entry(&ctx, node);
+  }
+  BufferWriter_deinit(&writer);
+  Arena_deinit(&arena);
+  if (result != 0 || Buffer_make_executable(&entry->code) != 0) {
+    CodeCacheEntry_free(entry);
+    return NULL;
+  }
+  entry->bytes = CodeCacheEntry_size(entry);
+  entry->refs = 1;
+  return entry;
+}
+
+// Return the compiled code for `source' under `options', compiling it if it
+// isn't cached, or NULL if it doesn't compile. The caller calls the entry
+// point at Buffer_code(&entry->code) and then gives the entry back with
+// CodeCache_release.
+CodeCacheEntry *CodeCache_get(CodeCache *cache, const char *source,
+                              int options) {
+  size_t length = strlen(source);
+  uint64_t hash = CodeCache_hash(source, length, options);
+  pthread_mutex_lock(&cache->lock);
+  CodeCacheEntry *entry = CodeCache_find(cache, source, length, hash, options);
+  if (entry != NULL) {
+    cache->hits++;
+    entry->refs++;
+    CodeCache_unlink(cache, entry);
+    CodeCache_push_newest(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+  }
+  cache->misses++;
+  pthread_mutex_unlock(&cache->lock);
+
+  CodeCacheEntry *compiled = CodeCache_compile(source, length, hash, options);
+  if (compiled == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&cache->lock);
+  // Another thread may have compiled the same program meanwhile.
+  entry = CodeCache_find(cache, source, length, hash, options);
+  if (entry != NULL) {
+    entry->refs++;
+    pthread_mutex_unlock(&cache->lock);
+    CodeCacheEntry_free(compiled);
+    return entry;
+  }
+  entry = compiled;
+  // The caller's reference keeps the entry alive even if it is over the
+  // budget on its own.
+  entry->refs++;
+  CodeCacheEntry *dead = CodeCache_insert(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+  CodeCache_free_chain(dead);
+  return entry;
+}
+
+void CodeCache_release(CodeCache *cache, CodeCacheEntry *entry) {
+  pthread_mutex_lock(&cache->lock);
+  bool dead = --entry->refs == 0;
+  pthread_mutex_unlock(&cache->lock);
+  if (dead) {
+    CodeCacheEntry_free(entry);
+  }
+}
+
+// Cache files
+
+// A cache can be saved to a file and loaded back by a later process, which
+// then starts out with the programs it would otherwise have to compile. The
+// file holds a header, a CodeCacheRecord for each entry, the entries' sources
+// and stack maps, and then their code at page-aligned offsets, so that loading
+// maps the code pages straight out of the file instead of copying them or
+// compiling anything. Offsets are from the start of the file.
+//
+// Code from another version of the compiler might have been generated
+// differently, so a file is only trusted by a compiler with the same
+// kCodeCacheFormat and kCodeCacheCodegen as the one that wrote it; and each
+// entry's hash is checked against its source, so that code never runs for a
+// program other than the one it was compiled from.
+
+typedef struct {
+  char magic[8];
+  uint64_t version; // CodeCache_version() of the compiler that wrote it
+  uint64_t num_entries;
+} CodeCacheFileHeader;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t source_offset;
+  uint64_t length;
+  // The StackMapEntrys, followed by the bitmap words.
+  uint64_t maps_offset;
+  uint64_t code_offset;
+  uint64_t code_length;
+  int32_t options;
+  int32_t num_map_entries;
+  int32_t num_map_bits;
+  int32_t padding;
+} CodeCacheRecord;
+
+static const char kCodeCacheMagic[8] = "lispjit";
+// Bump when the layout of the file changes.
+static const uint32_t kCodeCacheFormat = 1;
+// Bump when the code compiled for a program changes: its instructions, its
+// calling convention, the layout of heap objects or stack maps, or what the
+// runtime routines expect of it.
+static const uint32_t kCodeCacheCodegen = 1;
+
+static uint64_t CodeCache_version(void) {
+  return (uint64_t)kCodeCacheFormat << 32 | kCodeCacheCodegen;
+}
+
+static void CodeCache_align(BufferWriter *out, size_t alignment) {
+  while (out->pos % alignment != 0) {
+    Buffer_write8(out, 0);
+  }
+}
+
+// Write the cached programs to `path', replacing it. The file is written under
+// another name and then renamed into place, so that processes still running
+// code mapped from the old file keep their pages. Return 0 on success and -1
+// if the file couldn't be written.
+int CodeCache_save(CodeCache *cache, const char *path) {
+  Buffer buf;
+  BufferWriter out;
+  Buffer_init(&buf, 1);
+  BufferWriter_init(&out, &buf);
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&cache->lock);
+  size_t num_entries = cache->num_entries;
+  CodeCacheFileHeader header = {.version = CodeCache_version(),
+                                .num_entries = num_entries};
+  memcpy(header.magic, kCodeCacheMagic, sizeof header.magic);
+  Buffer_write_arr(&out, (byte *)&header, sizeof header);
+  size_t table_offset = out.pos;
+  memset(BufferWriter_reserve(&out, num_entries * sizeof(CodeCacheRecord)), 0,
+         num_entries * sizeof(CodeCacheRecord));
+  CodeCacheRecord *records = calloc(num_entries, sizeof *records);
+  assert(num_entries == 0 || records != NULL);
+  // Oldest first, so that loading them in order keeps the LRU order.
+  size_t i = 0;
+  for (CodeCacheEntry *entry = cache->oldest; entry != NULL;
+       entry = entry->newer, i++) {
+    StackMaps *maps = &entry->stack_maps;
+    CodeCacheRecord *record = &records[i];
+    *record = (CodeCacheRecord){.hash = entry->hash,
+                                .length = entry->length,
+                                .options = entry->options,
+                                .num_map_entries = maps->num_entries,
+                                .num_map_bits = maps->num_bits};
+    record->source_offset = out.pos;
+    Buffer_write_arr(&out, (byte *)entry->source, entry->length);
+    CodeCache_align(&out, sizeof(uint64_t));
+    record->maps_offset = out.pos;
+    if (maps->num_entries > 0) {
+      Buffer_write_arr(&out, (byte *)maps->entries,
+                       maps->num_entries * sizeof *maps->entries);
+      Buffer_write_arr(&out, (byte *)maps->bits,
+                       maps->num_bits * sizeof *maps->bits);
+    }
+  }
+  i = 0;
+  for (CodeCacheEntry *entry = cache->oldest; entry != NULL;
+       entry = entry->newer, i++) {
+    CodeCache_align(&out, page_size);
+    records[i].code_offset = out.pos;
+    records[i].code_length = entry->code.len;
+    Buffer_write_arr(&out, entry->code.address, entry->code.len);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (num_entries > 0) {
+    memcpy(buf.address + table_offset, records,
+           num_entries * sizeof *records);
+  }
+  free(records);
+
+  size_t path_len = strlen(path);
+  char *tmp_path = malloc(path_len + sizeof ".tmp");
+  assert(tmp_path != NULL);
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", sizeof ".tmp");
+  int result = 0;
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL || fwrite(buf.address, 1, out.pos, fp) != out.pos) {
+    result = -1;
+  }
+  if (fp != NULL && fclose(fp) != 0) {
+    result = -1;
+  }
+  if (result == 0 && rename(tmp_path, path) != 0) {
+    result = -1;
+  }
+  if (result != 0) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  BufferWriter_deinit(&out);
+  Buffer_deinit(&buf);
+  return result;
+}
+
+static bool CodeCache_in_file(size_t file_len, uint64_t offset,
+                              uint64_t size) {
+  return offset <= file_len && size <= file_len - offset;
+}
+
+static bool CodeCacheRecord_is_valid(const CodeCacheRecord *record,
+                                     const byte *file, size_t file_len) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  if (record->num_map_entries < 0 || record->num_map_bits < 0 ||
+      record->maps_offset % sizeof(uint64_t) != 0 ||
+      record->code_length == 0 || record->code_offset % page_size != 0 ||
+      record->code_length % page_size != 0) {
+    return false;
+  }
+  uint64_t maps_size =
+      (uint64_t)record->num_map_entries * sizeof(StackMapEntry) +
+      (uint64_t)record->num_map_bits * sizeof(uint64_t);
+  if (!CodeCache_in_file(file_len, record->source_offset, record->length) ||
+      !CodeCache_in_file(file_len, record->maps_offset, maps_size) ||
+      !CodeCache_in_file(file_len, record->code_offset, record->code_length)) {
+    return false;
+  }
+  return CodeCache_hash((const char *)file + record->source_offset,
+                        record->length, record->options) == record->hash;
+}
+
+static CodeCacheEntry *CodeCache_load_entry(const CodeCacheRecord *record,
+                                            const byte *file, int fd) {
+  void *code = mmap(/*addr=*/NULL, record->code_length, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE, fd, record->code_offset);
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+  CodeCacheEntry *entry = calloc(1, sizeof *entry);
+  assert(entry != NULL);
+  entry->hash = record->hash;
+  entry->length = record->length;
+  entry->options = record->options;
+  entry->source = malloc(entry->length + 1); // +1 for NUL
+  assert(entry->source != NULL);
+  memcpy(entry->source, file + record->source_offset, entry->length);
+  entry->source[entry->length] = '\0';
+  entry->code =
+      (Buffer){.address = code, .len = record->code_length,
+               .state = kExecutable};
+  StackMaps *maps = &entry->stack_maps;
+  StackMaps_init(maps);
+  if (record->num_map_entries > 0) {
+    size_t entries_size = record->num_map_entries * sizeof *maps->entries;
+    size_t bits_size = record->num_map_bits * sizeof *maps->bits;
+    maps->entries = malloc(entries_size);
+    maps->bits = malloc(bits_size + 1); // +1 so that it is never NULL
+    assert(maps->entries != NULL && maps->bits != NULL);
+    memcpy(maps->entries, file + record->maps_offset, entries_size);
+    memcpy(maps->bits, file + record->maps_offset + entries_size, bits_size);
+    maps->num_entries = maps->entries_capacity = record->num_map_entries;
+    maps->num_bits = maps->bits_capacity = record->num_map_bits;
+  }
+  entry->bytes = CodeCacheEntry_size(entry);
+  entry->refs = 1;
+  return entry;
+}
+
+// Add the programs saved in `path' to the cache, leaving alone the ones it
+// already has. Return how many were added: none if there is no such file or
+// it was written by another build of the compiler. Return -1 if the file is
+// damaged, in which case nothing is added.
+int CodeCache_load(CodeCache *cache, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CodeCacheFileHeader)) {
+    fprintf(stderr, "`%s' is not a code cache\n", path);
+    close(fd);
+    return -1;
+  }
+  size_t file_len = st.st_size;
+  byte *file = mmap(/*addr=*/NULL, file_len, PROT_READ, MAP_PRIVATE, fd,
+                    /*off=*/0);
+  if (file == MAP_FAILED) {
+    fprintf(stderr, "Could not map `%s'\n", path);
+    close(fd);
+    return -1;
+  }
+  CodeCacheFileHeader header;
+  memcpy(&header, file, sizeof header);
+  int result = 0;
+  if (memcmp(header.magic, kCodeCacheMagic, sizeof header.magic) != 0) {
+    result = -1;
+  } else if (header.version != CodeCache_version()) {
+    // Stale, not damaged.
+    munmap(file, file_len);
+    close(fd);
+    return 0;
+  } else if (header.num_entries > (file_len - sizeof header) /
+                                      sizeof(CodeCacheRecord)) {
+    result = -1;
+  }
+  const CodeCacheRecord *records =
+      (const CodeCacheRecord *)(file + sizeof header);
+  for (size_t i = 0; result == 0 && i < header.num_entries; i++) {
+    if (!CodeCacheRecord_is_valid(&records[i], file, file_len)) {
+      result = -1;
+    }
+  }
+  if (result != 0) {
+    fprintf(stderr, "`%s' is damaged\n", path);
+    munmap(file, file_len);
+    close(fd);
+    return -1;
+  }
+  for (size_t i = 0; i < header.num_entries; i++) {
+    CodeCacheEntry *entry = CodeCache_load_entry(&records[i], file, fd);
+    if (entry == NULL) {
+      continue;
+    }
+    pthread_mutex_lock(&cache->lock);
+    CodeCacheEntry *dead;
+    if (CodeCache_find(cache, entry->source, entry->length, entry->hash,
+                       entry->options) != NULL) {
+      entry->chain = NULL;
+      dead = entry;
+    } else {
+      dead = CodeCache_insert(cache, entry);
+      result++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    CodeCache_free_chain(dead);
+  }
+  // The code mappings keep their pages of the file alive.
+  munmap(file, file_len);
+  close(fd);
+  return result;
+}
+
+// End Code cache
+
+// ELF
+
+// Compiled code only refers to itself -- every jump and call is relative, and
+// the heap comes in as an argument -- so it can run wherever it is loaded. That
+// makes writing it out ahead of time a matter of wrapping the bytes in an ELF
+// file:
+//
+// - Elf_write_object writes a relocatable object defining the entry point as
+//   a global function. C code linked against it calls it the way
+//   Testing_call_entry does: `uint64_t entry(uint64_t heap)'.
+// - Elf_write_executable writes a static executable with a small runtime in
+//   front of the code. The runtime points rsi at a heap in the executable's
+//   bss, calls the entry point, writes the 8 bytes of the result to stdout and
+//   exits.
+//
+// Either way, each function of a `labels' form gets a local symbol, so that
+// debuggers and profilers can name the code. The same object, with .text where
+// the code already is, describes code loaded in this process to GDB (see the
+// JIT symbols section). kOptGC code needs the collector,
+// which lives in this process, so it can't be written out.
+
+typedef enum {
+  kElfObject,
+  kElfExecutable,
+  // An object for code that is already loaded, with .text at the address it
+  // runs from; see Jit_register.
+  kElfLoaded,
+} ElfKind;
+
+// Where a static executable is loaded. Low enough that its addresses fit in
+// the runtime's 32-bit immediates.
+static const uint64_t kElfBase = 0x400000;
+static const size_t kElfPageSize = 0x1000;
+static const size_t kElfRuntimeSize = 40; // bytes; see Elf_emit_runtime
+static const size_t kElfHeapSize = 16 << 20; // bytes
+static const char *kElfEntryName = "lisp_entry";
+
+static void Elf_align(BufferWriter *out, size_t alignment) {
+  while (out->pos % alignment != 0) {
+    Buffer_write8(out, 0);
+  }
+}
+
+// Copy `len' bytes to `pos' in `out', which has already been written past.
+static void Elf_put(BufferWriter *out, size_t pos, const void *data,
+                    size_t len) {
+  assert(pos + len <= out->pos);
+  memcpy(out->buf->address + pos, data, len);
+}
+
+static void Elf_add_section(BufferWriter *shdrs, uint32_t name, uint32_t type,
+                            uint64_t flags, uint64_t addr, uint64_t offset,
+                            uint64_t size, uint32_t link, uint32_t info,
+                            uint64_t align, uint64_t entsize) {
+  Elf64_Shdr shdr = {.sh_name = name,
+                     .sh_type = type,
+                     .sh_flags = flags,
+                     .sh_addr = addr,
+                     .sh_offset = offset,
+                     .sh_size = size,
+                     .sh_link = link,
+                     .sh_info = info,
+                     .sh_addralign = align,
+                     .sh_entsize = entsize};
+  Buffer_write_arr(shdrs, (byte *)&shdr, sizeof shdr);
+}
+
+static uint32_t Elf_add_string(BufferWriter *strtab, const char *str) {
+  uint32_t offset = strtab->pos;
+  Buffer_write_arr(strtab, (byte *)str, strlen(str) + 1); // +1 for NUL
+  return offset;
+}
+
+static void Elf_add_symbol(BufferWriter *symtab, uint32_t name, byte bind,
+                           byte type, uint16_t section, uint64_t value,
+                           uint64_t size) {
+  Elf64_Sym sym = {.st_name = name,
+                   .st_info = ELF64_ST_INFO(bind, type),
+                   .st_shndx = section,
+                   .st_value = value,
+                   .st_size = size};
+  Buffer_write_arr(symtab, (byte *)&sym, sizeof sym);
+}
+
+// mov edi, {heap}; call {code}; then write(1, &rax, 8) and exit(0). `code_disp'
+// is the distance from the runtime's start to the code's.
+static void Elf_emit_runtime(BufferWriter *writer, int32_t code_disp,
+                             uint32_t heap) {
+  size_t start = writer->pos;
+  Buffer_mov_reg_imm32(writer, kRdi, heap);
+  Buffer_call_rel32(writer, code_disp - (int32_t)(writer->pos - start + 5));
+  Buffer_push_reg(writer, kRax);
+  Buffer_mov_reg_imm32(writer, kRax, 1); // write
+  Buffer_mov_reg_imm32(writer, kRdi, 1); // stdout
+  Buffer_mov_reg_reg(writer, /*dst=*/kRsi, /*src=*/kRsp);
+  Buffer_mov_reg_imm32(writer, kRdx, kWordSize);
+  Buffer_syscall(writer);
+  Buffer_mov_reg_imm32(writer, kRax, 60); // exit
+  Buffer_xor_reg_reg(writer, kRdi, kRdi);
+  Buffer_syscall(writer);
+  assert(writer->pos - start == kElfRuntimeSize);
+}
+
+// Where the `i'th function of `labels' starts and ends in `code'.
+static void LabelSymbols_range(LabelSymbols *labels, int32_t i,
+                               BufferWriter *code, int32_t *start,
+                               int32_t *end) {
+  *start = BufferWriter_label_pos(code, labels->entries[i].label);
+  Label next = i + 1 < labels->num_entries ? labels->entries[i + 1].label
+                                           : labels->body;
+  *end = next == -1 ? (int32_t)code->pos : BufferWriter_label_pos(code, next);
+}
+
+// Build the file in `out', which must be empty. `code_addr' is where the code
+// is loaded for kElfLoaded; the other kinds decide that themselves. The code
+// in `code' must be readable, so with a buffer that isn't dual-mapped this has
+// to happen before Buffer_make_executable. `labels' may be NULL.
+static void Elf_build(BufferWriter *out, ElfKind kind,
+                      BufferWriter *code, LabelSymbols *labels,
+                      const char *entry_name, uint64_t code_addr) {
+  bool executable = kind == kElfExecutable;
+  Buffer symtab_buf, strtab_buf, shdrs_buf;
+  BufferWriter symtab, strtab, shdrs;
+  Buffer_init(&symtab_buf, 1);
+  Buffer_init(&strtab_buf, 1);
+  Buffer_init(&shdrs_buf, 1);
+  BufferWriter_init(&symtab, &symtab_buf);
+  BufferWriter_init(&strtab, &strtab_buf);
+  BufferWriter_init(&shdrs, &shdrs_buf);
+
+  // The headers are filled in once everything they point at is written.
+  size_t num_phdrs = executable ? 2 : 0;
+  size_t headers_size = sizeof(Elf64_Ehdr) + num_phdrs * sizeof(Elf64_Phdr);
+  memset(BufferWriter_reserve(out, headers_size), 0, headers_size);
+  Elf_align(out, 16);
+  size_t text_offset = out->pos;
+  uint64_t text_addr = executable              ? kElfBase + text_offset
+                       : kind == kElfLoaded ? code_addr
+                                            : 0;
+  // Symbols are addresses in an executable and offsets into their section in
+  // an object.
+  uint64_t symbol_base = executable ? text_addr : 0;
+  Buffer_write_arr(out, code->buf->address, code->pos);
+  size_t runtime_offset = 0;
+  uint64_t heap_addr = 0;
+  if (executable) {
+    Elf_align(out, 16);
+    runtime_offset = out->pos;
+    heap_addr = kElfBase + runtime_offset + kElfRuntimeSize;
+    heap_addr = (heap_addr + kElfPageSize - 1) & ~(kElfPageSize - 1);
+    assert(heap_addr + kElfHeapSize <= INT32_MAX && "code too big to load");
+    Elf_emit_runtime(out, (int32_t)(text_offset - runtime_offset),
+                     (uint32_t)heap_addr);
+  }
+  size_t text_size = out->pos - text_offset;
+
+  // Sections, in order: null, .text, .bss (executables only), .symtab,
+  // .strtab, .shstrtab, and .note.GNU-stack (objects only), which tells the
+  // linker the stack needn't be executable.
+  uint16_t text_index = 1;
+  uint16_t symtab_index = executable ? 3 : 2;
+  uint16_t num_sections = 6;
+
+  Buffer_write8(&strtab, 0);
+  Elf_add_symbol(&symtab, 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+  if (labels != NULL) {
+    for (int32_t i = 0; i < labels->num_entries; i++) {
+      int32_t start, end;
+      LabelSymbols_range(labels, i, code, &start, &end);
+      Elf_add_symbol(&symtab,
+                     Elf_add_string(&strtab, labels->entries[i].name->name),
+                     STB_LOCAL, STT_FUNC, text_index, symbol_base + start,
+                     end - start);
+    }
+  }
+  uint32_t first_global = symtab.pos / sizeof(Elf64_Sym);
+  Elf_add_symbol(&symtab, Elf_add_string(&strtab, entry_name), STB_GLOBAL,
+                 STT_FUNC, text_index, symbol_base, code->pos);
+  if (executable) {
+    Elf_add_symbol(&symtab, Elf_add_string(&strtab, "_start"), STB_GLOBAL,
+                   STT_FUNC, text_index, kElfBase + runtime_offset,
+                   kElfRuntimeSize);
+  }
+
+  Elf_align(out, 8);
+  size_t symtab_offset = out->pos;
+  Buffer_write_arr(out, symtab.buf->address, symtab.pos);
+  size_t strtab_offset = out->pos;
+  Buffer_write_arr(out, strtab.buf->address, strtab.pos);
+  // The section names go straight into the file.
+  size_t shstrtab_offset = out->pos;
+  Buffer_write8(out, 0);
+  uint32_t text_name = Elf_add_string(out, ".text") - shstrtab_offset;
+  uint32_t bss_name = Elf_add_string(out, ".bss") - shstrtab_offset;
+  uint32_t symtab_name = Elf_add_string(out, ".symtab") - shstrtab_offset;
+  uint32_t strtab_name = Elf_add_string(out, ".strtab") - shstrtab_offset;
+  uint32_t shstrtab_name =
+      Elf_add_string(out, ".shstrtab") - shstrtab_offset;
+  uint32_t note_name =
+      Elf_add_string(out, ".note.GNU-stack") - shstrtab_offset;
+  size_t shstrtab_size = out->pos - shstrtab_offset;
+
+  Elf_add_section(&shdrs, 0, SHT_NULL, 0, 0, 0, 0, 0, 0, 0, 0);
+  Elf_add_section(&shdrs, text_name, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                  text_addr, text_offset, text_size, 0, 0, 16, 0);
+  if (executable) {
+    Elf_add_section(&shdrs, bss_name, SHT_NOBITS, SHF_ALLOC | SHF_WRITE,
+                    heap_addr, runtime_offset + kElfRuntimeSize, kElfHeapSize,
+                    0, 0, kElfPageSize, 0);
+  }
+  Elf_add_section(&shdrs, symtab_name, SHT_SYMTAB, 0, 0, symtab_offset,
+                  symtab.pos, symtab_index + 1, first_global, 8,
+                  sizeof(Elf64_Sym));
+  Elf_add_section(&shdrs, strtab_name, SHT_STRTAB, 0, 0, strtab_offset,
+                  strtab.pos, 0, 0, 1, 0);
+  Elf_add_section(&shdrs, shstrtab_name, SHT_STRTAB, 0, 0, shstrtab_offset,
+                  shstrtab_size, 0, 0, 1, 0);
+  if (!executable) {
+    Elf_add_section(&shdrs, note_name, SHT_PROGBITS, 0, 0, out->pos, 0, 0, 0,
+                    1, 0);
+  }
+  Elf_align(out, 8);
+  size_t shdrs_offset = out->pos;
+  Buffer_write_arr(out, shdrs.buf->address, shdrs.pos);
+
+  Elf64_Ehdr ehdr = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                  EV_CURRENT, ELFOSABI_SYSV},
+      .e_type = executable ? ET_EXEC : ET_REL,
+      .e_machine = EM_X86_64,
+      .e_version = EV_CURRENT,
+      .e_entry = executable ? kElfBase + runtime_offset : 0,
+      .e_phoff = executable ? sizeof(Elf64_Ehdr) : 0,
+      .e_shoff = shdrs_offset,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_phentsize = executable ? sizeof(Elf64_Phdr) : 0,
+      .e_phnum = num_phdrs,
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = num_sections,
+      .e_shstrndx = symtab_index + 2};
+  Elf_put(out, 0, &ehdr, sizeof ehdr);
+  if (executable) {
+    // The headers, the code and the runtime, and then the heap.
+    Elf64_Phdr phdrs[] = {
+        {.p_type = PT_LOAD,
+         .p_flags = PF_R | PF_X,
+         .p_offset = 0,
+         .p_vaddr = kElfBase,
+         .p_paddr = kElfBase,
+         .p_filesz = text_offset + text_size,
+         .p_memsz = text_offset + text_size,
+         .p_align = kElfPageSize},
+        {.p_type = PT_LOAD,
+         .p_flags = PF_R | PF_W,
+         .p_offset = 0,
+         .p_vaddr = heap_addr,
+         .p_paddr = heap_addr,
+         .p_filesz = 0,
+         .p_memsz = kElfHeapSize,
+         .p_align = kElfPageSize},
+    };
+    Elf_put(out, sizeof ehdr, phdrs, sizeof phdrs);
+  }
+  BufferWriter_deinit(&symtab);
+  BufferWriter_deinit(&strtab);
+  BufferWriter_deinit(&shdrs);
+  Buffer_deinit(&symtab_buf);
+  Buffer_deinit(&strtab_buf);
+  Buffer_deinit(&shdrs_buf);
+}
+
+// `labels' may be NULL. Return 0 on success and -1 if the file couldn't be
+// written.
+static int Elf_write(const char *path, ElfKind kind, BufferWriter *code,
+                     LabelSymbols *labels, const char *entry_name) {
+  Buffer out_buf;
+  BufferWriter out;
+  Buffer_init(&out_buf, code->pos);
+  BufferWriter_init(&out, &out_buf);
+  Elf_build(&out, kind, code, labels, entry_name, /*code_addr=*/0);
+  int result = 0;
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL || fwrite(out.buf->address, 1, out.pos, fp) != out.pos) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    result = -1;
+  }
+  if (fp != NULL && fclose(fp) != 0) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    result = -1;
+  }
+  if (result == 0 && kind == kElfExecutable && chmod(path, 0755) != 0) {
+    fprintf(stderr, "Could not make `%s' executable\n", path);
+    result = -1;
+  }
+  BufferWriter_deinit(&out);
+  Buffer_deinit(&out_buf);
+  return result;
+}
+
+int Elf_write_object(const char *path, BufferWriter *code,
+                     LabelSymbols *labels, const char *entry_name) {
+  return Elf_write(path, kElfObject, code, labels, entry_name);
+}
+
+int Elf_write_executable(const char *path, BufferWriter *code,
+                         LabelSymbols *labels) {
+  return Elf_write(path, kElfExecutable, code, labels, kElfEntryName);
+}
+
+// Compile `source' -- a `labels' form or an entry expression -- with
+// `options' and write it to `path' as `kind'. Return 0 on success and -1 if it
+// doesn't compile or can't be written.
+int Elf_compile(char *source, int options, ElfKind kind, const char *path) {
+  if (options & kOptGC) {
+    fprintf(stderr, "Code compiled with kOptGC can't be written out\n");
+    return -1;
+  }
+  if (options & kOptProfile) {
+    fprintf(stderr, "Code compiled with kOptProfile can't be written out\n");
+    return -1;
+  }
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  BufferWriter writer;
+  BufferWriter_init(&writer, &buf);
+  Arena arena;
+  Arena_init(&arena);
+  LabelSymbols labels;
+  LabelSymbols_init(&labels);
+  CompilerContext ctx;
+  CompilerContext_init(&ctx, &writer, &arena, /*labels=*/NULL,
+                       /*locals=*/NULL);
+  ctx.options = options;
+  ctx.label_symbols = &labels;
+  ASTNode *node = Reader_read(&arena, source);
+  int result = -1;
+  if (node != NULL) {
+    result = AST_is_labels_form(node) ? AST_compile_prog(&ctx, node)
+                                      : AST_compile_entry(&ctx, node);
+  }
+  if (result == 0) {
+    result = kind == kElfObject
+                 ? Elf_write_object(path, &writer, &labels, kElfEntryName)
+                 : Elf_write_executable(path, &writer, &labels);
+  }
+  LabelSymbols_deinit(&labels);
+  Arena_deinit(&arena);
+  BufferWriter_deinit(&writer);
+  Buffer_deinit(&buf);
+  return result;
+}
+
+// End ELF
+
+// JIT symbols
+
+// Code compiled into this process runs from anonymous memory, where profilers
+// and debuggers see nothing but addresses. Jit_register tells them what is at
+// those addresses, in whichever of these ways its flags ask for:
+//
+// - kJitPerfMap appends a line for each function to /tmp/perf-<pid>.map,
+//   which `perf report' reads to name the samples in the process.
+// - kJitDump appends the functions and their code to /tmp/jit-<pid>.dump in
+//   perf's jitdump format, for `perf inject --jit' (with `perf record -k
+//   mono', which uses the clock the records are stamped with). The file is
+//   mapped executable when it is created, which is how `perf record' finds it.
+// - kJitGdb builds an ELF object describing the code (see Elf_build) and adds
+//   it to the list GDB reads through its JIT interface, so that it can name
+//   frames in the code.
+//
+// The functions of a `labels' form are named after their labels, and the rest
+// of the code (the entry point and the body) after the name passed in.
+// Registrations are process-wide and may be made from any thread. Code that
+// moves -- a Module's, when its buffer grows -- has to be registered again.
+
+typedef enum {
+  kJitPerfMap = 1 << 0,
+  kJitDump = 1 << 1,
+  kJitGdb = 1 << 2,
+} JitFlag;
+
+// GDB's JIT interface: it puts a breakpoint in __jit_debug_register_code and
+// reads __jit_debug_descriptor when it is hit. The names and layout are GDB's.
+typedef struct JitCodeEntry {
+  struct JitCodeEntry *next_entry;
+  struct JitCodeEntry *prev_entry;
+  const byte *symfile_addr;
+  uint64_t symfile_size;
+} JitCodeEntry;
+
+typedef enum {
+  kJitNoAction,
+  kJitRegisterFn,
+  kJitUnregisterFn,
+} JitAction;
+
+typedef struct {
+  uint32_t version;
+  uint32_t action_flag;
+  JitCodeEntry *relevant_entry;
+  JitCodeEntry *first_entry;
+} JitDescriptor;
+
+void __attribute__((noinline)) __jit_debug_register_code(void) {
+  // Keep the calls from being optimized away.
+  __asm__ __volatile__("" ::: "memory");
+}
+
+JitDescriptor __jit_debug_descriptor = {.version = 1};
+
+// perf's jitdump records; see tools/perf/util/jitdump.h in Linux.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JitDumpHeader;
+
+typedef struct {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // Followed by the NUL-terminated name and then the code.
+} JitDumpCodeLoad;
+
+static const uint32_t kJitDumpMagic = 0x4a695444; // "JiTD"
+static const uint32_t kJitDumpCodeLoadId = 0;
+
+// A registration, which must stay where it is until Jit_unregister: GDB's list
+// points into it.
+typedef struct {
+  int flags;
+  // With kJitGdb, the entry and the object it points to.
+  JitCodeEntry gdb_entry;
+  Buffer symfile;
+  BufferWriter symfile_writer;
+} JitRegistration;
+
+// A run of the code with a name.
+typedef struct {
+  const char *name;
+  int32_t start;
+  int32_t end;
+} JitSymbol;
+
+// Guards everything below, and the files.
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *jit_dump;
+static uint64_t jit_code_index;
+
+// Cover all of `code' with symbols: one per function in `labels', which may be
+// NULL, and `name' for the gaps between them. `symbols' needs room for
+// 2 * labels->num_entries + 1 of them. Return the number stored.
+static int32_t Jit_symbols(BufferWriter *code, LabelSymbols *labels,
+                           const char *name, JitSymbol *symbols) {
+  int32_t num_symbols = 0;
+  int32_t pos = 0;
+  for (int32_t i = 0; labels != NULL && i < labels->num_entries; i++) {
+    int32_t start, end;
+    LabelSymbols_range(labels, i, code, &start, &end);
+    if (start > pos) {
+      symbols[num_symbols++] = (JitSymbol){name, pos, start};
+    }
+    symbols[num_symbols++] =
+        (JitSymbol){labels->entries[i].name->name, start, end};
+    pos = end;
+  }
+  if ((size_t)pos < code->pos) {
+    symbols[num_symbols++] = (JitSymbol){name, pos, code->pos};
+  }
+  return num_symbols;
+}
+
+static int Jit_write_perf_map(const byte *address, JitSymbol *symbols,
+                              int32_t num_symbols) {
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/perf-%d.map", (int)getpid());
+  FILE *fp = fopen(path, "a");
+  if (fp == NULL) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    return -1;
+  }
+  for (int32_t i = 0; i < num_symbols; i++) {
+    fprintf(fp, "%llx %x %s\n",
+            (unsigned long long)(uintptr_t)(address + symbols[i].start),
+            (unsigned)(symbols[i].end - symbols[i].start), symbols[i].name);
+  }
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// Create the jitdump file and map it, if that hasn't been done yet.
+static int Jit_open_dump(void) {
+  if (jit_dump != NULL) {
+    return 0;
+  }
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/jit-%d.dump", (int)getpid());
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Could not write `%s'\n", path);
+    return -1;
+  }
+  // perf only looks for the mapping; it is never used, and stays until the
+  // process exits.
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (mmap(NULL, page_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) ==
+      MAP_FAILED) {
+    fprintf(stderr, "Could not map `%s'\n", path);
+    close(fd);
+    return -1;
+  }
+  jit_dump = fdopen(fd, "wb");
+  assert(jit_dump != NULL);
+  JitDumpHeader header = {.magic = kJitDumpMagic,
+                          .version = 1,
+                          .total_size = sizeof header,
+                          .elf_mach = EM_X86_64,
+                          .pid = getpid(),
+                          .timestamp = Stats_now()};
+  fwrite(&header, sizeof header, 1, jit_dump);
+  return 0;
+}
+
+static int Jit_write_dump(const byte *address, const byte *code,
+                          JitSymbol *symbols, int32_t num_symbols) {
+  if (Jit_open_dump() != 0) {
+    return -1;
+  }
+  for (int32_t i = 0; i < num_symbols; i++) {
+    JitSymbol *symbol = &symbols[i];
+    size_t name_size = strlen(symbol->name) + 1; // +1 for NUL
+    uint64_t size = symbol->end - symbol->start;
+    JitDumpCodeLoad record = {
+        .id = kJitDumpCodeLoadId,
+        .total_size = sizeof record + name_size + size,
+        .timestamp = Stats_now(),
+        .pid = getpid(),
+        .tid = syscall(SYS_gettid),
+        .vma = (uintptr_t)(address + symbol->start),
+        .code_addr = (uintptr_t)(address + symbol->start),
+        .code_size = size,
+        .code_index = jit_code_index++};
+    fwrite(&record, sizeof record, 1, jit_dump);
+    fwrite(symbol->name, 1, name_size, jit_dump);
+    fwrite(code + symbol->start, 1, size, jit_dump);
+  }
+  if (fflush(jit_dump) != 0) {
+    fprintf(stderr, "Could not write the jitdump file\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void Jit_add_to_gdb(JitRegistration *reg, BufferWriter *code,
+                           LabelSymbols *labels, const char *name) {
+  Buffer_init(&reg->symfile, code->pos);
+  BufferWriter_init(&reg->symfile_writer, &reg->symfile);
+  Elf_build(&reg->symfile_writer, kElfLoaded, code, labels, name,
+            (uintptr_t)Buffer_code(code->buf));
+  reg->gdb_entry = (JitCodeEntry){
+      .next_entry = __jit_debug_descriptor.first_entry,
+      .symfile_addr = reg->symfile.address,
+      .symfile_size = reg->symfile_writer.pos};
+  if (reg->gdb_entry.next_entry != NULL) {
+    reg->gdb_entry.next_entry->prev_entry = &reg->gdb_entry;
+  }
+  __jit_debug_descriptor.first_entry = &reg->gdb_entry;
+  __jit_debug_descriptor.relevant_entry = &reg->gdb_entry;
+  __jit_debug_descriptor.action_flag = kJitRegisterFn;
+  __jit_debug_register_code();
+}
+
+// Describe the code in `code', done compiling, to the tools `flags' asks for.
+// `labels' are the labels recorded while compiling it, or NULL. Return 0 on
+// success and -1 if any of the files couldn't be written; the other tools are
+// still told.
+int Jit_register(JitRegistration *reg, BufferWriter *code,
+                 LabelSymbols *labels, const char *name, int flags) {
+  reg->flags = flags;
+  int32_t max_symbols = 2 * (labels == NULL ? 0 : labels->num_entries) + 1;
+  JitSymbol *symbols = malloc(max_symbols * sizeof *symbols);
+  assert(symbols != NULL);
+  int32_t num_symbols = Jit_symbols(code, labels, name, symbols);
+  const byte *address = Buffer_code(code->buf);
+  int result = 0;
+  pthread_mutex_lock(&jit_lock);
+  if ((flags & kJitPerfMap) &&
+      Jit_write_perf_map(address, symbols, num_symbols) != 0) {
+    result = -1;
+  }
+  if ((flags & kJitDump) &&
+      Jit_write_dump(address, code->buf->address, symbols, num_symbols) != 0) {
+    result = -1;
+  }
+  if (flags & kJitGdb) {
+    Jit_add_to_gdb(reg, code, labels, name);
+  }
+  pthread_mutex_unlock(&jit_lock);
+  free(symbols);
+  return result;
+}
+
+// Take the code off GDB's list. perf has no way to forget code, so the files
+// keep their entries; whatever is loaded at those addresses next is named
+// after the newer ones.
+void Jit_unregister(JitRegistration *reg) {
+  if (!(reg->flags & kJitGdb)) {
+    return;
+  }
+  pthread_mutex_lock(&jit_lock);
+  JitCodeEntry *entry = &reg->gdb_entry;
+  if (entry->prev_entry != NULL) {
+    entry->prev_entry->next_entry = entry->next_entry;
+  } else {
+    __jit_debug_descriptor.first_entry = entry->next_entry;
+  }
+  if (entry->next_entry != NULL) {
+    entry->next_entry->prev_entry = entry->prev_entry;
+  }
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = kJitUnregisterFn;
+  __jit_debug_register_code();
+  pthread_mutex_unlock(&jit_lock);
+  BufferWriter_deinit(&reg->symfile_writer);
+  Buffer_deinit(&reg->symfile);
+  reg->flags = 0;
+}
+
+// End JIT symbols
+
+// Modules
+
+// A Module compiles a program a piece at a time into one long-lived code
+// buffer, for interactive use and for reloading parts of a program: each
+// `labels' form or expression added to it is appended to the code that is
+// already there, and can call any label defined before it. Nothing that is
+// already compiled is touched again, so adding a definition costs time in
+// proportion to the new code rather than to the whole program.
+//
+// A label defined again hides the old one from what is added later; code
+// compiled earlier keeps calling the old one. The buffer is dual-mapped where
+// possible, so the code doesn't change protection between additions and
+// doesn't move as it grows. Entry points are still offsets into it, because
+// without a dual mapping it may move, and then nothing may run from the module
+// while something is being added.
+
+typedef struct {
+  int options;
+  Buffer code;
+  BufferWriter writer;
+  // With kOptGC, for the Heap the code runs on.
+  StackMaps stack_maps;
+  // Every label defined so far, the most recent first.
+  EnvNode *labels;
+  // Where the nodes of `labels' live.
+  Arena arena;
+} Module;
+
+// kOptParallel doesn't apply: definitions are compiled one after another.
+void Module_init(Module *module, int options) {
+  module->options = options;
+  Buffer_init_dual(&module->code, 1);
+  BufferWriter_init(&module->writer, &module->code);
+  StackMaps_init(&module->stack_maps);
+  module->labels = NULL;
+  Arena_init(&module->arena);
+}
+
+void Module_deinit(Module *module) {
+  Arena_deinit(&module->arena);
+  StackMaps_deinit(&module->stack_maps);
+  BufferWriter_deinit(&module->writer);
+  Buffer_deinit(&module->code);
+}
+
+// Compile the `code' forms bound by `bindings' one after another, each seeing
+// the ones before it, and store the resulting label table in *labels.
+static int Module_compile_labels(Module *module, CompilerContext *ctx,
+                                 ASTNode *bindings, EnvNode **labels) {
+  for (; bindings != nil; bindings = AST_cdr(bindings)) {
+    if (bindings->type != kCons) {
+      fprintf(stderr, "Malformed labels binding\n");
+      return -1;
+    }
+    ASTNode *binding = AST_car(bindings);
+    if (binding->type != kCons || binding == nil ||
+        AST_list_length(binding) != 2 || !AST_is_atom(AST_car(binding))) {
+      fprintf(stderr, "Malformed labels binding\n");
+      return -1;
+    }
+    Label label = BufferWriter_new_label(ctx->writer);
+    BufferWriter_bind_label(ctx->writer, label);
+    // Nodes for definitions that end up failing stay in the arena until the
+    // module goes; it's only a few bytes each.
+    EnvNode *node = Arena_alloc(&module->arena, sizeof *node);
+    *node = Env_init(AST_car(binding)->value.atom, label, *labels);
+    *labels = node;
+    CompilerContext binding_ctx = CompilerContext_with_labels(ctx, node);
+    int result = AST_compile_expr(&binding_ctx, operand2(binding),
+                                  /*stack_index=*/-kWordSize);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+// Compile `source' and append it to the module. It is either an expression,
+// or a `labels' form whose body may be left out. Store the offset of the entry
+// point for the expression or body in *entry, or -1 if there isn't one. Return
+// 0 on success, and -1 (and leave the module as it was) if the source doesn't
+// compile.
+int Module_add(Module *module, char *source, int32_t *entry) {
+  BufferWriter *writer = &module->writer;
+  StackMaps *maps = &module->stack_maps;
+  if (module->code.exec == NULL && module->code.state == kExecutable) {
+    Buffer_make_writable(&module->code);
+  }
+  size_t pos = writer->pos;
+  int32_t num_labels = writer->num_labels;
+  int32_t num_entries = maps->num_entries;
+  int32_t num_bits = maps->num_bits;
+  Arena arena;
+  Arena_init(&arena);
+  CompilerContext ctx;
+  CompilerContext_init(&ctx, writer, &arena, module->labels,
+                       /*locals=*/NULL);
+  ctx.options = module->options & ~kOptParallel;
+  if (ctx.options & kOptGC) {
+    ctx.stack_maps = maps;
+  }
+  EnvNode *labels = module->labels;
+  ASTNode *node = Reader_read(&arena, source);
+  ASTNode *body = node;
+  int result = node == NULL ? -1 : 0;
+  if (result == 0 && AST_is_labels_form(node)) {
+    ASTNode *args = AST_cdr(node);
+    if (args == nil || AST_list_length(args) > 2) {
+      fprintf(stderr, "Malformed labels form\n");
+      result = -1;
+    } else {
+      result = Module_compile_labels(module, &ctx, operand1(args), &labels);
+      body = AST_cdr(args) == nil ? NULL : operand2(args);
+    }
+  }
+  *entry = -1;
+  if (result == 0 && body != NULL) {
+    Label entry_label = BufferWriter_new_label(writer);
+    BufferWriter_bind_label(writer, entry_label);
+    CompilerContext body_ctx = CompilerContext_with_labels(&ctx, labels);
+    result = AST_compile_entry(&body_ctx, body);
+    if (result == 0) {
+      *entry = BufferWriter_label_pos(writer, entry_label);
+    }
+  } else if (result == 0) {
+    AST_relax(&ctx);
+    if (ctx.options & kOptGC) {
+      StackMaps_resolve(maps, writer);
+    }
+  }
+  Arena_deinit(&arena);
+  if (result != 0) {
+    writer->pos = pos;
+    writer->num_labels = num_labels;
+    writer->num_fixups = 0;
+    maps->num_entries = num_entries;
+    maps->num_bits = num_bits;
+    maps->num_slow_paths = 0;
+    if (maps->stub >= num_labels) {
+      maps->stub = -1;
+    }
+  } else {
+    module->labels = labels;
+  }
+  Buffer_make_executable(&module->code);
+  return result;
+}
+
+// Call the entry point at `entry', as returned by Module_add, with `arg': the
+// heap, or with kOptGC the Heap, which must have been set up for the module's
+// code and stack maps as they are now.
+uint64_t Module_call(Module *module, int32_t entry, uint64_t arg) {
+  assert(entry >= 0 && (size_t)entry < module->writer.pos);
+  return EntryFunction_at(Buffer_code(&module->code) + entry)(arg);
+}
+
+// End Modules
+
+// Testing
+
+uint64_t Testing_call_entry(Buffer *buf, uint64_t heap) {
+  assert(buf != NULL);
+  assert(buf->address != NULL);
+  assert(buf->state == kExecutable);
+  return EntryFunction_at(Buffer_code(buf))(heap);
+}
+
+void run_test(void (*test_body)(CompilerContext *, uint64_t)) {
+  Buffer buf;
+  Buffer_init(&buf, 100);
+  void *heap = malloc(100 * kWordSize);
+  Arena arena;
+  Arena_init(&arena);
+  {
+    BufferWriter writer;
     BufferWriter_init(&writer, &buf);
     CompilerContext ctx;
-    CompilerContext_init(&ctx, /*writer=*/&writer, /*labels=*/NULL,
-                         /*locals=*/NULL);
+    CompilerContext_init(&ctx, /*writer=*/&writer, /*arena=*/&arena,
+                         /*labels=*/NULL, /*locals=*/NULL);
     test_body(&ctx, (uint64_t)heap);
+    BufferWriter_deinit(&writer);
+  }
+  Arena_deinit(&arena);
+  free(heap);
+  Buffer_deinit(&buf);
+}
+
+#define EXPECT_EQUALS_BYTES(buf, arr)                                          \
+  {                                                                            \
+    int result =                                                               \
+        cmp_ok(memcmp(buf->address, arr, sizeof arr), "==", 0, __func__);      \
+    if (!result) {                                                             \
+      printf("NOT EQUAL. Expected: ");                                         \
+      for (size_t i = 0; i < sizeof arr; i++) {                                \
+        printf("%.2x ", arr[i]);                                               \
+      }                                                                        \
+      printf("\n           Found:    ");                                       \
+      for (size_t i = 0; i < ctx->writer->pos; i++) {                          \
+        printf("%.2x ", buf->address[i]);                                      \
+      }                                                                        \
+      printf("\n");                                                            \
+    }                                                                          \
+  }
+
+#define EXPECT_CALL_EQUALS(buf, expected)                                      \
+  cmp_ok(Testing_call_entry(buf, heap), "==", expected, __func__)
+
+#define TEST(name)                                                             \
+  static void test_##name(CompilerContext *ctx,                                \
+                          __attribute__((unused)) uint64_t heap)
+
+uint64_t Run_from_cstr(char *input, CompilerContext *ctx, uint64_t heap) {
+  ASTNode *node = Reader_read(ctx->arena, input);
+  int compile_result = AST_compile_entry(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  return Testing_call_entry(ctx->writer->buf, heap);
+}
+
+uint64_t Run_prog_from_cstr(char *input, CompilerContext *ctx,
+                            uint64_t heap) {
+  ASTNode *prog = Reader_read(ctx->arena, input);
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  return Testing_call_entry(ctx->writer->buf, heap);
+}
+
+// Compile `input' as a program with kOptGC on top of ctx's options, and run it
+// on a Heap that starts out with `space_size' bytes in each space. Store the
+// number of collections in *collections.
+uint64_t Testing_run_gc_prog(char *input, CompilerContext *ctx,
+                             size_t space_size, int *collections) {
+  StackMaps maps;
+  StackMaps_init(&maps);
+  ctx->options |= kOptGC;
+  ctx->stack_maps = &maps;
+  ASTNode *prog = Reader_read(ctx->arena, input);
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  Heap heap;
+  Heap_init(&heap, space_size, &maps, ctx->writer->buf);
+  uint64_t result = Testing_call_entry(ctx->writer->buf, (uint64_t)&heap);
+  *collections = heap.collections;
+  Heap_deinit(&heap);
+  StackMaps_deinit(&maps);
+  ctx->stack_maps = NULL;
+  return result;
+}
+
+TEST(write_bytes_manually) {
+  byte arr[] = {0xb8, 0x2a, 0x00, 0x00, 0x00, 0xc3};
+  Buffer_write_arr(ctx->writer, arr, sizeof arr);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, 42);
+}
+
+TEST(write_bytes_manually2) {
+  byte arr[] = {0xb8, 0x2a, 0x00, 0x00, 0x00, 0xff, 0xc0, 0xc3};
+  Buffer_write_arr(ctx->writer, arr, sizeof arr);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, 43);
+}
+
+TEST(mov_rax_imm32) {
+  Buffer_mov_reg_imm32(ctx->writer, kRax, 42);
+  byte expected[] = {0xb8, 0x2a, 0x00, 0x00, 0x00};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(mov_rcx_imm32) {
+  Buffer_mov_reg_imm32(ctx->writer, kRcx, 42);
+  byte expected[] = {0xb9, 0x2a, 0x00, 0x00, 0x00};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(mov_inc) {
+  Buffer_mov_reg_imm32(ctx->writer, kRax, 42);
+  Buffer_inc_reg(ctx->writer, kRax);
+  Buffer_ret(ctx->writer);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, 43);
+}
+
+TEST(mov_rax_rax) {
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRax);
+  byte expected[] = {0x48, 0x89, 0xc0};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(mov_rax_rsi) {
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
+  byte expected[] = {0x48, 0x89, 0xf0};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(mov_rdi_rbp) {
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRdi, /*src=*/kRbp);
+  byte expected[] = {0x48, 0x89, 0xef};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(load_zero_uses_xor) {
+  Buffer_load_reg_imm32(ctx->writer, kRcx, 0);
+  Buffer_load_reg_imm32(ctx->writer, kRax, 7);
+  // 0:  31 c9                   xor    ecx,ecx
+  // 2:  b8 07 00 00 00          mov    eax,0x7
+  byte expected[] = {0x31, 0xc9, 0xb8, 0x07, 0x00, 0x00, 0x00};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(alu_uses_imm8_when_it_fits) {
+  Buffer_add_reg_imm32(ctx->writer, kRsi, 16);
+  Buffer_add_reg_imm32(ctx->writer, kRsi, 128);
+  Buffer_and_reg_imm32(ctx->writer, kRsp, -16);
+  Buffer_cmp_reg_imm32(ctx->writer, kRax, -128);
+  Buffer_cmp_reg_imm32(ctx->writer, kRax, 0);
+  // 0:  48 83 c6 10             add    rsi,0x10
+  // 4:  48 81 c6 80 00 00 00    add    rsi,0x80
+  // b:  48 83 e4 f0             and    rsp,0xfffffffffffffff0
+  // f:  48 83 f8 80             cmp    rax,0xffffffffffffff80
+  // 13: 48 85 c0                test   rax,rax
+  byte expected[] = {0x48, 0x83, 0xc6, 0x10, 0x48, 0x81, 0xc6, 0x80,
+                     0x00, 0x00, 0x00, 0x48, 0x83, 0xe4, 0xf0, 0x48,
+                     0x83, 0xf8, 0x80, 0x48, 0x85, 0xc0};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(displacements_use_the_shortest_form) {
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, -128);
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, -136);
+  Buffer_mov_rax_to_reg_disp(ctx->writer, kRsi, 0);
+  Buffer_mov_reg_disp_to_rax(ctx->writer, kRbp, 0);
+  Buffer_lea_reg_disp(ctx->writer, kRsi, kRsi, -32);
+  // 0:  48 89 44 24 80          mov    QWORD PTR [rsp-0x80],rax
+  // 5:  48 89 84 24 78 ff ff ff mov    QWORD PTR [rsp-0x88],rax
+  // d:  48 89 06                mov    QWORD PTR [rsi],rax
+  // 10: 48 8b 45 00             mov    rax,QWORD PTR [rbp+0x0]
+  // 14: 48 8d 76 e0             lea    rsi,[rsi-0x20]
+  byte expected[] = {0x48, 0x89, 0x44, 0x24, 0x80, 0x48, 0x89, 0x84, 0x24,
+                     0x78, 0xff, 0xff, 0xff, 0x48, 0x89, 0x06, 0x48, 0x8b,
+                     0x45, 0x00, 0x48, 0x8d, 0x76, 0xe0};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(compile_fixnum) {
+  // 123
+  ASTNode *node = AST_new_fixnum(ctx->arena, 123);
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, 123; ret
+  byte expected[] = {0xb8, 0xec, 0x01, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(123));
+}
+
+ASTNode *list1(Arena *arena, ASTNode *e0) {
+  return AST_new_cons(arena, e0, nil);
+}
+
+ASTNode *list2(Arena *arena, ASTNode *e0, ASTNode *e1) {
+  return AST_new_cons(arena, e0, list1(arena, e1));
+}
+
+ASTNode *list3(Arena *arena, ASTNode *e0, ASTNode *e1, ASTNode *e2) {
+  return AST_new_cons(arena, e0, list2(arena, e1, e2));
+}
+
+ASTNode *list4(Arena *arena, ASTNode *e0, ASTNode *e1, ASTNode *e2,
+               ASTNode *e3) {
+  return AST_new_cons(arena, e0, list3(arena, e1, e2, e3));
+}
+
+TEST(compile_primcall_add1) {
+  // (add1 5)
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "add1"),
+                        AST_new_fixnum(ctx->arena, 5));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(5); add eax, imm(1); ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x83, 0xc0, 0x04, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(6));
+}
+
+TEST(compile_primcall_sub1) {
+  // (sub1 5)
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "sub1"),
+                        AST_new_fixnum(ctx->arena, 5));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(5); sub eax, imm(1); ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x83, 0xe8, 0x04, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(4));
+}
+
+TEST(compile_primcall_add1_sub1) {
+  // (sub1 (add1 5))
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "sub1"),
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "add1"),
+                              AST_new_fixnum(ctx->arena, 5)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(5); add eax, imm(1); sub eax, imm(1); ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x83,
+                     0xc0, 0x04, 0x83, 0xe8, 0x04, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_primcall_sub1_add1) {
+  // (add1 (sub1 5))
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "add1"),
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "sub1"),
+                              AST_new_fixnum(ctx->arena, 5)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(5); sub eax, imm(1); add eax, imm(1); ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x83,
+                     0xe8, 0x04, 0x83, 0xc0, 0x04, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_add_two_ints) {
+  // (+ 1 2)
+  ASTNode *node =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+            AST_new_fixnum(ctx->arena, 1), AST_new_fixnum(ctx->arena, 2));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(2); mov [rsp-8], rax; mov eax, imm(1); add eax, [rsp-8]
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0xb8, 0x04, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+}
+
+TEST(compile_add_three_ints) {
+  // (+ 1 (+ 2 3))
+  ASTNode *node = list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                        AST_new_fixnum(ctx->arena, 1),
+                        list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                              AST_new_fixnum(ctx->arena, 2),
+                              AST_new_fixnum(ctx->arena, 3)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 0c 00 00 00          mov    eax,0xc
+  // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // a:  b8 08 00 00 00          mov    eax,0x8
+  // f:  03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 13: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 18: b8 04 00 00 00          mov    eax,0x4
+  // 1d: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 21: c3                      ret
+  byte expected[] = {0xb8, 0x0c, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
+                     0xf8, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24,
+                     0xf8, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x04, 0x00,
+                     0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(6));
+}
+
+TEST(compile_add_four_ints) {
+  // (+ (+ 1 2) (+ 3 4))
+  ASTNode *node =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 1), AST_new_fixnum(ctx->arena, 2)),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 3),
+                  AST_new_fixnum(ctx->arena, 4)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 10 00 00 00          mov    eax,0x10
+  // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // a:  b8 0c 00 00 00          mov    eax,0xc
+  // f:  03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 13: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 18: b8 08 00 00 00          mov    eax,0x8
+  // 1d: 48 89 44 24 f0          mov    QWORD PTR [rsp-0x10],rax
+  // 22: b8 04 00 00 00          mov    eax,0x4
+  // 27: 03 44 24 f0             add    eax,DWORD PTR [rsp-0x10]
+  // 2b: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 2f: c3                      ret
+  byte expected[] = {0xb8, 0x10, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0xb8, 0x0c, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0x48,
+                     0x89, 0x44, 0x24, 0xf8, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0x44, 0x24, 0xf0, 0xb8, 0x04, 0x00, 0x00, 0x00, 0x03,
+                     0x44, 0x24, 0xf0, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(10));
+}
+
+TEST(integer_to_char) {
+  // (integer->char 65)
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "integer->char"),
+                        AST_new_fixnum(ctx->arena, 65));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 04 01 00 00          mov    eax,0x104
+  // 5:  48 c1 e0 06             shl    rax,0x6
+  // 9:  48 83 c8 0f             or     rax,0xf
+  // d:  c3                      ret
+  byte expected[] = {0xb8, 0x04, 0x01, 0x00, 0x00, 0x48, 0xc1,
+                     0xe0, 0x06, 0x48, 0x83, 0xc8, 0x0f, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateChar('A'));
+}
+
+ASTNode *call1(Arena *arena, char *fnname, ASTNode *arg) {
+  return list2(arena, AST_new_atom(arena, fnname), arg);
+}
+
+TEST(zerop_with_zero_returns_true) {
+  // (zero? (sub1 (add1 0)))
+  ASTNode *node =
+      call1(ctx->arena, "zero?",
+            call1(ctx->arena, "sub1",
+                  call1(ctx->arena, "add1", AST_new_fixnum(ctx->arena, 0))));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // -> prelude
+  // 0:  31 c0                   xor    eax,eax
+  // 2:  83 c0 04                add    eax,0x4
+  // 5:  83 e8 04                sub    eax,0x4
+  // -> body of zero?
+  // 8:  48 85 c0                test   rax,rax
+  // b:  0f 94 c0                sete   al
+  // e:  0f b6 c0                movzx  eax,al
+  // 11: 48 c1 e0 07             shl    rax,0x7
+  // 15: 48 83 c8 1f             or     rax,0x1f
+  // 19: c3                      ret
+  byte expected[] = {0x31, 0xc0, 0x83, 0xc0, 0x04, 0x83, 0xe8, 0x04, 0x48,
+                     0x85, 0xc0, 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0, 0x48,
+                     0xc1, 0xe0, 0x07, 0x48, 0x83, 0xc8, 0x1f, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateBool(true));
+}
+
+TEST(zerop_with_non_zero_returns_false) {
+  // (zero? (sub1 (add1 0)))
+  ASTNode *node =
+      call1(ctx->arena, "zero?",
+            call1(ctx->arena, "sub1",
+                  call1(ctx->arena, "add1", AST_new_fixnum(ctx->arena, 1))));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // -> prelude
+  // 0:  b8 04 00 00 00          mov    eax,0x4
+  // 5:  83 c0 04                add    eax,0x4
+  // 8:  83 e8 04                sub    eax,0x4
+  // -> body of zero?
+  // b:  48 85 c0                test   rax,rax
+  // e:  0f 94 c0                sete   al
+  // 11: 0f b6 c0                movzx  eax,al
+  // 14: 48 c1 e0 07             shl    rax,0x7
+  // 18: 48 83 c8 1f             or     rax,0x1f
+  // 1c: c3                      ret
+  byte expected[] = {0xb8, 0x04, 0x00, 0x00, 0x00, 0x83, 0xc0, 0x04, 0x83, 0xe8,
+                     0x04, 0x48, 0x85, 0xc0, 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0,
+                     0x48, 0xc1, 0xe0, 0x07, 0x48, 0x83, 0xc8, 0x1f, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateBool(false));
+}
+
+TEST(let_with_no_bindings) {
+  // (let () (+ 1 2))
+  ASTNode *node =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "let"), /*bindings*/ nil,
+            /*body*/ list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                           AST_new_fixnum(ctx->arena, 1),
+                           AST_new_fixnum(ctx->arena, 2)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(2); mov [rsp-8], rax; mov eax, imm(1); add eax, [rsp-8]
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0xb8, 0x04, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+}
+
+TEST(let_with_one_binding) {
+  // (let ((x 2)) (+ 1 x))
+  ASTNode *node =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "let"),
+            /*bindings*/ list1(ctx->arena,
+                               list2(ctx->arena, AST_new_atom(ctx->arena, "x"),
+                                     AST_new_fixnum(ctx->arena, 2))),
+            /*body*/ list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                           AST_new_fixnum(ctx->arena, 1),
+                           AST_new_atom(ctx->arena, "x")));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 08 00 00 00          mov    eax,0x08
+  // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // a:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // f:  48 89 44 24 f0          mov    QWORD PTR [rsp-0x10],rax
+  // 14: b8 04 00 00 00          mov    eax,0x4
+  // 19: 03 44 24 f0             add    eax,DWORD PTR [rsp-0x10]
+  // 1d: c3                      ret
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0x48, 0x8b, 0x44, 0x24, 0xf8, 0x48, 0x89, 0x44, 0x24, 0xf0,
+                     0xb8, 0x04, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf0, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+}
+
+TEST(compile_atom_with_undefined_variable) {
+  ASTNode *node = AST_new_atom(ctx->arena, "foo");
+  int result = AST_compile_expr(ctx, node, /*stack_index=*/0);
+  cmp_ok(result, "==", -1, __func__);
+}
+
+TEST(compile_atom_in_env_emits_stack_index) {
+  ASTNode *node = AST_new_atom(ctx->arena, "foo");
+  EnvNode locals = Env_init(Symbol_intern("foo"), -34, /*next=*/NULL);
+  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &locals);
+  int result = AST_compile_expr(&new_ctx, node, /*stack_index=*/0);
+  cmp_ok(result, "==", 0, __func__);
+  byte expected[] = {0x48, 0x8b, 0x44, 0x24, 0x100 - 34};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(compile_if_test_true) {
+  // (if (zero? 0) (+ 1 2) (+ 3 4))
+  ASTNode *node =
+      list4(ctx->arena, AST_new_atom(ctx->arena, "if"),
+            list2(ctx->arena, AST_new_atom(ctx->arena, "zero?"),
+                  AST_new_fixnum(ctx->arena, 0)),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 1), AST_new_fixnum(ctx->arena, 2)),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 3),
+                  AST_new_fixnum(ctx->arena, 4)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  31 c0                   xor    eax,eax
+  // -> zero?, fused with the if
+  // 2:  48 85 c0                test   rax,rax
+  // 5:  75 14                   jne    0x1b
+  // +
+  // 7:  b8 08 00 00 00          mov    eax,0x8
+  // c:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 11: b8 04 00 00 00          mov    eax,0x4
+  // 16: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 1a: c3                      ret
+  // +
+  // 1b: b8 10 00 00 00          mov    eax,0x10
+  // 20: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 25: b8 0c 00 00 00          mov    eax,0xc
+  // 2a: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 2e: c3                      ret
+  byte expected[] = {0x31, 0xc0, 0x48, 0x85, 0xc0, 0x75, 0x14, 0xb8, 0x08, 0x00,
+                     0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x04, 0x00,
+                     0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3, 0xb8, 0x10, 0x00,
+                     0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x0c, 0x00,
+                     0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+}
+
+TEST(compile_if_test_false) {
+  // (if (zero? 1) (+ 1 2) (+ 3 4))
+  ASTNode *node =
+      list4(ctx->arena, AST_new_atom(ctx->arena, "if"),
+            list2(ctx->arena, AST_new_atom(ctx->arena, "zero?"),
+                  AST_new_fixnum(ctx->arena, 1)),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 1), AST_new_fixnum(ctx->arena, 2)),
+            list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                  AST_new_fixnum(ctx->arena, 3),
+                  AST_new_fixnum(ctx->arena, 4)));
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 04 00 00 00          mov    eax,imm(0x1)
+  // -> zero?, fused with the if
+  // 5:  48 85 c0                test   rax,rax
+  // 8:  75 14                   jne    0x1e
+  // +
+  // a:  b8 08 00 00 00          mov    eax,0x8
+  // f:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 14: b8 04 00 00 00          mov    eax,0x4
+  // 19: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 1d: c3                      ret
+  // +
+  // 1e: b8 10 00 00 00          mov    eax,0x10
+  // 23: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 28: b8 0c 00 00 00          mov    eax,0xc
+  // 2d: 03 44 24 f8             add    eax,DWORD PTR [rsp-0x8]
+  // 31: c3                      ret
+  byte expected[] = {0xb8, 0x04, 0x00, 0x00, 0x00, 0x48, 0x85, 0xc0, 0x75, 0x14,
+                     0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0xb8, 0x04, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3,
+                     0xb8, 0x10, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0xb8, 0x0c, 0x00, 0x00, 0x00, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(7));
+}
+
+TEST(return_heap_address) {
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRdi);
+  Buffer_ret(ctx->writer);
+  byte expected[] = {0x48, 0x89, 0xf8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  uint64_t result = Testing_call_entry(ctx->writer->buf, 0xdeadbeef);
+  cmp_ok(result, "==", 0xdeadbeef, __func__);
+}
+
+TEST(compile_cons) {
+  // (cons 10 20)
+  ASTNode *node =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "cons"),
+            AST_new_fixnum(ctx->arena, 10), AST_new_fixnum(ctx->arena, 20));
+  int compile_result = AST_compile_entry(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // -> prologue
+  // 0:  48 89 fe                mov    rsi,rdi
+  // 3:  b8 28 00 00 00          mov    eax,0x28
+  // 8:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // d:  b8 50 00 00 00          mov    eax,0x50
+  // 12: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
+  // 16: 48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 1b: 48 89 06                mov    QWORD PTR [rsi],rax
+  // 1e: 48 89 f0                mov    rax,rsi
+  // 21: 48 83 c8 01             or     rax,0x1
+  // 25: 48 83 c6 10             add    rsi,0x10
+  // 29: c3                      ret
+  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0x44, 0x24, 0xf8, 0xb8, 0x50, 0x00, 0x00, 0x00,
+                     0x48, 0x89, 0x46, 0x08, 0x48, 0x8b, 0x44, 0x24, 0xf8,
+                     0x48, 0x89, 0x06, 0x48, 0x89, 0xf0, 0x48, 0x83, 0xc8,
+                     0x01, 0x48, 0x83, 0xc6, 0x10, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
+  cmp_ok(result, "==", (uintptr_t)heap | 0x1UL, __func__);
+}
+
+TEST(compile_car) {
+  // (car (cons 10 20))
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "car"),
+                        list3(ctx->arena, AST_new_atom(ctx->arena, "cons"),
+                              AST_new_fixnum(ctx->arena, 10),
+                              AST_new_fixnum(ctx->arena, 20)));
+  int compile_result = AST_compile_entry(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // -> prologue
+  // 0:  48 89 fe                mov    rsi,rdi
+  // -> cons
+  // 3:  b8 28 00 00 00          mov    eax,0x28
+  // 8:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // d:  b8 50 00 00 00          mov    eax,0x50
+  // 12: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
+  // 16: 48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 1b: 48 89 06                mov    QWORD PTR [rsi],rax
+  // 1e: 48 89 f0                mov    rax,rsi
+  // 21: 48 83 c8 01             or     rax,0x1
+  // 25: 48 83 c6 10             add    rsi,0x10
+  // -> car
+  // 29: 48 8b 40 ff             mov    rax,QWORD PTR [rax-0x1]
+  // 2d: c3                      ret
+  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48, 0x89,
+                     0x44, 0x24, 0xf8, 0xb8, 0x50, 0x00, 0x00, 0x00, 0x48, 0x89,
+                     0x46, 0x08, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0x48, 0x89, 0x06,
+                     0x48, 0x89, 0xf0, 0x48, 0x83, 0xc8, 0x01, 0x48, 0x83, 0xc6,
+                     0x10, 0x48, 0x8b, 0x40, 0xff, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10), __func__);
+}
+
+TEST(compile_cdr) {
+  // (cdr (cons 10 20))
+  ASTNode *node = list2(ctx->arena, AST_new_atom(ctx->arena, "cdr"),
+                        list3(ctx->arena, AST_new_atom(ctx->arena, "cons"),
+                              AST_new_fixnum(ctx->arena, 10),
+                              AST_new_fixnum(ctx->arena, 20)));
+  int compile_result = AST_compile_entry(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // -> prologue
+  // 0:  48 89 fe                mov    rsi,rdi
+  // -> cons
+  // 3:  b8 28 00 00 00          mov    eax,0x28
+  // 8:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // d:  b8 50 00 00 00          mov    eax,0x50
+  // 12: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
+  // 16: 48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 1b: 48 89 06                mov    QWORD PTR [rsi],rax
+  // 1e: 48 89 f0                mov    rax,rsi
+  // 21: 48 83 c8 01             or     rax,0x1
+  // 25: 48 83 c6 10             add    rsi,0x10
+  // -> cdr
+  // 29: 48 8b 40 07             mov    rax,QWORD PTR [rax+0x7]
+  // 2d: c3                      ret
+  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48, 0x89,
+                     0x44, 0x24, 0xf8, 0xb8, 0x50, 0x00, 0x00, 0x00, 0x48, 0x89,
+                     0x46, 0x08, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0x48, 0x89, 0x06,
+                     0x48, 0x89, 0xf0, 0x48, 0x83, 0xc8, 0x01, 0x48, 0x83, 0xc6,
+                     0x10, 0x48, 0x8b, 0x40, 0x07, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(20), __func__);
+}
+
+TEST(compile_empty_labels) {
+  // (labels () 5)
+  ASTNode *prog = list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), nil,
+                        AST_new_fixnum(ctx->arena, 5));
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // jump 0x0; mov rsi, rdi; mov eax, imm(5); ret
+  byte expected[] = {0xeb, 0x00, 0x48, 0x89, 0xfe, 0xb8,
+                     encodeImmediateFixnum(5), 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_code_with_no_params) {
+  // (code () 5)
+  ASTNode *node = list3(ctx->arena, AST_new_atom(ctx->arena, "code"), nil,
+                        AST_new_fixnum(ctx->arena, 5));
+  int compile_result = AST_compile_function(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // mov eax, imm(5); ret
+  byte expected[] = {0xb8, encodeImmediateFixnum(5), 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(compile_code_with_params) {
+  // (code (x y) (+ x y))
+  ASTNode *node = list3(ctx->arena, AST_new_atom(ctx->arena, "code"),
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "x"),
+                              AST_new_atom(ctx->arena, "y")),
+                        list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+                              AST_new_atom(ctx->arena, "x"),
+                              AST_new_atom(ctx->arena, "y")));
+  int compile_result = AST_compile_function(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // -> Load formal (y) into a new temporary stack location (rsp-0x18)
+  // 0:  48 8b 44 24 f0          mov    rax,QWORD PTR [rsp-0x10]
+  // 5:  48 89 44 24 e8          mov    QWORD PTR [rsp-0x18],rax
+  // -> Load formal (x) into rax
+  // a:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // -> add
+  // f:  03 44 24 e8             add    eax,DWORD PTR [rsp-0x18]
+  // 13: c3                      ret
+  byte expected[] = {0x48, 0x8b, 0x44, 0x24, 0xf0, 0x48, 0x89, 0x44, 0x24, 0xe8,
+                     0x48, 0x8b, 0x44, 0x24, 0xf8, 0x03, 0x44, 0x24, 0xe8, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(compile_label_with_no_param_and_no_labelcall) {
+  // (labels ((const (code () 6))) 5)
+  ASTNode *labels =
+      list1(ctx->arena,
+            list2(ctx->arena, AST_new_atom(ctx->arena, "const"),
+                  list3(ctx->arena, AST_new_atom(ctx->arena, "code"), nil,
+                        AST_new_fixnum(ctx->arena, 6))));
+  ASTNode *prog = list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels,
+                        AST_new_fixnum(ctx->arena, 5));
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // -> jump to body
+  // 0:  eb 06                   jmp    0x8
+  // -> code for (code () 5)
+  // 2:  b8 18 00 00 00          mov    eax,0x18
+  // 7:  c3                      ret
+  // -> body:
+  // 8:  48 89 fe                mov    rsi,rdi
+  // b:  b8 14 00 00 00          mov    eax,0x14
+  // 10: c3                      ret
+  byte expected[] = {0xeb, 0x06, 0xb8, encodeImmediateFixnum(6), 0x00, 0x00,
+                     0x00, 0xc3, 0x48, 0x89, 0xfe, 0xb8,
+                     encodeImmediateFixnum(5), 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_labelcall_with_undefined_name) {
+  ASTNode *prog = list2(ctx->arena, AST_new_atom(ctx->arena, "labelcall"),
+                        AST_new_atom(ctx->arena, "nonexistent-label"));
+  int compile_result = AST_compile_function(ctx, prog);
+  cmp_ok(compile_result, "==", -1, __func__);
+}
+
+TEST(compile_labelcall_with_no_param) {
+  // (labels ((const (code () 5))) (labelcall const))
+  ASTNode *labels =
+      list1(ctx->arena,
+            list2(ctx->arena, AST_new_atom(ctx->arena, "const"),
+                  list3(ctx->arena, AST_new_atom(ctx->arena, "code"), nil,
+                        AST_new_fixnum(ctx->arena, 5))));
+  ASTNode *prog = list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels,
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "labelcall"),
+                              AST_new_atom(ctx->arena, "const")));
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // 0:  eb 06                   jmp    0x8
+  // 2:  b8 14 00 00 00          mov    eax,0x14
+  // 7:  c3                      ret
+  // 8:  48 89 fe                mov    rsi,rdi
+  // b:  eb f5                   jmp    0x2
+  byte expected[] = {0xeb, 0x06, 0xb8, 0x14, 0x00, 0x00, 0x00,
+                     0xc3, 0x48, 0x89, 0xfe, 0xeb, 0xf5};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_labelcall_with_one_param) {
+  // (labels ((id (code (x) x))) (labelcall id 5))
+  ASTNode *labels =
+      list1(ctx->arena,
+            list2(ctx->arena, AST_new_atom(ctx->arena, "id"),
+                  list3(ctx->arena, AST_new_atom(ctx->arena, "code"),
+                        list1(ctx->arena, AST_new_atom(ctx->arena, "x")),
+                        AST_new_atom(ctx->arena, "x"))));
+  ASTNode *prog = list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels,
+                        list3(ctx->arena, AST_new_atom(ctx->arena, "labelcall"),
+                              AST_new_atom(ctx->arena, "id"),
+                              AST_new_fixnum(ctx->arena, 5)));
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // 0:  eb 06                   jmp    0x8
+  // 2:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 7:  c3                      ret
+  // 8:  48 89 fe                mov    rsi,rdi
+  // b:  b8 14 00 00 00          mov    eax,0x14
+  // -> a tail call: the argument goes over our own frame
+  // 10: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 15: eb eb                   jmp    0x2
+  byte expected[] = {0xeb, 0x06, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0xc3,
+                     0x48, 0x89, 0xfe, 0xb8, 0x14, 0x00, 0x00, 0x00,
+                     0x48, 0x89, 0x44, 0x24, 0xf8, 0xeb, 0xeb};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(compile_labelcall_from_let_adjusts_rsp) {
+  // (labels ((id (code (x) x))) (let ((y 5)) (add1 (labelcall id y))))
+  // The add1 keeps the call out of tail position.
+  ASTNode *labels =
+      list1(ctx->arena,
+            list2(ctx->arena, AST_new_atom(ctx->arena, "id"),
+                  list3(ctx->arena, AST_new_atom(ctx->arena, "code"),
+                        list1(ctx->arena, AST_new_atom(ctx->arena, "x")),
+                        AST_new_atom(ctx->arena, "x"))));
+  ASTNode *body = list3(ctx->arena, AST_new_atom(ctx->arena, "let"),
+                        list1(ctx->arena,
+                              list2(ctx->arena, AST_new_atom(ctx->arena, "y"),
+                                    AST_new_fixnum(ctx->arena, 5))),
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "add1"),
+                              list3(ctx->arena,
+                                    AST_new_atom(ctx->arena, "labelcall"),
+                                    AST_new_atom(ctx->arena, "id"),
+                                    AST_new_atom(ctx->arena, "y"))));
+  ASTNode *prog =
+      list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels, body);
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // 0:  eb 06                   jmp    0x8
+  // 2:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 7:  c3                      ret
+  // 8:  48 89 fe                mov    rsi,rdi
+  // b:  b8 14 00 00 00          mov    eax,0x14
+  // 10: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 15: 48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // -> skip [rsp-0x10]; the return address goes there
+  // 1a: 48 89 44 24 e8          mov    QWORD PTR [rsp-0x18],rax
+  // 1f: 48 83 c4 f8             add    rsp,0xfffffffffffffff8
+  // 23: e8 da ff ff ff          call   0x2
+  // 28: 48 83 c4 08             add    rsp,0x8
+  // -> add1
+  // 2c: 83 c0 04                add    eax,0x4
+  // 2f: c3                      ret
+  byte expected[] = {0xeb, 0x06, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0xc3, 0x48, 0x89,
+                     0xfe, 0xb8, 0x14, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
+                     0xf8, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0x48, 0x89, 0x44, 0x24,
+                     0xe8, 0x48, 0x83, 0xc4, 0xf8, 0xe8, 0xda, 0xff, 0xff, 0xff,
+                     0x48, 0x83, 0xc4, 0x08, 0x83, 0xc0, 0x04, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(6));
+}
+
+TEST(buffer_grows_past_initial_capacity) {
+  size_t initial_len = ctx->writer->buf->len;
+  Buffer_mov_reg_imm32(ctx->writer, kRax, 0);
+  int count = 0;
+  while (BufferWriter_get_pos(ctx->writer) <= 3 * initial_len) {
+    Buffer_add_reg_imm32(ctx->writer, kRax, 1);
+    count++;
+  }
+  Buffer_ret(ctx->writer);
+  ok(ctx->writer->buf->len > initial_len, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, count);
+}
+
+TEST(labels_still_link_after_buffer_grows) {
+  // (labels ((big (code () (add1 (add1 ... 0))))) (labelcall big))
+  // The jump over `big' needs its rel32 form, and the call into it is emitted
+  // after the buffer has had to grow.
+  size_t initial_len = ctx->writer->buf->len;
+  int count = initial_len; // add1 is at least one byte
+  ASTNode *expr = AST_new_fixnum(ctx->arena, 0);
+  for (int i = 0; i < count; i++) {
+    expr = list2(ctx->arena, AST_new_atom(ctx->arena, "add1"), expr);
+  }
+  ASTNode *labels =
+      list1(ctx->arena,
+            list2(ctx->arena, AST_new_atom(ctx->arena, "big"),
+                  list3(ctx->arena, AST_new_atom(ctx->arena, "code"), nil,
+                        expr)));
+  ASTNode *prog = list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels,
+                        list2(ctx->arena, AST_new_atom(ctx->arena, "labelcall"),
+                              AST_new_atom(ctx->arena, "big")));
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  ok(ctx->writer->buf->len > initial_len, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(count));
+}
+TEST(relax_uses_short_forms_for_near_jumps) {
+  BufferWriter *writer = ctx->writer;
+  Label iffalse = BufferWriter_new_label(writer);
+  Label end = BufferWriter_new_label(writer);
+  Buffer_cmp_reg_imm32(writer, kRax, 0);
+  Buffer_jcc_label(writer, kNotEqual, iffalse);
+  Buffer_mov_reg_imm32(writer, kRax, 1);
+  Buffer_jmp_label(writer, end);
+  BufferWriter_bind_label(writer, iffalse);
+  Buffer_mov_reg_imm32(writer, kRax, 2);
+  BufferWriter_bind_label(writer, end);
+  Buffer_ret(writer);
+  BufferWriter_relax(writer);
+  // 0:  48 85 c0                test   rax,rax
+  // 3:  75 07                   jne    0xc
+  // 5:  b8 01 00 00 00          mov    eax,0x1
+  // a:  eb 05                   jmp    0x11
+  // c:  b8 02 00 00 00          mov    eax,0x2
+  // 11: c3                      ret
+  byte expected[] = {0x48, 0x85, 0xc0, 0x75, 0x07, 0xb8, 0x01, 0x00, 0x00,
+                     0x00, 0xeb, 0x05, 0xb8, 0x02, 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(writer), "==", sizeof expected, __func__);
+  cmp_ok(BufferWriter_label_pos(writer, iffalse), "==", 0xc, __func__);
+  cmp_ok(BufferWriter_label_pos(writer, end), "==", 0x11, __func__);
+}
+
+TEST(relax_keeps_rel32_for_far_jumps) {
+  BufferWriter *writer = ctx->writer;
+  Label end = BufferWriter_new_label(writer);
+  Buffer_mov_reg_imm32(writer, kRax, 0);
+  Buffer_cmp_reg_imm32(writer, kRax, 0);
+  Buffer_jcc_label(writer, kEqual, end);
+  // 26 * 5 = 130 bytes: one too many for a rel8
+  for (int i = 0; i < 26; i++) {
+    Buffer_mov_reg_imm32(writer, kRax, 1);
+  }
+  BufferWriter_bind_label(writer, end);
+  Buffer_ret(writer);
+  BufferWriter_relax(writer);
+  // 8:  0f 84 82 00 00 00       je     0x90
+  byte expected[] = {0x0f, 0x84, 0x82, 0x00, 0x00, 0x00};
+  cmp_ok(memcmp(writer->buf->address + 0x8, expected, sizeof expected), "==",
+         0, __func__);
+  cmp_ok(BufferWriter_label_pos(writer, end), "==", 0x90, __func__);
+  Buffer_make_executable(writer->buf);
+  EXPECT_CALL_EQUALS(writer->buf, 0);
+}
+
+TEST(relax_shortens_jumps_that_only_fit_once_others_do) {
+  // The first jump is 129 bytes from its target while the second one is
+  // long, and 126 once the second one is short.
+  BufferWriter *writer = ctx->writer;
+  Label end = BufferWriter_new_label(writer);
+  Buffer_jmp_label(writer, end);
+  Buffer_jmp_label(writer, end);
+  for (int i = 0; i < 124; i++) {
+    Buffer_write8(writer, 0x90); // nop
+  }
+  BufferWriter_bind_label(writer, end);
+  Buffer_ret(writer);
+  BufferWriter_relax(writer);
+  // 0:  eb 7e                   jmp    0x80
+  // 2:  eb 7c                   jmp    0x80
+  byte expected[] = {0xeb, 0x7e, 0xeb, 0x7c};
+  EXPECT_EQUALS_BYTES(writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(writer), "==", 0x81, __func__);
+}
+
+TEST(relax_handles_backward_jumps) {
+  BufferWriter *writer = ctx->writer;
+  Label near = BufferWriter_new_label(writer);
+  Label far = BufferWriter_new_label(writer);
+  Label end = BufferWriter_new_label(writer);
+  BufferWriter_bind_label(writer, far);
+  for (int i = 0; i < 130; i++) {
+    Buffer_write8(writer, 0x90); // nop
+  }
+  BufferWriter_bind_label(writer, near);
+  Buffer_jmp_label(writer, end);
+  Buffer_jmp_label(writer, near);
+  Buffer_jmp_label(writer, far);
+  BufferWriter_bind_label(writer, end);
+  BufferWriter_relax(writer);
+  // 82: eb 07                   jmp    0x8b
+  // 84: eb fc                   jmp    0x82
+  // 86: e9 75 ff ff ff          jmp    0x0
+  byte expected[] = {0xeb, 0x07, 0xeb, 0xfc, 0xe9, 0x75, 0xff, 0xff, 0xff};
+  cmp_ok(memcmp(writer->buf->address + 0x82, expected, sizeof expected), "==",
+         0, __func__);
+  cmp_ok(BufferWriter_get_pos(writer), "==", 0x8b, __func__);
+}
+
+// TEST(compile_labelcall_with_two_params) {
+//   // (labels ((add (code (x y) (+ x y)))) (labelcall add 3 4))
+//   ASTNode *body =
+//       list3(ctx->arena, AST_new_atom(ctx->arena, "+"),
+//             AST_new_atom(ctx->arena, "x"), AST_new_atom(ctx->arena, "y"));
+//   ASTNode *labels =
+//       list1(ctx->arena,
+//             list2(ctx->arena, AST_new_atom(ctx->arena, "id"),
+//                   list3(ctx->arena, AST_new_atom(ctx->arena, "code"),
+//                         list2(ctx->arena, AST_new_atom(ctx->arena, "x"),
+//                               AST_new_atom(ctx->arena, "y")),
+//                         body)));
+//   ASTNode *prog =
+//       list3(ctx->arena, AST_new_atom(ctx->arena, "labels"), labels,
+//             AST_new_fixnum(ctx->arena, 5));
+//   int compile_result = AST_compile_prog(ctx, prog);
+//   cmp_ok(compile_result, "==", 0, __func__);
+//   // 0:  e9 06 00 00 00          jmp    0xb
+//   // 5:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+//   // a:  c3                      ret
+//   // b:  48 89 fe                mov    rsi,rdi
+//   // e:  b8 14 00 00 00          mov    eax,0x14
+//   // 13: c3                      ret
+//   byte expected[] = {0xe9, 0x06, 0x00, 0x00, 0x00, 0x48, 0x8b,
+//                      0x44, 0x24, 0xf8, 0xc3, 0x48, 0x89, 0xfe,
+//                      0xb8, 0x14, 0x00, 0x00, 0x00, 0xc3};
+//   EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+//   Buffer_make_executable(ctx->writer->buf);
+//   EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+// }
+
+TEST(read_with_number_returns_fixnum) {
+  (void)ctx;
+  char *input = "1234";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kFixnum);
+  cmp_ok(output->value.fixnum, "==", 1234);
+}
+
+TEST(read_with_leading_whitespace_ignores_whitespace) {
+  (void)ctx;
+  char *input = "  \t \n 1234";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kFixnum);
+  cmp_ok(output->value.fixnum, "==", 1234);
+}
+
+TEST(read_with_atom_returns_atom) {
+  (void)ctx;
+  char *input = "hello";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kAtom);
+  ok(AST_atom_equals_cstr(output, "hello"));
+}
+
+TEST(read_with_nil_returns_nil) {
+  (void)ctx;
+  char *input = "()";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kCons);
+  ok(output == nil);
+}
+
+TEST(read_with_list_returns_list) {
+  (void)ctx;
+  char *input = "(1 2 3)";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kCons);
+  ASTNode *elt = AST_car(output);
+  cmp_ok(elt->type, "==", kFixnum);
+  cmp_ok(elt->value.fixnum, "==", 1);
+  elt = AST_car(AST_cdr(output));
+  cmp_ok(elt->type, "==", kFixnum);
+  cmp_ok(elt->value.fixnum, "==", 2);
+  elt = AST_car(AST_cdr(AST_cdr(output)));
+  cmp_ok(elt->type, "==", kFixnum);
+  cmp_ok(elt->value.fixnum, "==", 3);
+}
+
+TEST(read_with_nested_list_returns_list) {
+  (void)ctx;
+  char *input = "((hello world) (foo bar))";
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kCons);
+  ASTNode *elt = AST_car(output);
+  cmp_ok(elt->type, "==", kCons);
+  ok(AST_atom_equals_cstr(AST_car(elt), "hello"));
+  ok(AST_atom_equals_cstr(AST_car(AST_cdr(elt)), "world"));
+  elt = AST_car(AST_cdr(output));
+  cmp_ok(elt->type, "==", kCons);
+  ok(AST_atom_equals_cstr(AST_car(elt), "foo"));
+  ok(AST_atom_equals_cstr(AST_car(AST_cdr(elt)), "bar"));
+}
+
+TEST(arena_allocations_are_aligned_and_distinct) {
+  (void)ctx;
+  Arena arena;
+  Arena_init(&arena);
+  char *a = Arena_alloc(&arena, 3);
+  char *b = Arena_alloc(&arena, 1);
+  ok(a != b, __func__);
+  cmp_ok((uintptr_t)b % kArenaAlignment, "==", 0, __func__);
+  // Bigger than a chunk: gets its own chunk.
+  char *big = Arena_alloc(&arena, 2 * kArenaChunkSize);
+  memset(big, 0xab, 2 * kArenaChunkSize);
+  char *c = Arena_alloc(&arena, 8);
+  ok(c != NULL, __func__);
+  char *str = Arena_strdup(&arena, "hello");
+  ok(strcmp(str, "hello") == 0, __func__);
+  Arena_deinit(&arena);
+  ok(arena.chunks == NULL, __func__);
+}
+
+TEST(read_allocates_nodes_in_arena) {
+  (void)ctx;
+  Arena arena;
+  Arena_init(&arena);
+  ASTNode *output = Reader_read(&arena, "(foo 1 2)");
+  byte *chunk_start = (byte *)arena.chunks->data;
+  ok((byte *)output >= chunk_start && (byte *)output < arena.ptr, __func__);
+  ASTNode *atom = AST_car(output);
+  ok((byte *)atom >= chunk_start && (byte *)atom < arena.ptr, __func__);
+  Arena_deinit(&arena);
+}
+
+TEST(intern_returns_same_symbol_for_same_name) {
+  (void)ctx;
+  Symbol *a = Symbol_intern("some-name");
+  char name[] = "some-name";
+  Symbol *b = Symbol_intern(name);
+  ok(a == b, __func__);
+  ok(a != Symbol_intern("some-other-name"), __func__);
+  ok(Symbol_from_id(a->id) == a, __func__);
+  cmp_ok(a->hash, "==", Symbol_hash("some-name", strlen("some-name")),
+         __func__);
+}
+
+TEST(intern_keeps_builtin_ids) {
+  (void)ctx;
+  Symbol *let = Symbol_intern("let");
+  cmp_ok(let->id, "==", kSymLet, __func__);
+  ok(Symbol_builtin(kSymLet) == let, __func__);
+}
+
+TEST(intern_survives_table_growth) {
+  (void)ctx;
+  Symbol *first = Symbol_intern("growth-0");
+  char name[32];
+  for (int i = 1; i < 1000; i++) {
+    snprintf(name, sizeof name, "growth-%d", i);
+    Symbol_intern(name);
+  }
+  ok(Symbol_intern("growth-0") == first, __func__);
+  ok(strcmp(Symbol_intern("growth-999")->name, "growth-999") == 0, __func__);
+}
+
+enum { kTestingInternThreads = 4, kTestingInternNames = 20000 };
+
+typedef struct {
+  pthread_barrier_t *start;
+  Symbol **symbols;
+} TestingInternThread;
+
+// Intern the same names as the other threads, all starting at once and with
+// enough names that the table grows while the others are probing it.
+static void *Testing_intern_thread(void *arg) {
+  TestingInternThread *thread = arg;
+  pthread_barrier_wait(thread->start);
+  char name[32];
+  for (int i = 0; i < kTestingInternNames; i++) {
+    snprintf(name, sizeof name, "threaded-%d", i);
+    thread->symbols[i] = Symbol_intern(name);
+  }
+  return NULL;
+}
+
+TEST(intern_is_shared_between_threads) {
+  (void)ctx;
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, /*attr=*/NULL, kTestingInternThreads);
+  pthread_t threads[kTestingInternThreads];
+  TestingInternThread args[kTestingInternThreads];
+  for (int t = 0; t < kTestingInternThreads; t++) {
+    args[t] = (TestingInternThread){
+        .start = &start,
+        .symbols = malloc(kTestingInternNames * sizeof *args[t].symbols)};
+    pthread_create(&threads[t], /*attr=*/NULL, Testing_intern_thread,
+                   &args[t]);
+  }
+  for (int t = 0; t < kTestingInternThreads; t++) {
+    pthread_join(threads[t], /*retval=*/NULL);
+  }
+  pthread_barrier_destroy(&start);
+  int mismatches = 0;
+  for (int i = 0; i < kTestingInternNames; i++) {
+    Symbol *sym = args[0].symbols[i];
+    for (int t = 1; t < kTestingInternThreads; t++) {
+      mismatches += args[t].symbols[i] != sym;
+    }
+    mismatches += Symbol_from_id(sym->id) != sym;
+  }
+  cmp_ok(mismatches, "==", 0, __func__);
+  for (int t = 0; t < kTestingInternThreads; t++) {
+    free(args[t].symbols);
+  }
+}
+
+TEST(read_interns_atoms) {
+  ASTNode *output = Reader_read(ctx->arena, "(foo bar foo)");
+  ASTNode *first = AST_car(output);
+  ASTNode *third = AST_car(AST_cdr(AST_cdr(output)));
+  ok(first != third, __func__);
+  ok(first->value.atom == third->value.atom, __func__);
+  ok(first->value.atom == Symbol_intern("foo"), __func__);
+}
+
+static int compile_double(CompilerContext *ctx, ASTNode *args,
+                          int stack_index) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_shl_reg(ctx->writer, kRax, 1);
+  return 0;
+}
+
+TEST(compile_registered_primitive) {
+  Primitive_register("double", 1, compile_double);
+  ASTNode *node = Reader_read(ctx->arena, "(double 5)");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // mov eax, imm(5); shl rax, 1; ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x48,
+                     0xc1, 0xe0, 0x01, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(10));
+}
+
+TEST(compile_primcall_with_wrong_arity) {
+  ASTNode *node = Reader_read(ctx->arena, "(car 1 2)");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", -1, __func__);
+}
+
+TEST(compile_unknown_primitive) {
+  ASTNode *node = Reader_read(ctx->arena, "(frobnicate 1)");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", -1, __func__);
+}
+
+TEST(read_atom_with_punctuation_and_digits) {
+  ASTNode *output = Reader_read(ctx->arena, "integer->char");
+  ok(output != NULL && AST_atom_equals_cstr(output, "integer->char"));
+  output = Reader_read(ctx->arena, "zero?");
+  ok(output != NULL && AST_atom_equals_cstr(output, "zero?"));
+  output = Reader_read(ctx->arena, "add1");
+  ok(output != NULL && AST_atom_equals_cstr(output, "add1"));
+}
+
+TEST(read_long_atom_is_not_truncated) {
+  char input[200];
+  memset(input, 'a', sizeof input - 1);
+  input[sizeof input - 1] = '\0';
+  ASTNode *output = Reader_read(ctx->arena, input);
+  ok(output != NULL && AST_atom_equals_cstr(output, input), __func__);
+}
+
+TEST(read_negative_number) {
+  ASTNode *output = Reader_read(ctx->arena, "-42");
+  assert(output != NULL);
+  cmp_ok(output->type, "==", kFixnum);
+  cmp_ok(output->value.fixnum, "==", -42);
+  output = Reader_read(ctx->arena, "-");
+  ok(output != NULL && AST_atom_equals_cstr(output, "-"));
+}
+
+TEST(read_multiple_forms_one_at_a_time) {
+  Reader reader;
+  Reader_init_cstr(&reader, ctx->arena, " 1 ; comment (\n (a b)\nc ");
+  ASTNode *form = NULL;
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  cmp_ok(form->type, "==", kFixnum);
+  cmp_ok(form->span_start, "==", 1);
+  cmp_ok(form->span_length, "==", 1);
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  cmp_ok(form->type, "==", kCons);
+  cmp_ok(form->span_start, "==", 16);
+  cmp_ok(form->span_length, "==", 5);
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  ok(AST_atom_equals_cstr(form, "c"));
+  cmp_ok(form->span_start, "==", 22);
+  cmp_ok(Reader_next(&reader, &form), "==", kReadEof);
+  Reader_deinit(&reader);
+}
+
+TEST(read_reports_errors) {
+  Reader reader;
+  ASTNode *form = NULL;
+  Reader_init_cstr(&reader, ctx->arena, "(1 (2)");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  cmp_ok(reader.error_pos, "==", 0);
+  Reader_deinit(&reader);
+  Reader_init_cstr(&reader, ctx->arena, "  )");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  cmp_ok(reader.error_pos, "==", 2);
+  Reader_deinit(&reader);
+  Reader_init_cstr(&reader, ctx->arena, "99999999999");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  Reader_deinit(&reader);
+}
+
+TEST(read_numbers_at_the_fixnum_bounds) {
+  ASTNode *output = Reader_read(ctx->arena, "536870911");
+  assert(output != NULL);
+  cmp_ok(output->value.fixnum, "==", kFixnumMax);
+  output = Reader_read(ctx->arena, "-536870912");
+  assert(output != NULL);
+  cmp_ok(output->value.fixnum, "==", kFixnumMin);
+  Reader reader;
+  ASTNode *form = NULL;
+  Reader_init_cstr(&reader, ctx->arena, "536870912");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  Reader_deinit(&reader);
+  Reader_init_cstr(&reader, ctx->arena, "-536870913");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  Reader_deinit(&reader);
+  Reader_init_cstr(&reader, ctx->arena, "1000000000");
+  cmp_ok(Reader_next(&reader, &form), "==", kReadError);
+  Reader_deinit(&reader);
+}
+
+TEST(read_long_list_without_recursion) {
+  int count = 100000;
+  char *input = malloc(count * 2 + 3);
+  char *p = input;
+  *p++ = '(';
+  for (int i = 0; i < count; i++) {
+    *p++ = '7';
+    *p++ = ' ';
+  }
+  *p++ = ')';
+  *p = '\0';
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  cmp_ok(AST_list_length(output), "==", count, __func__);
+  free(input);
+}
+
+TEST(read_deeply_nested_list_without_recursion) {
+  int depth = 100000;
+  char *input = malloc(depth * 2 + 2);
+  memset(input, '(', depth);
+  input[depth] = 'x';
+  memset(input + depth + 1, ')', depth);
+  input[depth * 2 + 1] = '\0';
+  ASTNode *output = Reader_read(ctx->arena, input);
+  assert(output != NULL);
+  int seen = 0;
+  while (output->type == kCons) {
+    output = AST_car(output);
+    seen++;
+  }
+  cmp_ok(seen, "==", depth, __func__);
+  ok(AST_atom_equals_cstr(output, "x"), __func__);
+  free(input);
+}
+
+typedef struct {
+  const char *input;
+  size_t pos;
+} TrickleState;
+
+// Hand out one byte per refill, so every token straddles windows.
+static size_t trickle_refill(void *state, char *buf, size_t len) {
+  TrickleState *trickle = state;
+  if (len == 0 || trickle->input[trickle->pos] == '\0') {
+    return 0;
+  }
+  buf[0] = trickle->input[trickle->pos++];
+  return 1;
+}
+
+TEST(read_from_stream_across_refills) {
+  TrickleState state = {.input = "(labels () 123) some-atom", .pos = 0};
+  Reader reader;
+  Reader_init_stream(&reader, ctx->arena, trickle_refill, &state);
+  ASTNode *form = NULL;
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  ok(AST_atom_equals_cstr(AST_car(form), "labels"));
+  cmp_ok(operand2(AST_cdr(form))->value.fixnum, "==", 123);
+  cmp_ok(form->span_length, "==", 15);
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  ok(AST_atom_equals_cstr(form, "some-atom"));
+  cmp_ok(form->span_start, "==", 16);
+  cmp_ok(Reader_next(&reader, &form), "==", kReadEof);
+  Reader_deinit(&reader);
+}
+
+TEST(read_from_mapped_file) {
+  char path[] = "/tmp/ghuloum-reader-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  const char *source = "(let ((x 2)) x)\n(cons 1 2)\n";
+  ssize_t written = write(fd, source, strlen(source));
+  cmp_ok(written, "==", strlen(source));
+  close(fd);
+  Reader reader;
+  cmp_ok(Reader_init_file(&reader, ctx->arena, path), "==", 0);
+  ASTNode *form = NULL;
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  ok(AST_atom_is_builtin(AST_car(form), kSymLet));
+  cmp_ok(Reader_next(&reader, &form), "==", kReadOk);
+  ok(AST_atom_is_builtin(AST_car(form), kSymCons));
+  cmp_ok(Reader_next(&reader, &form), "==", kReadEof);
+  Reader_deinit(&reader);
+  unlink(path);
+  cmp_ok(Reader_init_file(&reader, ctx->arena, path), "==", -1);
+}
+
+TEST(compile_with_read) {
+  uint64_t result = Run_from_cstr("(let ((x 2) (y 3)) (+ x y))", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(5), __func__);
+}
+
+TEST(add_rax_rcx) {
+  Buffer_add_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRcx);
+  byte expected[] = {0x48, 0x01, 0xc8};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(let_and_plus_keep_values_in_registers) {
+  ctx->options |= kOptRegisters;
+  ASTNode *node = Reader_read(ctx->arena, "(let ((x 2)) (+ x 3))");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 08 00 00 00          mov    eax,0x8
+  // 5:  48 89 c1                mov    rcx,rax
+  // 8:  b8 0c 00 00 00          mov    eax,0xc
+  // d:  48 89 c2                mov    rdx,rax
+  // 10: 48 89 c8                mov    rax,rcx
+  // 13: 03 c2                   add    eax,edx
+  // 15: c3                      ret
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0xc1,
+                     0xb8, 0x0c, 0x00, 0x00, 0x00, 0x48, 0x89, 0xc2,
+                     0x48, 0x89, 0xc8, 0x03, 0xc2, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(labelcall_passes_register_args_through_stack) {
+  ctx->options |= kOptRegisters;
+  ASTNode *prog =
+      Reader_read(ctx->arena, "(labels ((id (code (x) x))) (labelcall id 5))");
+  int result = AST_compile_prog(ctx, prog);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  eb 09                   jmp    0xb
+  // 2:  48 8b 4c 24 f8          mov    rcx,QWORD PTR [rsp-0x8]
+  // 7:  48 89 c8                mov    rax,rcx
+  // a:  c3                      ret
+  // b:  48 89 fe                mov    rsi,rdi
+  // e:  b8 14 00 00 00          mov    eax,0x14
+  // 13: 48 89 c1                mov    rcx,rax
+  // 16: 48 89 4c 24 f8          mov    QWORD PTR [rsp-0x8],rcx
+  // 1b: eb e5                   jmp    0x2
+  byte expected[] = {0xeb, 0x09, 0x48, 0x8b, 0x4c, 0x24, 0xf8, 0x48, 0x89, 0xc8,
+                     0xc3, 0x48, 0x89, 0xfe, 0xb8, 0x14, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0xc1, 0x48, 0x89, 0x4c, 0x24, 0xf8, 0xeb, 0xe5};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(registers_spill_past_the_pool) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_from_cstr(
+      "(let ((a 1) (b 2) (c 3) (d 4) (e 5)) (+ a (+ b (+ c (+ d e)))))", ctx,
+      heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(15), __func__);
+}
+
+TEST(registers_survive_labelcall) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((add (code (x y) (+ x y))))"
+      "  (let ((a 1) (b 2)) (+ a (+ (labelcall add 3 4) b))))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10), __func__);
+}
+
+TEST(registers_survive_labelcall_in_argument) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((add (code (x y) (+ x y))))"
+      "  (labelcall add 1 (labelcall add 2 3)))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(6), __func__);
+}
+
+TEST(registers_hold_formals_across_recursion) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((sum (code (n acc)"
+      "              (if (zero? n) acc (labelcall sum (sub1 n) (+ acc n))))))"
+      "  (labelcall sum 10 0))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(55), __func__);
+}
+
+// Lower `input' as the body of a function with no formals and return the IR
+// dump, which the caller must free.
+static char *Testing_lower_cstr(CompilerContext *ctx, char *input) {
+  IRFunction fn;
+  IR_init(&fn, ctx->labels);
+  int result = IR_lower_function(&fn, nil, Reader_read(ctx->arena, input));
+  cmp_ok(result, "==", 0, __func__);
+  char *dump = NULL;
+  size_t dump_len = 0;
+  FILE *fp = open_memstream(&dump, &dump_len);
+  assert(fp != NULL);
+  IR_dump(&fn, fp);
+  fclose(fp);
+  IR_deinit(&fn);
+  return dump;
+}
+
+TEST(ir_lowers_let_to_three_address_code) {
+  char *dump = Testing_lower_cstr(ctx, "(let ((x 2)) (+ x 3))");
+  is(dump,
+     "b0:\n"
+     "  v0 = const 8\n"
+     "  v1 = const 12\n"
+     "  v2 = add v0 v1\n"
+     "  return v2\n",
+     __func__);
+  free(dump);
+}
+
+TEST(ir_lowers_if_to_blocks) {
+  char *dump = Testing_lower_cstr(ctx, "(if (zero? 0) 1 2)");
+  is(dump,
+     "b0:\n"
+     "  v0 = const 0\n"
+     "  branch.compare v0 e b2\n"
+     "b1:\n"
+     "  v1 = const 4\n"
+     "  return v1\n"
+     "b2:\n"
+     "  v2 = const 8\n"
+     "  return v2\n",
+     __func__);
+  free(dump);
+}
+
+TEST(ir_refuses_unknown_primitives) {
+  IRFunction fn;
+  IR_init(&fn, NULL);
+  ASTNode *node = Reader_read(ctx->arena, "(add1 (frobnicate 1))");
+  cmp_ok(IR_lower_function(&fn, nil, node), "==", -1, __func__);
+  IR_deinit(&fn);
+}
+
+TEST(ir_allocates_registers_and_keeps_temporaries_in_rax) {
+  ctx->options |= kOptIR;
+  ASTNode *node = Reader_read(ctx->arena, "(let ((x 2)) (+ x 3))");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b9 08 00 00 00          mov    ecx,0x8
+  // 5:  ba 0c 00 00 00          mov    edx,0xc
+  // a:  48 89 c8                mov    rax,rcx
+  // d:  03 c2                   add    eax,edx
+  // f:  c3                      ret
+  byte expected[] = {0xb9, 0x08, 0x00, 0x00, 0x00, 0xba, 0x0c, 0x00,
+                     0x00, 0x00, 0x48, 0x89, 0xc8, 0x03, 0xc2, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+}
+
+TEST(ir_spills_under_register_pressure) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_from_cstr(
+      "(let ((a 1) (b 2) (c 3) (d 4) (e 5)) (+ a (+ b (+ c (+ d e)))))", ctx,
+      heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(15), __func__);
+}
+
+TEST(ir_compiles_conditionals) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_from_cstr(
+      "(let ((x 0)) (if (zero? x) (if (zero? (add1 x)) 1 2) 3))", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(2), __func__);
+}
+
+TEST(ir_compiles_pairs) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_from_cstr(
+      "(let ((p (cons 1 (integer->char 65)))) (cons (cdr p) (car p)))", ctx,
+      heap);
+  cmp_ok(result & kHeapObjectMask, "==", kPairTag, __func__);
+  uint64_t *cell = (uint64_t *)(result - kPairTag);
+  cmp_ok(cell[0], "==", encodeImmediateChar('A'), __func__);
+  cmp_ok(cell[1], "==", encodeImmediateFixnum(1), __func__);
+}
+
+TEST(ir_keeps_values_in_slots_across_labelcall) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((add (code (x y) (+ x y))))"
+      "  (let ((a 1) (b 2)) (+ a (+ (labelcall add 3 4) b))))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10), __func__);
+}
+
+TEST(ir_evaluates_labelcall_arguments_before_storing_them) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((add (code (x y) (+ x y))))"
+      "  (labelcall add 1 (labelcall add 2 3)))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(6), __func__);
+}
+
+TEST(ir_compiles_recursion) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((sum (code (n acc)"
+      "              (if (zero? n) acc (labelcall sum (sub1 n) (+ acc n))))))"
+      "  (labelcall sum 10 0))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(55), __func__);
+}
+
+TEST(ir_falls_back_per_function) {
+  ctx->options |= kOptIR;
+  Primitive_register("double", 1, compile_double);
+  // `dbl' goes through the direct emitter and `quad' through the IR.
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((dbl (code (x) (double x)))"
+      "         (quad (code (x) (labelcall dbl (labelcall dbl x)))))"
+      "  (labelcall quad 3))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(12), __func__);
+}
+
+static bool Testing_ast_equal(ASTNode *a, ASTNode *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+  switch (a->type) {
+  case kFixnum:
+    return a->value.fixnum == b->value.fixnum;
+  case kAtom:
+    return a->value.atom == b->value.atom;
+  case kChar:
+    return a->value.character == b->value.character;
+  case kBool:
+    return a->value.boolean == b->value.boolean;
+  case kCons:
+    if (a == nil || b == nil) {
+      return a == b;
+    }
+    return Testing_ast_equal(AST_car(a), AST_car(b)) &&
+           Testing_ast_equal(AST_cdr(a), AST_cdr(b));
   }
-  free(heap);
+  return false;
+}
+
+static ASTNode *Testing_fold_cstr(CompilerContext *ctx, char *input) {
+  return AST_fold(ctx, Reader_read(ctx->arena, input));
+}
+
+TEST(fold_add_four_ints) {
+  ctx->options |= kOptFold;
+  ASTNode *node = Reader_read(ctx->arena, "(+ (+ 1 2) (+ 3 4))");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 28 00 00 00          mov    eax,0x28
+  // 5:  c3                      ret
+  byte expected[] = {0xb8, 0x28, 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(10));
+}
+
+TEST(fold_prunes_if_with_constant_test) {
+  ctx->options |= kOptFold;
+  // The other arm would not even compile.
+  ASTNode *node =
+      Reader_read(ctx->arena, "(if (zero? 0) (add1 1) (frobnicate))");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+}
+
+TEST(fold_propagates_let_constants) {
+  ASTNode *folded =
+      Testing_fold_cstr(ctx, "(let ((x 5) (y (add1 x))) (+ x y))");
+  cmp_ok(folded->type, "==", kFixnum, __func__);
+  cmp_ok(folded->value.fixnum, "==", 11, __func__);
+}
+
+TEST(fold_keeps_bindings_computed_at_run_time) {
+  ASTNode *folded = Testing_fold_cstr(ctx, "(let ((a 2) (b (car p))) (+ a b))");
+  ASTNode *expected = Reader_read(ctx->arena, "(let ((b (car p))) (+ 2 b))");
+  ok(Testing_ast_equal(folded, expected), __func__);
+}
+
+TEST(fold_respects_shadowing) {
+  ASTNode *input =
+      Reader_read(ctx->arena, "(let ((x 1)) (let ((x (car y))) x))");
+  ok(Testing_ast_equal(AST_fold(ctx, input), input), __func__);
+}
+
+TEST(fold_leaves_embedder_forms_alone) {
+  Primitive_register("double", 1, compile_double);
+  ASTNode *input = Reader_read(ctx->arena, "(let ((x 5)) (double x))");
+  ok(AST_fold(ctx, input) == input, __func__);
+}
+
+TEST(fold_makes_chars_and_bools) {
+  ASTNode *folded = Testing_fold_cstr(ctx, "(integer->char 65)");
+  cmp_ok(folded->type, "==", kChar, __func__);
+  cmp_ok(folded->value.character, "==", 'A', __func__);
+  folded = Testing_fold_cstr(ctx, "(zero? (integer->char 0))");
+  cmp_ok(folded->type, "==", kBool, __func__);
+  ok(!folded->value.boolean, __func__);
+  ctx->options |= kOptFold;
+  uint64_t result = Run_from_cstr("(integer->char 65)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateChar('A'), __func__);
+}
+
+TEST(fold_leaves_overflow_to_run_time) {
+  ASTNode *input = Reader_read(ctx->arena, "(add1 536870911)");
+  ok(AST_fold(ctx, input) == input, __func__);
+}
+
+static int test_nonzerop(CompilerContext *ctx, ASTNode *args, int stack_index,
+                         Condition *cond) {
+  int result = AST_compile_expr(ctx, operand1(args), stack_index);
+  if (result != 0) {
+    return result;
+  }
+  Buffer_cmp_reg_imm32(ctx->writer, kRax, 0);
+  *cond = kNotEqual;
+  return 0;
+}
+
+TEST(if_branches_on_registered_predicate) {
+  Primitive_register_test("nonzero?", 1, test_nonzerop);
+  ASTNode *node = Reader_read(ctx->arena, "(if (nonzero? 5) 1 2)");
+  int result = AST_compile_function(ctx, node);
+  cmp_ok(result, "==", 0, __func__);
+  // 0:  b8 14 00 00 00          mov    eax,0x14
+  // 5:  48 85 c0                test   rax,rax
+  // 8:  74 06                   je     0x10
+  // a:  b8 04 00 00 00          mov    eax,0x4
+  // f:  c3                      ret
+  // 10: b8 08 00 00 00          mov    eax,0x8
+  // 15: c3                      ret
+  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x48, 0x85, 0xc0,
+                     0x74, 0x06, 0xb8, 0x04, 0x00, 0x00, 0x00, 0xc3,
+                     0xb8, 0x08, 0x00, 0x00, 0x00, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(1));
+}
+
+TEST(registered_predicate_as_value_makes_bool) {
+  Primitive_register_test("nonzero?", 1, test_nonzerop);
+  uint64_t result = Run_from_cstr("(nonzero? 0)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateBool(false), __func__);
+}
+
+TEST(if_on_non_predicate_tests_against_false) {
+  // Only #f is false, so 0 takes the first arm.
+  uint64_t result = Run_from_cstr("(if 0 1 2)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(1), __func__);
+}
+
+TEST(ir_compares_predicates_used_as_values) {
+  char *dump = Testing_lower_cstr(ctx, "(zero? 3)");
+  is(dump,
+     "b0:\n"
+     "  v0 = const 12\n"
+     "  v1 = compare v0 e\n"
+     "  return v1\n",
+     __func__);
+  free(dump);
+  ctx->options |= kOptIR;
+  uint64_t result = Run_from_cstr("(zero? 3)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateBool(false), __func__);
+}
+
+// Ten million iterations: without tail calls, the frames alone would take a
+// couple of hundred megabytes of stack.
+static char *kTestingCountdown =
+    "(labels ((count (code (n acc)"
+    "                (if (zero? n) acc"
+    "                    (labelcall count (sub1 n) (add1 acc))))))"
+    "  (labelcall count 10000000 0))";
+
+TEST(tail_labelcall_runs_in_constant_stack) {
+  uint64_t result = Run_prog_from_cstr(kTestingCountdown, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10000000), __func__);
+}
+
+TEST(tail_labelcall_runs_in_constant_stack_with_registers) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_prog_from_cstr(kTestingCountdown, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10000000), __func__);
+}
+
+TEST(ir_tail_call_runs_in_constant_stack) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(kTestingCountdown, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(10000000), __func__);
+}
+
+// Each argument is another formal, so moving any of them into place before all
+// of them are evaluated would be wrong.
+static char *kTestingRotate =
+    "(labels ((rot (code (n a b c)"
+    "              (if (zero? n) (+ a (+ (+ b b) (+ (+ c c) (+ c c))))"
+    "                  (labelcall rot (sub1 n) b c a)))))"
+    "  (labelcall rot 4 1 2 3))";
+
+TEST(tail_labelcall_rotates_arguments) {
+  uint64_t result = Run_prog_from_cstr(kTestingRotate, ctx, heap);
+  // After four rotations a, b, c are 2, 3, 1.
+  cmp_ok(result, "==", encodeImmediateFixnum(2 + 2 * 3 + 4 * 1), __func__);
+}
+
+TEST(tail_labelcall_rotates_arguments_with_registers) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_prog_from_cstr(kTestingRotate, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(2 + 2 * 3 + 4 * 1), __func__);
+}
+
+TEST(ir_tail_call_rotates_arguments) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(kTestingRotate, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(2 + 2 * 3 + 4 * 1), __func__);
+}
+
+TEST(tail_labelcall_from_let_moves_arguments_up) {
+  // The arguments are evaluated below `m' and moved up over `n' and `acc'.
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((count (code (n acc)"
+      "                (let ((m (sub1 n)))"
+      "                  (if (zero? n) acc (labelcall count m (add1 acc)))))))"
+      "  (labelcall count 1000000 0))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(1000000), __func__);
+}
+
+TEST(labelcall_in_argument_position_is_not_a_tail_call) {
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((id (code (x) x)))"
+      "  (if (zero? 0) (add1 (labelcall id 4)) 0))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(5), __func__);
+}
+
+TEST(ir_lowers_labelcall_in_tail_position) {
+  Label label = BufferWriter_new_label(ctx->writer);
+  EnvNode labels = Env_init(Symbol_intern("f"), label, NULL);
+  ctx->labels = &labels;
+  char *dump = Testing_lower_cstr(ctx, "(labelcall f (labelcall f 1) 2)");
+  is(dump,
+     "b0:\n"
+     "  v0 = const 4\n"
+     "  arg v0 0\n"
+     "  v1 = call 0\n"
+     "  v2 = const 8\n"
+     "  arg v1 0\n"
+     "  arg v2 1\n"
+     "  tailcall 0\n",
+     __func__);
+  free(dump);
+}
+
+TEST(ir_joins_if_arms_used_as_values) {
+  char *dump = Testing_lower_cstr(ctx, "(add1 (if (zero? 0) 1 2))");
+  is(dump,
+     "b0:\n"
+     "  v0 = const 0\n"
+     "  branch.compare v0 e b2\n"
+     "b1:\n"
+     "  v2 = const 4\n"
+     "  v1 = move v2\n"
+     "  jump b3\n"
+     "b2:\n"
+     "  v3 = const 8\n"
+     "  v1 = move v3\n"
+     "  jump b3\n"
+     "b3:\n"
+     "  v4 = add v1 4\n"
+     "  return v4\n",
+     __func__);
+  free(dump);
+}
+
+TEST(nested_cons_keeps_its_car) {
+  // The inner pair is allocated while the outer one's car is waiting.
+  uint64_t result = Run_from_cstr(
+      "(let ((p (cons 1 (cons 2 3)))) (+ (car p) (car (cdr p))))", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(3), __func__);
+}
+
+TEST(gc_coalesces_heap_checks) {
+  StackMaps maps;
+  StackMaps_init(&maps);
+  ctx->options |= kOptGC;
+  ctx->stack_maps = &maps;
+  ASTNode *node = Reader_read(ctx->arena, "(cons 1 (cons 2 3))");
+  int compile_result = AST_compile_function(ctx, node);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // One check for both pairs, then the pairs; the slow path and the GC stub
+  // come after the ret.
+  // 0:  48 83 c6 20             add    rsi,0x20
+  // 4:  49 3b 73 08             cmp    rsi,QWORD PTR [r11+0x8]
+  // 8:  48 8d 76 e0             lea    rsi,[rsi-0x20]
+  // c:  77 48                   ja     0x56
+  // e:  b8 04 00 00 00          mov    eax,0x4
+  // 13: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 18: b8 08 00 00 00          mov    eax,0x8
+  // 1d: 48 89 44 24 f0          mov    QWORD PTR [rsp-0x10],rax
+  // 22: b8 0c 00 00 00          mov    eax,0xc
+  // 27: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
+  // 2b: 48 8b 44 24 f0          mov    rax,QWORD PTR [rsp-0x10]
+  // 30: 48 89 06                mov    QWORD PTR [rsi],rax
+  // 33: 48 89 f0                mov    rax,rsi
+  // 36: 48 83 c8 01             or     rax,0x1
+  // 3a: 48 83 c6 10             add    rsi,0x10
+  // 3e: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
+  // 42: 48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  // 47: 48 89 06                mov    QWORD PTR [rsi],rax
+  // 4a: 48 89 f0                mov    rax,rsi
+  // 4d: 48 83 c8 01             or     rax,0x1
+  // 51: 48 83 c6 10             add    rsi,0x10
+  // 55: c3                      ret
+  byte expected[] = {0x48, 0x83, 0xc6, 0x20, 0x49, 0x3b, 0x73, 0x08, 0x48, 0x8d,
+                     0x76, 0xe0, 0x77, 0x48, 0xb8, 0x04, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0x44, 0x24, 0xf8, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0x44, 0x24, 0xf0, 0xb8, 0x0c, 0x00, 0x00, 0x00, 0x48,
+                     0x89, 0x46, 0x08, 0x48, 0x8b, 0x44, 0x24, 0xf0, 0x48, 0x89,
+                     0x06, 0x48, 0x89, 0xf0, 0x48, 0x83, 0xc8, 0x01, 0x48, 0x83,
+                     0xc6, 0x10, 0x48, 0x89, 0x46, 0x08, 0x48, 0x8b, 0x44, 0x24,
+                     0xf8, 0x48, 0x89, 0x06, 0x48, 0x89, 0xf0, 0x48, 0x83, 0xc8,
+                     0x01, 0x48, 0x83, 0xc6, 0x10, 0xc3};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(maps.num_entries, "==", 1, __func__);
+  StackMaps_deinit(&maps);
+}
+
+TEST(gc_checks_pairs_whose_halves_call_labels) {
+  StackMaps maps;
+  StackMaps_init(&maps);
+  ctx->options |= kOptGC;
+  ctx->stack_maps = &maps;
+  ASTNode *prog = Reader_read(
+      ctx->arena, "(labels ((id (code (x) x))) (cons (labelcall id 1) 2))");
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  // The call, and a check for the pair after it: (labelcall id 1) can't be
+  // sized up front.
+  cmp_ok(maps.num_entries, "==", 2, __func__);
+  StackMaps_deinit(&maps);
+}
+
+// Each round allocates garbage and a fresh copy of `keep', so a heap of a few
+// dozen pairs has to be collected over and over.
+static char *kTestingChurn =
+    "(labels ((churn (code (n keep)"
+    "                (if (zero? n) keep"
+    "                    (let ((junk (cons n n)))"
+    "                      (labelcall churn (sub1 n)"
+    "                                 (cons (cdr keep) (car keep))))))))"
+    "  (let ((p (labelcall churn 1001 (cons 3 4))))"
+    "    (+ (car p) (+ (cdr p) (cdr p)))))";
+
+TEST(gc_collects_garbage) {
+  int collections;
+  uint64_t result = Testing_run_gc_prog(kTestingChurn, ctx, 1024, &collections);
+  // An odd number of swaps leaves (4 . 3).
+  cmp_ok(result, "==", encodeImmediateFixnum(4 + 2 * 3), __func__);
+  cmp_ok(collections, ">", 10, __func__);
+}
+
+TEST(gc_collects_garbage_with_registers) {
+  ctx->options |= kOptRegisters;
+  int collections;
+  uint64_t result = Testing_run_gc_prog(kTestingChurn, ctx, 1024, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(4 + 2 * 3), __func__);
+  cmp_ok(collections, ">", 10, __func__);
+}
+
+TEST(ir_gc_collects_garbage) {
+  ctx->options |= kOptIR;
+  int collections;
+  uint64_t result = Testing_run_gc_prog(kTestingChurn, ctx, 1024, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(4 + 2 * 3), __func__);
+  cmp_ok(collections, ">", 10, __func__);
+}
+
+// A thousand pairs stay live, in a heap that starts out with room for 16. The
+// car comes from a labelcall, so each pair is checked for with its cdr -- the
+// list so far -- live in rax.
+static char *kTestingLongList =
+    "(labels ((id (code (x) x))"
+    "         (build (code (n acc)"
+    "                (if (zero? n) acc"
+    "                    (labelcall build (sub1 n)"
+    "                               (cons (labelcall id n) acc)))))"
+    "         (sum (code (l acc)"
+    "              (if (zero? (car l)) acc"
+    "                  (labelcall sum (cdr l) (+ acc (car l)))))))"
+    "  (labelcall sum (labelcall build 1000 (cons 0 0)) 0))";
+
+TEST(gc_grows_the_heap_to_fit_live_data) {
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingLongList, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(500500), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+TEST(gc_grows_the_heap_to_fit_live_data_with_registers) {
+  ctx->options |= kOptRegisters;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingLongList, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(500500), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+TEST(ir_gc_grows_the_heap_to_fit_live_data) {
+  ctx->options |= kOptIR;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingLongList, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(500500), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+// Every frame holds on to a pair across the call below it, so the collector
+// has to find and update roots all the way up the stack.
+static char *kTestingDeepFrames =
+    "(labels ((f (code (n)"
+    "            (if (zero? n) (cons 0 0)"
+    "                (let ((p (cons n n)))"
+    "                  (let ((q (labelcall f (sub1 n))))"
+    "                    (cons (+ (car p) (car q)) (cdr q))))))))"
+    "  (car (labelcall f 300)))";
+
+TEST(gc_updates_roots_in_every_frame) {
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingDeepFrames, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+TEST(gc_updates_roots_in_every_frame_with_registers) {
+  ctx->options |= kOptRegisters;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingDeepFrames, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+TEST(ir_gc_updates_roots_in_every_frame) {
+  ctx->options |= kOptIR;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingDeepFrames, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+// Twenty slots, and then some for the sums: past what a disp8 can reach.
+static char *kTestingWideFrame =
+    "(let ((a 1) (b 2) (c 3) (d 4) (e 5) (f 6) (g 7) (h 8) (i 9) (j 10)"
+    "      (k 11) (l 12) (m 13) (n 14) (o 15) (p 16) (q 17) (r 18) (s 19)"
+    "      (t 20))"
+    "  (+ a (+ b (+ c (+ d (+ e (+ f (+ g (+ h (+ i (+ j (+ k (+ l"
+    "    (+ m (+ n (+ o (+ p (+ q (+ r (+ s t))))))))))))))))))))";
+
+TEST(let_frame_past_disp8) {
+  uint64_t result = Run_from_cstr(kTestingWideFrame, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(210), __func__);
+}
+
+TEST(let_frame_past_disp8_with_registers) {
+  ctx->options |= kOptRegisters;
+  uint64_t result = Run_from_cstr(kTestingWideFrame, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(210), __func__);
+}
+
+TEST(ir_let_frame_past_disp8) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_from_cstr(kTestingWideFrame, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(210), __func__);
+}
+
+static char *kTestingManyArguments =
+    "(labels ((sum (code (a b c d e f g h i j k l m n o p q r s t)"
+    "                (+ a (+ b (+ c (+ d (+ e (+ f (+ g (+ h (+ i (+ j"
+    "                  (+ k (+ l (+ m (+ n (+ o (+ p (+ q (+ r (+ s t"
+    "                  ))))))))))))))))))))))"
+    "  (labelcall sum 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20))";
+
+TEST(labelcall_with_arguments_past_disp8) {
+  uint64_t result = Run_prog_from_cstr(kTestingManyArguments, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(210), __func__);
+}
+
+TEST(ir_labelcall_with_arguments_past_disp8) {
+  ctx->options |= kOptIR;
+  uint64_t result = Run_prog_from_cstr(kTestingManyArguments, ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(210), __func__);
+}
+
+TEST(code_cache_hit_returns_the_compiled_code) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCacheEntry *first = CodeCache_get(&cache, "(add1 41)", ctx->options);
+  CodeCacheEntry *second = CodeCache_get(&cache, "(add1 41)", ctx->options);
+  ok(first != NULL && first == second, __func__);
+  cmp_ok(Testing_call_entry(&second->code, heap), "==",
+         encodeImmediateFixnum(42), __func__);
+  cmp_ok(cache.hits, "==", 1, __func__);
+  cmp_ok(cache.misses, "==", 1, __func__);
+  CodeCache_release(&cache, first);
+  CodeCache_release(&cache, second);
+  CodeCache_deinit(&cache);
+}
+
+TEST(code_cache_keys_on_options) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCacheEntry *plain = CodeCache_get(&cache, "(add1 41)", ctx->options);
+  CodeCacheEntry *ir =
+      CodeCache_get(&cache, "(add1 41)", ctx->options | kOptIR);
+  ok(plain != NULL && ir != NULL && plain != ir, __func__);
+  cmp_ok(cache.num_entries, "==", 2, __func__);
+  CodeCache_release(&cache, plain);
+  CodeCache_release(&cache, ir);
+  CodeCache_deinit(&cache);
+}
+
+TEST(code_cache_runs_programs) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCacheEntry *entry = CodeCache_get(
+      &cache, "(labels ((id (code (x) x))) (labelcall id 5))", ctx->options);
+  ok(entry != NULL, __func__);
+  cmp_ok(Testing_call_entry(&entry->code, heap), "==",
+         encodeImmediateFixnum(5), __func__);
+  CodeCache_release(&cache, entry);
+  CodeCache_deinit(&cache);
+}
+
+TEST(code_cache_does_not_keep_failed_compiles) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  ok(CodeCache_get(&cache, "(frobnicate 1)", ctx->options) == NULL, __func__);
+  ok(CodeCache_get(&cache, "(add1", ctx->options) == NULL, __func__);
+  cmp_ok(cache.num_entries, "==", 0, __func__);
+  CodeCache_deinit(&cache);
+}
+
+TEST(code_cache_evicts_least_recently_used) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCacheEntry *a = CodeCache_get(&cache, "(add1 1)", ctx->options);
+  // Room for two programs the size of this one.
+  cache.budget = 2 * a->bytes;
+  CodeCache_release(&cache, a);
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 2)", ctx->options));
+  // Touch (add1 1), so that (add1 2) is the one to go.
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 1)", ctx->options));
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 3)", ctx->options));
+  cmp_ok(cache.evictions, "==", 1, __func__);
+  cmp_ok(cache.num_entries, "==", 2, __func__);
+  uint64_t hits = cache.hits;
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 1)", ctx->options));
+  cmp_ok(cache.hits, "==", hits + 1, __func__);
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 2)", ctx->options));
+  cmp_ok(cache.hits, "==", hits + 1, __func__);
+  CodeCache_deinit(&cache);
+}
+
+TEST(code_cache_entry_outlives_eviction_while_held) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/0);
+  CodeCacheEntry *entry = CodeCache_get(&cache, "(add1 41)", ctx->options);
+  cmp_ok(cache.num_entries, "==", 0, __func__);
+  cmp_ok(Testing_call_entry(&entry->code, heap), "==",
+         encodeImmediateFixnum(42), __func__);
+  CodeCache_release(&cache, entry);
+  CodeCache_deinit(&cache);
+}
+
+typedef struct {
+  CodeCache *cache;
+  int options;
+  uint64_t heap;
+  int failures;
+} TestingCacheThread;
+
+static const int kTestingCacheRounds = 200;
+static const int kTestingCachePrograms = 8;
+
+static void *Testing_cache_thread(void *arg) {
+  TestingCacheThread *thread = arg;
+  for (int round = 0; round < kTestingCacheRounds; round++) {
+    int n = round % kTestingCachePrograms;
+    char source[32];
+    snprintf(source, sizeof source, "(+ %d (add1 0))", n);
+    CodeCacheEntry *entry =
+        CodeCache_get(thread->cache, source, thread->options);
+    if (entry == NULL || Testing_call_entry(&entry->code, thread->heap) !=
+                             (uint64_t)encodeImmediateFixnum(n + 1)) {
+      thread->failures++;
+    }
+    if (entry != NULL) {
+      CodeCache_release(thread->cache, entry);
+    }
+  }
+  return NULL;
+}
+
+TEST(code_cache_is_shared_between_threads) {
+  CodeCache cache;
+  // Each program takes a page of code and a little more, so this is room for
+  // fewer than half of them: threads evict entries the others are running.
+  CodeCache_init(&cache, /*budget=*/(size_t)sysconf(_SC_PAGESIZE) *
+                             kTestingCachePrograms / 2);
+  enum { kNumThreads = 4 };
+  pthread_t threads[kNumThreads];
+  TestingCacheThread args[kNumThreads];
+  for (int i = 0; i < kNumThreads; i++) {
+    args[i] = (TestingCacheThread){
+        .cache = &cache, .options = ctx->options, .heap = heap};
+    pthread_create(&threads[i], /*attr=*/NULL, Testing_cache_thread, &args[i]);
+  }
+  int failures = 0;
+  for (int i = 0; i < kNumThreads; i++) {
+    pthread_join(threads[i], /*retval=*/NULL);
+    failures += args[i].failures;
+  }
+  cmp_ok(failures, "==", 0, __func__);
+  cmp_ok(cache.hits + cache.misses, "==", kNumThreads * kTestingCacheRounds,
+         __func__);
+  cmp_ok(cache.evictions, ">", 0, __func__);
+  CodeCache_deinit(&cache);
+}
+
+// Write `source' to a temporary file as `kind'; store its path in `path',
+// which holds at least kTestingPathSize bytes.
+enum { kTestingPathSize = 32 };
+
+static int Testing_elf_compile(char *source, int options, ElfKind kind,
+                               char *path) {
+  strcpy(path, "/tmp/compiler-elf-XXXXXX");
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  return Elf_compile(source, options, kind, path);
+}
+
+// Run the executable at `path' and return the result it writes out.
+static uint64_t Testing_run_executable(char *path) {
+  FILE *fp = popen(path, "r");
+  assert(fp != NULL);
+  uint64_t result = 0;
+  size_t read = fread(&result, sizeof result, 1, fp);
+  cmp_ok(read, "==", 1, __func__);
+  cmp_ok(pclose(fp), "==", 0, __func__);
+  return result;
+}
+
+TEST(elf_executable_writes_the_result) {
+  char path[kTestingPathSize];
+  int result = Testing_elf_compile(
+      "(labels ((id (code (x) x))) (labelcall id (car (cons 5 6))))",
+      ctx->options, kElfExecutable, path);
+  cmp_ok(result, "==", 0, __func__);
+  cmp_ok(Testing_run_executable(path), "==", encodeImmediateFixnum(5),
+         __func__);
+  unlink(path);
+}
+
+TEST(ir_elf_executable_writes_the_result) {
+  ctx->options |= kOptIR;
+  char path[kTestingPathSize];
+  int result = Testing_elf_compile("(let ((x (cons 1 2))) (+ (car x) (cdr x)))",
+                                   ctx->options, kElfExecutable, path);
+  cmp_ok(result, "==", 0, __func__);
+  cmp_ok(Testing_run_executable(path), "==", encodeImmediateFixnum(3),
+         __func__);
+  unlink(path);
+}
+
+// Look `name' up in the symbol table of the ELF file in `image'.
+static Elf64_Sym *Testing_elf_symbol(byte *image, const char *name) {
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image;
+  Elf64_Shdr *shdrs = (Elf64_Shdr *)(image + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    Elf64_Sym *syms = (Elf64_Sym *)(image + shdrs[i].sh_offset);
+    char *strtab = (char *)image + shdrs[shdrs[i].sh_link].sh_offset;
+    for (size_t j = 0; j < shdrs[i].sh_size / sizeof *syms; j++) {
+      if (strcmp(strtab + syms[j].st_name, name) == 0) {
+        return &syms[j];
+      }
+    }
+  }
+  return NULL;
+}
+
+TEST(elf_object_exports_the_entry_and_labels) {
+  char path[kTestingPathSize];
+  int result = Testing_elf_compile(
+      "(labels ((one (code () 1)) (id (code (x) x))) (labelcall id 5))",
+      ctx->options, kElfObject, path);
+  cmp_ok(result, "==", 0, __func__);
+  FILE *fp = fopen(path, "rb");
+  assert(fp != NULL);
+  byte image[4096];
+  size_t size = fread(image, 1, sizeof image, fp);
+  fclose(fp);
+  unlink(path);
+  ok(size > sizeof(Elf64_Ehdr) && memcmp(image, ELFMAG, SELFMAG) == 0,
+     __func__);
+  cmp_ok(((Elf64_Ehdr *)image)->e_type, "==", ET_REL, __func__);
+  Elf64_Sym *entry = Testing_elf_symbol(image, kElfEntryName);
+  Elf64_Sym *one = Testing_elf_symbol(image, "one");
+  Elf64_Sym *id = Testing_elf_symbol(image, "id");
+  ok(entry != NULL && one != NULL && id != NULL, __func__);
+  if (entry == NULL || one == NULL || id == NULL) {
+    return;
+  }
+  cmp_ok(ELF64_ST_BIND(entry->st_info), "==", STB_GLOBAL, __func__);
+  cmp_ok(entry->st_value, "==", 0, __func__);
+  cmp_ok(ELF64_ST_BIND(id->st_info), "==", STB_LOCAL, __func__);
+  // After the jump over the labels, one after the other.
+  cmp_ok(one->st_value, "==", 2, __func__);
+  cmp_ok(id->st_value, "==", one->st_value + one->st_size, __func__);
+}
+
+TEST(elf_rejects_gc_code) {
+  char path[kTestingPathSize];
+  int result = Testing_elf_compile("(cons 1 2)", ctx->options | kOptGC,
+                                   kElfExecutable, path);
+  cmp_ok(result, "==", -1, __func__);
+  unlink(path);
+}
+
+// Save `cache' to a temporary file; store its path in `path', which holds at
+// least kTestingPathSize bytes.
+static void Testing_save_code_cache(CodeCache *cache, char *path) {
+  strcpy(path, "/tmp/compiler-cache-XXXXXX");
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  int result = CodeCache_save(cache, path);
+  cmp_ok(result, "==", 0, __func__);
+}
+
+static const char *kTestingCachedProg =
+    "(labels ((id (code (x) x))) (labelcall id 5))";
+
+TEST(code_cache_file_round_trips) {
+  CodeCache saved;
+  CodeCache_init(&saved, /*budget=*/1 << 20);
+  CodeCache_release(&saved,
+                    CodeCache_get(&saved, kTestingCachedProg, ctx->options));
+  CodeCache_release(&saved, CodeCache_get(&saved, "(add1 41)", ctx->options));
+  char path[kTestingPathSize];
+  Testing_save_code_cache(&saved, path);
+  CodeCache_deinit(&saved);
+  CodeCache loaded;
+  CodeCache_init(&loaded, /*budget=*/1 << 20);
+  cmp_ok(CodeCache_load(&loaded, path), "==", 2, __func__);
+  CodeCacheEntry *entry =
+      CodeCache_get(&loaded, kTestingCachedProg, ctx->options);
+  ok(entry != NULL, __func__);
+  cmp_ok(loaded.hits, "==", 1, __func__);
+  cmp_ok(loaded.misses, "==", 0, __func__);
+  cmp_ok(Testing_call_entry(&entry->code, heap), "==",
+         encodeImmediateFixnum(5), __func__);
+  CodeCache_release(&loaded, entry);
+  // The programs are already there.
+  cmp_ok(CodeCache_load(&loaded, path), "==", 0, __func__);
+  cmp_ok(loaded.num_entries, "==", 2, __func__);
+  CodeCache_deinit(&loaded);
+  unlink(path);
+}
+
+TEST(code_cache_file_keeps_stack_maps) {
+  CodeCache saved;
+  CodeCache_init(&saved, /*budget=*/1 << 20);
+  int options = ctx->options | kOptGC;
+  CodeCache_release(&saved, CodeCache_get(&saved, kTestingChurn, options));
+  char path[kTestingPathSize];
+  Testing_save_code_cache(&saved, path);
+  CodeCache_deinit(&saved);
+  CodeCache loaded;
+  CodeCache_init(&loaded, /*budget=*/1 << 20);
+  cmp_ok(CodeCache_load(&loaded, path), "==", 1, __func__);
+  CodeCacheEntry *entry = CodeCache_get(&loaded, kTestingChurn, options);
+  cmp_ok(loaded.misses, "==", 0, __func__);
+  Heap gc_heap;
+  Heap_init(&gc_heap, 1024, &entry->stack_maps, &entry->code);
+  cmp_ok(Testing_call_entry(&entry->code, (uint64_t)&gc_heap), "==",
+         encodeImmediateFixnum(4 + 2 * 3), __func__);
+  cmp_ok(gc_heap.collections, ">", 10, __func__);
+  Heap_deinit(&gc_heap);
+  CodeCache_release(&loaded, entry);
+  CodeCache_deinit(&loaded);
+  unlink(path);
+}
+
+// Overwrite `len' bytes at `offset' in the file at `path'.
+static void Testing_patch_file(const char *path, size_t offset,
+                               const void *data, size_t len) {
+  int fd = open(path, O_RDWR);
+  assert(fd != -1);
+  ssize_t written = pwrite(fd, data, len, offset);
+  assert(written == (ssize_t)len);
+  (void)written;
+  close(fd);
+}
+
+TEST(code_cache_file_from_another_build_is_ignored) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 41)", ctx->options));
+  char path[kTestingPathSize];
+  Testing_save_code_cache(&cache, path);
+  CodeCache_deinit(&cache);
+  uint64_t version = CodeCache_version() + 1;
+  Testing_patch_file(path, offsetof(CodeCacheFileHeader, version), &version,
+                     sizeof version);
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  cmp_ok(CodeCache_load(&cache, path), "==", 0, __func__);
+  cmp_ok(cache.num_entries, "==", 0, __func__);
+  CodeCache_deinit(&cache);
+  unlink(path);
+}
+
+TEST(code_cache_file_with_changed_source_is_rejected) {
+  CodeCache cache;
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  CodeCache_release(&cache, CodeCache_get(&cache, "(add1 41)", ctx->options));
+  char path[kTestingPathSize];
+  Testing_save_code_cache(&cache, path);
+  CodeCache_deinit(&cache);
+  // The only source comes straight after the table: make it (add1 42).
+  Testing_patch_file(path,
+                     sizeof(CodeCacheFileHeader) + sizeof(CodeCacheRecord) +
+                         strlen("(add1 4"),
+                     "2", 1);
+  CodeCache_init(&cache, /*budget=*/1 << 20);
+  cmp_ok(CodeCache_load(&cache, path), "==", -1, __func__);
+  cmp_ok(cache.num_entries, "==", 0, __func__);
+  CodeCache_deinit(&cache);
+  unlink(path);
+}
+
+// A `labels' form with a chain of `n' functions, each of which adds one to
+// what the one before it returns (half of them from a tail call), and a loop
+// that counts to 5. It returns n + 5.
+static char *Testing_chain_prog(int n) {
+  size_t size = 128 + (size_t)n * 64;
+  char *prog = malloc(size);
+  assert(prog != NULL);
+  size_t len = snprintf(prog, size, "(labels ((f0 (code (x) (add1 x)))");
+  for (int i = 1; i < n; i++) {
+    len += snprintf(prog + len, size - len,
+                    i % 2 == 0 ? " (f%d (code (x) (labelcall f%d (add1 x))))"
+                               : " (f%d (code (x) (add1 (labelcall f%d x))))",
+                    i, i - 1);
+  }
+  snprintf(prog + len, size - len,
+           " (count (code (n acc) (if (zero? n) acc"
+           " (labelcall count (sub1 n) (add1 acc)))))) "
+           "(+ (labelcall f%d 0) (labelcall count 5 0)))",
+           n - 1);
+  return prog;
+}
+
+// Compile the program `input' under `options' into `buf', which is set up
+// here. Return how many bytes of code it took, or -1 if it doesn't compile.
+static int32_t Testing_compile_prog(char *input, int options, Buffer *buf) {
+  Buffer_init(buf, 1);
+  BufferWriter writer;
+  BufferWriter_init(&writer, buf);
+  Arena arena;
+  Arena_init(&arena);
+  CompilerContext ctx;
+  CompilerContext_init(&ctx, &writer, &arena, /*labels=*/NULL,
+                       /*locals=*/NULL);
+  ctx.options = options;
+  ASTNode *prog = Reader_read(&arena, input);
+  int32_t result = AST_compile_prog(&ctx, prog) == 0 ? (int32_t)writer.pos : -1;
+  BufferWriter_deinit(&writer);
+  Arena_deinit(&arena);
+  return result;
+}
+
+// Check that `prog' compiles to the same code with and without kOptParallel,
+// and that the code returns `expected'.
+static void Testing_parallel_labels_match(char *prog, int32_t expected,
+                                          int options, uint64_t heap) {
+  Buffer sequential, parallel;
+  int32_t sequential_len = Testing_compile_prog(prog, options, &sequential);
+  int32_t parallel_len =
+      Testing_compile_prog(prog, options | kOptParallel, &parallel);
+  ok(sequential_len > 0, __func__);
+  cmp_ok(parallel_len, "==", sequential_len, __func__);
+  ok(memcmp(parallel.address, sequential.address, sequential_len) == 0,
+     __func__);
+  Buffer_make_executable(&parallel);
+  cmp_ok(Testing_call_entry(&parallel, heap), "==",
+         encodeImmediateFixnum(expected), __func__);
+  Buffer_deinit(&sequential);
+  Buffer_deinit(&parallel);
+}
+
+TEST(parallel_labels_compile_the_same_code) {
+  char *prog = Testing_chain_prog(300);
+  Testing_parallel_labels_match(prog, 305, ctx->options, heap);
+  free(prog);
+}
+
+TEST(ir_parallel_labels_compile_the_same_code) {
+  char *prog = Testing_chain_prog(300);
+  Testing_parallel_labels_match(prog, 305, ctx->options | kOptIR | kOptFold,
+                                heap);
+  free(prog);
+}
+
+TEST(parallel_labels_report_errors) {
+  Buffer buf;
+  int32_t result = Testing_compile_prog(
+      "(labels ((a (code () 1)) (b (code () (frobnicate 2)))) (labelcall a))",
+      ctx->options | kOptParallel, &buf);
+  cmp_ok(result, "==", -1, __func__);
   Buffer_deinit(&buf);
 }
 
-#define EXPECT_EQUALS_BYTES(buf, arr)                                          \
-  {                                                                            \
-    int result =                                                               \
-        cmp_ok(memcmp(buf->address, arr, sizeof arr), "==", 0, __func__);      \
-    if (!result) {                                                             \
-      printf("NOT EQUAL. Expected: ");                                         \
-      for (size_t i = 0; i < sizeof arr; i++) {                                \
-        printf("%.2x ", arr[i]);                                               \
-      }                                                                        \
-      printf("\n           Found:    ");                                       \
-      for (size_t i = 0; i < ctx->writer->pos; i++) {                          \
-        printf("%.2x ", buf->address[i]);                                      \
-      }                                                                        \
-      printf("\n");                                                            \
-    }                                                                          \
+static char *kTestingAllocatingLabels =
+    "(labels ((pair (code (n) (cons n n)))"
+    "         (sum (code (n)"
+    "              (if (zero? n) 0"
+    "                  (let ((p (labelcall pair n)))"
+    "                    (+ (car p) (labelcall sum (sub1 n))))))))"
+    "  (labelcall sum 300))";
+
+TEST(parallel_labels_keep_stack_maps) {
+  ctx->options |= kOptParallel;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingAllocatingLabels, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+TEST(ir_parallel_labels_keep_stack_maps) {
+  ctx->options |= kOptParallel | kOptIR;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingAllocatingLabels, ctx, 256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(collections, ">", 0, __func__);
+}
+
+typedef struct {
+  const Buffer *code;
+  const StackMaps *maps;
+  uint64_t result;
+  int collections;
+} TestingHeapThread;
+
+static void *Testing_heap_thread(void *arg) {
+  TestingHeapThread *thread = arg;
+  Heap heap;
+  Heap_init(&heap, 1024, thread->maps, thread->code);
+  thread->result = Heap_run(&heap);
+  thread->collections = heap.collections;
+  Heap_deinit(&heap);
+  return NULL;
+}
+
+TEST(gc_runs_one_program_on_many_threads) {
+  StackMaps maps;
+  StackMaps_init(&maps);
+  ctx->options |= kOptGC;
+  ctx->stack_maps = &maps;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingChurn);
+  int compile_result = AST_compile_prog(ctx, prog);
+  cmp_ok(compile_result, "==", 0, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  enum { kNumThreads = 4 };
+  pthread_t threads[kNumThreads];
+  TestingHeapThread args[kNumThreads];
+  for (int i = 0; i < kNumThreads; i++) {
+    args[i] = (TestingHeapThread){.code = ctx->writer->buf, .maps = &maps};
+    pthread_create(&threads[i], /*attr=*/NULL, Testing_heap_thread, &args[i]);
   }
+  for (int i = 0; i < kNumThreads; i++) {
+    pthread_join(threads[i], /*retval=*/NULL);
+    cmp_ok(args[i].result, "==", encodeImmediateFixnum(4 + 2 * 3), __func__);
+    cmp_ok(args[i].collections, ">", 10, __func__);
+  }
+  StackMaps_deinit(&maps);
+  ctx->stack_maps = NULL;
+}
 
-#define EXPECT_CALL_EQUALS(buf, expected)                                      \
-  cmp_ok(Testing_call_entry(buf, heap), "==", expected, __func__)
+// These write into a dual-mapped buffer of their own instead of the usual one.
 
-#define TEST(name)                                                             \
-  static void test_##name(CompilerContext *ctx,                                \
-                          __attribute__((unused)) uint64_t heap)
+TEST(dual_buffer_runs_code_as_it_is_written) {
+  Buffer buf;
+  Buffer_init_dual(&buf, 1);
+  ok(buf.exec != NULL && buf.exec != buf.address, __func__);
+  ctx->writer->buf = &buf;
+  BufferWriter *writer = ctx->writer;
+  Buffer_mov_reg_imm32(writer, kRax, 42);
+  Buffer_ret(writer);
+  cmp_ok(Buffer_make_executable(&buf), "==", 0, __func__);
+  cmp_ok(Testing_call_entry(&buf, heap), "==", 42, __func__);
+  // Keep writing after the code that has run, and run the new code too.
+  size_t second = writer->pos;
+  Buffer_mov_reg_imm32(writer, kRax, 43);
+  Buffer_ret(writer);
+  EntryFunction function = EntryFunction_at(Buffer_code(&buf) + second);
+  cmp_ok(function(heap), "==", 43, __func__);
+  cmp_ok(Testing_call_entry(&buf, heap), "==", 42, __func__);
+  Buffer_deinit(&buf);
+}
+
+TEST(dual_buffer_grows) {
+  Buffer buf;
+  Buffer_init_dual(&buf, 1);
+  ctx->writer->buf = &buf;
+  BufferWriter *writer = ctx->writer;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  // Jump over a few pages of padding to the code at the end.
+  Label end = BufferWriter_new_label(writer);
+  Buffer_jmp_label(writer, end);
+  memset(BufferWriter_reserve(writer, 3 * page_size), 0xcc, 3 * page_size);
+  BufferWriter_bind_label(writer, end);
+  Buffer_mov_reg_imm32(writer, kRax, 42);
+  Buffer_ret(writer);
+  BufferWriter_relax(writer);
+  cmp_ok(buf.len, ">", 3 * page_size, __func__);
+  Buffer_make_executable(&buf);
+  cmp_ok(Testing_call_entry(&buf, heap), "==", 42, __func__);
+  Buffer_deinit(&buf);
+}
+
+TEST(dual_buffer_keeps_code_in_place_as_it_grows) {
+  Buffer buf;
+  Buffer_init_dual(&buf, 1);
+  ctx->writer->buf = &buf;
+  BufferWriter *writer = ctx->writer;
+  Buffer_mov_reg_imm32(writer, kRax, 42);
+  Buffer_ret(writer);
+  Buffer_make_executable(&buf);
+  byte *code = Buffer_code(&buf);
+  EntryFunction function = EntryFunction_at(code);
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  memset(BufferWriter_reserve(writer, 3 * page_size), 0xcc, 3 * page_size);
+  size_t second = writer->pos;
+  Buffer_mov_reg_imm32(writer, kRax, 43);
+  Buffer_ret(writer);
+  cmp_ok(buf.len, ">", 3 * page_size, __func__);
+  ok(Buffer_code(&buf) == code, __func__);
+  cmp_ok(function(heap), "==", 42, __func__);
+  cmp_ok(EntryFunction_at(code + second)(heap), "==", 43, __func__);
+  Buffer_deinit(&buf);
+}
+
+TEST(dual_buffer_runs_programs) {
+  Buffer buf;
+  Buffer_init_dual(&buf, 1);
+  ctx->writer->buf = &buf;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingManyArguments);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
+  Buffer_make_executable(&buf);
+  cmp_ok(Testing_call_entry(&buf, heap), "==", encodeImmediateFixnum(210),
+         __func__);
+  Buffer_deinit(&buf);
+}
+
+// Add `source' to `module' and return the entry point, which must be there.
+static int32_t Testing_module_add(Module *module, char *source) {
+  int32_t entry;
+  int result = Module_add(module, source, &entry);
+  cmp_ok(result, "==", 0, __func__);
+  return entry;
+}
+
+TEST(module_calls_labels_added_earlier) {
+  Module module;
+  Module_init(&module, ctx->options);
+  int32_t entry;
+  cmp_ok(Module_add(&module, "(labels ((id (code (x) x))))", &entry), "==", 0,
+         __func__);
+  cmp_ok(entry, "==", -1, __func__);
+  int32_t twice = Testing_module_add(
+      &module,
+      "(labels ((twice (code (x) (+ (labelcall id x) x)))) (labelcall twice "
+      "21))");
+  int32_t seven = Testing_module_add(&module, "(labelcall id 7)");
+  cmp_ok(Module_call(&module, seven, heap), "==", encodeImmediateFixnum(7),
+         __func__);
+  cmp_ok(Module_call(&module, twice, heap), "==", encodeImmediateFixnum(42),
+         __func__);
+  Module_deinit(&module);
+}
+
+TEST(module_leaves_compiled_code_alone) {
+  Module module;
+  Module_init(&module, ctx->options);
+  char *prog = Testing_chain_prog(100);
+  int32_t chain = Testing_module_add(&module, prog);
+  free(prog);
+  size_t len = module.writer.pos;
+  byte *before = malloc(len);
+  assert(before != NULL);
+  memcpy(before, module.code.address, len);
+  Testing_module_add(&module, "(labels ((f100 (code (x) (add1 x)))))");
+  int32_t entry =
+      Testing_module_add(&module, "(labelcall f100 (labelcall f99 0))");
+  ok(memcmp(module.code.address, before, len) == 0, __func__);
+  // Only the new code was written.
+  cmp_ok(module.writer.pos - len, "<", 64, __func__);
+  cmp_ok(Module_call(&module, entry, heap), "==", encodeImmediateFixnum(101),
+         __func__);
+  cmp_ok(Module_call(&module, chain, heap), "==", encodeImmediateFixnum(105),
+         __func__);
+  free(before);
+  Module_deinit(&module);
+}
+
+TEST(module_redefinition_hides_the_old_label) {
+  Module module;
+  Module_init(&module, ctx->options);
+  Testing_module_add(&module, "(labels ((k (code () 1))))");
+  int32_t old = Testing_module_add(
+      &module, "(labels ((use-k (code () (labelcall k)))) (labelcall use-k))");
+  Testing_module_add(&module, "(labels ((k (code () 2))))");
+  int32_t latest = Testing_module_add(&module, "(labelcall k)");
+  cmp_ok(Module_call(&module, latest, heap), "==", encodeImmediateFixnum(2),
+         __func__);
+  cmp_ok(Module_call(&module, old, heap), "==", encodeImmediateFixnum(1),
+         __func__);
+  Module_deinit(&module);
+}
+
+TEST(module_drops_what_does_not_compile) {
+  Module module;
+  Module_init(&module, ctx->options);
+  Testing_module_add(&module, "(labels ((one (code () 1))))");
+  size_t len = module.writer.pos;
+  int32_t entry;
+  cmp_ok(Module_add(&module,
+                    "(labels ((bad (code () (frobnicate 1)))) (labelcall bad))",
+                    &entry),
+         "==", -1, __func__);
+  cmp_ok(module.writer.pos, "==", len, __func__);
+  cmp_ok(Module_add(&module, "(labelcall bad)", &entry), "==", -1, __func__);
+  cmp_ok(Module_add(&module, "(labels (x) 1)", &entry), "==", -1, __func__);
+  entry = Testing_module_add(&module, "(labelcall one)");
+  cmp_ok(Module_call(&module, entry, heap), "==", encodeImmediateFixnum(1),
+         __func__);
+  Module_deinit(&module);
+}
+
+TEST(module_collects_garbage) {
+  Module module;
+  Module_init(&module, ctx->options | kOptGC);
+  Testing_module_add(&module, "(labels ((pair (code (n) (cons n n)))))");
+  int32_t entry = Testing_module_add(
+      &module,
+      "(labels ((sum (code (n)"
+      "              (if (zero? n) 0"
+      "                  (let ((p (labelcall pair n)))"
+      "                    (+ (car p) (labelcall sum (sub1 n))))))))"
+      "  (labelcall sum 300))");
+  Heap gc_heap;
+  Heap_init(&gc_heap, 256, &module.stack_maps, &module.code);
+  cmp_ok(Module_call(&module, entry, (uint64_t)&gc_heap), "==",
+         encodeImmediateFixnum(300 * 301 / 2), __func__);
+  cmp_ok(gc_heap.collections, ">", 0, __func__);
+  Heap_deinit(&gc_heap);
+  Module_deinit(&module);
+}
+
+TEST(stats_are_off_by_default) {
+  ok(ctx->stats == NULL, __func__);
+  Reader reader;
+  Reader_init_cstr(&reader, ctx->arena, "5");
+  ok(reader.stats == NULL, __func__);
+  Reader_deinit(&reader);
+}
+
+TEST(stats_record_reading_and_compiling) {
+  Stats stats;
+  Stats_reset(&stats);
+  Reader reader;
+  Reader_init_cstr(&reader, ctx->arena,
+                   "(labels ((f (code (x) (if (zero? x) 1 (labelcall f 0)))))"
+                   "  (labelcall f 3))");
+  reader.stats = &stats;
+  ASTNode *prog;
+  cmp_ok(Reader_next(&reader, &prog), "==", kReadOk, __func__);
+  Reader_deinit(&reader);
+  cmp_ok(stats.phase_count[kPhaseRead], "==", 1, __func__);
+  cmp_ok(stats.ast_nodes, "==", ctx->arena->num_nodes, __func__);
+  uint64_t read_nodes = stats.ast_nodes;
+  ctx->stats = &stats;
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
+  cmp_ok(stats.phase_count[kPhaseCompile], "==", 1, __func__);
+  // Compiling without kOptFold makes no new nodes.
+  cmp_ok(stats.ast_nodes, "==", read_nodes, __func__);
+  cmp_ok(stats.code_bytes, "==", ctx->writer->pos, __func__);
+  // The jump over the labels, the `if', the call in the body and the tail
+  // call.
+  cmp_ok(stats.branches_patched, ">=", 4, __func__);
+  // x, f in f, and f in the body.
+  cmp_ok(stats.env_hops, "==", 3, __func__);
+  Buffer_make_executable(ctx->writer->buf);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(1));
+}
+
+TEST(stats_snapshot_can_reset) {
+  Stats stats;
+  Stats_reset(&stats);
+  ctx->stats = &stats;
+  ASTNode *node = Reader_read(ctx->arena, "(let ((x 1) (y 2)) (+ x y))");
+  cmp_ok(AST_compile_entry(ctx, node), "==", 0, __func__);
+  Stats first = Stats_snapshot(&stats, /*reset=*/true);
+  cmp_ok(first.phase_count[kPhaseCompile], "==", 1, __func__);
+  cmp_ok(first.env_hops, "==", 3, __func__);
+  cmp_ok(first.code_bytes, "==", ctx->writer->pos, __func__);
+  Stats second = Stats_snapshot(&stats, /*reset=*/false);
+  cmp_ok(second.phase_count[kPhaseCompile], "==", 0, __func__);
+  cmp_ok(second.env_hops, "==", 0, __func__);
+  cmp_ok(second.code_bytes, "==", 0, __func__);
+}
+
+TEST(stats_count_folded_nodes) {
+  Stats stats;
+  Stats_reset(&stats);
+  ctx->stats = &stats;
+  ctx->options |= kOptFold;
+  ASTNode *node = Reader_read(ctx->arena, "(add1 (add1 1))");
+  uint64_t read_nodes = ctx->arena->num_nodes;
+  cmp_ok(AST_compile_entry(ctx, node), "==", 0, __func__);
+  // Folding makes a node for the fixnum it comes up with.
+  cmp_ok(stats.ast_nodes, "==", ctx->arena->num_nodes - read_nodes, __func__);
+  cmp_ok(stats.ast_nodes, ">", 0, __func__);
+}
 
-uint64_t Run_from_cstr(char *input, CompilerContext *ctx, uint64_t heap) {
-  ASTNode *node = Reader_read(input);
-  int compile_result = AST_compile_entry(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  Buffer_make_executable(ctx->writer->buf);
-  return Testing_call_entry(ctx->writer->buf, heap);
+TEST(stats_add_up_parallel_labels) {
+  char *input = Testing_chain_prog(20);
+  ASTNode *prog = Reader_read(ctx->arena, input);
+  Stats sequential;
+  Stats_reset(&sequential);
+  ctx->stats = &sequential;
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  BufferWriter writer;
+  BufferWriter_init(&writer, &buf);
+  Stats parallel;
+  Stats_reset(&parallel);
+  CompilerContext parallel_ctx = *ctx;
+  parallel_ctx.writer = &writer;
+  parallel_ctx.stats = &parallel;
+  parallel_ctx.options |= kOptParallel;
+  cmp_ok(AST_compile_prog(&parallel_ctx, prog), "==", 0, __func__);
+  cmp_ok(parallel.env_hops, "==", sequential.env_hops, __func__);
+  cmp_ok(parallel.code_bytes, "==", sequential.code_bytes, __func__);
+  cmp_ok(parallel.branches_patched, "==", sequential.branches_patched,
+         __func__);
+  BufferWriter_deinit(&writer);
+  Buffer_deinit(&buf);
+  free(input);
 }
 
-TEST(write_bytes_manually) {
-  byte arr[] = {0xb8, 0x2a, 0x00, 0x00, 0x00, 0xc3};
-  Buffer_write_arr(ctx->writer, arr, sizeof arr);
+TEST(stats_count_heap_bytes_across_collections) {
+  StackMaps maps;
+  StackMaps_init(&maps);
+  ctx->options |= kOptGC;
+  ctx->stack_maps = &maps;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingChurn);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, 42);
+  Stats stats;
+  Stats_reset(&stats);
+  Heap gc_heap;
+  Heap_init(&gc_heap, 1024, &maps, ctx->writer->buf);
+  gc_heap.stats = &stats;
+  cmp_ok(Heap_run(&gc_heap), "==", encodeImmediateFixnum(4 + 2 * 3),
+         __func__);
+  cmp_ok(gc_heap.collections, ">", 10, __func__);
+  cmp_ok(stats.phase_count[kPhaseRun], "==", 1, __func__);
+  // Two pairs a round, and the one it starts with.
+  cmp_ok(stats.heap_bytes, "==", (1001 * 2 + 1) * 2 * kWordSize, __func__);
+  Heap_deinit(&gc_heap);
+  StackMaps_deinit(&maps);
+  ctx->stack_maps = NULL;
 }
 
-TEST(write_bytes_manually2) {
-  byte arr[] = {0xb8, 0x2a, 0x00, 0x00, 0x00, 0xff, 0xc0, 0xc3};
-  Buffer_write_arr(ctx->writer, arr, sizeof arr);
+static char *kTestingJitProg =
+    "(labels ((f (code (x) x)) (g (code () (labelcall f 1))))"
+    "  (labelcall g))";
+
+// Compile kTestingJitProg into ctx's buffer, recording its labels in
+// `labels', and make it executable.
+static void Testing_compile_jit_prog(CompilerContext *ctx,
+                                     LabelSymbols *labels) {
+  LabelSymbols_init(labels);
+  ctx->label_symbols = labels;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingJitProg);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, 43);
 }
 
-TEST(mov_rax_imm32) {
-  Buffer_mov_reg_imm32(ctx->writer, kRax, 42);
-  byte expected[] = {0xb8, 0x2a, 0x00, 0x00, 0x00};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(jit_perf_map_names_each_function) {
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/perf-%d.map", (int)getpid());
+  unlink(path);
+  LabelSymbols labels;
+  Testing_compile_jit_prog(ctx, &labels);
+  JitRegistration reg;
+  cmp_ok(Jit_register(&reg, ctx->writer, &labels, "prog", kJitPerfMap), "==",
+         0, __func__);
+  FILE *fp = fopen(path, "r");
+  ok(fp != NULL, __func__);
+  byte *code = Buffer_code(ctx->writer->buf);
+  // The jump over the labels, the two functions and the body.
+  const char *names[] = {"prog", "f", "g", "prog"};
+  unsigned long long expected_start = (uintptr_t)code;
+  int num_lines = 0;
+  unsigned long long start;
+  unsigned size;
+  char name[16];
+  while (fp != NULL && fscanf(fp, "%llx %x %15s", &start, &size, name) == 3) {
+    if (num_lines < 4) {
+      cmp_ok(start, "==", expected_start, __func__);
+      is(name, names[num_lines], __func__);
+    }
+    expected_start = start + size;
+    num_lines++;
+  }
+  cmp_ok(num_lines, "==", 4, __func__);
+  cmp_ok(expected_start, "==", (uintptr_t)code + ctx->writer->pos, __func__);
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  unlink(path);
+  Jit_unregister(&reg);
+  LabelSymbols_deinit(&labels);
 }
 
-TEST(mov_rcx_imm32) {
-  Buffer_mov_reg_imm32(ctx->writer, kRcx, 42);
-  byte expected[] = {0xb9, 0x2a, 0x00, 0x00, 0x00};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(jit_dump_records_each_function) {
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/jit-%d.dump", (int)getpid());
+  LabelSymbols labels;
+  Testing_compile_jit_prog(ctx, &labels);
+  JitRegistration reg;
+  cmp_ok(Jit_register(&reg, ctx->writer, &labels, "prog", kJitDump), "==", 0,
+         __func__);
+  FILE *fp = fopen(path, "rb");
+  ok(fp != NULL, __func__);
+  JitDumpHeader header = {0};
+  cmp_ok(fread(&header, sizeof header, 1, fp), "==", 1, __func__);
+  cmp_ok(header.magic, "==", kJitDumpMagic, __func__);
+  cmp_ok(header.pid, "==", getpid(), __func__);
+  // Records from earlier tests come first; find the one for f.
+  byte *code = Buffer_code(ctx->writer->buf);
+  int32_t f_start, f_end;
+  LabelSymbols_range(&labels, 0, ctx->writer, &f_start, &f_end);
+  bool found = false;
+  JitDumpCodeLoad record;
+  while (!found && fread(&record, sizeof record, 1, fp) == 1) {
+    char name[16] = {0};
+    size_t rest = record.total_size - sizeof record;
+    byte *data = malloc(rest);
+    assert(data != NULL);
+    cmp_ok(fread(data, 1, rest, fp), "==", rest, __func__);
+    memcpy(name, data, rest < sizeof name - 1 ? rest : sizeof name - 1);
+    if (record.vma == (uintptr_t)(code + f_start) && strcmp(name, "f") == 0) {
+      found = true;
+      cmp_ok(record.code_size, "==", f_end - f_start, __func__);
+      byte *copy = data + strlen(name) + 1;
+      ok(memcmp(copy, code + f_start, f_end - f_start) == 0, __func__);
+    }
+    free(data);
+  }
+  ok(found, __func__);
+  fclose(fp);
+  unlink(path);
+  Jit_unregister(&reg);
+  LabelSymbols_deinit(&labels);
 }
 
-TEST(mov_inc) {
-  Buffer_mov_reg_imm32(ctx->writer, kRax, 42);
-  Buffer_inc_reg(ctx->writer, kRax);
-  Buffer_ret(ctx->writer);
+TEST(jit_gdb_registration_describes_the_code) {
+  LabelSymbols labels;
+  Testing_compile_jit_prog(ctx, &labels);
+  JitRegistration reg;
+  cmp_ok(Jit_register(&reg, ctx->writer, &labels, "prog", kJitGdb), "==", 0,
+         __func__);
+  ok(__jit_debug_descriptor.first_entry == &reg.gdb_entry, __func__);
+  ok(__jit_debug_descriptor.relevant_entry == &reg.gdb_entry, __func__);
+  cmp_ok(__jit_debug_descriptor.action_flag, "==", kJitRegisterFn, __func__);
+  byte *image = (byte *)reg.gdb_entry.symfile_addr;
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image;
+  ok(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0, __func__);
+  cmp_ok(ehdr->e_type, "==", ET_REL, __func__);
+  Elf64_Shdr *text = (Elf64_Shdr *)(image + ehdr->e_shoff) + 1;
+  cmp_ok(text->sh_addr, "==", (uintptr_t)Buffer_code(ctx->writer->buf),
+         __func__);
+  Elf64_Sym *g = Testing_elf_symbol(image, "g");
+  ok(g != NULL, __func__);
+  if (g != NULL) {
+    cmp_ok(g->st_value, "==",
+           BufferWriter_label_pos(ctx->writer, labels.entries[1].label),
+           __func__);
+  }
+  ok(Testing_elf_symbol(image, "prog") != NULL, __func__);
+  Jit_unregister(&reg);
+  ok(__jit_debug_descriptor.first_entry == NULL, __func__);
+  cmp_ok(__jit_debug_descriptor.action_flag, "==", kJitUnregisterFn, __func__);
+  LabelSymbols_deinit(&labels);
+}
+
+static char *kTestingProfiledProg =
+    "(labels ((count (code (n)"
+    "                  (if (zero? n) 0 (labelcall count (sub1 n)))))"
+    "         (twice (code (n) (+ (labelcall count n) (labelcall count n)))))"
+    "  (labelcall twice 10))";
+
+// Compile and run kTestingProfiledProg with kOptProfile, counting in
+// `profile', and check the counts.
+static void Testing_check_profile(CompilerContext *ctx, Profile *profile) {
+  ctx->options |= kOptProfile;
+  ctx->profile = profile;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingProfiledProg);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, 43);
+  cmp_ok(Testing_call_entry(ctx->writer->buf, 0), "==",
+         encodeImmediateFixnum(0), __func__);
+  cmp_ok(Profile_entry_count(profile, Symbol_intern("twice")), "==", 1,
+         __func__);
+  cmp_ok(Profile_entry_count(profile, Symbol_intern("count")), "==", 22,
+         __func__);
+  size_t test_start = strstr(kTestingProfiledProg, "(zero?") -
+                      kTestingProfiledProg;
+  uint64_t iftrue, iffalse;
+  ok(Profile_branch_counts(profile, test_start, &iftrue, &iffalse), __func__);
+  cmp_ok(iftrue, "==", 2, __func__);
+  cmp_ok(iffalse, "==", 20, __func__);
+  ok(!Profile_branch_counts(profile, test_start + 1, &iftrue, &iffalse),
+     __func__);
 }
 
-TEST(mov_rax_rax) {
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRax);
-  byte expected[] = {0x48, 0x89, 0xc0};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(profile_counts_entries_and_arms) {
+  Profile profile;
+  Profile_init(&profile, 16);
+  Testing_check_profile(ctx, &profile);
+  Profile_reset(&profile);
+  cmp_ok(Profile_entry_count(&profile, Symbol_intern("count")), "==", 0,
+         __func__);
+  Profile_deinit(&profile);
 }
 
-TEST(mov_rax_rsi) {
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
-  byte expected[] = {0x48, 0x89, 0xf0};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(profile_counts_with_registers) {
+  ctx->options |= kOptRegisters;
+  Profile profile;
+  Profile_init(&profile, 16);
+  Testing_check_profile(ctx, &profile);
+  Profile_deinit(&profile);
 }
 
-TEST(mov_rdi_rbp) {
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRdi, /*src=*/kRbp);
-  byte expected[] = {0x48, 0x89, 0xef};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(profile_turns_off_ir) {
+  ctx->options |= kOptIR | kOptFold;
+  Profile profile;
+  Profile_init(&profile, 16);
+  Testing_check_profile(ctx, &profile);
+  Profile_deinit(&profile);
 }
 
-TEST(compile_fixnum) {
-  // 123
-  ASTNode *node = AST_new_fixnum(123);
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, 123; ret
-  byte expected[] = {0xb8, 0xec, 0x01, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(profile_counts_tail_arms) {
+  ctx->options |= kOptProfile;
+  Profile profile;
+  Profile_init(&profile, 16);
+  ctx->profile = &profile;
+  char *input = "(if (zero? 1) 2 3)";
+  ASTNode *node = Reader_read(ctx->arena, input);
+  cmp_ok(AST_compile_entry(ctx, node), "==", 0, __func__);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(123));
-  free(node);
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+  uint64_t iftrue, iffalse;
+  ok(Profile_branch_counts(&profile, strlen("(if "), &iftrue, &iffalse),
+     __func__);
+  cmp_ok(iftrue, "==", 0, __func__);
+  cmp_ok(iffalse, "==", 2, __func__);
+  Profile_deinit(&profile);
 }
 
-ASTNode *list1(ASTNode *e0) { return AST_new_cons(e0, nil); }
+TEST(profile_reports_running_out_of_counters) {
+  ctx->options |= kOptProfile;
+  Profile profile;
+  Profile_init(&profile, 2);
+  ctx->profile = &profile;
+  ASTNode *prog = Reader_read(ctx->arena, kTestingProfiledProg);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", -1, __func__);
+  Profile_deinit(&profile);
+}
 
-ASTNode *list2(ASTNode *e0, ASTNode *e1) { return AST_new_cons(e0, list1(e1)); }
+TEST(profile_needs_a_profile) {
+  ctx->options |= kOptProfile;
+  ASTNode *node = Reader_read(ctx->arena, "(if (zero? 0) 1 2)");
+  cmp_ok(AST_compile_entry(ctx, node), "==", -1, __func__);
+}
 
-ASTNode *list3(ASTNode *e0, ASTNode *e1, ASTNode *e2) {
-  return AST_new_cons(e0, list2(e1, e2));
+TEST(elf_rejects_profiled_code) {
+  char path[kTestingPathSize];
+  int result = Testing_elf_compile("(if (zero? 0) 1 2)",
+                                   ctx->options | kOptProfile, kElfObject,
+                                   path);
+  cmp_ok(result, "==", -1, __func__);
+  unlink(path);
 }
 
-ASTNode *list4(ASTNode *e0, ASTNode *e1, ASTNode *e2, ASTNode *e3) {
-  return AST_new_cons(e0, list3(e1, e2, e3));
+// Check that `input' compiles with kOptInline on top of `options' to the same
+// code as `expected' without it, and return what that code returns.
+static uint64_t Testing_inline_matches(char *input, char *expected,
+                                       int options, uint64_t heap) {
+  Buffer inlined, reference;
+  int32_t inlined_len =
+      Testing_compile_prog(input, options | kOptInline, &inlined);
+  int32_t reference_len = Testing_compile_prog(expected, options, &reference);
+  ok(inlined_len > 0, __func__);
+  cmp_ok(inlined_len, "==", reference_len, __func__);
+  ok(inlined_len == reference_len &&
+         memcmp(inlined.address, reference.address, inlined_len) == 0,
+     __func__);
+  Buffer_make_executable(&inlined);
+  uint64_t result = Testing_call_entry(&inlined, heap);
+  Buffer_deinit(&inlined);
+  Buffer_deinit(&reference);
+  return result;
 }
 
-TEST(compile_primcall_add1) {
-  // (add1 5)
-  ASTNode *node = list2(AST_new_atom("add1"), AST_new_fixnum(5));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(5); add eax, imm(1); ret
-  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x05,
-                     0x04, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(6));
-  // TODO: figure out how to collect ASTs
+TEST(inline_replaces_small_calls) {
+  uint64_t result = Testing_inline_matches(
+      "(labels ((inc (code (x) (add1 x)))) (labelcall inc 5))",
+      "(labels ((inc (code (x) (add1 x)))) (let ((x 5)) (add1 x)))",
+      ctx->options, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(6), __func__);
 }
 
-TEST(compile_primcall_sub1) {
-  // (sub1 5)
-  ASTNode *node = list2(AST_new_atom("sub1"), AST_new_fixnum(5));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(5); sub eax, imm(1); ret
-  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x2d,
-                     0x04, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(4));
-  // TODO: figure out how to collect ASTs
+TEST(inline_exposes_constants_to_folding) {
+  uint64_t result = Testing_inline_matches(
+      "(labels ((inc (code (x) (add1 x)))) (labelcall inc 5))",
+      "(labels ((inc (code (x) (add1 x)))) 6)", ctx->options | kOptFold,
+      heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(6), __func__);
 }
 
-TEST(compile_primcall_add1_sub1) {
-  // (sub1 (add1 5))
-  ASTNode *node = list2(AST_new_atom("sub1"),
-                        list2(AST_new_atom("add1"), AST_new_fixnum(5)));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(5); add eax, imm(1); sub eax, imm(1); ret
-  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x05, 0x04, 0x00,
-                     0x00, 0x00, 0x2d, 0x04, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
-  // TODO: figure out how to collect ASTs
+TEST(inline_inlines_into_functions_in_order) {
+  uint64_t result = Testing_inline_matches(
+      "(labels ((id (code (x) x))"
+      "         (two (code (x) (+ (labelcall id x) (labelcall id x)))))"
+      "  (labelcall two 4))",
+      "(labels ((id (code (x) x))"
+      "         (two (code (x) (+ (let ((x x)) x) (let ((x x)) x)))))"
+      "  (let ((x 4)) (+ (let ((x x)) x) (let ((x x)) x))))",
+      ctx->options, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(8), __func__);
 }
 
-TEST(compile_primcall_sub1_add1) {
-  // (add1 (sub1 5))
-  ASTNode *node = list2(AST_new_atom("add1"),
-                        list2(AST_new_atom("sub1"), AST_new_fixnum(5)));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(5); sub eax, imm(1); add eax, imm(1); ret
-  byte expected[] = {0xb8, 0x14, 0x00, 0x00, 0x00, 0x2d, 0x04, 0x00,
-                     0x00, 0x00, 0x05, 0x04, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
-  // TODO: figure out how to collect ASTs
+TEST(inline_keeps_arguments_from_capture) {
+  // Binding x to y and then y to x would give y the new x. The reader can't
+  // read the inliner's temporaries, but the code doesn't depend on names.
+  uint64_t result = Testing_inline_matches(
+      "(labels ((sub (code (x y) (+ x (sub1 y)))))"
+      "  (let ((x 10) (y 1)) (labelcall sub y x)))",
+      "(labels ((sub (code (x y) (+ x (sub1 y)))))"
+      "  (let ((x 10) (y 1))"
+      "    (let ((a0 y) (a1 x) (x a0) (y a1)) (+ x (sub1 y)))))",
+      ctx->options, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(1 + 9), __func__);
 }
 
-TEST(compile_add_two_ints) {
-  // (+ 1 2)
-  ASTNode *node =
-      list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_fixnum(2));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(2); mov [rsp-8], rax; mov rax, imm(1); add rax, [rsp-8]
-  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89,
-                     0x44, 0x24, 0xf8, 0xb8, 0x04, 0x00, 0x00,
-                     0x00, 0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(inline_leaves_recursive_and_big_functions) {
+  char *input = "(labels ((down (code (n)"
+                "                 (if (zero? n) 0 (labelcall down (sub1 n)))))"
+                "         (big (code (x)"
+                "                (+ (+ (+ x x) (+ x x)) (+ (+ x x) (+ x x))))))"
+                "  (+ (labelcall down 3) (labelcall big 1)))";
+  uint64_t result = Testing_inline_matches(input, input, ctx->options, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(8), __func__);
+}
+
+TEST(inline_leaves_bodies_with_free_variables) {
+  ctx->options |= kOptInline;
+  ASTNode *prog = Reader_read(
+      ctx->arena, "(labels ((f (code () x))) (let ((x 1)) (labelcall f)))");
+  cmp_ok(AST_compile_prog(ctx, prog), "==", -1, __func__);
+}
+
+TEST(inline_leaves_programs_that_rebind_a_label) {
+  char *input = "(labels ((g (code () 1))"
+                "         (f (code () (labelcall g)))"
+                "         (g (code () 2)))"
+                "  (labelcall f))";
+  uint64_t result = Testing_inline_matches(input, input, ctx->options, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(1), __func__);
+}
+
+TEST(inline_goes_by_the_profile) {
+  char *input = "(labels ((cold (code (x) (add1 x)))"
+                "         (hot (code (x) (sub1 x))))"
+                "  (if (zero? 0) (labelcall hot 1) (labelcall cold 1)))";
+  Profile profile;
+  Profile_init(&profile, 16);
+  ctx->options |= kOptProfile;
+  ctx->profile = &profile;
+  ASTNode *prog = Reader_read(ctx->arena, input);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
-  // TODO: figure out how to collect ASTs
+  cmp_ok(Testing_call_entry(ctx->writer->buf, heap), "==",
+         encodeImmediateFixnum(0), __func__);
+  // Recompile with the counts: `cold' never ran, so it stays a call.
+  Buffer buf;
+  Buffer_init(&buf, 1);
+  BufferWriter writer;
+  BufferWriter_init(&writer, &buf);
+  CompilerContext_init(ctx, &writer, ctx->arena, NULL, NULL);
+  ctx->options = kOptInline;
+  ctx->profile = &profile;
+  prog = Reader_read(ctx->arena, input);
+  cmp_ok(AST_compile_prog(ctx, prog), "==", 0, __func__);
+  Buffer expected;
+  int32_t expected_len = Testing_compile_prog(
+      "(labels ((cold (code (x) (add1 x)))"
+      "         (hot (code (x) (sub1 x))))"
+      "  (if (zero? 0) (let ((x 1)) (sub1 x)) (labelcall cold 1)))",
+      kOptNone, &expected);
+  cmp_ok(writer.pos, "==", expected_len, __func__);
+  ok(writer.pos == (size_t)expected_len &&
+         memcmp(buf.address, expected.address, expected_len) == 0,
+     __func__);
+  Buffer_deinit(&expected);
+  BufferWriter_deinit(&writer);
+  Buffer_deinit(&buf);
+  Profile_deinit(&profile);
 }
 
-TEST(compile_add_three_ints) {
-  // (+ 1 (+ 2 3))
-  ASTNode *node =
-      list3(AST_new_atom("+"), AST_new_fixnum(1),
-            list3(AST_new_atom("+"), AST_new_fixnum(2), AST_new_fixnum(3)));
+TEST(compile_minus) {
+  ASTNode *node = Reader_read(ctx->arena, "(- 5 2)");
   int result = AST_compile_function(ctx, node);
   cmp_ok(result, "==", 0, __func__);
-  // 0:  b8 0c 00 00 00          mov    eax,0xc
+  // 0:  b8 08 00 00 00          mov    eax,0x8
   // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // a:  b8 08 00 00 00          mov    eax,0x8
-  // f:  48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 14: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 19: b8 04 00 00 00          mov    eax,0x4
-  // 1e: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 23: c3                      ret
-  byte expected[] = {0xb8, 0x0c, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
-                     0xf8, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x03, 0x44,
-                     0x24, 0xf8, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x04,
-                     0x00, 0x00, 0x00, 0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  // a:  b8 14 00 00 00          mov    eax,0x14
+  // f:  2b 44 24 f8             sub    eax,DWORD PTR [rsp-0x8]
+  // 13: c3                      ret
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89,
+                     0x44, 0x24, 0xf8, 0xb8, 0x14, 0x00, 0x00,
+                     0x00, 0x2b, 0x44, 0x24, 0xf8, 0xc3};
   EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(6));
-  // TODO: figure out how to collect ASTs
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
 }
 
-TEST(compile_add_four_ints) {
-  // (+ (+ 1 2) (+ 3 4))
-  ASTNode *node =
-      list3(AST_new_atom("+"),
-            list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_fixnum(2)),
-            list3(AST_new_atom("+"), AST_new_fixnum(3), AST_new_fixnum(4)));
+TEST(compile_times_untags_one_operand) {
+  ASTNode *node = Reader_read(ctx->arena, "(* 3 4)");
   int result = AST_compile_function(ctx, node);
   cmp_ok(result, "==", 0, __func__);
   // 0:  b8 10 00 00 00          mov    eax,0x10
   // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
   // a:  b8 0c 00 00 00          mov    eax,0xc
-  // f:  48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 14: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 19: b8 08 00 00 00          mov    eax,0x8
-  // 1e: 48 89 44 24 f0          mov    QWORD PTR [rsp-0x10],rax
-  // 23: b8 04 00 00 00          mov    eax,0x4
-  // 28: 48 03 44 24 f0          add    rax,QWORD PTR [rsp-0x10]
-  // 2d: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 32: c3                      ret
-  byte expected[] = {0xb8, 0x10, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
-                     0xf8, 0xb8, 0x0c, 0x00, 0x00, 0x00, 0x48, 0x03, 0x44,
-                     0x24, 0xf8, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x08,
-                     0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24, 0xf0, 0xb8,
-                     0x04, 0x00, 0x00, 0x00, 0x48, 0x03, 0x44, 0x24, 0xf0,
-                     0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
+  // f:  c1 f8 02                sar    eax,0x2
+  // 12: 0f af 44 24 f8          imul   eax,DWORD PTR [rsp-0x8]
+  // 17: c3                      ret
+  byte expected[] = {0xb8, 0x10, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44,
+                     0x24, 0xf8, 0xb8, 0x0c, 0x00, 0x00, 0x00, 0xc1,
+                     0xf8, 0x02, 0x0f, 0xaf, 0x44, 0x24, 0xf8, 0xc3};
   EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(10));
-  // TODO: figure out how to collect ASTs
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(12));
 }
 
-TEST(integer_to_char) {
-  // (integer->char 65)
-  ASTNode *node = list2(AST_new_atom("integer->char"), AST_new_fixnum(65));
+TEST(compile_less_compares_tagged_values) {
+  ASTNode *node = Reader_read(ctx->arena, "(if (< 1 2) 3 4)");
   int result = AST_compile_function(ctx, node);
   cmp_ok(result, "==", 0, __func__);
-  // 0:  b8 04 01 00 00          mov    eax,0x104
-  // 5:  48 c1 e0 06             shl    rax,0x6
-  // 9:  48 25 0f 00 00 00       and    rax,0xf
-  // f:  c3                      ret
-  byte expected[] = {0xb8, 0x04, 0x01, 0x00, 0x00, 0x48, 0xc1, 0xe0,
-                     0x06, 0x48, 0x0d, 0x0f, 0x00, 0x00, 0x00, 0xc3};
+  // 0:  b8 08 00 00 00          mov    eax,0x8
+  // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // a:  b8 04 00 00 00          mov    eax,0x4
+  // f:  3b 44 24 f8             cmp    eax,DWORD PTR [rsp-0x8]
+  // 13: 7d 06                   jge    0x1b
+  // 15: b8 0c 00 00 00          mov    eax,0xc
+  // 1a: c3                      ret
+  // 1b: b8 10 00 00 00          mov    eax,0x10
+  // 20: c3                      ret
+  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
+                     0xf8, 0xb8, 0x04, 0x00, 0x00, 0x00, 0x3b, 0x44, 0x24,
+                     0xf8, 0x7d, 0x06, 0xb8, 0x0c, 0x00, 0x00, 0x00, 0xc3,
+                     0xb8, 0x10, 0x00, 0x00, 0x00, 0xc3};
   EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
   Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateChar('A'));
-  // TODO: figure out how to collect ASTs
+  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
 }
 
-ASTNode *call1(char *fnname, ASTNode *arg) {
-  return list2(AST_new_atom(fnname), arg);
+static const struct {
+  char *expr;
+  int32_t expected;
+} kTestingArithmetic[] = {
+    {"(- 2 5)", -3},
+    {"(- -2 -5)", 3},
+    {"(* -3 4)", -12},
+    {"(* -3 -4)", 12},
+    {"(quotient 7 2)", 3},
+    {"(quotient -7 2)", -3},
+    {"(quotient 7 -2)", -3},
+    {"(remainder 7 2)", 1},
+    {"(remainder -7 2)", -1},
+    {"(remainder 7 -2)", 1},
+    {"(logand 12 10)", 8},
+    {"(logor 12 10)", 14},
+    {"(logand -1 5)", 5},
+    {"(if (= 3 3) 1 0)", 1},
+    {"(if (= 3 4) 1 0)", 0},
+    {"(if (< -1 1) 1 0)", 1},
+    {"(if (< 1 -1) 1 0)", 0},
+    {"(if (<= 2 2) 1 0)", 1},
+    {"(if (<= 3 2) 1 0)", 0},
+    // Operands that need slots of their own while the others are live.
+    {"(let ((a 1)) (let ((b 2)) (+ b (+ a (quotient 100 7)))))", 17},
+    {"(let ((a 1)) (+ a (remainder 100 7)))", 3},
+    {"(let ((a 3)) (let ((b 4)) (let ((c 5)) (* a (- b (quotient c b))))))",
+     9},
+    {"(quotient (* 6 7) (- 10 (logor 1 2)))", 6},
+    // Sums that carry out of the low 32 bits must not leave it in the high
+    // ones.
+    {"(if (zero? (+ -1 1)) 1 0)", 1},
+    {"(let ((a -1)) (if (zero? (+ a 1)) 1 0))", 1},
+    {"(let ((a -1)) (vector-ref (make-vector 3 7) (+ a 2)))", 7},
+};
+
+// Run the table above through the compiler with `options'.
+static void Testing_check_arithmetic(int options, uint64_t heap) {
+  for (size_t i = 0;
+       i < sizeof kTestingArithmetic / sizeof kTestingArithmetic[0]; i++) {
+    char prog[256];
+    snprintf(prog, sizeof prog, "(labels () %s)", kTestingArithmetic[i].expr);
+    Buffer buf;
+    int32_t len = Testing_compile_prog(prog, options, &buf);
+    ok(len > 0, "%s", kTestingArithmetic[i].expr);
+    if (len > 0) {
+      Buffer_make_executable(&buf);
+      cmp_ok(Testing_call_entry(&buf, heap), "==",
+             encodeImmediateFixnum(kTestingArithmetic[i].expected), "%s",
+             kTestingArithmetic[i].expr);
+    }
+    Buffer_deinit(&buf);
+  }
 }
 
-TEST(zerop_with_zero_returns_true) {
-  // (zero? (sub1 (add1 0)))
-  ASTNode *node =
-      call1("zero?", call1("sub1", call1("add1", AST_new_fixnum(0))));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // -> prelude
-  // 0:  b8 00 00 00 00          mov    eax,0x0
-  // 5:  05 04 00 00 00          add    eax,0x4
-  // a:  2d 04 00 00 00          sub    eax,0x4
-  // -> body of zero?
-  // f:  48 3d 00 00 00 00       cmp    rax,0x0
-  // 15: b8 00 00 00 00          mov    eax,0x0
-  // 1a: 0f 94 c0                sete   al
-  // 1d: 48 c1 e0 07             shl    rax,0x7
-  // 21: 48 0d 1f 00 00 00       or     rax,0x1f
-  // 27: c3                      ret
-  byte expected[] = {0xb8, 0x00, 0x00, 0x00, 0x00, 0x05, 0x04, 0x00,
-                     0x00, 0x00, 0x2d, 0x04, 0x00, 0x00, 0x00, 0x48,
-                     0x3d, 0x00, 0x00, 0x00, 0x00, 0xb8, 0x00, 0x00,
-                     0x00, 0x00, 0x0f, 0x94, 0xc0, 0x48, 0xc1, 0xe0,
-                     0x07, 0x48, 0x0d, 0x1f, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateBool(true));
-  // TODO: figure out how to collect ASTs
+TEST(arithmetic_primitives) {
+  (void)ctx;
+  Testing_check_arithmetic(kOptNone, heap);
 }
 
-TEST(zerop_with_non_zero_returns_false) {
-  // (zero? (sub1 (add1 0)))
-  ASTNode *node =
-      call1("zero?", call1("sub1", call1("add1", AST_new_fixnum(1))));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // -> prelude
-  // 0:  b8 00 00 00 00          mov    eax,0x0
-  // 5:  05 04 00 00 00          add    eax,0x4
-  // a:  2d 04 00 00 00          sub    eax,0x4
-  // -> body of zero?
-  // f:  48 3d 00 00 00 00       cmp    rax,0x0
-  // 15: b8 00 00 00 00          mov    eax,0x0
-  // 1a: 0f 94 c0                sete   al
-  // 1d: 48 c1 e0 07             shl    rax,0x7
-  // 21: 48 0d 1f 00 00 00       or     rax,0x1f
-  // 27: c3                      ret
-  byte expected[] = {0xb8, 0x04, 0x00, 0x00, 0x00, 0x05, 0x04, 0x00,
-                     0x00, 0x00, 0x2d, 0x04, 0x00, 0x00, 0x00, 0x48,
-                     0x3d, 0x00, 0x00, 0x00, 0x00, 0xb8, 0x00, 0x00,
-                     0x00, 0x00, 0x0f, 0x94, 0xc0, 0x48, 0xc1, 0xe0,
-                     0x07, 0x48, 0x0d, 0x1f, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateBool(false));
-  // TODO: figure out how to collect ASTs
+TEST(arithmetic_primitives_with_registers) {
+  (void)ctx;
+  Testing_check_arithmetic(kOptRegisters, heap);
 }
 
-TEST(let_with_no_bindings) {
-  // (let () (+ 1 2))
-  ASTNode *node = list3(
-      AST_new_atom("let"),
-      /*bindings*/ nil,
-      /*body*/ list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_fixnum(2)));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // mov eax, imm(2); mov [rsp-8], rax; mov rax, imm(1); add rax, [rsp-8]
-  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89,
-                     0x44, 0x24, 0xf8, 0xb8, 0x04, 0x00, 0x00,
-                     0x00, 0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
-  // TODO: figure out how to collect ASTs
+TEST(arithmetic_primitives_with_overflow_checks) {
+  (void)ctx;
+  Testing_check_arithmetic(kOptOverflow | kOptRegisters, heap);
 }
 
-TEST(let_with_one_binding) {
-  // (let ((x 2)) (+ 1 x))
-  ASTNode *node = list3(
-      AST_new_atom("let"),
-      /*bindings*/ list1(list2(AST_new_atom("x"), AST_new_fixnum(2))),
-      /*body*/ list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_atom("x")));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // 0:  b8 08 00 00 00          mov    eax,0x08
-  // 5:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // a:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
-  // f:  48 89 44 24 f0          mov    QWORD PTR [rsp-0x10],rax
-  // 14: b8 04 00 00 00          mov    eax,0x4
-  // 19: 48 03 44 24 f0          add    rax,QWORD PTR [rsp-0x10]
-  // 1e: c3                      ret
-  byte expected[] = {0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44,
-                     0x24, 0xf8, 0x48, 0x8b, 0x44, 0x24, 0xf8, 0x48,
-                     0x89, 0x44, 0x24, 0xf0, 0xb8, 0x04, 0x00, 0x00,
-                     0x00, 0x48, 0x03, 0x44, 0x24, 0xf0, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
-  // TODO: figure out how to collect ASTs
+TEST(ir_arithmetic_primitives) {
+  (void)ctx;
+  Testing_check_arithmetic(kOptIR | kOptRegisters | kOptFold, heap);
 }
 
-TEST(compile_atom_with_undefined_variable) {
-  ASTNode *node = AST_new_atom("foo");
-  int result = AST_compile_expr(ctx, node, /*stack_index=*/0);
-  cmp_ok(result, "==", -1, __func__);
-  // TODO: figure out how to collect ASTs
+TEST(comparisons_as_values_make_bools) {
+  uint64_t result = Run_from_cstr("(<= -4 -5)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateBool(false), __func__);
 }
 
-TEST(compile_atom_in_env_emits_stack_index) {
-  ASTNode *node = AST_new_atom("foo");
-  EnvNode locals = Env_init("foo", -34, /*next=*/NULL);
-  CompilerContext new_ctx = CompilerContext_with_locals(ctx, &locals);
-  int result = AST_compile_expr(&new_ctx, node, /*stack_index=*/0);
-  cmp_ok(result, "==", 0, __func__);
-  byte expected[] = {0x48, 0x8b, 0x44, 0x24, 0x100 - 34};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  // TODO: figure out how to collect ASTs
+TEST(arithmetic_primitives_in_a_loop) {
+  uint64_t result = Run_prog_from_cstr(
+      "(labels ((fact (code (n)"
+      "                 (if (= n 0) 1 (* n (labelcall fact (- n 1)))))))"
+      "  (labelcall fact 10))",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(3628800), __func__);
 }
 
-TEST(compile_if_test_true) {
-  // (if (zero? 0) (+ 1 2) (+ 3 4))
-  ASTNode *node =
-      list4(AST_new_atom("if"), list2(AST_new_atom("zero?"), AST_new_fixnum(0)),
-            list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_fixnum(2)),
-            list3(AST_new_atom("+"), AST_new_fixnum(3), AST_new_fixnum(4)));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // 0:  b8 00 00 00 00          mov    eax,0x0
-  // -> zero?
-  // 5:  48 3d 00 00 00 00       cmp    rax,0x0
-  // b:  b8 00 00 00 00          mov    eax,0x0
-  // 10: 0f 94 c0                sete   al
-  // 13: 48 c1 e0 07             shl    rax,0x7
-  // 17: 48 0d 1f 00 00 00       or     rax,0x1f
-  // -> if
-  // 1d: 48 3d 1f 00 00 00       cmp    rax,0x1f
-  // 23: 0f 84 19 00 00 00       je     0x42
-  // +
-  // 29: b8 08 00 00 00          mov    eax,0x8
-  // 2e: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 33: b8 04 00 00 00          mov    eax,0x4
-  // 38: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 3d: e9 14 00 00 00          jmp    0x56
-  // +
-  // 42: b8 10 00 00 00          mov    eax,0x10
-  // 47: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 4c: b8 0c 00 00 00          mov    eax,0xc
-  // 51: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 56: c3                      ret
-  byte expected[] = {0xb8, 0x00, 0x00, 0x00, 0x00, 0x48, 0x3d, 0x00, 0x00, 0x00,
-                     0x00, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x94, 0xc0, 0x48,
-                     0xc1, 0xe0, 0x07, 0x48, 0x0d, 0x1f, 0x00, 0x00, 0x00, 0x48,
-                     0x3d, 0x1f, 0x00, 0x00, 0x00, 0x0f, 0x84, 0x19, 0x00, 0x00,
-                     0x00, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
-                     0xf8, 0xb8, 0x04, 0x00, 0x00, 0x00, 0x48, 0x03, 0x44, 0x24,
-                     0xf8, 0xe9, 0x14, 0x00, 0x00, 0x00, 0xb8, 0x10, 0x00, 0x00,
-                     0x00, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x0c, 0x00, 0x00,
-                     0x00, 0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(3));
+TEST(fold_arithmetic_primitives) {
+  ASTNode *folded =
+      Testing_fold_cstr(ctx, "(quotient (* 6 (- 10 3)) (logand 7 -2))");
+  cmp_ok(folded->type, "==", kFixnum, __func__);
+  cmp_ok(folded->value.fixnum, "==", 7, __func__);
+  folded = Testing_fold_cstr(ctx, "(< (remainder -7 2) 0)");
+  ok(folded->type == kBool && folded->value.boolean, __func__);
+  ASTNode *input = Reader_read(ctx->arena, "(quotient 1 0)");
+  ok(AST_fold(ctx, input) == input, __func__);
+  input = Reader_read(ctx->arena, "(* 536870911 2)");
+  ok(AST_fold(ctx, input) == input, __func__);
 }
 
-TEST(compile_if_test_false) {
-  // (if (zero? 1) (+ 1 2) (+ 3 4))
-  ASTNode *node =
-      list4(AST_new_atom("if"), list2(AST_new_atom("zero?"), AST_new_fixnum(1)),
-            list3(AST_new_atom("+"), AST_new_fixnum(1), AST_new_fixnum(2)),
-            list3(AST_new_atom("+"), AST_new_fixnum(3), AST_new_fixnum(4)));
-  int result = AST_compile_function(ctx, node);
-  cmp_ok(result, "==", 0, __func__);
-  // 0:  b8 04 00 00 00          mov    eax,imm(0x1)
-  // -> zero?
-  // 5:  48 3d 00 00 00 00       cmp    rax,0x0
-  // b:  b8 00 00 00 00          mov    eax,0x0
-  // 10: 0f 94 c0                sete   al
-  // 13: 48 c1 e0 07             shl    rax,0x7
-  // 17: 48 0d 1f 00 00 00       or     rax,0x1f
-  // -> if
-  // 1d: 48 3d 1f 00 00 00       cmp    rax,0x1f
-  // 23: 0f 84 19 00 00 00       je     0x42
-  // +
-  // 29: b8 08 00 00 00          mov    eax,0x8
-  // 2e: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 33: b8 04 00 00 00          mov    eax,0x4
-  // 38: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 3d: e9 14 00 00 00          jmp    0x56
-  // +
-  // 42: b8 10 00 00 00          mov    eax,0x10
-  // 47: 48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
-  // 4c: b8 0c 00 00 00          mov    eax,0xc
-  // 51: 48 03 44 24 f8          add    rax,QWORD PTR [rsp-0x8]
-  // 56: c3                      ret
-  byte expected[] = {0xb8, 0x04, 0x00, 0x00, 0x00, 0x48, 0x3d, 0x00, 0x00, 0x00,
-                     0x00, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x94, 0xc0, 0x48,
-                     0xc1, 0xe0, 0x07, 0x48, 0x0d, 0x1f, 0x00, 0x00, 0x00, 0x48,
-                     0x3d, 0x1f, 0x00, 0x00, 0x00, 0x0f, 0x84, 0x19, 0x00, 0x00,
-                     0x00, 0xb8, 0x08, 0x00, 0x00, 0x00, 0x48, 0x89, 0x44, 0x24,
-                     0xf8, 0xb8, 0x04, 0x00, 0x00, 0x00, 0x48, 0x03, 0x44, 0x24,
-                     0xf8, 0xe9, 0x14, 0x00, 0x00, 0x00, 0xb8, 0x10, 0x00, 0x00,
-                     0x00, 0x48, 0x89, 0x44, 0x24, 0xf8, 0xb8, 0x0c, 0x00, 0x00,
-                     0x00, 0x48, 0x03, 0x44, 0x24, 0xf8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(7));
+// Compile `input' with `options' and run it in a child process. Return the
+// signal that killed it, or 0 if it returned.
+static int Testing_signal_from_prog(char *input, int options, uint64_t heap) {
+  Buffer buf;
+  int32_t len = Testing_compile_prog(input, options, &buf);
+  ok(len > 0, __func__);
+  Buffer_make_executable(&buf);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    Testing_call_entry(&buf, heap);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  Buffer_deinit(&buf);
+  return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
 }
 
-TEST(return_heap_address) {
-  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRdi);
-  Buffer_ret(ctx->writer);
-  byte expected[] = {0x48, 0x89, 0xf8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  uint64_t result = Testing_call_entry(ctx->writer->buf, 0xdeadbeef);
-  cmp_ok(result, "==", 0xdeadbeef, __func__);
+TEST(overflow_checks_trap) {
+  (void)ctx;
+  char *overflows[] = {
+      "(labels () (+ 536870911 1))",
+      "(labels () (- -536870912 1))",
+      "(labels () (* 65536 65536))",
+      "(labels () (add1 536870911))",
+      "(labels () (sub1 -536870912))",
+      "(labels () (quotient -536870912 -1))",
+      "(labels ((f (code (x) (* x x)))) (labelcall f 100000))",
+  };
+  for (size_t i = 0; i < sizeof overflows / sizeof overflows[0]; i++) {
+    cmp_ok(Testing_signal_from_prog(overflows[i], kOptOverflow, heap), "==",
+           SIGILL, "%s", overflows[i]);
+  }
+  cmp_ok(Testing_signal_from_prog("(labels () (+ 536870910 1))", kOptOverflow,
+                                  heap),
+         "==", 0, __func__);
 }
 
-TEST(compile_cons) {
-  // (cons 10 20)
-  ASTNode *node =
-      list3(AST_new_atom("cons"), AST_new_fixnum(10), AST_new_fixnum(20));
-  int compile_result = AST_compile_entry(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // -> prologue
-  // 0:  48 89 fe                mov    rsi,rdi
-  // 3:  b8 28 00 00 00          mov    eax,0x28
-  // 8:  48 89 46 00             mov    QWORD PTR [rsi+0x0],rax
-  // c:  b8 50 00 00 00          mov    eax,0x50
-  // 11: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
-  // 15: 48 89 f0                mov    rax,rsi
-  // 18: 48 0d 01 00 00 00       or     rax,0x1
-  // 1e: 81 c6 10 00 00 00       add    esi,0x10
-  // 24: c3                      ret
-  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48, 0x89,
-                     0x46, 0x00, 0xb8, 0x50, 0x00, 0x00, 0x00, 0x48, 0x89, 0x46,
-                     0x08, 0x48, 0x89, 0xf0, 0x48, 0x0d, 0x01, 0x00, 0x00, 0x00,
-                     0x81, 0xc6, 0x10, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
-  cmp_ok(result, "==", (uintptr_t)heap | 0x1UL, __func__);
+TEST(unchecked_arithmetic_wraps) {
+  uint64_t result = Run_from_cstr("(- -536870912 1)", ctx, heap);
+  cmp_ok(result, "==", encodeImmediateFixnum(536870911), __func__);
 }
 
-TEST(compile_car) {
-  // (car (cons 10 20))
-  ASTNode *node =
-      list2(AST_new_atom("car"), list3(AST_new_atom("cons"), AST_new_fixnum(10),
-                                       AST_new_fixnum(20)));
-  int compile_result = AST_compile_entry(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // -> prologue
-  // 0:  48 89 fe                mov    rsi,rdi
-  // -> cons
-  // 3:  b8 28 00 00 00          mov    eax,0x28
-  // 8:  48 89 46 00             mov    QWORD PTR [rsi+0x0],rax
-  // c:  b8 50 00 00 00          mov    eax,0x50
-  // 11: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
-  // 15: 48 89 f0                mov    rax,rsi
-  // 18: 48 0d 01 00 00 00       or     rax,0x1
-  // 1e: 81 c6 10 00 00 00       add    esi,0x10
-  // -> car
-  // 24: 48 8b 40 ff             mov    rax,QWORD PTR [rax-0x1]
-  // 28: c3                      ret
-  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48,
-                     0x89, 0x46, 0x00, 0xb8, 0x50, 0x00, 0x00, 0x00, 0x48,
-                     0x89, 0x46, 0x08, 0x48, 0x89, 0xf0, 0x48, 0x0d, 0x01,
-                     0x00, 0x00, 0x00, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00,
-                     0x48, 0x8b, 0x40, 0xff, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
-  cmp_ok(result, "==", encodeImmediateFixnum(10), __func__);
+// Each of these evaluates to a fixnum. The strings are long enough for the
+// routines to take both their 16-byte and their word-sized steps.
+static const struct {
+  const char *expr;
+  int32_t expected;
+} kTestingSequences[] = {
+    {"(vector-length (make-vector 5 0))", 5},
+    {"(vector-length (make-vector 0 0))", 0},
+    {"(vector-ref (make-vector 3 7) 2)", 7},
+    {"(let ((v (make-vector 4 0)))"
+     "  (let ((w (vector-set! v 1 9))) (+ (vector-ref w 1) (vector-ref v 0))))",
+     9},
+    {"(vector-ref (vector-fill! (make-vector 7 1) 6) 6)", 6},
+    {"(let ((a (make-vector 5 2)) (b (make-vector 3 1)))"
+     "  (let ((c (vector-copy! a b)))"
+     "    (+ (vector-ref a 2) (+ (vector-ref a 3) (vector-length c)))))",
+     8},
+    {"(vector-ref (vector-copy! (make-vector 2 0) (make-vector 9 4)) 1)", 4},
+    {"(string-length (make-string 19 (integer->char 65)))", 19},
+    {"(let ((a (make-string 20 (integer->char 97)))"
+     "      (b (make-string 20 (integer->char 97))))"
+     "  (if (string=? a b) 1 0))",
+     1},
+    {"(let ((a (make-string 20 (integer->char 97)))"
+     "      (b (make-string 20 (integer->char 97))))"
+     "  (if (string=? a (string-set! b 17 (integer->char 98))) 1 0))",
+     0},
+    {"(if (string=? (make-string 3 (integer->char 97))"
+     "              (make-string 4 (integer->char 97))) 1 0)",
+     0},
+    // The padding after the third char differs.
+    {"(let ((a (string-fill! (make-string 3 (integer->char 120))"
+     "                       (integer->char 97))))"
+     "  (let ((b (make-string 3 (integer->char 97))))"
+     "    (if (string=? (string-set! a 2 (string-ref b 0)) b) 1 0)))",
+     1},
+    {"(let ((a (make-string 3 (integer->char 120))))"
+     "  (if (string=? (string-set! a 1 (integer->char 97))"
+     "                (make-string 3 (integer->char 120))) 1 0))",
+     0},
+    {"(if (string<? (make-string 2 (integer->char 97))"
+     "              (make-string 3 (integer->char 97))) 1 0)",
+     1},
+    {"(if (string<? (make-string 3 (integer->char 97))"
+     "              (make-string 3 (integer->char 97))) 1 0)",
+     0},
+    {"(if (string<? (make-string 3 (integer->char 98))"
+     "              (make-string 5 (integer->char 97))) 1 0)",
+     0},
+    {"(let ((a (make-string 40 (integer->char 65)))"
+     "      (b (make-string 40 (integer->char 65))))"
+     "  (if (string<? a (string-set! b 33 (integer->char 200))) 1 0))",
+     1},
+    // Indices and lengths computed from negative fixnums.
+    {"(let ((v (make-vector 3 7))) (vector-ref v (+ -1 2)))", 7},
+    {"(vector-length (make-vector (+ -1 3) 0))", 2},
+    {"(string-length (make-string (+ -1 3) (integer->char 65)))", 2},
+    {"(let ((i (- 1 2)))"
+     "  (let ((v (vector-set! (make-vector (+ i 4) 0) (+ i 3) 5)))"
+     "    (+ (vector-ref v (+ i 3)) (vector-length v))))",
+     8},
+    {"(let ((i (- 1 2)))"
+     "  (let ((s (string-set! (make-string (+ i 4) (integer->char 97))"
+     "                        (+ i 2) (integer->char 98))))"
+     "    (if (string<? (make-string 3 (integer->char 97)) s) 1 0)))",
+     1},
+};
+
+static void Testing_check_sequences(int options, uint64_t heap) {
+  for (size_t i = 0;
+       i < sizeof kTestingSequences / sizeof kTestingSequences[0]; i++) {
+    char prog[512];
+    snprintf(prog, sizeof prog, "(labels () %s)", kTestingSequences[i].expr);
+    Buffer buf;
+    int32_t len = Testing_compile_prog(prog, options, &buf);
+    ok(len > 0, "%s", kTestingSequences[i].expr);
+    if (len > 0) {
+      Buffer_make_executable(&buf);
+      cmp_ok(Testing_call_entry(&buf, heap), "==",
+             encodeImmediateFixnum(kTestingSequences[i].expected), "%s",
+             kTestingSequences[i].expr);
+    }
+    Buffer_deinit(&buf);
+  }
+}
+
+TEST(vector_and_string_primitives) {
+  (void)ctx;
+  Testing_check_sequences(kOptNone, heap);
+}
+
+TEST(vector_and_string_primitives_with_registers) {
+  (void)ctx;
+  Testing_check_sequences(kOptRegisters, heap);
 }
 
-TEST(compile_cdr) {
-  // (cdr (cons 10 20))
-  ASTNode *node =
-      list2(AST_new_atom("cdr"), list3(AST_new_atom("cons"), AST_new_fixnum(10),
-                                       AST_new_fixnum(20)));
-  int compile_result = AST_compile_entry(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // -> prologue
-  // 0:  48 89 fe                mov    rsi,rdi
-  // -> cons
-  // 3:  b8 28 00 00 00          mov    eax,0x28
-  // 8:  48 89 46 00             mov    QWORD PTR [rsi+0x0],rax
-  // c:  b8 50 00 00 00          mov    eax,0x50
-  // 11: 48 89 46 08             mov    QWORD PTR [rsi+0x8],rax
-  // 15: 48 89 f0                mov    rax,rsi
-  // 18: 48 0d 01 00 00 00       or     rax,0x1
-  // 1e: 81 c6 10 00 00 00       add    esi,0x10
-  // -> cdr
-  // 24: 48 8b 40 07             mov    rax,QWORD PTR [rax+0x7]
-  // 28: c3                      ret
-  byte expected[] = {0x48, 0x89, 0xfe, 0xb8, 0x28, 0x00, 0x00, 0x00, 0x48,
-                     0x89, 0x46, 0x00, 0xb8, 0x50, 0x00, 0x00, 0x00, 0x48,
-                     0x89, 0x46, 0x08, 0x48, 0x89, 0xf0, 0x48, 0x0d, 0x01,
-                     0x00, 0x00, 0x00, 0x81, 0xc6, 0x10, 0x00, 0x00, 0x00,
-                     0x48, 0x8b, 0x40, 0x07, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  uint64_t result = Testing_call_entry(ctx->writer->buf, heap);
-  cmp_ok(result, "==", encodeImmediateFixnum(20), __func__);
+TEST(ir_vector_and_string_primitives) {
+  (void)ctx;
+  Testing_check_sequences(kOptIR | kOptRegisters | kOptFold, heap);
 }
 
-TEST(compile_empty_labels) {
-  // (labels () 5)
-  ASTNode *prog = list3(AST_new_atom("labels"), nil, AST_new_fixnum(5));
-  int compile_result = AST_compile_prog(ctx, prog);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // jump 0x0; mov rsi, rdi; mov eax, imm(5); ret
-  byte expected[] = {0xe9, 0x00, 0x00, 0x00, 0x00,
-                     0x48, 0x89, 0xfe, 0xb8, encodeImmediateFixnum(5),
-                     0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+TEST(make_vector_allocates_from_rsi) {
+  uint64_t result = Run_from_cstr("(make-vector 3 (cons 1 2))", ctx, heap);
+  cmp_ok(result & kHeapObjectMask, "==", kVectorTag, __func__);
+  uint64_t *vector = (uint64_t *)(result - kVectorTag);
+  // The pair came first, then the header and three elements, padded to 16.
+  cmp_ok((uint64_t)vector, "==", heap + 2 * kWordSize, __func__);
+  cmp_ok(vector[0], "==", (3 << kHeaderShift) | kVectorHeaderTag, __func__);
+  cmp_ok(vector[3], "==", heap | kPairTag, __func__);
 }
 
-TEST(compile_code_with_no_params) {
-  // (code () 5)
-  ASTNode *node = list3(AST_new_atom("code"), nil, AST_new_fixnum(5));
-  int compile_result = AST_compile_function(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // mov eax, imm(5); ret
-  byte expected[] = {0xb8, encodeImmediateFixnum(5), 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+TEST(string_ref_makes_chars) {
+  uint64_t result = Run_from_cstr(
+      "(string-ref (string-set! (make-string 9 (integer->char 65)) 8"
+      "                         (integer->char 66))"
+      "            8)",
+      ctx, heap);
+  cmp_ok(result, "==", encodeImmediateChar('B'), __func__);
 }
 
-TEST(compile_code_with_params) {
-  // (code (x y) (+ x y))
-  ASTNode *node =
-      list3(AST_new_atom("code"), list2(AST_new_atom("x"), AST_new_atom("y")),
-            list3(AST_new_atom("+"), AST_new_atom("x"), AST_new_atom("y")));
-  int compile_result = AST_compile_function(ctx, node);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // -> Load formal (y) into a new temporary stack location (rsp-0x18)
-  // 0:  48 8b 44 24 f0          mov    rax,QWORD PTR [rsp-0x10]
-  // 5:  48 89 44 24 e8          mov    QWORD PTR [rsp-0x18],rax
-  // -> Load formal (x) into rax
-  // a:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
-  // -> add
-  // f:  48 03 44 24 e8          add    rax,QWORD PTR [rsp-0x18]
-  // 14: c3                      ret
-  byte expected[] = {0x48, 0x8b, 0x44, 0x24, 0xf0, 0x48, 0x89,
-                     0x44, 0x24, 0xe8, 0x48, 0x8b, 0x44, 0x24,
-                     0xf8, 0x48, 0x03, 0x44, 0x24, 0xe8, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+// The number of copies of the fill routine in the code compiled from `input',
+// found by its first instruction (movq xmm0, rax), which nothing else emits.
+static int Testing_count_fill_routines(char *input) {
+  static const byte kMovqXmm0Rax[] = {0x66, 0x48, 0x0f, 0x6e, 0xc0};
+  Buffer buf;
+  int32_t len = Testing_compile_prog(input, kOptNone, &buf);
+  ok(len > 0, __func__);
+  int count = 0;
+  for (int32_t i = 0; i + (int32_t)sizeof kMovqXmm0Rax <= len; i++) {
+    count += memcmp(Buffer_code(&buf) + i, kMovqXmm0Rax,
+                    sizeof kMovqXmm0Rax) == 0;
+  }
+  Buffer_deinit(&buf);
+  return count;
 }
 
-TEST(compile_label_with_no_param_and_no_labelcall) {
-  // (labels ((const (code () 6))) 5)
-  ASTNode *labels =
-      list1(list2(AST_new_atom("const"),
-                  list3(AST_new_atom("code"), nil, AST_new_fixnum(6))));
-  ASTNode *prog = list3(AST_new_atom("labels"), labels, AST_new_fixnum(5));
-  int compile_result = AST_compile_prog(ctx, prog);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // -> jump to body
-  // 0:  e9 06 00 00 00          jmp    0xb
-  // -> code for (code () 5)
-  // 5:  b8 18 00 00 00          mov    eax,0x18
-  // a:  c3                      ret
-  // -> body:
-  // b:  48 89 fe                mov    rsi,rdi
-  // e:  b8 14 00 00 00          mov    eax,0x14
-  // 13: c3                      ret
-  byte expected[] = {
-      0xe9, 0x06, 0x00, 0x00, 0x00, 0xb8, encodeImmediateFixnum(6), 0x00, 0x00,
-      0x00, 0xc3, 0x48, 0x89, 0xfe, 0xb8, encodeImmediateFixnum(5), 0x00, 0x00,
-      0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+TEST(routines_go_at_the_end_of_the_functions_that_call_them) {
+  (void)ctx;
+  cmp_ok(Testing_count_fill_routines("(labels () (cons 1 2))"), "==", 0,
+         __func__);
+  cmp_ok(Testing_count_fill_routines(
+             "(labels () (vector-ref (make-vector 2 (make-vector 2 0)) 0))"),
+         "==", 1, __func__);
+  cmp_ok(Testing_count_fill_routines(
+             "(labels ((f (code () (make-vector 2 0))))"
+             "  (vector-ref (make-vector 2 (labelcall f)) 0))"),
+         "==", 2, __func__);
 }
 
-TEST(compile_labelcall_with_undefined_name) {
-  ASTNode *prog =
-      list2(AST_new_atom("labelcall"), AST_new_atom("nonexistent-label"));
-  int compile_result = AST_compile_function(ctx, prog);
-  cmp_ok(compile_result, "==", -1, __func__);
+// Each round allocates a vector and a string of garbage, and keeps a new pair
+// in the vector it was passed.
+static char *kTestingSequenceChurn =
+    "(labels ((churn (code (n v s)"
+    "                (if (zero? n)"
+    "                    (+ (car (vector-ref v 2))"
+    "                       (if (string=? s"
+    "                                     (make-string 21 (integer->char 66)))"
+    "                           100 0))"
+    "                    (let ((junk (make-vector 9 n))"
+    "                          (chars (make-string 13 (integer->char 65))))"
+    "                      (labelcall churn (sub1 n)"
+    "                                 (vector-set! v 2"
+    "                                   (cons n (vector-ref junk 0)))"
+    "                                 s))))))"
+    "  (labelcall churn 500 (make-vector 3 0)"
+    "             (make-string 21 (integer->char 66))))";
+
+TEST(gc_copies_vectors_and_strings) {
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingSequenceChurn, ctx, 512, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(101), __func__);
+  cmp_ok(collections, ">", 10, __func__);
 }
 
-TEST(compile_labelcall_with_no_param) {
-  // (labels ((const (code () 5))) (labelcall const))
-  ASTNode *labels =
-      list1(list2(AST_new_atom("const"),
-                  list3(AST_new_atom("code"), nil, AST_new_fixnum(5))));
-  ASTNode *prog =
-      list3(AST_new_atom("labels"), labels,
-            list2(AST_new_atom("labelcall"), AST_new_atom("const")));
-  int compile_result = AST_compile_prog(ctx, prog);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // 0:  e9 06 00 00 00          jmp    0xb
-  // 5:  b8 14 00 00 00          mov    eax,0x14
-  // a:  c3                      ret
-  // b:  48 89 fe                mov    rsi,rdi
-  // e:  e8 f2 ff ff ff          call   0x5
-  // 13: c3                      ret
-  byte expected[] = {0xe9, 0x06, 0x00, 0x00, 0x00, 0xb8, 0x14,
-                     0x00, 0x00, 0x00, 0xc3, 0x48, 0x89, 0xfe,
-                     0xe8, 0xf2, 0xff, 0xff, 0xff, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+TEST(gc_copies_vectors_and_strings_with_registers) {
+  ctx->options |= kOptRegisters;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingSequenceChurn, ctx, 512, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(101), __func__);
+  cmp_ok(collections, ">", 10, __func__);
 }
 
-TEST(compile_labelcall_with_one_param) {
-  // (labels ((id (code (x) x))) (labelcall id 5))
-  ASTNode *labels = list1(list2(
-      AST_new_atom("id"), list3(AST_new_atom("code"), list1(AST_new_atom("x")),
-                                AST_new_atom("x"))));
-  ASTNode *prog = list3(
-      AST_new_atom("labels"), labels,
-      list3(AST_new_atom("labelcall"), AST_new_atom("id"), AST_new_fixnum(5)));
-  int compile_result = AST_compile_prog(ctx, prog);
-  cmp_ok(compile_result, "==", 0, __func__);
-  // 0:  e9 06 00 00 00          jmp    0xb
-  // 5:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
-  // a:  c3                      ret
-  // b:  48 89 fe                mov    rsi,rdi
-  // e:  b8 14 00 00 00          mov    eax,0x14
-  // 13: c3                      ret
-  byte expected[] = {0xe9, 0x06, 0x00, 0x00, 0x00, 0x48, 0x8b,
-                     0x44, 0x24, 0xf8, 0xc3, 0x48, 0x89, 0xfe,
-                     0xb8, 0x14, 0x00, 0x00, 0x00, 0xc3};
-  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-  Buffer_make_executable(ctx->writer->buf);
-  EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
+// A vector too big for the heap it is made in grows it.
+TEST(gc_grows_the_heap_for_a_big_vector) {
+  int collections;
+  uint64_t result = Testing_run_gc_prog(
+      "(labels () (car (vector-ref (make-vector 1000 (cons 5 6)) 999)))", ctx,
+      256, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(5), __func__);
+  cmp_ok(collections, "==", 1, __func__);
 }
 
-// TEST(compile_labelcall_with_two_params) {
-//   // (labels ((add (code (x y) (+ x y)))) (labelcall add 3 4))
-//   ASTNode *body =
-//       list3(AST_new_atom("+"), AST_new_atom("x"), AST_new_atom("y"));
-//   ASTNode *labels =
-//       list1(list2(AST_new_atom("id"),
-//                   list3(AST_new_atom("code"),
-//                         list2(AST_new_atom("x"), AST_new_atom("y")), body)));
-//   ASTNode *prog = list3(AST_new_atom("labels"), labels, AST_new_fixnum(5));
-//   int compile_result = AST_compile_prog(ctx, prog);
-//   cmp_ok(compile_result, "==", 0, __func__);
-//   // 0:  e9 06 00 00 00          jmp    0xb
-//   // 5:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
-//   // a:  c3                      ret
-//   // b:  48 89 fe                mov    rsi,rdi
-//   // e:  b8 14 00 00 00          mov    eax,0x14
-//   // 13: c3                      ret
-//   byte expected[] = {0xe9, 0x06, 0x00, 0x00, 0x00, 0x48, 0x8b,
-//                      0x44, 0x24, 0xf8, 0xc3, 0x48, 0x89, 0xfe,
-//                      0xb8, 0x14, 0x00, 0x00, 0x00, 0xc3};
-//   EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
-//   Buffer_make_executable(ctx->writer->buf);
-//   EXPECT_CALL_EQUALS(ctx->writer->buf, encodeImmediateFixnum(5));
-// }
+// Each of these evaluates to a fixnum. Some of the closures are only ever
+// called and so are compiled as functions; the rest are made on the heap.
+static const struct {
+  const char *prog;
+  int32_t expected;
+} kTestingClosures[] = {
+    {"(labels () (let ((y 5)) (let ((f (lambda (x) (+ x y)))) (funcall f 3))))",
+     8},
+    {"(labels () (let ((y 5)) (let ((f (lambda (x) (+ x y))))"
+     "  (+ (funcall f 1) (funcall f 2)))))",
+     13},
+    {"(labels () (funcall (lambda (a b) (- a b)) 9 4))", 5},
+    {"(labels ((apply (code (f x) (funcall f x))))"
+     "  (let ((y 5)) (labelcall apply (lambda (x) (+ x y)) 10)))",
+     15},
+    {"(labels ((adder (code (n) (lambda (x) (+ x n)))))"
+     "  (funcall (labelcall adder 3) 4))",
+     7},
+    // The inner closure gets one free variable from g's formals and one that
+    // g was passed.
+    {"(labels () (let ((a 1) (b 2))"
+     "  (let ((g (lambda (x) (lambda (y) (+ x (+ y b))))))"
+     "    (funcall (funcall g 10) 100))))",
+     112},
+    {"(labels () (let ((k 7)) (let ((p (cons (lambda () k) 0)))"
+     "  (funcall (car p)))))",
+     7},
+    {"(labels ((twice (code (f x) (funcall f (funcall f x)))))"
+     "  (labelcall twice (lambda (x) (add1 x)) 5))",
+     7},
+    // The y that f sees is not the one its caller does.
+    {"(labels () (let ((y 1)) (let ((f (lambda () y)) (y 2))"
+     "  (+ y (funcall f)))))",
+     3},
+    {"(labels () (let ((f (lambda (x) (add1 x))))"
+     "  (let ((f (lambda (x) (funcall f (funcall f x))))) (funcall f 0))))",
+     2},
+    // A million calls through a closure, all of them in tail position.
+    {"(labels ((count (code (self n)"
+     "                  (if (zero? n) 42 (funcall self self (sub1 n))))))"
+     "  (labelcall count (lambda (s n) (labelcall count s n)) 1000000))",
+     42},
+};
+
+static void Testing_check_closures(int options, uint64_t heap) {
+  for (size_t i = 0; i < sizeof kTestingClosures / sizeof kTestingClosures[0];
+       i++) {
+    Buffer buf;
+    int32_t len = Testing_compile_prog((char *)kTestingClosures[i].prog,
+                                       options, &buf);
+    ok(len > 0, "%s", kTestingClosures[i].prog);
+    if (len > 0) {
+      Buffer_make_executable(&buf);
+      cmp_ok(Testing_call_entry(&buf, heap), "==",
+             encodeImmediateFixnum(kTestingClosures[i].expected), "%s",
+             kTestingClosures[i].prog);
+    }
+    Buffer_deinit(&buf);
+  }
+}
 
-TEST(read_with_number_returns_fixnum) {
+TEST(closures) {
   (void)ctx;
-  char *input = "1234";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kFixnum);
-  cmp_ok(output->value.fixnum, "==", 1234);
+  Testing_check_closures(kOptNone, heap);
 }
 
-TEST(read_with_leading_whitespace_ignores_whitespace) {
+TEST(closures_with_registers) {
   (void)ctx;
-  char *input = "  \t \n 1234";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kFixnum);
-  cmp_ok(output->value.fixnum, "==", 1234);
+  Testing_check_closures(kOptRegisters, heap);
 }
 
-TEST(read_with_atom_returns_atom) {
+TEST(closures_with_ir_fold_and_inline) {
   (void)ctx;
-  char *input = "hello";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kAtom);
-  ok(AST_atom_equals_cstr(output, "hello"));
+  Testing_check_closures(kOptIR | kOptRegisters | kOptFold | kOptInline,
+                         heap);
 }
 
-TEST(read_with_nil_returns_nil) {
-  (void)ctx;
-  char *input = "()";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kCons);
-  ok(output == nil);
+TEST(lambda_makes_a_closure_on_the_heap) {
+  uint64_t result =
+      Run_from_cstr("(let ((y 5)) (let ((f (lambda (x) (+ x y)))) (cons f 0)))",
+                    ctx, heap);
+  uint64_t *pair = (uint64_t *)(result - kPairTag);
+  // The header, the code and y, padded to 16.
+  cmp_ok((uint64_t)pair, "==", heap + 4 * kWordSize, __func__);
+  cmp_ok(pair[0], "==", heap | kClosureTag, __func__);
+  uint64_t *closure = (uint64_t *)heap;
+  cmp_ok(closure[0], "==", (1 << kHeaderShift) | kClosureHeaderTag, __func__);
+  cmp_ok(closure[2], "==", encodeImmediateFixnum(5), __func__);
 }
 
-TEST(read_with_list_returns_list) {
+TEST(closures_that_are_only_called_are_not_made) {
+  uint64_t result = Run_from_cstr(
+      "(let ((y 5)) (let ((f (lambda (x) (+ x y)))) (cons (funcall f 1) 0)))",
+      ctx, heap);
+  cmp_ok(result, "==", heap | kPairTag, __func__);
+  cmp_ok(((uint64_t *)heap)[0], "==", encodeImmediateFixnum(6), __func__);
+}
+
+// Each round makes a closure over a pair that holds the running total, and
+// garbage to make the collector run while the closures are live.
+static char *kTestingClosureChurn =
+    "(labels ((churn (code (n f)"
+    "                (if (zero? n)"
+    "                    (funcall f 0)"
+    "                    (let ((junk (make-vector 5 n)))"
+    "                      (labelcall churn (sub1 n)"
+    "                        (let ((p (cons (+ n (funcall f 0)) junk)))"
+    "                          (lambda (x) (+ x (car p))))))))))"
+    "  (labelcall churn 300 (lambda (x) x)))";
+
+// A program of `n' functions that each make a closure and pass it on, so
+// that the threads of a parallel compile all compile lambdas at once. It
+// evaluates to n, and makes n - 1 closures of 32 bytes each.
+static char *Testing_closure_chain_prog(int n) {
+  size_t size = 128 + (size_t)n * 96;
+  char *prog = malloc(size);
+  assert(prog != NULL);
+  size_t len = snprintf(prog, size,
+                        "(labels ((apply (code (f x) (funcall f x)))"
+                        " (f0 (code (x) x))");
+  for (int i = 1; i < n; i++) {
+    len += snprintf(prog + len, size - len,
+                    " (f%d (code (x) (labelcall apply"
+                    " (lambda (y) (+ y x)) (labelcall f%d x))))",
+                    i, i - 1);
+  }
+  snprintf(prog + len, size - len, ") (labelcall f%d 1))", n - 1);
+  return prog;
+}
+
+TEST(parallel_labels_compile_closures) {
+  // As many as fit in the test heap.
+  char *prog = Testing_closure_chain_prog(24);
+  Testing_parallel_labels_match(prog, 24, ctx->options, heap);
+  Testing_parallel_labels_match(prog, 24, ctx->options | kOptRegisters,
+                                heap);
+  free(prog);
+}
+
+TEST(gc_copies_closures) {
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingClosureChurn, ctx, 512, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(45150), __func__);
+  cmp_ok(collections, ">", 10, __func__);
+}
+
+TEST(gc_copies_closures_with_registers) {
+  ctx->options |= kOptRegisters;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingClosureChurn, ctx, 512, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(45150), __func__);
+  cmp_ok(collections, ">", 10, __func__);
+}
+
+TEST(peephole_drops_reloads_and_dead_moves) {
+  ctx->writer->peephole = true;
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, -kWordSize);
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, -kWordSize);
+  Buffer_mov_stack_to_reg(ctx->writer, kRcx, -kWordSize);
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRcx);
+  Buffer_load_reg_imm32(ctx->writer, kRdx, 1);
+  Buffer_load_reg_imm32(ctx->writer, kRdx, 2);
+  // 0:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 5:  48 89 c1                mov    rcx,rax
+  // 8:  ba 02 00 00 00          mov    edx,0x2
+  byte expected[] = {0x48, 0x89, 0x44, 0x24, 0xf8, 0x48, 0x89,
+                     0xc1, 0xba, 0x02, 0x00, 0x00, 0x00};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(peephole_folds_immediates) {
+  ctx->writer->peephole = true;
+  Buffer_mov_reg_reg(ctx->writer, /*dst=*/kRax, /*src=*/kRsi);
+  Buffer_or_reg_imm32(ctx->writer, kRax, kPairTag);
+  Buffer_shl_reg(ctx->writer, kRax, kCharShift - kFixnumShift);
+  Buffer_or_reg_imm32(ctx->writer, kRax, kCharTag);
+  Buffer_add_reg_imm32(ctx->writer, kRax, 4);
+  Buffer_sub_reg_imm32(ctx->writer, kRax, 12);
+  Buffer_add_reg_imm32(ctx->writer, kRsi, 16);
+  Buffer_sub_reg_imm32(ctx->writer, kRsi, 16);
+  // 0:  48 8d 46 01             lea    rax,[rsi+0x1]
+  // 4:  48 c1 e0 06             shl    rax,0x6
+  // 8:  0c 0f                   or     al,0xf
+  // a:  83 c0 f8                add    eax,0xfffffff8
+  byte expected[] = {0x48, 0x8d, 0x46, 0x01, 0x48, 0xc1, 0xe0,
+                     0x06, 0x0c, 0x0f, 0x83, 0xc0, 0xf8};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(peephole_stops_at_labels) {
+  ctx->writer->peephole = true;
+  Buffer_mov_reg_to_stack(ctx->writer, kRax, -kWordSize);
+  BufferWriter_bind_label(ctx->writer, BufferWriter_new_label(ctx->writer));
+  Buffer_mov_stack_to_reg(ctx->writer, kRax, -kWordSize);
+  // 0:  48 89 44 24 f8          mov    QWORD PTR [rsp-0x8],rax
+  // 5:  48 8b 44 24 f8          mov    rax,QWORD PTR [rsp-0x8]
+  byte expected[] = {0x48, 0x89, 0x44, 0x24, 0xf8,
+                     0x48, 0x8b, 0x44, 0x24, 0xf8};
+  EXPECT_EQUALS_BYTES(ctx->writer->buf, expected);
+  cmp_ok(BufferWriter_get_pos(ctx->writer), "==", sizeof expected, __func__);
+}
+
+TEST(peephole_makes_shorter_code_that_does_the_same) {
   (void)ctx;
-  char *input = "(1 2 3)";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kCons);
-  ASTNode *elt = AST_car(output);
-  cmp_ok(elt->type, "==", kFixnum);
-  cmp_ok(elt->value.fixnum, "==", 1);
-  elt = AST_car(AST_cdr(output));
-  cmp_ok(elt->type, "==", kFixnum);
-  cmp_ok(elt->value.fixnum, "==", 2);
-  elt = AST_car(AST_cdr(AST_cdr(output)));
-  cmp_ok(elt->type, "==", kFixnum);
-  cmp_ok(elt->value.fixnum, "==", 3);
+  char *prog = "(labels ((f (code (x) (let ((y (add1 (add1 x))))"
+               "                       (cons (integer->char 65) y)))))"
+               "  (cdr (labelcall f 1)))";
+  Buffer plain;
+  int32_t plain_len = Testing_compile_prog(prog, kOptNone, &plain);
+  Buffer tidied;
+  int32_t tidied_len = Testing_compile_prog(prog, kOptPeephole, &tidied);
+  ok(plain_len > 0 && tidied_len > 0, __func__);
+  cmp_ok(tidied_len, "<", plain_len, __func__);
+  if (plain_len > 0 && tidied_len > 0) {
+    Buffer_make_executable(&plain);
+    Buffer_make_executable(&tidied);
+    cmp_ok(Testing_call_entry(&plain, heap), "==", encodeImmediateFixnum(3),
+           __func__);
+    cmp_ok(Testing_call_entry(&tidied, heap), "==", encodeImmediateFixnum(3),
+           __func__);
+  }
+  Buffer_deinit(&plain);
+  Buffer_deinit(&tidied);
 }
 
-TEST(read_with_nested_list_returns_list) {
+TEST(peephole_programs) {
   (void)ctx;
-  char *input = "((hello world) (foo bar))";
-  ASTNode *output = Reader_read(input);
-  assert(output != NULL);
-  cmp_ok(output->type, "==", kCons);
-  ASTNode *elt = AST_car(output);
-  cmp_ok(elt->type, "==", kCons);
-  ok(AST_atom_equals_cstr(AST_car(elt), "hello"));
-  ok(AST_atom_equals_cstr(AST_car(AST_cdr(elt)), "world"));
-  elt = AST_car(AST_cdr(output));
-  cmp_ok(elt->type, "==", kCons);
-  ok(AST_atom_equals_cstr(AST_car(elt), "foo"));
-  ok(AST_atom_equals_cstr(AST_car(AST_cdr(elt)), "bar"));
+  Testing_check_arithmetic(kOptPeephole, heap);
+  Testing_check_sequences(kOptPeephole | kOptRegisters, heap);
+  Testing_check_closures(kOptPeephole, heap);
+  Testing_check_closures(kOptPeephole | kOptIR | kOptRegisters | kOptFold,
+                         heap);
 }
 
-TEST(compile_with_read) {
-  uint64_t result = Run_from_cstr("(let ((x 2) (y 3)) (+ x y))", ctx, heap);
-  cmp_ok(result, "==", encodeImmediateFixnum(5), __func__);
+TEST(gc_with_peephole) {
+  ctx->options |= kOptPeephole | kOptRegisters;
+  int collections;
+  uint64_t result =
+      Testing_run_gc_prog(kTestingClosureChurn, ctx, 512, &collections);
+  cmp_ok(result, "==", encodeImmediateFixnum(45150), __func__);
+  cmp_ok(collections, ">", 10, __func__);
 }
 
 int run_tests() {
@@ -1729,6 +12818,9 @@ int run_tests() {
   run_test(test_mov_rax_rax);
   run_test(test_mov_rax_rsi);
   run_test(test_mov_rdi_rbp);
+  run_test(test_load_zero_uses_xor);
+  run_test(test_alu_uses_imm8_when_it_fits);
+  run_test(test_displacements_use_the_shortest_form);
   run_test(test_compile_fixnum);
   run_test(test_compile_primcall_add1);
   run_test(test_compile_primcall_sub1);
@@ -1757,16 +12849,532 @@ int run_tests() {
   run_test(test_compile_labelcall_with_undefined_name);
   run_test(test_compile_labelcall_with_no_param);
   run_test(test_compile_labelcall_with_one_param);
+  run_test(test_compile_labelcall_from_let_adjusts_rsp);
+  run_test(test_buffer_grows_past_initial_capacity);
+  run_test(test_labels_still_link_after_buffer_grows);
+  run_test(test_relax_uses_short_forms_for_near_jumps);
+  run_test(test_relax_keeps_rel32_for_far_jumps);
+  run_test(test_relax_shortens_jumps_that_only_fit_once_others_do);
+  run_test(test_relax_handles_backward_jumps);
   run_test(test_read_with_number_returns_fixnum);
   run_test(test_read_with_leading_whitespace_ignores_whitespace);
   run_test(test_read_with_atom_returns_atom);
   run_test(test_read_with_nil_returns_nil);
   run_test(test_read_with_list_returns_list);
   run_test(test_read_with_nested_list_returns_list);
+  run_test(test_arena_allocations_are_aligned_and_distinct);
+  run_test(test_read_allocates_nodes_in_arena);
+  run_test(test_intern_returns_same_symbol_for_same_name);
+  run_test(test_intern_keeps_builtin_ids);
+  run_test(test_intern_survives_table_growth);
+  run_test(test_intern_is_shared_between_threads);
+  run_test(test_read_interns_atoms);
+  run_test(test_compile_registered_primitive);
+  run_test(test_compile_primcall_with_wrong_arity);
+  run_test(test_compile_unknown_primitive);
+  run_test(test_read_atom_with_punctuation_and_digits);
+  run_test(test_read_long_atom_is_not_truncated);
+  run_test(test_read_negative_number);
+  run_test(test_read_multiple_forms_one_at_a_time);
+  run_test(test_read_reports_errors);
+  run_test(test_read_numbers_at_the_fixnum_bounds);
+  run_test(test_read_long_list_without_recursion);
+  run_test(test_read_deeply_nested_list_without_recursion);
+  run_test(test_read_from_stream_across_refills);
+  run_test(test_read_from_mapped_file);
   run_test(test_compile_with_read);
+  run_test(test_add_rax_rcx);
+  run_test(test_let_and_plus_keep_values_in_registers);
+  run_test(test_labelcall_passes_register_args_through_stack);
+  run_test(test_registers_spill_past_the_pool);
+  run_test(test_registers_survive_labelcall);
+  run_test(test_registers_survive_labelcall_in_argument);
+  run_test(test_registers_hold_formals_across_recursion);
+  run_test(test_ir_lowers_let_to_three_address_code);
+  run_test(test_ir_lowers_if_to_blocks);
+  run_test(test_ir_refuses_unknown_primitives);
+  run_test(test_ir_allocates_registers_and_keeps_temporaries_in_rax);
+  run_test(test_ir_spills_under_register_pressure);
+  run_test(test_ir_compiles_conditionals);
+  run_test(test_ir_compiles_pairs);
+  run_test(test_ir_keeps_values_in_slots_across_labelcall);
+  run_test(test_ir_evaluates_labelcall_arguments_before_storing_them);
+  run_test(test_ir_compiles_recursion);
+  run_test(test_ir_falls_back_per_function);
+  run_test(test_fold_add_four_ints);
+  run_test(test_fold_prunes_if_with_constant_test);
+  run_test(test_fold_propagates_let_constants);
+  run_test(test_fold_keeps_bindings_computed_at_run_time);
+  run_test(test_fold_respects_shadowing);
+  run_test(test_fold_leaves_embedder_forms_alone);
+  run_test(test_fold_makes_chars_and_bools);
+  run_test(test_fold_leaves_overflow_to_run_time);
+  run_test(test_if_branches_on_registered_predicate);
+  run_test(test_registered_predicate_as_value_makes_bool);
+  run_test(test_if_on_non_predicate_tests_against_false);
+  run_test(test_ir_compares_predicates_used_as_values);
+  run_test(test_tail_labelcall_runs_in_constant_stack);
+  run_test(test_tail_labelcall_runs_in_constant_stack_with_registers);
+  run_test(test_ir_tail_call_runs_in_constant_stack);
+  run_test(test_tail_labelcall_rotates_arguments);
+  run_test(test_tail_labelcall_rotates_arguments_with_registers);
+  run_test(test_ir_tail_call_rotates_arguments);
+  run_test(test_tail_labelcall_from_let_moves_arguments_up);
+  run_test(test_labelcall_in_argument_position_is_not_a_tail_call);
+  run_test(test_ir_lowers_labelcall_in_tail_position);
+  run_test(test_ir_joins_if_arms_used_as_values);
+  run_test(test_nested_cons_keeps_its_car);
+  run_test(test_gc_coalesces_heap_checks);
+  run_test(test_gc_checks_pairs_whose_halves_call_labels);
+  run_test(test_gc_collects_garbage);
+  run_test(test_gc_collects_garbage_with_registers);
+  run_test(test_ir_gc_collects_garbage);
+  run_test(test_gc_grows_the_heap_to_fit_live_data);
+  run_test(test_gc_grows_the_heap_to_fit_live_data_with_registers);
+  run_test(test_ir_gc_grows_the_heap_to_fit_live_data);
+  run_test(test_gc_updates_roots_in_every_frame);
+  run_test(test_gc_updates_roots_in_every_frame_with_registers);
+  run_test(test_ir_gc_updates_roots_in_every_frame);
+  run_test(test_let_frame_past_disp8);
+  run_test(test_let_frame_past_disp8_with_registers);
+  run_test(test_ir_let_frame_past_disp8);
+  run_test(test_labelcall_with_arguments_past_disp8);
+  run_test(test_ir_labelcall_with_arguments_past_disp8);
+  run_test(test_code_cache_hit_returns_the_compiled_code);
+  run_test(test_code_cache_keys_on_options);
+  run_test(test_code_cache_runs_programs);
+  run_test(test_code_cache_does_not_keep_failed_compiles);
+  run_test(test_code_cache_evicts_least_recently_used);
+  run_test(test_code_cache_entry_outlives_eviction_while_held);
+  run_test(test_code_cache_is_shared_between_threads);
+  run_test(test_elf_executable_writes_the_result);
+  run_test(test_ir_elf_executable_writes_the_result);
+  run_test(test_elf_object_exports_the_entry_and_labels);
+  run_test(test_elf_rejects_gc_code);
+  run_test(test_code_cache_file_round_trips);
+  run_test(test_code_cache_file_keeps_stack_maps);
+  run_test(test_code_cache_file_from_another_build_is_ignored);
+  run_test(test_code_cache_file_with_changed_source_is_rejected);
+  run_test(test_parallel_labels_compile_the_same_code);
+  run_test(test_ir_parallel_labels_compile_the_same_code);
+  run_test(test_parallel_labels_report_errors);
+  run_test(test_parallel_labels_keep_stack_maps);
+  run_test(test_ir_parallel_labels_keep_stack_maps);
+  run_test(test_gc_runs_one_program_on_many_threads);
+  run_test(test_dual_buffer_runs_code_as_it_is_written);
+  run_test(test_dual_buffer_grows);
+  run_test(test_dual_buffer_keeps_code_in_place_as_it_grows);
+  run_test(test_dual_buffer_runs_programs);
+  run_test(test_module_calls_labels_added_earlier);
+  run_test(test_module_leaves_compiled_code_alone);
+  run_test(test_module_redefinition_hides_the_old_label);
+  run_test(test_module_drops_what_does_not_compile);
+  run_test(test_module_collects_garbage);
+  run_test(test_stats_are_off_by_default);
+  run_test(test_stats_record_reading_and_compiling);
+  run_test(test_stats_snapshot_can_reset);
+  run_test(test_stats_count_folded_nodes);
+  run_test(test_stats_add_up_parallel_labels);
+  run_test(test_stats_count_heap_bytes_across_collections);
+  run_test(test_jit_perf_map_names_each_function);
+  run_test(test_jit_dump_records_each_function);
+  run_test(test_jit_gdb_registration_describes_the_code);
+  run_test(test_profile_counts_entries_and_arms);
+  run_test(test_profile_counts_with_registers);
+  run_test(test_profile_turns_off_ir);
+  run_test(test_profile_counts_tail_arms);
+  run_test(test_profile_reports_running_out_of_counters);
+  run_test(test_profile_needs_a_profile);
+  run_test(test_elf_rejects_profiled_code);
+  run_test(test_inline_replaces_small_calls);
+  run_test(test_inline_exposes_constants_to_folding);
+  run_test(test_inline_inlines_into_functions_in_order);
+  run_test(test_inline_keeps_arguments_from_capture);
+  run_test(test_inline_leaves_recursive_and_big_functions);
+  run_test(test_inline_leaves_bodies_with_free_variables);
+  run_test(test_inline_leaves_programs_that_rebind_a_label);
+  run_test(test_inline_goes_by_the_profile);
+  run_test(test_compile_minus);
+  run_test(test_compile_times_untags_one_operand);
+  run_test(test_compile_less_compares_tagged_values);
+  run_test(test_arithmetic_primitives);
+  run_test(test_arithmetic_primitives_with_registers);
+  run_test(test_arithmetic_primitives_with_overflow_checks);
+  run_test(test_ir_arithmetic_primitives);
+  run_test(test_comparisons_as_values_make_bools);
+  run_test(test_arithmetic_primitives_in_a_loop);
+  run_test(test_fold_arithmetic_primitives);
+  run_test(test_overflow_checks_trap);
+  run_test(test_unchecked_arithmetic_wraps);
+  run_test(test_vector_and_string_primitives);
+  run_test(test_vector_and_string_primitives_with_registers);
+  run_test(test_ir_vector_and_string_primitives);
+  run_test(test_make_vector_allocates_from_rsi);
+  run_test(test_string_ref_makes_chars);
+  run_test(test_routines_go_at_the_end_of_the_functions_that_call_them);
+  run_test(test_gc_copies_vectors_and_strings);
+  run_test(test_gc_copies_vectors_and_strings_with_registers);
+  run_test(test_gc_grows_the_heap_for_a_big_vector);
+  run_test(test_closures);
+  run_test(test_closures_with_registers);
+  run_test(test_closures_with_ir_fold_and_inline);
+  run_test(test_lambda_makes_a_closure_on_the_heap);
+  run_test(test_closures_that_are_only_called_are_not_made);
+  run_test(test_gc_copies_closures);
+  run_test(test_gc_copies_closures_with_registers);
+  run_test(test_parallel_labels_compile_closures);
+  run_test(test_peephole_drops_reloads_and_dead_moves);
+  run_test(test_peephole_folds_immediates);
+  run_test(test_peephole_stops_at_labels);
+  run_test(test_peephole_makes_shorter_code_that_does_the_same);
+  run_test(test_peephole_programs);
+  run_test(test_gc_with_peephole);
   done_testing();
 }
 
 // End Testing
 
-int main() { return run_tests(); }
+// Benchmarks
+
+// `make bench' times reading, compiling and running a set of workloads under
+// each of a few option combinations, on an optimized build. Each workload is
+// generated rather than checked in, and each measurement is the fastest of
+// kBenchRepeats tries. The results are printed one JSON object per line, so
+// that runs of two versions can be diffed or compared with a script.
+
+static const int kBenchRepeats = 5;
+// For workloads that allocate without kOptGC; nothing is ever freed.
+static const size_t kBenchHeapSize = 64 * 1024 * 1024;
+// Each space of the Heap with kOptGC, small enough that cons_list collects.
+static const size_t kBenchSpaceSize = 64 * 1024;
+
+typedef struct {
+  const char *name;
+  int options;
+} BenchConfig;
+
+static const BenchConfig kBenchConfigs[] = {
+    {"plain", kOptNone},
+    {"registers", kOptRegisters},
+    {"ir", kOptIR | kOptRegisters | kOptFold},
+    {"parallel", kOptParallel},
+    {"gc", kOptGC},
+    {"overflow", kOptOverflow},
+    {"peephole", kOptPeephole},
+};
+
+typedef struct {
+  const char *name;
+  // Return a new program for the workload, for the caller to free.
+  char *(*generate)(void);
+  int64_t expected;
+} BenchWorkload;
+
+// A string that grows as it is printed to.
+typedef struct {
+  char *chars;
+  size_t len;
+  size_t capacity;
+} BenchString;
+
+static void BenchString_init(BenchString *str) {
+  *str = (BenchString){.capacity = 1024};
+  str->chars = malloc(str->capacity);
+  assert(str->chars != NULL);
+  str->chars[0] = '\0';
+}
+
+static void BenchString_printf(BenchString *str, const char *fmt, ...) {
+  while (true) {
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(str->chars + str->len, str->capacity - str->len,
+                            fmt, args);
+    va_end(args);
+    assert(written >= 0);
+    if (str->len + written < str->capacity) {
+      str->len += written;
+      return;
+    }
+    str->capacity *= 2;
+    str->chars = realloc(str->chars, str->capacity);
+    assert(str->chars != NULL);
+  }
+}
+
+enum { kBenchLetDepth = 500 };
+
+// (let ((x0 0)) (let ((x1 (add1 x0))) ... xN))
+static char *Bench_deep_let(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str, "(let ((x0 0)) ");
+  for (int i = 1; i <= kBenchLetDepth; i++) {
+    BenchString_printf(&str, "(let ((x%d (add1 x%d))) ", i, i - 1);
+  }
+  BenchString_printf(&str, "x%d", kBenchLetDepth);
+  for (int i = 0; i <= kBenchLetDepth; i++) {
+    BenchString_printf(&str, ")");
+  }
+  return str.chars;
+}
+
+enum { kBenchNumLabels = 2000 };
+
+// A chain of functions, each adding one to what the one before it returns.
+static char *Bench_many_labels(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str, "(labels ((f0 (code (x) (add1 x)))");
+  for (int i = 1; i < kBenchNumLabels; i++) {
+    BenchString_printf(&str, " (f%d (code (x) (add1 (labelcall f%d x))))", i,
+                       i - 1);
+  }
+  BenchString_printf(&str, ") (labelcall f%d 0))", kBenchNumLabels - 1);
+  return str.chars;
+}
+
+enum { kBenchListLength = 10000 };
+
+// Build a list and add it up.
+static char *Bench_cons_list(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str,
+                     "(labels ((build (code (n acc) (if (zero? n) acc"
+                     " (labelcall build (sub1 n) (cons n acc)))))"
+                     " (sum (code (l n acc) (if (zero? n) acc"
+                     " (labelcall sum (cdr l) (sub1 n) (+ acc (car l)))))))"
+                     " (labelcall sum (labelcall build %d 0) %d 0))",
+                     kBenchListLength, kBenchListLength);
+  return str.chars;
+}
+
+enum { kBenchLoopCount = 1000000 };
+
+// Count up in a loop written as tail recursion.
+static char *Bench_loop(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str,
+                     "(labels ((count (code (n acc) (if (zero? n) acc"
+                     " (labelcall count (sub1 n) (add1 acc))))))"
+                     " (labelcall count %d 0))",
+                     kBenchLoopCount);
+  return str.chars;
+}
+
+// Add up 3n mod 7 in a loop, with the arithmetic primitives.
+static char *Bench_arith(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str,
+                     "(labels ((sum (code (n acc) (if (= n 0) acc"
+                     " (labelcall sum (- n 1)"
+                     " (+ acc (remainder (* n 3) 7)))))))"
+                     " (labelcall sum %d 0))",
+                     kBenchLoopCount);
+  return str.chars;
+}
+
+enum { kBenchStringLength = 4096, kBenchStringRounds = 10000 };
+
+// Fill a string and compare it with another over and over, which is all
+// routine calls.
+static char *Bench_strings(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str,
+                     "(labels ((cmp (code (n a b acc) (if (zero? n) acc"
+                     " (labelcall cmp (sub1 n) a"
+                     " (string-fill! b (integer->char 97))"
+                     " (if (string=? a b) (add1 acc) acc))))))"
+                     " (labelcall cmp %d (make-string %d (integer->char 97))"
+                     " (make-string %d (integer->char 98)) 0))",
+                     kBenchStringRounds, kBenchStringLength,
+                     kBenchStringLength);
+  return str.chars;
+}
+
+// Call a closure over one of the loop's variables on each round. It is only
+// ever called, so it is never made.
+static char *Bench_closures(void) {
+  BenchString str;
+  BenchString_init(&str);
+  BenchString_printf(&str,
+                     "(labels ((sum (code (n d acc) (if (zero? n) acc"
+                     " (let ((step (lambda (x) (+ x d))))"
+                     " (labelcall sum (sub1 n) d (funcall step acc)))))))"
+                     " (labelcall sum %d 3 0))",
+                     kBenchLoopCount);
+  return str.chars;
+}
+
+static const BenchWorkload kBenchWorkloads[] = {
+    {"deep_let", Bench_deep_let, kBenchLetDepth},
+    {"many_labels", Bench_many_labels, kBenchNumLabels},
+    {"cons_list", Bench_cons_list,
+     (int64_t)kBenchListLength * (kBenchListLength + 1) / 2},
+    {"loop", Bench_loop, kBenchLoopCount},
+    // kBenchLoopCount is one more than a multiple of 7: every 7 terms add up
+    // to 21, and the one left over is 3.
+    {"arith", Bench_arith, 3 * kBenchLoopCount},
+    {"strings", Bench_strings, kBenchStringRounds},
+    {"closures", Bench_closures, 3 * kBenchLoopCount},
+};
+
+static int64_t Bench_count_nodes(ASTNode *node) {
+  int64_t count = 1;
+  for (; node->type == kCons && node != nil; node = AST_cdr(node)) {
+    count += Bench_count_nodes(AST_car(node));
+    count++;
+  }
+  return count;
+}
+
+typedef struct {
+  int64_t nodes;
+  int64_t read_ns;
+  int64_t compile_ns;
+  size_t code_bytes;
+  int64_t run_ns;
+  uint64_t result;
+} BenchResult;
+
+// Compile `source' under `options' into `buf' and `maps', and add the time it
+// took to *ns.
+static int Bench_compile(char *source, int options, Buffer *buf,
+                         StackMaps *maps, BenchResult *result) {
+  Arena arena;
+  Arena_init(&arena);
+  int64_t start = Stats_now();
+  ASTNode *node = Reader_read(&arena, source);
+  int64_t read_ns = Stats_now() - start;
+  if (node == NULL) {
+    Arena_deinit(&arena);
+    return -1;
+  }
+  result->nodes = Bench_count_nodes(node);
+  Buffer_init(buf, 1);
+  BufferWriter writer;
+  BufferWriter_init(&writer, buf);
+  StackMaps_init(maps);
+  CompilerContext ctx;
+  CompilerContext_init(&ctx, &writer, &arena, /*labels=*/NULL,
+                       /*locals=*/NULL);
+  ctx.options = options;
+  if (options & kOptGC) {
+    ctx.stack_maps = maps;
+  }
+  start = Stats_now();
+  int compile_result = AST_is_labels_form(node) ? AST_compile_prog(&ctx, node)
+                                                : AST_compile_entry(&ctx, node);
+  int64_t compile_ns = Stats_now() - start;
+  result->code_bytes = writer.pos;
+  BufferWriter_deinit(&writer);
+  Arena_deinit(&arena);
+  if (compile_result != 0 || Buffer_make_executable(buf) != 0) {
+    StackMaps_deinit(maps);
+    Buffer_deinit(buf);
+    return -1;
+  }
+  if (result->read_ns == 0 || read_ns < result->read_ns) {
+    result->read_ns = read_ns;
+  }
+  if (result->compile_ns == 0 || compile_ns < result->compile_ns) {
+    result->compile_ns = compile_ns;
+  }
+  return 0;
+}
+
+static int Bench_measure(char *source, int options, void *heap,
+                         BenchResult *result) {
+  *result = (BenchResult){0};
+  Buffer buf;
+  StackMaps maps;
+  for (int i = 0; i < kBenchRepeats; i++) {
+    if (Bench_compile(source, options, &buf, &maps, result) != 0) {
+      return -1;
+    }
+    if (i < kBenchRepeats - 1) {
+      StackMaps_deinit(&maps);
+      Buffer_deinit(&buf);
+    }
+  }
+  EntryFunction function = EntryFunction_at(Buffer_code(&buf));
+  for (int i = 0; i < kBenchRepeats; i++) {
+    Heap gc_heap;
+    uint64_t arg = (uint64_t)heap;
+    if (options & kOptGC) {
+      Heap_init(&gc_heap, kBenchSpaceSize, &maps, &buf);
+      arg = (uint64_t)&gc_heap;
+    }
+    int64_t start = Stats_now();
+    result->result = function(arg);
+    int64_t run_ns = Stats_now() - start;
+    if (options & kOptGC) {
+      Heap_deinit(&gc_heap);
+    }
+    if (i == 0 || run_ns < result->run_ns) {
+      result->run_ns = run_ns;
+    }
+  }
+  StackMaps_deinit(&maps);
+  Buffer_deinit(&buf);
+  return 0;
+}
+
+// Per second, from a count and the nanoseconds it took.
+static long long Bench_rate(int64_t count, int64_t ns) {
+  return ns > 0 ? (long long)(count * 1e9 / ns) : 0;
+}
+
+int run_benchmarks(void) {
+  void *heap = malloc(kBenchHeapSize);
+  assert(heap != NULL);
+  int failures = 0;
+  for (size_t w = 0; w < sizeof kBenchWorkloads / sizeof *kBenchWorkloads;
+       w++) {
+    const BenchWorkload *workload = &kBenchWorkloads[w];
+    char *source = workload->generate();
+    size_t source_bytes = strlen(source);
+    for (size_t c = 0; c < sizeof kBenchConfigs / sizeof *kBenchConfigs;
+         c++) {
+      const BenchConfig *config = &kBenchConfigs[c];
+      BenchResult result;
+      if (Bench_measure(source, config->options, heap, &result) != 0 ||
+          result.result !=
+              (uint64_t)encodeImmediateFixnum(workload->expected)) {
+        fprintf(stderr, "%s under %s failed\n", workload->name, config->name);
+        failures++;
+        continue;
+      }
+      printf("{\"workload\": \"%s\", \"config\": \"%s\", "
+             "\"source_bytes\": %zu, \"nodes\": %lld, \"code_bytes\": %zu, "
+             "\"read_ns\": %lld, \"compile_ns\": %lld, \"run_ns\": %lld, "
+             "\"read_bytes_per_sec\": %lld, "
+             "\"compile_nodes_per_sec\": %lld, "
+             "\"compile_code_bytes_per_sec\": %lld}\n",
+             workload->name, config->name, source_bytes,
+             (long long)result.nodes, result.code_bytes,
+             (long long)result.read_ns, (long long)result.compile_ns,
+             (long long)result.run_ns,
+             Bench_rate(source_bytes, result.read_ns),
+             Bench_rate(result.nodes, result.compile_ns),
+             Bench_rate(result.code_bytes, result.compile_ns));
+    }
+    free(source);
+  }
+  free(heap);
+  return failures == 0 ? 0 : 1;
+}
+
+// End Benchmarks
+
+// `compiler --bench' runs the benchmarks instead of the tests.
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    return run_benchmarks();
+  }
+  return run_tests();
+}